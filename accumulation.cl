@@ -0,0 +1,81 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ACCUMULATION_CL
+#define ACCUMULATION_CL
+
+#include "common.cl_hpp"
+
+/// The accumulated state of a pixel consists of the sums of its samples,
+/// with the color in xyz and the squared luminance in w. The sums are
+/// formed by Kahan summation, such that the contributions of new samples
+/// are not lost even if a pixel has accumulated a very large number of
+/// samples. The compensation terms are stored in half precision relative
+/// to the sums: they are bounded by the rounding error of the sums, i.e.
+/// by 2^-24 times the sums, so that the stored values lie in [-1,1].
+/// Note that the Kahan summation relies on the compiler not reassociating
+/// floating point operations, so -cl-fast-relaxed-math must not be used.
+/// The scale of the stored compensations is ACCUMULATION_COMPENSATION_SCALE.
+
+/// Adds a value to a sum by Kahan summation
+/// \param sum The sum, the true value of which is \c sum - \c compensation
+/// \param compensation The rounding error of the sum
+void accumulation_add(float4* sum, float4* compensation, float4 value)
+{
+  float4 y = value - *compensation;
+  float4 t = *sum + y;
+  *compensation = (t - *sum) - y;
+  *sum = t;
+}
+
+/// Loads the accumulated sum and its compensation of a pixel
+void accumulation_load(__global const float4* sums,
+                       __global const half* compensations,
+                       int pixel_index,
+                       float4* sum,
+                       float4* compensation)
+{
+  *sum = sums[pixel_index];
+  *compensation = vload_half4(pixel_index, compensations)
+                * fabs(*sum) * (1.f / ACCUMULATION_COMPENSATION_SCALE);
+}
+
+/// Stores the accumulated sum and its compensation of a pixel
+void accumulation_store(__global float4* sums,
+                        __global half* compensations,
+                        int pixel_index,
+                        float4 sum,
+                        float4 compensation)
+{
+  float4 scale = fmax(fabs(sum) * (1.f / ACCUMULATION_COMPENSATION_SCALE), FLT_MIN);
+  // Only sums close to zero can have larger relative compensations,
+  // for which the compensation does not matter
+  float4 relative_compensation = clamp(compensation / scale, -1.f, 1.f);
+  sums[pixel_index] = sum;
+  vstore_half4(relative_compensation, pixel_index, compensations);
+}
+
+/// \return The average of the samples of a pixel, or 0 if there are none
+float4 accumulation_get_mean(float4 sum, float4 compensation, int num_samples)
+{
+  if (num_samples <= 0)
+    return (float4)(0.f, 0.f, 0.f, 0.f);
+  return (sum - compensation) / (float)num_samples;
+}
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADAPTIVE_SAMPLING_CL
+#define ADAPTIVE_SAMPLING_CL
+
+#include "common.cl_hpp"
+
+/// Pixels with fewer samples are always sampled uniformly, because
+/// their variance estimate is not yet reliable.
+#define ADAPTIVE_SAMPLING_MIN_RAYS 16
+/// The maximum number of rays of a pixel relative to the average number
+/// of rays per pixel
+#define ADAPTIVE_SAMPLING_MAX_RAY_FACTOR 4.f
+/// Prevents dark pixels from getting an infinite relative error
+#define ADAPTIVE_SAMPLING_LUMINANCE_EPSILON 1.e-2f
+/// Fixed point scale for the accumulation of the error with integer atomics.
+/// Each group adds at most this scale divided by the number of groups,
+/// which keeps the sums below 2^31.
+#define ADAPTIVE_SAMPLING_ERROR_SCALE 1073741824.f
+/// The maximum size of a work group
+#define ADAPTIVE_SAMPLING_MAX_GROUP_SIZE 64
+
+scalar adaptive_sampling_luminance(vector3 color)
+{
+  return dot(color, (vector3)(0.2126f, 0.7152f, 0.0722f));
+}
+
+/// Estimates the relative standard error of a pixel.
+/// \return The relative error, clamped to [0, 1]
+/// \param pixel The accumulated pixel, xyz is the mean color and w the
+/// mean of the squared luminance of the individual samples.
+/// \param num_rays The number of samples of the pixel
+scalar adaptive_sampling_get_error(float4 pixel, int num_rays)
+{
+  if(num_rays < 2)
+    return 1.f;
+
+  scalar mean = adaptive_sampling_luminance(pixel.xyz);
+  scalar variance = fmax(pixel.w - mean * mean, 0.f);
+  scalar standard_error = sqrt(variance / (scalar)num_rays);
+
+  return clamp(standard_error / (mean + ADAPTIVE_SAMPLING_LUMINANCE_EPSILON), 0.f, 1.f);
+}
+
+/// \return The number of work groups of the launch
+int adaptive_sampling_get_num_groups()
+{
+  // With several views, the third dimension of the launch selects the view
+  return get_num_groups(0) * get_num_groups(1) * get_num_groups(2);
+}
+
+/// \return The average relative error of the image in the previous launch
+/// \param error_sums The error sums of the current and the previous launch,
+/// see SAMPLING_ERROR_WEIGHT_OFFSET
+/// \param error_sum_slot The slot of \c error_sums used by the current launch
+scalar adaptive_sampling_get_mean_error(__global const unsigned* error_sums,
+                                        int error_sum_slot)
+{
+  // Both sums are weighted by the same number of groups, which cancels
+  unsigned error_weight = error_sums[SAMPLING_ERROR_WEIGHT_OFFSET + 1 - error_sum_slot];
+  if(error_weight == 0)
+    return 0.f;
+  return (scalar)error_sums[1 - error_sum_slot] / (scalar)error_weight;
+}
+
+/// \return The number of rays that should be evaluated for a pixel
+/// \param sampling_mode One of the SAMPLING_MODE_* values
+/// \param rays_per_pixel The average number of rays per pixel
+/// \param num_previous_rays The number of rays already evaluated for this pixel
+/// \param pixel_error The estimated relative error of the pixel
+/// \param mean_error The average relative error of the image
+/// \param convergence_threshold The error below which pixels are considered
+/// as converged
+int adaptive_sampling_get_num_rays(int sampling_mode,
+                                   int rays_per_pixel,
+                                   int num_previous_rays,
+                                   scalar pixel_error,
+                                   scalar mean_error,
+                                   scalar convergence_threshold)
+{
+  if(sampling_mode == SAMPLING_MODE_UNIFORM ||
+     num_previous_rays < ADAPTIVE_SAMPLING_MIN_RAYS ||
+     mean_error <= 0.f)
+    return rays_per_pixel;
+
+  if(sampling_mode == SAMPLING_MODE_ADAPTIVE_STOP_CONVERGED &&
+     pixel_error < convergence_threshold)
+    return 0;
+
+  scalar num_rays = (scalar)rays_per_pixel * pixel_error / mean_error;
+  num_rays = fmin(num_rays, ADAPTIVE_SAMPLING_MAX_RAY_FACTOR * (scalar)rays_per_pixel);
+
+  // Rounding stochastically would require another random number,
+  // so all pixels that are not converged get at least one ray.
+  return max((int)(num_rays + 0.5f), 1);
+}
+
+/// \return The factor by which the number of rays of a pixel is scaled
+/// according to its priority
+/// \param priority The prioritized region
+/// \param priority_mask The per-pixel factors, row-major. Only used if
+/// enabled in \c priority.
+/// \param px_x The pixel index in x direction
+/// \param px_y The pixel index in y direction
+/// \param width The number of pixels in x direction
+scalar adaptive_sampling_get_priority(const sampling_priority* priority,
+                                      __global const float* priority_mask,
+                                      int px_x, int px_y, int width)
+{
+  if(priority->use_mask)
+    return priority_mask[px_y * width + px_x];
+
+  int is_inside = px_x >= priority->min_x && px_x < priority->max_x &&
+                  px_y >= priority->min_y && px_y < priority->max_y;
+  return is_inside ? priority->inside_factor : priority->outside_factor;
+}
+
+/// Scales the number of rays of a pixel by its priority. Fractional
+/// numbers of rays are rounded stochastically, such that the total number
+/// of rays is preserved on average. Since each pixel keeps track of its
+/// number of rays, the accumulated image remains unbiased.
+/// \return The number of rays of the pixel
+/// \param num_rays The number of rays without priorities
+/// \param priority The priority factor of the pixel
+/// \param num_previous_rays The number of rays already evaluated for this pixel
+/// \param random_number A uniformly distributed random number in [0,1)
+int adaptive_sampling_apply_priority(int num_rays,
+                                     scalar priority,
+                                     int num_previous_rays,
+                                     scalar random_number)
+{
+  if(num_rays == 0 || priority == 1.f)
+    return num_rays;
+
+  scalar expected_rays = (scalar)num_rays * priority;
+  int prioritized_rays = (int)expected_rays;
+  if(random_number < expected_rays - (scalar)prioritized_rays)
+    ++prioritized_rays;
+
+  // Pixels without any samples would remain black
+  if(num_previous_rays == 0)
+    prioritized_rays = max(prioritized_rays, 1);
+  return prioritized_rays;
+}
+
+/// Adds the error and the number of rays of the pixels of the work group
+/// to the sums of the current launch. Must be called by all work items
+/// of the group.
+/// \param group_errors Local memory with at least one element per work item
+/// \param group_rays Local memory with at least one element per work item
+/// \param pixel_error The error of the pixel of this work item
+/// \param pixel_rays The number of rays traced for the pixel of this work item
+/// \param is_valid_pixel Whether this work item has processed a pixel
+/// \param error_sums The error sums of the current and the previous launch,
+/// their weights and the number of rays of the current launch, see
+/// SAMPLING_ERROR_WEIGHT_OFFSET
+/// \param error_sum_slot The slot of \c error_sums used by the current launch
+void adaptive_sampling_accumulate_error(__local scalar* group_errors,
+                                        __local int* group_rays,
+                                        scalar pixel_error,
+                                        int pixel_rays,
+                                        int is_valid_pixel,
+                                        __global unsigned* error_sums,
+                                        int error_sum_slot)
+{
+  int local_id = get_local_id(0) * get_local_size(1) + get_local_id(1);
+  int group_size = get_local_size(0) * get_local_size(1);
+
+  // Invalid pixels are marked with a negative error
+  group_errors[local_id] = is_valid_pixel ? pixel_error : -1.f;
+  group_rays[local_id] = is_valid_pixel ? pixel_rays : 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if(local_id == 0)
+  {
+    scalar error_sum = 0.f;
+    int num_pixels = 0;
+    unsigned num_rays = 0;
+    for(int i = 0; i < group_size; ++i)
+    {
+      if(group_errors[i] >= 0.f)
+      {
+        error_sum += group_errors[i];
+        ++num_pixels;
+      }
+      num_rays += (unsigned)group_rays[i];
+    }
+    // The average error of the group is at most one. Each group adds
+    // at most the scale divided by the number of groups, hence the sum
+    // over all groups stays below the scale plus the rounding of each
+    // group. Groups without pixels only contribute to the ray count.
+    if(num_pixels > 0)
+    {
+      scalar group_weight = ADAPTIVE_SAMPLING_ERROR_SCALE
+                          / (scalar)adaptive_sampling_get_num_groups();
+      atomic_add(error_sums + error_sum_slot,
+                 (unsigned)(group_weight * error_sum / (scalar)num_pixels + 0.5f));
+      atomic_add(error_sums + SAMPLING_ERROR_WEIGHT_OFFSET + error_sum_slot,
+                 (unsigned)(group_weight + 0.5f));
+    }
+    // The duration of a launch is bounded, which bounds its number of rays
+    if(num_rays > 0)
+      atomic_add(error_sums + SAMPLING_RAY_COUNT_SLOT, num_rays);
+  }
+}
+
+#endif
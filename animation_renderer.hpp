@@ -0,0 +1,337 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANIMATION_RENDERER_HPP
+#define ANIMATION_RENDERER_HPP
+
+#include "camera_path.hpp"
+#include "frame_renderer.hpp"
+#include "image.hpp"
+#include "scene.hpp"
+#include "timer.hpp"
+#include "qcl.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace gray {
+
+/// Encodes and writes png files on background threads, such that the
+/// host can keep the device busy in the meantime
+class png_writer
+{
+public:
+  /// \param num_threads The number of threads that encode images
+  /// \param max_pending_images The number of images that may wait for
+  /// their encoding before \c write() blocks, which limits the memory
+  /// if the encoding is slower than the rendering.
+  png_writer(std::size_t num_threads, std::size_t max_pending_images)
+  : _max_pending_images{max_pending_images}, _is_finished{false}
+  {
+    assert(num_threads > 0 && max_pending_images > 0);
+    for(std::size_t i = 0; i < num_threads; ++i)
+      _threads.push_back(std::thread{[this](){ this->process_images(); }});
+  }
+
+  png_writer(const png_writer&) = delete;
+  png_writer& operator=(const png_writer&) = delete;
+
+  ~png_writer()
+  {
+    stop_threads();
+  }
+
+  /// Queues an image for writing
+  /// \param filename The name of the file
+  /// \param pixels The RGBA pixels, the first row being the top row
+  /// \param width The width of the image
+  /// \param height The height of the image
+  void write(const std::string& filename,
+             std::vector<unsigned char>&& pixels,
+             std::size_t width, std::size_t height)
+  {
+    std::unique_lock<std::mutex> lock{_mutex};
+    _slot_available.wait(lock, [this](){
+      return _pending_images.size() < _max_pending_images;
+    });
+
+    pending_image img;
+    img.filename = filename;
+    img.pixels = std::move(pixels);
+    img.width = width;
+    img.height = height;
+    _pending_images.push_back(std::move(img));
+
+    _image_available.notify_one();
+  }
+
+  /// Waits until all queued images have been written
+  /// \throws std::runtime_error if an image could not be written
+  void finish()
+  {
+    stop_threads();
+    if(_error)
+      std::rethrow_exception(_error);
+  }
+
+private:
+  struct pending_image
+  {
+    std::string filename;
+    std::vector<unsigned char> pixels;
+    std::size_t width;
+    std::size_t height;
+  };
+
+  void process_images()
+  {
+    while(true)
+    {
+      pending_image img;
+      {
+        std::unique_lock<std::mutex> lock{_mutex};
+        _image_available.wait(lock, [this](){
+          return !_pending_images.empty() || _is_finished;
+        });
+        if(_pending_images.empty())
+          return;
+
+        img = std::move(_pending_images.front());
+        _pending_images.pop_front();
+      }
+      _slot_available.notify_one();
+
+      try
+      {
+        image::save_rgba_png(img.filename, img.pixels, img.width, img.height);
+      }
+      catch(...)
+      {
+        std::lock_guard<std::mutex> lock{_mutex};
+        if(!_error)
+          _error = std::current_exception();
+      }
+    }
+  }
+
+  void stop_threads()
+  {
+    {
+      std::lock_guard<std::mutex> lock{_mutex};
+      _is_finished = true;
+    }
+    _image_available.notify_all();
+
+    for(std::thread& t : _threads)
+      if(t.joinable())
+        t.join();
+    _threads.clear();
+  }
+
+  std::size_t _max_pending_images;
+  bool _is_finished;
+  std::deque<pending_image> _pending_images;
+  std::vector<std::thread> _threads;
+  std::exception_ptr _error;
+
+  std::mutex _mutex;
+  std::condition_variable _image_available;
+  std::condition_variable _slot_available;
+};
+
+/// Renders the frames of a camera path into a sequence of png files.
+/// The scene remains on the device for all frames. The frames are
+/// pipelined, such that the device never waits for the host: the image
+/// of a frame is read back asynchronously, and the host only waits for
+/// it once the next frame has been enqueued. The encoding of the images
+/// runs on background threads.
+///
+/// The exposure adapts across the frames as in the realtime renderer,
+/// which avoids flickering of the brightness.
+class animation_renderer
+{
+public:
+  /// \param ctx The device context
+  /// \param renderer The renderer of the frames, its resolution is the
+  /// resolution of the animation
+  /// \param num_writer_threads The number of threads that encode images
+  animation_renderer(const qcl::device_context_ptr& ctx,
+                     frame_renderer& renderer,
+                     std::size_t num_writer_threads = 2)
+  : _ctx{ctx},
+    _renderer(renderer),
+    _width{renderer.get_resolution_width()},
+    _height{renderer.get_resolution_height()},
+    _num_writer_threads{num_writer_threads}
+  {
+    assert(num_writer_threads > 0);
+    _pixels = cl::Image2D{ctx->get_context(), CL_MEM_READ_WRITE,
+                          cl::ImageFormat{CL_RGBA, CL_UNORM_INT8},
+                          _width, _height};
+  }
+
+  /// Renders all frames of a camera path
+  /// \param output_file The name of the first image. The frame number is
+  /// inserted before the file extension of each image,
+  /// e.g. render_00000.png.
+  /// \param s The scene
+  /// \param path The camera path
+  /// \param base_camera The camera from which the properties are taken
+  /// that are not part of the keyframes, e.g. the aperture
+  /// \param frames_per_second The number of frames per unit of keyframe time
+  /// \param rays_per_pixel The number of rays per pixel of each frame
+  void render(const std::string& output_file,
+              const device_object::scene& s,
+              const camera_path& path,
+              const device_object::camera& base_camera,
+              double frames_per_second,
+              std::size_t rays_per_pixel)
+  {
+    assert(frames_per_second > 0.0);
+    assert(rays_per_pixel > 0);
+
+    std::size_t num_frames = get_num_frames(path, frames_per_second);
+
+    // At most two images per writer thread wait for their encoding
+    png_writer writer{_num_writer_threads, 2 * _num_writer_threads};
+    std::unique_ptr<pending_frame> previous_frame;
+
+    timer render_timer;
+    render_timer.start();
+
+    for(std::size_t frame = 0; frame < num_frames; ++frame)
+    {
+      scalar time = path.get_start_time()
+                  + static_cast<scalar>(static_cast<double>(frame) / frames_per_second);
+      device_object::camera cam = path.get_camera(time, base_camera);
+
+      _renderer.reset_accumulation();
+      while(_renderer.get_total_rays_per_pixel() < rays_per_pixel &&
+            !_renderer.is_converged())
+        _renderer.trace(s, cam);
+
+      // The first frame has no luminance histogram of a previous frame
+      // to derive its exposure from
+      if(frame == 0)
+        _renderer.present(_pixels);
+      _renderer.present(_pixels);
+
+      std::unique_ptr<pending_frame> current_frame{new pending_frame};
+      current_frame->filename = get_frame_file_name(output_file, frame);
+      current_frame->pixels.resize(4 * _width * _height);
+      cl_int err = _ctx->get_command_queue().enqueueReadImage(_pixels,
+                                                              CL_FALSE,
+                                                              {{0, 0, 0}},
+                                                              {{_width, _height, 1}},
+                                                              0, 0,
+                                                              current_frame->pixels.data(),
+                                                              nullptr,
+                                                              &current_frame->read);
+      qcl::check_cl_error(err, "Could not enqueue read of animation frame!");
+      err = _ctx->get_command_queue().flush();
+      qcl::check_cl_error(err, "Could not flush command queue!");
+
+      // The device works on the current frame while the previous one is
+      // handed to the writer
+      if(previous_frame)
+        write_frame(*previous_frame, writer);
+      previous_frame = std::move(current_frame);
+
+      std::cout << "Enqueued frame " << frame + 1 << "/" << num_frames
+                << ", t=" << time << std::endl;
+    }
+    if(previous_frame)
+      write_frame(*previous_frame, writer);
+
+    writer.finish();
+
+    double elapsed_time = render_timer.stop();
+    std::cout << "Rendered " << num_frames << " frames in " << elapsed_time
+              << "s (" << elapsed_time / static_cast<double>(num_frames)
+              << "s per frame)." << std::endl;
+  }
+
+  /// \return The number of frames of a camera path
+  /// \param path The camera path
+  /// \param frames_per_second The number of frames per unit of keyframe time
+  static std::size_t get_num_frames(const camera_path& path,
+                                    double frames_per_second)
+  {
+    double duration = static_cast<double>(path.get_end_time() - path.get_start_time());
+    return static_cast<std::size_t>(std::floor(duration * frames_per_second + 1.e-6)) + 1;
+  }
+
+  /// \return The name of the image of a frame
+  /// \param output_file The name of the animation, e.g. render.png
+  /// \param frame The number of the frame
+  static std::string get_frame_file_name(const std::string& output_file,
+                                         std::size_t frame)
+  {
+    char frame_number[32];
+    std::snprintf(frame_number, sizeof(frame_number), "_%05zu", frame);
+
+    std::size_t extension = output_file.rfind('.');
+    std::size_t directory = output_file.rfind('/');
+    if(extension == std::string::npos ||
+       (directory != std::string::npos && extension < directory))
+      return output_file + frame_number + ".png";
+    return output_file.substr(0, extension) + frame_number
+         + output_file.substr(extension);
+  }
+
+private:
+  /// An image that is read back from the device
+  struct pending_frame
+  {
+    std::string filename;
+    std::vector<unsigned char> pixels;
+    cl::Event read;
+  };
+
+  void write_frame(pending_frame& frame, png_writer& writer) const
+  {
+    cl_int err = frame.read.wait();
+    qcl::check_cl_error(err, "Could not read animation frame!");
+
+    writer.write(frame.filename, std::move(frame.pixels), _width, _height);
+  }
+
+  qcl::device_context_ptr _ctx;
+  frame_renderer& _renderer;
+
+  std::size_t _width;
+  std::size_t _height;
+  std::size_t _num_writer_threads;
+
+  cl::Image2D _pixels;
+};
+
+}
+
+#endif
@@ -0,0 +1,723 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BDPT_CL
+#define BDPT_CL
+
+#include "random.cl"
+#include "scene.cl"
+#include "emitters.cl"
+
+// Bidirectional path tracing. For each camera ray, a light subpath is
+// started on a randomly selected emitter, and every vertex of the camera
+// subpath is connected to every vertex of the light subpath. The
+// contributions of all strategies are combined using multiple importance
+// sampling (balance heuristic) with the area densities stored at the vertices.
+//
+// The BSDF at a vertex is defined by material_propagate_ray: the BSDF times
+// the cosine equals the scattered fraction times the sampling pdf. Only the
+// reflection to the side of the arriving path can be evaluated, hence only
+// rough surfaces are connected, and refractions are treated like specular
+// (delta) scattering events. Light subpaths start from the emissive objects
+// only. The environment is handled by the camera subpath, with explicit
+// environment sampling as in evaluate_ray. Connections to the camera lens
+// (light tracing) are not performed.
+
+/// The maximum number of vertices of a camera subpath, including the
+/// vertex on the lens
+#define BDPT_MAX_CAMERA_VERTICES 7
+/// The maximum number of vertices of a light subpath, including the
+/// vertex on the emitter
+#define BDPT_MAX_LIGHT_VERTICES 6
+
+#define BDPT_VERTEX_CAMERA 0
+#define BDPT_VERTEX_LIGHT 1
+#define BDPT_VERTEX_SURFACE 2
+
+typedef struct
+{
+  vector3 position;
+  vector3 normal;
+  /// The throughput of the subpath up to this vertex
+  intensity beta;
+  /// The material with which the subpath interacts at this vertex.
+  /// For light vertices, only the emitted light is set.
+  material mat;
+  /// The object on which the vertex is located
+  object_entry object;
+  /// The refraction indices on the side from which the subpath arrived
+  /// and on the other side of the surface
+  scalar refraction_index_from;
+  scalar refraction_index_to;
+  /// The area density with which this vertex is generated by its own subpath
+  scalar pdf_fwd;
+  /// The area density with which this vertex would be generated by
+  /// the other subpath
+  scalar pdf_rev;
+  int type;
+  /// Whether the subpath has been scattered specularly at this vertex
+  int is_delta;
+} bdpt_vertex;
+
+/// Initializes a subpath vertex from an intersection
+/// \param ctx The vertex
+/// \param impact The intersection
+/// \param r The ray that arrived at the intersection
+void bdpt_vertex_init_surface(bdpt_vertex* ctx, const path_vertex* impact, const ray* r)
+{
+  ctx->type = BDPT_VERTEX_SURFACE;
+  ctx->position = impact->position;
+  ctx->normal = impact->normal;
+  ctx->beta = r->energy;
+  ctx->refraction_index_from = impact->material_from.refraction_index;
+  ctx->refraction_index_to = impact->material_to.refraction_index;
+  ctx->pdf_fwd = 0.f;
+  ctx->pdf_rev = 0.f;
+  ctx->is_delta = 0;
+
+  if (dot(impact->normal, r->direction) < 0.f)
+  {
+    // Incoming ray
+    ctx->mat = impact->material_to;
+    ctx->object = impact->hit_object_to;
+  }
+  else
+  {
+    // Outgoing ray
+    ctx->mat = impact->material_from;
+    ctx->object = impact->hit_object_from;
+  }
+}
+
+/// \return Whether a vertex can be connected to the other subpath
+int bdpt_vertex_is_connectable(const bdpt_vertex* ctx)
+{
+  return ctx->type == BDPT_VERTEX_LIGHT ||
+        (ctx->type == BDPT_VERTEX_SURFACE &&
+         ctx->mat.roughness >= SPECULAR_ROUGHNESS_THRESHOLD);
+}
+
+/// \return The surface area of an emitter
+/// \param s The scene
+/// \param emitter The emitter
+scalar bdpt_get_emitter_area(const scene* s, object_entry emitter)
+{
+  if (emitter.type == OBJECT_TYPE_SPHERE)
+  {
+    scalar radius = s->spheres[emitter.local_id].geometry.radius;
+    return 4.f * M_PI_F * radius * radius;
+  }
+  else if (emitter.type == OBJECT_TYPE_DISK_PLANE)
+  {
+    scalar radius = s->disks[emitter.local_id].geometry.radius;
+    return M_PI_F * radius * radius;
+  }
+  return 0.f;
+}
+
+/// \return The area density with which \c bdpt_sample_light_vertex
+/// generates a point on an emitter
+/// \param s The scene
+/// \param emitter The emitter
+scalar bdpt_light_origin_pdf(const scene* s, object_entry emitter)
+{
+  scalar area = bdpt_get_emitter_area(s, emitter);
+  if (area <= 0.f)
+    return 0.f;
+  return emitter.emitter_probability / area;
+}
+
+/// \return The probability density (with respect to solid angle) with
+/// which a light subpath leaves an emitter in a given direction.
+/// Spheres emit only to the outside, disks to both sides.
+/// \param emitter The emitter
+/// \param normal The (outward) surface normal of the emitter
+/// \param direction The (normalized) direction of emission
+scalar bdpt_light_direction_pdf(object_entry emitter, vector3 normal, vector3 direction)
+{
+  scalar cos_theta = dot(normal, direction);
+  if (emitter.type == OBJECT_TYPE_SPHERE)
+    return fmax(cos_theta, 0.f) * M_1_PI_F;
+  return 0.5f * fabs(cos_theta) * M_1_PI_F;
+}
+
+/// Selects an emitter and samples a uniformly distributed point on its surface
+/// \return 0 if no point could be generated
+/// \param s The scene, must contain at least one emitter
+/// \param rand The random number generator context
+/// \param light Will contain the light vertex
+int bdpt_sample_light_vertex(const scene* s, random_ctx* rand, bdpt_vertex* light)
+{
+  object_entry emitter = emitters_select(s, rand);
+
+  if (emitter.type == OBJECT_TYPE_SPHERE)
+  {
+    sphere_geometry sphere = s->spheres[emitter.local_id].geometry;
+    light->normal = random_uniform_sphere(rand);
+    light->position = sphere.position + sphere.radius * light->normal;
+  }
+  else if (emitter.type == OBJECT_TYPE_DISK_PLANE)
+  {
+    disk_geometry disk = s->disks[emitter.local_id].geometry;
+    light->position = emitters_sample_disk_point(&disk, rand);
+    light->normal = disk.plane.normal;
+  }
+  else
+    return 0;
+
+  light->type = BDPT_VERTEX_LIGHT;
+  light->object = emitter;
+  light->mat.emitted_light = emitters_get_emitted_light(s, emitter, light->normal);
+  light->pdf_fwd = bdpt_light_origin_pdf(s, emitter);
+  light->pdf_rev = 0.f;
+  light->is_delta = 0;
+
+  if (light->pdf_fwd <= 0.f)
+    return 0;
+
+  light->beta = (intensity)(1, 1, 1) / light->pdf_fwd;
+  return 1;
+}
+
+/// Converts a probability density with respect to solid angle into an
+/// area density at a vertex
+/// \param pdf The density with respect to solid angle
+/// \param origin The point from which the direction has been sampled
+/// \param target The vertex at which the area density is evaluated
+scalar bdpt_convert_density(scalar pdf, vector3 origin, const bdpt_vertex* target)
+{
+  vector3 delta = vec_from_to(origin, target->position);
+  scalar dist2 = dot(delta, delta);
+  if (dist2 == 0.f)
+    return 0.f;
+  // The lens is not connected to, its density is never used
+  if (target->type == BDPT_VERTEX_CAMERA)
+    return pdf;
+  return pdf * fabs(dot(target->normal, delta)) * rsqrt(dist2) / dist2;
+}
+
+/// \return The probability density (with respect to solid angle) with which
+/// a subpath arriving at a surface vertex is reflected into a given direction.
+/// Only reflections to the side of the arriving subpath can be evaluated.
+/// \param ctx The surface vertex
+/// \param incident The direction of the arriving subpath
+/// \param outgoing The direction of the reflected subpath
+scalar bdpt_surface_pdf(const bdpt_vertex* ctx, vector3 incident, vector3 outgoing)
+{
+  if (ctx->mat.roughness < SPECULAR_ROUGHNESS_THRESHOLD)
+    return 0.f;
+
+  // The material functions only require the geometry and refraction indices
+  path_vertex impact;
+  impact.position = ctx->position;
+  impact.normal = ctx->normal;
+  impact.material_from.refraction_index = ctx->refraction_index_from;
+  impact.material_to.refraction_index = ctx->refraction_index_to;
+
+  vector3 facing_normal = path_vertex_get_facing_normal(&impact, incident);
+  if (dot(outgoing, facing_normal) <= 0.f)
+    return 0.f;
+
+  return material_reflection_pdf(&(ctx->mat), &impact, incident, outgoing);
+}
+
+/// \return The area density with which a vertex generates the next vertex
+/// of a subpath
+/// \param ctx The scattering vertex
+/// \param previous The position of the vertex preceding \c ctx in the subpath.
+/// Ignored for light vertices.
+/// \param next The generated vertex
+scalar bdpt_pdf(const bdpt_vertex* ctx, vector3 previous, const bdpt_vertex* next)
+{
+  vector3 outgoing = normalized_vec_from_to(ctx->position, next->position);
+
+  scalar pdf;
+  if (ctx->type == BDPT_VERTEX_LIGHT)
+    pdf = bdpt_light_direction_pdf(ctx->object, ctx->normal, outgoing);
+  else
+    pdf = bdpt_surface_pdf(ctx,
+                           normalized_vec_from_to(previous, ctx->position),
+                           outgoing);
+
+  return bdpt_convert_density(pdf, ctx->position, next);
+}
+
+/// \return The BSDF at a surface vertex, with respect to the direction of
+/// light transport (from \c light_side towards \c camera_side)
+/// \param ctx The surface vertex
+/// \param camera_side The position of the neighbor on the side of the camera
+/// \param light_side The position of the neighbor on the side of the light
+intensity bdpt_surface_bsdf(const bdpt_vertex* ctx, vector3 camera_side, vector3 light_side)
+{
+  vector3 incident = normalized_vec_from_to(camera_side, ctx->position);
+  vector3 outgoing = normalized_vec_from_to(ctx->position, light_side);
+
+  scalar cos_theta = fabs(dot(ctx->normal, outgoing));
+  if (cos_theta <= 0.f)
+    return (intensity)(0, 0, 0);
+
+  // The BSDF times the cosine equals the scattered fraction times
+  // the pdf of material_propagate_ray.
+  return ctx->mat.scattered_fraction * bdpt_surface_pdf(ctx, incident, outgoing)
+       / cos_theta;
+}
+
+/// \return The geometry term between two vertices, without visibility
+scalar bdpt_geometry_term(const bdpt_vertex* a, const bdpt_vertex* b)
+{
+  vector3 delta = vec_from_to(a->position, b->position);
+  scalar dist2 = dot(delta, delta);
+  if (dist2 == 0.f)
+    return 0.f;
+
+  return fabs(dot(a->normal, delta)) * fabs(dot(b->normal, delta)) / (dist2 * dist2);
+}
+
+/// \return Whether two vertices are mutually visible
+/// \param s The scene
+/// \param a The first vertex
+/// \param b The second vertex
+int bdpt_is_visible(const scene* s, const bdpt_vertex* a, const bdpt_vertex* b)
+{
+  ray shadow_ray;
+  shadow_ray.direction = normalized_vec_from_to(a->position, b->position);
+  shadow_ray.origin_vertex.position = a->position
+                                    + self_shadowing_epsilon * shadow_ray.direction;
+
+  path_vertex occluder;
+  scene_get_nearest_intersection(s, &shadow_ray, &occluder);
+  if (occluder.hit_object_to.type == OBJECT_TYPE_BACKGROUND)
+    return 0;
+
+  scalar target_distance = distance(shadow_ray.origin_vertex.position, b->position);
+  scalar hit_distance = distance(shadow_ray.origin_vertex.position, occluder.position);
+
+  return hit_distance >= target_distance - 2.f * self_shadowing_epsilon;
+}
+
+/// \return Whether any component of an intensity is positive
+int bdpt_is_nonzero(intensity value)
+{
+  return value.x > 0.f || value.y > 0.f || value.z > 0.f;
+}
+
+scalar bdpt_remap0(scalar pdf)
+{
+  return (pdf != 0.f) ? pdf : 1.f;
+}
+
+/// Calculates the multiple importance sampling weight (balance heuristic)
+/// of a path generated by connecting a light subpath of \c s vertices with
+/// a camera subpath of \c t vertices. The reverse densities of the vertices
+/// next to the connection depend on the strategy and are passed explicitly.
+/// Strategies that exceed the maximum subpath lengths or that connect to
+/// the lens are not taken into account, since they are never performed.
+/// \return The weight of the strategy
+/// \param camera_path The camera subpath
+/// \param t The number of vertices of the camera subpath, at least 2
+/// \param light_path The light subpath
+/// \param s The number of vertices of the light subpath
+/// \param sampled_light The light vertex if \c s is 1, which is sampled
+/// separately from the light subpath
+/// \param pt_pdf_rev The reverse density of the last camera vertex
+/// \param pt_minus_pdf_rev The reverse density of the second to last camera vertex
+/// \param qs_pdf_rev The reverse density of the last light vertex
+/// \param qs_minus_pdf_rev The reverse density of the second to last light vertex
+scalar bdpt_mis_weight(const bdpt_vertex* camera_path, int t,
+                       const bdpt_vertex* light_path, int s,
+                       const bdpt_vertex* sampled_light,
+                       scalar pt_pdf_rev, scalar pt_minus_pdf_rev,
+                       scalar qs_pdf_rev, scalar qs_minus_pdf_rev)
+{
+  if (s + t == 2)
+    return 1.f;
+
+  scalar sum_ri = 0.f;
+
+  // Strategies with fewer camera vertices
+  scalar ri = 1.f;
+  for (int i = t - 1; i > 1; --i)
+  {
+    scalar pdf_rev = camera_path[i].pdf_rev;
+    if (i == t - 1)
+      pdf_rev = pt_pdf_rev;
+    else if (i == t - 2)
+      pdf_rev = pt_minus_pdf_rev;
+
+    ri *= bdpt_remap0(pdf_rev) / bdpt_remap0(camera_path[i].pdf_fwd);
+
+    int is_delta = (i == t - 1) ? 0 : camera_path[i].is_delta;
+    if (!is_delta && !camera_path[i - 1].is_delta &&
+        s + t - i <= BDPT_MAX_LIGHT_VERTICES)
+      sum_ri += ri;
+  }
+
+  // Strategies with fewer light vertices
+  ri = 1.f;
+  for (int i = s - 1; i >= 0; --i)
+  {
+    const bdpt_vertex* vertex = (s == 1) ? sampled_light : &(light_path[i]);
+
+    scalar pdf_rev = vertex->pdf_rev;
+    if (i == s - 1)
+      pdf_rev = qs_pdf_rev;
+    else if (i == s - 2)
+      pdf_rev = qs_minus_pdf_rev;
+
+    ri *= bdpt_remap0(pdf_rev) / bdpt_remap0(vertex->pdf_fwd);
+
+    int is_delta = (i == s - 1) ? 0 : vertex->is_delta;
+    int is_previous_delta = (i > 0) ? light_path[i - 1].is_delta : 0;
+    if (!is_delta && !is_previous_delta &&
+        s + t - i <= BDPT_MAX_CAMERA_VERTICES)
+      sum_ri += ri;
+  }
+
+  return 1.f / (1.f + sum_ri);
+}
+
+/// \return The weight of the emission found by the camera subpath at its
+/// last vertex
+/// \param s The scene
+/// \param camera_path The camera subpath
+/// \param t The number of vertices of the camera subpath
+/// \param light_path The light subpath
+scalar bdpt_emission_weight(const scene* s,
+                            const bdpt_vertex* camera_path, int t,
+                            const bdpt_vertex* light_path)
+{
+  const bdpt_vertex* pt = &(camera_path[t - 1]);
+  const bdpt_vertex* pt_minus = &(camera_path[t - 2]);
+
+  // Objects that are not sampled as emitters can only be found
+  // by the camera subpath
+  if (pt->object.emitter_probability <= 0.f)
+    return 1.f;
+
+  vector3 to_previous = normalized_vec_from_to(pt->position, pt_minus->position);
+  scalar direction_pdf = bdpt_light_direction_pdf(pt->object, pt->normal, to_previous);
+  if (direction_pdf <= 0.f)
+    // No light subpath leaves the emitter in this direction
+    return 1.f;
+
+  return bdpt_mis_weight(camera_path, t, light_path, 0, 0,
+                         bdpt_light_origin_pdf(s, pt->object),
+                         bdpt_convert_density(direction_pdf, pt->position, pt_minus),
+                         0.f, 0.f);
+}
+
+/// Connects the last vertex of the camera subpath to a newly sampled
+/// point on an emitter.
+/// \return The weighted contribution of the connection
+/// \param s The scene
+/// \param rand The random number generator context
+/// \param camera_path The camera subpath
+/// \param t The number of vertices of the camera subpath
+/// \param light_path The light subpath
+intensity bdpt_connect_to_light(const scene* s, random_ctx* rand,
+                                const bdpt_vertex* camera_path, int t,
+                                const bdpt_vertex* light_path)
+{
+  intensity result = (intensity)(0, 0, 0);
+
+  if (s->num_emitters == 0)
+    return result;
+
+  bdpt_vertex light;
+  if (!bdpt_sample_light_vertex(s, rand, &light))
+    return result;
+
+  const bdpt_vertex* pt = &(camera_path[t - 1]);
+  const bdpt_vertex* pt_minus = &(camera_path[t - 2]);
+
+  vector3 to_camera = normalized_vec_from_to(light.position, pt->position);
+  scalar direction_pdf = bdpt_light_direction_pdf(light.object, light.normal, to_camera);
+  if (direction_pdf <= 0.f)
+    return result;
+
+  intensity bsdf = bdpt_surface_bsdf(pt, pt_minus->position, light.position);
+  if (!bdpt_is_nonzero(bsdf) || !bdpt_is_visible(s, pt, &light))
+    return result;
+
+  // The emitted light is proportional to the cosine, see evaluate_ray
+  intensity emitted_light = light.mat.emitted_light * fabs(dot(light.normal, to_camera));
+
+  result = pt->beta * bsdf * emitted_light * light.beta;
+  result *= bdpt_geometry_term(pt, &light);
+
+  result *= bdpt_mis_weight(camera_path, t, light_path, 1, &light,
+                            bdpt_convert_density(direction_pdf, light.position, pt),
+                            bdpt_pdf(pt, light.position, pt_minus),
+                            bdpt_pdf(pt, pt_minus->position, &light),
+                            0.f);
+  return result;
+}
+
+/// Connects the last vertex of the camera subpath to a vertex of the
+/// light subpath.
+/// \return The weighted contribution of the connection
+/// \param s The scene
+/// \param camera_path The camera subpath
+/// \param t The number of vertices of the camera subpath
+/// \param light_path The light subpath
+/// \param num_light_vertices The number of vertices of the light subpath
+/// that are used, at least 2
+intensity bdpt_connect(const scene* s,
+                       const bdpt_vertex* camera_path, int t,
+                       const bdpt_vertex* light_path, int num_light_vertices)
+{
+  intensity result = (intensity)(0, 0, 0);
+
+  const bdpt_vertex* pt = &(camera_path[t - 1]);
+  const bdpt_vertex* pt_minus = &(camera_path[t - 2]);
+  const bdpt_vertex* qs = &(light_path[num_light_vertices - 1]);
+  const bdpt_vertex* qs_minus = &(light_path[num_light_vertices - 2]);
+
+  if (!bdpt_vertex_is_connectable(qs))
+    return result;
+
+  intensity camera_bsdf = bdpt_surface_bsdf(pt, pt_minus->position, qs->position);
+  if (!bdpt_is_nonzero(camera_bsdf))
+    return result;
+
+  intensity light_bsdf = bdpt_surface_bsdf(qs, pt->position, qs_minus->position);
+  if (!bdpt_is_nonzero(light_bsdf) || !bdpt_is_visible(s, pt, qs))
+    return result;
+
+  result = pt->beta * camera_bsdf * light_bsdf * qs->beta;
+  result *= bdpt_geometry_term(pt, qs);
+
+  result *= bdpt_mis_weight(camera_path, t, light_path, num_light_vertices, 0,
+                            bdpt_pdf(qs, qs_minus->position, pt),
+                            bdpt_pdf(pt, qs->position, pt_minus),
+                            bdpt_pdf(pt, pt_minus->position, qs),
+                            bdpt_pdf(qs, pt->position, qs_minus));
+  return result;
+}
+
+/// \return The probability density (with respect to solid angle) of a
+/// scattering event sampled by \c material_propagate_ray, or 0 if the event
+/// cannot be evaluated and is treated as specular.
+/// \param ctx The scattering vertex
+/// \param incident The direction of the arriving subpath
+/// \param outgoing The sampled direction
+/// \param reflected The return value of \c material_propagate_ray
+scalar bdpt_scattering_pdf(const bdpt_vertex* ctx, vector3 incident,
+                           vector3 outgoing, int reflected)
+{
+  if (!reflected)
+    return 0.f;
+  return bdpt_surface_pdf(ctx, incident, outgoing);
+}
+
+/// \return The probability with which a subpath is continued after
+/// a scattering event, used for russian roulette
+scalar bdpt_continuation_probability(const material* mat)
+{
+  return fmin(1.f, fmax(mat->scattered_fraction.x,
+                        fmax(mat->scattered_fraction.y,
+                             mat->scattered_fraction.z)));
+}
+
+/// Generates a light subpath starting on a randomly selected emitter
+/// \return The number of vertices of the light subpath
+/// \param s The scene
+/// \param rand The random number generator context
+/// \param light_path Will contain the vertices of the light subpath
+int bdpt_generate_light_path(const scene* s, random_ctx* rand, bdpt_vertex* light_path)
+{
+  if (s->num_emitters == 0)
+    return 0;
+
+  bdpt_vertex* light = &(light_path[0]);
+  if (!bdpt_sample_light_vertex(s, rand, light))
+    return 0;
+
+  // Cosine weighted direction
+  vector3 emission_normal = light->normal;
+  if (light->object.type == OBJECT_TYPE_DISK_PLANE && random_uniform_scalar(rand) < 0.5f)
+    emission_normal *= -1.f;
+  scalar cos_theta = sqrt(random_uniform_scalar(rand));
+
+  ray r;
+  r.direction = random_point_on_cone(rand, emission_normal, cos_theta);
+  r.origin_vertex.position = light->position + self_shadowing_epsilon * r.direction;
+
+  scalar direction_pdf = bdpt_light_direction_pdf(light->object, light->normal, r.direction);
+  if (direction_pdf <= 0.f)
+    return 1;
+
+  // The emitted light is proportional to the cosine, see evaluate_ray
+  r.energy = light->beta * light->mat.emitted_light * cos_theta * cos_theta / direction_pdf;
+
+  int num_vertices = 1;
+  while (num_vertices < BDPT_MAX_LIGHT_VERTICES)
+  {
+    path_vertex impact;
+    scene_get_nearest_intersection(s, &r, &impact);
+    if (impact.hit_object_to.type == OBJECT_TYPE_BACKGROUND)
+      break;
+
+    bdpt_vertex* vertex = &(light_path[num_vertices]);
+    bdpt_vertex* previous = &(light_path[num_vertices - 1]);
+
+    bdpt_vertex_init_surface(vertex, &impact, &r);
+    vertex->pdf_fwd = bdpt_convert_density(direction_pdf, previous->position, vertex);
+    ++num_vertices;
+
+    if (num_vertices == BDPT_MAX_LIGHT_VERTICES)
+      break;
+
+    scalar continuation_probability = bdpt_continuation_probability(&(vertex->mat));
+    if (random_uniform_scalar(rand) >= continuation_probability)
+      break;
+
+    vector3 incident = r.direction;
+    int reflected = material_propagate_ray(&(vertex->mat), &impact, rand, &r);
+
+    intensity weight = vertex->mat.scattered_fraction / continuation_probability;
+
+    direction_pdf = bdpt_scattering_pdf(vertex, incident, r.direction, reflected);
+    if (direction_pdf > 0.f)
+    {
+      scalar reverse_pdf = bdpt_surface_pdf(vertex, -r.direction, -incident);
+      previous->pdf_rev = bdpt_convert_density(reverse_pdf, vertex->position, previous);
+
+      // material_propagate_ray samples the BSDF in the direction of the
+      // camera subpaths. Light subpaths use the BSDF with exchanged directions.
+      scalar cos_incident = fabs(dot(vertex->normal, incident));
+      if (cos_incident <= 0.f)
+        break;
+      weight *= reverse_pdf / direction_pdf
+              * fabs(dot(vertex->normal, r.direction)) / cos_incident;
+    }
+    else
+    {
+      // Specular reflections are symmetric. The scaling of radiance at
+      // refractive interfaces is neglected, as for the camera subpaths.
+      vertex->is_delta = 1;
+      previous->pdf_rev = 0.f;
+    }
+
+    r.energy *= weight;
+  }
+
+  return num_vertices;
+}
+
+/// Evaluates a camera ray using bidirectional path tracing.
+/// \return The intensity of the sampled light paths
+/// \param r The ray that shall be traced
+/// \param rand The random context that shall be used to generate random numbers
+/// \param s The scene
+intensity bdpt_evaluate_ray(ray* r, random_ctx* rand, const scene* s)
+{
+  bdpt_vertex light_path[BDPT_MAX_LIGHT_VERTICES];
+  bdpt_vertex camera_path[BDPT_MAX_CAMERA_VERTICES];
+
+  intensity radiance = (intensity)(0, 0, 0);
+
+  int num_light_vertices = bdpt_generate_light_path(s, rand, light_path);
+
+  bdpt_vertex* lens = &(camera_path[0]);
+  lens->type = BDPT_VERTEX_CAMERA;
+  lens->position = r->origin_vertex.position;
+  lens->normal = r->direction;
+  lens->beta = r->energy;
+  lens->pdf_fwd = 0.f;
+  lens->pdf_rev = 0.f;
+  lens->is_delta = 0;
+
+  // The pdf with which the current ray direction has been sampled,
+  // 0 for the camera ray and specular events
+  scalar direction_pdf = 0.f;
+
+  for (int t = 2; t <= BDPT_MAX_CAMERA_VERTICES; ++t)
+  {
+    path_vertex impact;
+    scene_get_nearest_intersection(s, r, &impact);
+
+    if (impact.hit_object_to.type == OBJECT_TYPE_BACKGROUND)
+    {
+      scalar weight = 1.f;
+      if (direction_pdf > 0.f && emitters_is_environment_sampling_enabled(s))
+        weight = emitters_power_heuristic(direction_pdf,
+                                          emitters_environment_pdf(s, r->direction));
+
+      radiance += weight * r->energy * impact.material_to.emitted_light;
+      break;
+    }
+
+    bdpt_vertex* vertex = &(camera_path[t - 1]);
+    bdpt_vertex* previous = &(camera_path[t - 2]);
+
+    bdpt_vertex_init_surface(vertex, &impact, r);
+    vertex->pdf_fwd = bdpt_convert_density(direction_pdf, previous->position, vertex);
+
+    // Light subpath without vertices: emission found by the camera subpath
+    intensity emitted_light = fabs(dot(impact.normal, r->direction))
+                            * vertex->mat.emitted_light;
+    if (bdpt_is_nonzero(emitted_light))
+      radiance += r->energy * emitted_light
+                * bdpt_emission_weight(s, camera_path, t, light_path);
+
+    if (bdpt_vertex_is_connectable(vertex))
+    {
+      radiance += r->energy * emitters_sample_environment_light(s,
+                                                                &(vertex->mat),
+                                                                &impact,
+                                                                r->direction,
+                                                                0,
+                                                                rand);
+
+      radiance += bdpt_connect_to_light(s, rand, camera_path, t, light_path);
+
+      for (int num_used_light_vertices = 2;
+           num_used_light_vertices <= num_light_vertices;
+           ++num_used_light_vertices)
+        radiance += bdpt_connect(s, camera_path, t, light_path, num_used_light_vertices);
+    }
+
+    if (t == BDPT_MAX_CAMERA_VERTICES)
+      break;
+
+    scalar continuation_probability = bdpt_continuation_probability(&(vertex->mat));
+    if (random_uniform_scalar(rand) >= continuation_probability)
+      break;
+
+    vector3 incident = r->direction;
+    int reflected = material_propagate_ray(&(vertex->mat), &impact, rand, r);
+    r->energy *= vertex->mat.scattered_fraction / continuation_probability;
+
+    direction_pdf = bdpt_scattering_pdf(vertex, incident, r->direction, reflected);
+    if (direction_pdf > 0.f)
+    {
+      scalar reverse_pdf = bdpt_surface_pdf(vertex, -r->direction, -incident);
+      previous->pdf_rev = bdpt_convert_density(reverse_pdf, vertex->position, previous);
+    }
+    else
+    {
+      vertex->is_delta = 1;
+      previous->pdf_rev = 0.f;
+    }
+  }
+
+  return radiance;
+}
+
+#endif
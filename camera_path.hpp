@@ -0,0 +1,182 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAMERA_PATH_HPP
+#define CAMERA_PATH_HPP
+
+#include "scene.hpp"
+#include "common_math.cl_hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace gray {
+
+/// The state of the camera at a point in time of an animation
+struct camera_keyframe
+{
+  scalar time;
+  vector3 position;
+  vector3 look_at;
+  /// The distance of the plane in focus, values <= 0 enable the autofocus
+  scalar focal_plane_distance;
+  scalar roll_angle;
+};
+
+/// A camera motion that is interpolated between keyframes. Positions and
+/// viewing directions follow Catmull-Rom splines, such that the camera
+/// moves smoothly through the keyframes, the focal plane distance and the
+/// roll angle are interpolated linearly.
+class camera_path
+{
+public:
+  /// Loads the keyframes from a text file with one keyframe per line:
+  /// time x y z look_at_x look_at_y look_at_z focal_plane_distance roll.
+  /// Empty lines and lines starting with # are ignored.
+  /// \param filename The name of the file
+  static camera_path load(const std::string& filename)
+  {
+    std::ifstream file{filename.c_str()};
+    if(!file.is_open())
+      throw std::runtime_error("Could not open camera path "+filename);
+
+    camera_path path;
+    std::string line;
+    std::size_t line_number = 0;
+    while(std::getline(file, line))
+    {
+      ++line_number;
+      std::size_t first = line.find_first_not_of(" \t\r");
+      if(first == std::string::npos || line[first] == '#')
+        continue;
+
+      camera_keyframe keyframe;
+      std::istringstream line_stream{line};
+      if(!(line_stream >> keyframe.time
+                       >> keyframe.position.s[0]
+                       >> keyframe.position.s[1]
+                       >> keyframe.position.s[2]
+                       >> keyframe.look_at.s[0]
+                       >> keyframe.look_at.s[1]
+                       >> keyframe.look_at.s[2]
+                       >> keyframe.focal_plane_distance
+                       >> keyframe.roll_angle))
+        throw std::runtime_error("Invalid keyframe in line "+std::to_string(line_number)
+                                 +" of "+filename);
+      path.add_keyframe(keyframe);
+    }
+    if(path.get_num_keyframes() == 0)
+      throw std::runtime_error("Camera path "+filename+" has no keyframes");
+
+    return path;
+  }
+
+  /// Inserts a keyframe, keeping the keyframes ordered by time
+  void add_keyframe(const camera_keyframe& keyframe)
+  {
+    assert(math::dot(keyframe.look_at, keyframe.look_at) > 0.0f);
+
+    auto position = std::upper_bound(_keyframes.begin(), _keyframes.end(), keyframe,
+                                     [](const camera_keyframe& a, const camera_keyframe& b){
+                                       return a.time < b.time;
+                                     });
+    _keyframes.insert(position, keyframe);
+  }
+
+  std::size_t get_num_keyframes() const
+  {
+    return _keyframes.size();
+  }
+
+  scalar get_start_time() const
+  {
+    assert(!_keyframes.empty());
+    return _keyframes.front().time;
+  }
+
+  scalar get_end_time() const
+  {
+    assert(!_keyframes.empty());
+    return _keyframes.back().time;
+  }
+
+  /// \return The camera at a point in time. Before the first and after
+  /// the last keyframe, the camera remains at the respective keyframe.
+  /// \param time The time
+  /// \param base_camera The camera from which the remaining properties,
+  /// e.g. the aperture, are taken
+  device_object::camera get_camera(scalar time,
+                                   const device_object::camera& base_camera) const
+  {
+    assert(!_keyframes.empty());
+
+    std::size_t segment = 0;
+    while(segment + 2 < _keyframes.size() && _keyframes[segment + 1].time <= time)
+      ++segment;
+
+    const camera_keyframe& k1 = _keyframes[segment];
+    const camera_keyframe& k2 = _keyframes[std::min(segment + 1, _keyframes.size() - 1)];
+    // The tangents at the first and last keyframe are one-sided
+    const camera_keyframe& k0 = _keyframes[segment > 0 ? segment - 1 : segment];
+    const camera_keyframe& k3 = _keyframes[std::min(segment + 2, _keyframes.size() - 1)];
+
+    scalar t = 0.0f;
+    if(k2.time > k1.time)
+      t = std::min(std::max((time - k1.time) / (k2.time - k1.time), 0.0f), 1.0f);
+
+    device_object::camera cam = base_camera;
+    cam.set_position(catmull_rom(k0.position, k1.position, k2.position, k3.position, t));
+    cam.set_roll_angle((1.0f - t) * k1.roll_angle + t * k2.roll_angle);
+    cam.set_look_at(math::normalize(catmull_rom(math::normalize(k0.look_at),
+                                                math::normalize(k1.look_at),
+                                                math::normalize(k2.look_at),
+                                                math::normalize(k3.look_at), t)));
+
+    if(k1.focal_plane_distance > 0.0f && k2.focal_plane_distance > 0.0f)
+      cam.set_focal_plane_distance((1.0f - t) * k1.focal_plane_distance
+                                   + t * k2.focal_plane_distance);
+    else
+      cam.enable_autofocus();
+
+    return cam;
+  }
+
+private:
+  /// Evaluates the uniform Catmull-Rom spline through p1 and p2
+  static vector3 catmull_rom(const vector3& p0, const vector3& p1,
+                             const vector3& p2, const vector3& p3, scalar t)
+  {
+    scalar t2 = t * t;
+    scalar t3 = t2 * t;
+    return 0.5f * ((2.0f * p1)
+                   + t * (p2 - p0)
+                   + t2 * (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3)
+                   + t3 * (3.0f * p1 - p0 - 3.0f * p2 + p3));
+  }
+
+  std::vector<camera_keyframe> _keyframes;
+};
+
+}
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include "content_hash.hpp"
+#include "frame_renderer.hpp"
+#include "scene.hpp"
+#include "qcl.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace gray {
+
+/// Identifies checkpoint files
+constexpr std::uint32_t checkpoint_magic = 0x47524350;
+constexpr std::uint32_t checkpoint_version = 2;
+/// Integrator names are short, longer names indicate a corrupted file
+constexpr std::uint64_t checkpoint_max_integrator_size = 256;
+
+/// Hashes the parameters of a camera. The members are hashed one by one
+/// rather than the bytes of the camera, since the unused fourth component
+/// of its vectors and the padding are indeterminate and may differ
+/// between processes.
+/// \param cam The camera
+/// \param hash The hash of the preceding data, if the hash is continued
+inline std::uint64_t hash_camera(const device_object::camera& cam,
+                                 std::uint64_t hash = hash_bytes(nullptr, 0))
+{
+  const vector3 vectors[] = {cam.get_position(), cam.get_look_at(),
+                             cam.get_screen_basis1(), cam.get_screen_basis2()};
+  for(const vector3& v : vectors)
+    for(std::size_t i = 0; i < 3; ++i)
+      hash = hash_bytes(&v.s[i], sizeof(scalar), hash);
+
+  const scalar parameters[] = {cam.get_roll_angle(),
+                               cam.get_lens_plane_distance(),
+                               cam.get_aperture_diameter(),
+                               cam.is_autofocus_enabled() ? 0.0f : cam.get_focal_length()};
+  for(scalar parameter : parameters)
+    hash = hash_bytes(&parameter, sizeof(scalar), hash);
+  return hash;
+}
+
+/// The state of an offline render from which it can be resumed: the
+/// accumulated samples, the features for the denoiser and the state of
+/// the random number generators, such that the resumed render continues
+/// with the random numbers of the interrupted one.
+///
+/// The state of integrator extensions is not part of a checkpoint, they
+/// are rebuilt after resuming. The compensations of the accumulated sums
+/// are dropped as well, which loses less than the rounding error of one
+/// addition per pixel.
+struct render_checkpoint
+{
+  render_checkpoint()
+  : width{0}, height{0}, sampling_mode{SAMPLING_MODE_UNIFORM}, scene_hash{0},
+    rays_per_pixel{0}, frame_number{0}, elapsed_time{0.0}
+  {}
+
+  std::uint64_t width;
+  std::uint64_t height;
+  std::string integrator;
+  /// Renders must not be resumed with a different sampling mode, since
+  /// the samples of the modes are distributed differently
+  std::int64_t sampling_mode;
+  /// Identifies the scene and camera, such that a checkpoint is not
+  /// resumed with a different scene
+  std::uint64_t scene_hash;
+  std::uint64_t rays_per_pixel;
+  std::uint64_t frame_number;
+  /// The rendering time before the checkpoint, for renders with a
+  /// time budget
+  double elapsed_time;
+
+  std::vector<cl_float4> sums;
+  std::vector<cl_int> sample_counts;
+  std::vector<cl_float4> albedo;
+  std::vector<cl_float4> normal_depth;
+  std::vector<cl_int> random_state;
+
+  /// Reads the state of a renderer. Waits for the device to finish
+  /// the enqueued frames.
+  void capture(const frame_renderer& renderer)
+  {
+    const qcl::device_context_ptr& ctx = renderer.get_cl_context();
+    std::size_t num_pixels = renderer.get_resolution_width()
+                           * renderer.get_resolution_height();
+
+    width = renderer.get_resolution_width();
+    height = renderer.get_resolution_height();
+    sampling_mode = renderer.get_sampling_mode();
+    rays_per_pixel = renderer.get_total_rays_per_pixel();
+    frame_number = renderer.get_frame_number();
+
+    sums.resize(num_pixels);
+    sample_counts.resize(num_pixels);
+    albedo.resize(num_pixels);
+    normal_depth.resize(num_pixels);
+    random_state.resize(renderer.get_random_engine().get_num_states());
+
+    ctx->memcpy_d2h(sums.data(), renderer.get_accumulated_sums(), sums.size());
+    ctx->memcpy_d2h(sample_counts.data(), renderer.get_sample_counts(),
+                    sample_counts.size());
+    ctx->memcpy_d2h(albedo.data(), renderer.get_albedo(), albedo.size());
+    ctx->memcpy_d2h(normal_depth.data(), renderer.get_normal_depth(),
+                    normal_depth.size());
+    ctx->memcpy_d2h(random_state.data(), renderer.get_random_engine().get(),
+                    random_state.size());
+  }
+
+  /// Replaces the state of a renderer by the checkpoint
+  void restore(frame_renderer& renderer) const
+  {
+    if(width != renderer.get_resolution_width() ||
+       height != renderer.get_resolution_height() ||
+       random_state.size() != renderer.get_random_engine().get_num_states())
+      throw std::runtime_error("Checkpoint does not match the resolution of the render");
+
+    renderer.load_samples(sums, sample_counts, albedo, normal_depth,
+                          static_cast<std::size_t>(rays_per_pixel));
+    renderer.load_random_state(random_state);
+    renderer.set_frame_number(frame_number);
+  }
+
+  /// Writes the checkpoint. The file is replaced at once, such that an
+  /// interruption while writing keeps the previous checkpoint intact.
+  /// \param filename The name of the file
+  void save(const std::string& filename) const
+  {
+    std::string temporary_filename = filename + ".tmp";
+    {
+      std::ofstream file{temporary_filename.c_str(), std::ios::binary | std::ios::trunc};
+      if(!file.is_open())
+        throw std::runtime_error("Could not open checkpoint file "+temporary_filename);
+
+      write_value(file, checkpoint_magic);
+      write_value(file, checkpoint_version);
+      write_value(file, width);
+      write_value(file, height);
+      write_value(file, static_cast<std::uint64_t>(integrator.size()));
+      file.write(integrator.data(), static_cast<std::streamsize>(integrator.size()));
+      write_value(file, sampling_mode);
+      write_value(file, static_cast<std::uint64_t>(random_state.size()));
+      write_value(file, scene_hash);
+      write_value(file, rays_per_pixel);
+      write_value(file, frame_number);
+      write_value(file, elapsed_time);
+      write_vector(file, sums);
+      write_vector(file, sample_counts);
+      write_vector(file, albedo);
+      write_vector(file, normal_depth);
+      write_vector(file, random_state);
+
+      file.flush();
+      if(!file)
+        throw std::runtime_error("Could not write checkpoint file "+temporary_filename);
+    }
+    if(std::rename(temporary_filename.c_str(), filename.c_str()) != 0)
+      throw std::runtime_error("Could not replace checkpoint file "+filename);
+  }
+
+  /// Reads a checkpoint
+  /// \param filename The name of the file
+  static render_checkpoint load(const std::string& filename)
+  {
+    std::ifstream file{filename.c_str(), std::ios::binary | std::ios::ate};
+    if(!file.is_open())
+      throw std::runtime_error("Could not open checkpoint file "+filename);
+    // The sizes stored in the file are checked against its length before
+    // anything is allocated, such that a corrupted file cannot cause
+    // huge allocations
+    std::uint64_t file_size = static_cast<std::uint64_t>(file.tellg());
+    file.seekg(0);
+
+    if(read_value<std::uint32_t>(file) != checkpoint_magic ||
+       read_value<std::uint32_t>(file) != checkpoint_version)
+      throw std::runtime_error(filename+" is not a checkpoint of this version");
+
+    render_checkpoint checkpoint;
+    checkpoint.width = read_value<std::uint64_t>(file);
+    checkpoint.height = read_value<std::uint64_t>(file);
+    std::uint64_t integrator_size = read_value<std::uint64_t>(file);
+    if(integrator_size > checkpoint_max_integrator_size)
+      throw std::runtime_error("Checkpoint file "+filename+" is invalid");
+    checkpoint.integrator.resize(static_cast<std::size_t>(integrator_size));
+    file.read(&checkpoint.integrator[0],
+              static_cast<std::streamsize>(checkpoint.integrator.size()));
+    checkpoint.sampling_mode = read_value<std::int64_t>(file);
+    std::uint64_t num_random_states = read_value<std::uint64_t>(file);
+    checkpoint.scene_hash = read_value<std::uint64_t>(file);
+    checkpoint.rays_per_pixel = read_value<std::uint64_t>(file);
+    checkpoint.frame_number = read_value<std::uint64_t>(file);
+    checkpoint.elapsed_time = read_value<double>(file);
+
+    // Each pixel occupies more than one byte, which also bounds the
+    // product against overflows
+    if(checkpoint.width == 0 || checkpoint.height == 0 ||
+       checkpoint.width > file_size || checkpoint.height > file_size / checkpoint.width)
+      throw std::runtime_error("Checkpoint file "+filename+" is invalid");
+    std::uint64_t num_pixels = checkpoint.width * checkpoint.height;
+
+    checkpoint.sums = read_vector<cl_float4>(file, num_pixels, file_size);
+    checkpoint.sample_counts = read_vector<cl_int>(file, num_pixels, file_size);
+    checkpoint.albedo = read_vector<cl_float4>(file, num_pixels, file_size);
+    checkpoint.normal_depth = read_vector<cl_float4>(file, num_pixels, file_size);
+    checkpoint.random_state = read_vector<cl_int>(file, num_random_states, file_size);
+
+    return checkpoint;
+  }
+
+private:
+  template<class T>
+  static void write_value(std::ofstream& file, const T& value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be written");
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template<class T>
+  static void write_vector(std::ofstream& file, const std::vector<T>& data)
+  {
+    write_value(file, static_cast<std::uint64_t>(data.size()));
+    file.write(reinterpret_cast<const char*>(data.data()),
+               static_cast<std::streamsize>(data.size() * sizeof(T)));
+  }
+
+  template<class T>
+  static T read_value(std::ifstream& file)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be read");
+    T value = T();
+    if(!file.read(reinterpret_cast<char*>(&value), sizeof(T)))
+      throw std::runtime_error("Checkpoint file is truncated");
+    return value;
+  }
+
+  /// Reads a vector whose number of elements is known from the header
+  /// \param file The checkpoint file
+  /// \param expected_size The number of elements of the vector
+  /// \param file_size The length of the file in bytes
+  template<class T>
+  static std::vector<T> read_vector(std::ifstream& file,
+                                    std::uint64_t expected_size,
+                                    std::uint64_t file_size)
+  {
+    std::uint64_t size = read_value<std::uint64_t>(file);
+    std::uint64_t position = static_cast<std::uint64_t>(file.tellg());
+    if(size != expected_size || position > file_size ||
+       size > (file_size - position) / sizeof(T))
+      throw std::runtime_error("Checkpoint file is invalid or truncated");
+
+    std::vector<T> data(static_cast<std::size_t>(size));
+    if(!file.read(reinterpret_cast<char*>(data.data()),
+                  static_cast<std::streamsize>(data.size() * sizeof(T))))
+      throw std::runtime_error("Checkpoint file is truncated");
+    return data;
+  }
+};
+
+}
+
+#endif
@@ -30,9 +30,12 @@
 
 void cl_gl::init_environment() { glewInit(); }
 
-cl_gl::cl_gl(const gl_renderer* r, const cl::Context& context, bool gl_sharing)
-    : _renderer(r), _gl_sharing(gl_sharing), _context(context)
+cl_gl::cl_gl(const gl_renderer* r, const cl::Context& context, bool gl_sharing,
+             std::size_t frames_in_flight)
+    : _gl_sharing(gl_sharing), _renderer(r), _context(context),
+      _slots(frames_in_flight), _current_slot{0}
 {
+  assert(frames_in_flight > 0);
   init();
 }
 
@@ -44,13 +47,37 @@ void cl_gl::rebuild_buffers()
   init();
 }
 
-void cl_gl::release() { glDeleteTextures(1, &_texture); }
+void cl_gl::release()
+{
+  for (frame_slot& slot : _slots)
+  {
+    if (slot.fence)
+      glDeleteSync(static_cast<GLsync>(slot.fence));
+    slot.fence = nullptr;
+
+    glDeleteTextures(1, &slot.texture);
+  }
+}
 
 void cl_gl::init()
 {
-  glGenTextures(1, &_texture);
+  for (frame_slot& slot : _slots)
+    init_slot(slot);
+  _current_slot = 0;
 
-  glBindTexture(GL_TEXTURE_2D, _texture);
+  glFinish();
+  assert(glGetError() == GL_NO_ERROR);
+}
+
+void cl_gl::init_slot(frame_slot& slot)
+{
+  slot.fence = nullptr;
+  slot.is_rendered = false;
+  slot.ready = cl::Event{};
+
+  glGenTextures(1, &slot.texture);
+
+  glBindTexture(GL_TEXTURE_2D, slot.texture);
 
   // set basic parameters
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -66,71 +93,109 @@ void cl_gl::init()
   cl_int err;
   if (_gl_sharing)
   {
-    this->_cl_buffer = std::make_shared<cl::ImageGL>(
-        _context, CL_MEM_READ_WRITE, GL_TEXTURE_2D, 0, _texture, &err);
+    slot.cl_buffer = std::make_shared<cl::ImageGL>(
+        _context, CL_MEM_READ_WRITE, GL_TEXTURE_2D, 0, slot.texture, &err);
   }
   else
   {
-    this->_cl_buffer = std::make_shared<cl::Image2D>(
+    slot.cl_buffer = std::make_shared<cl::Image2D>(
         _context, CL_MEM_READ_WRITE, cl::ImageFormat{CL_RGBA, CL_UNORM_INT8},
         _renderer->get_width(), _renderer->get_height(), 0, nullptr, &err);
-    this->_host_cl_buffer.resize(4 * _renderer->get_width() *
-                                 _renderer->get_height());
+    slot.host_buffer.resize(4 * _renderer->get_width() *
+                            _renderer->get_height());
   }
 
   if (err != CL_SUCCESS)
     throw std::runtime_error("Could not create Image!");
 
-  this->_gl_objects.clear();
-  this->_gl_objects.push_back(*_cl_buffer);
+  slot.gl_objects.clear();
+  slot.gl_objects.push_back(*slot.cl_buffer);
 
   glBindTexture(GL_TEXTURE_2D, 0);
-  glFinish();
-  assert(glGetError() == GL_NO_ERROR);
+}
+
+void cl_gl::wait_for_gl(frame_slot& slot)
+{
+  if (GLEW_ARB_sync)
+  {
+    if (slot.fence)
+    {
+      GLsync fence = static_cast<GLsync>(slot.fence);
+      glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+      glDeleteSync(fence);
+      slot.fence = nullptr;
+    }
+  }
+  else
+    // Without sync objects, only waiting for all GL commands is possible
+    glFinish();
 }
 
 void cl_gl::display(kernel_executor_type kernel_call, cl::CommandQueue& queue)
 {
+  frame_slot& slot = _slots[_current_slot];
 
-  // Call Kernel
-  glFinish();
+  // The GL must not read the image anymore while it is rendered into
+  wait_for_gl(slot);
 
   if (this->_gl_sharing)
   {
-    cl_int err = queue.enqueueAcquireGLObjects(&_gl_objects, NULL, NULL);
+    cl_int err = queue.enqueueAcquireGLObjects(&slot.gl_objects, NULL, NULL);
     assert(err == CL_SUCCESS);
 
-    kernel_call(*(this->_cl_buffer), _renderer->get_width(),
+    kernel_call(*(slot.cl_buffer), _renderer->get_width(),
                 _renderer->get_height());
 
-    err = queue.enqueueReleaseGLObjects(&_gl_objects, NULL, NULL);
+    err = queue.enqueueReleaseGLObjects(&slot.gl_objects, NULL, &slot.ready);
     assert(err == CL_SUCCESS);
-    queue.finish();
   }
   else
   {
     // We need to load the data explicitly into the texture
-    kernel_call(*(this->_cl_buffer), _renderer->get_width(),
+    kernel_call(*(slot.cl_buffer), _renderer->get_width(),
                 _renderer->get_height());
-    queue.finish();
     cl_int err;
     err = queue.enqueueReadImage(
-        *_cl_buffer, CL_TRUE, {{0, 0, 0}},
+        *slot.cl_buffer, CL_FALSE, {{0, 0, 0}},
         {{_renderer->get_width(), _renderer->get_height(), 1}}, 0, 0,
-        _host_cl_buffer.data(), nullptr, nullptr);
+        slot.host_buffer.data(), nullptr, &slot.ready);
     assert(err == CL_SUCCESS);
-    queue.finish();
+  }
+  // Start the work on the device without waiting for it
+  queue.flush();
+  slot.is_rendered = true;
+
+  _current_slot = (_current_slot + 1) % _slots.size();
 
+  // Display the oldest frame in flight, which is the frame that will
+  // be rendered into next. Until all slots have been used, display
+  // the newest frame instead.
+  frame_slot* displayed_slot = &_slots[_current_slot];
+  if (!displayed_slot->is_rendered)
+    displayed_slot = &slot;
+
+  displayed_slot->ready.wait();
+
+  if (!this->_gl_sharing)
+  {
     // Copy Image to GL texture
-    glBindTexture(GL_TEXTURE_2D, this->_texture);
+    glBindTexture(GL_TEXTURE_2D, displayed_slot->texture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
                  static_cast<GLsizei>(_renderer->get_width()),
                  static_cast<GLsizei>(_renderer->get_height()), 0, GL_RGBA,
-                 GL_UNSIGNED_BYTE, _host_cl_buffer.data());
+                 GL_UNSIGNED_BYTE, displayed_slot->host_buffer.data());
   }
 
+  draw_texture(displayed_slot->texture);
+
+  if (GLEW_ARB_sync)
+    displayed_slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void cl_gl::draw_texture(GLuint texture)
+{
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  glBindTexture(GL_TEXTURE_2D, this->_texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
 
   glEnable(GL_TEXTURE_2D);
   glDisable(GL_DEPTH_TEST);
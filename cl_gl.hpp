@@ -32,29 +32,58 @@ class cl_gl
 public:
   static void init_environment();
   
-  cl_gl(const gl_renderer* r, const cl::Context& context, bool gl_sharing=true);
+  /// \param r The GL renderer
+  /// \param context The OpenCL context
+  /// \param gl_sharing Whether CL images are shared with GL textures
+  /// \param frames_in_flight The number of frames that may be processed by
+  /// the device while an older frame is displayed
+  cl_gl(const gl_renderer* r, const cl::Context& context, bool gl_sharing=true,
+        std::size_t frames_in_flight=2);
   ~cl_gl();
   
   typedef std::function<void (const cl::Image&, std::size_t, std::size_t)> 
         kernel_executor_type;
   
+  /// Enqueues the rendering of a new frame and displays the oldest frame
+  /// in flight. Blocks only if the displayed frame has not been finished
+  /// by the device yet, or if the GL has not finished reading the image
+  /// the new frame is rendered into.
   void display(kernel_executor_type kernel_call, cl::CommandQueue& queue);
   
+  /// Recreates the images for the current window size. All frames in
+  /// flight must have been finished.
   void rebuild_buffers();
 private:
+  /// The images of one frame in flight
+  struct frame_slot
+  {
+    GLuint texture;
+    std::shared_ptr<cl::Image> cl_buffer;
+    std::vector<cl::Memory> gl_objects;
+    std::vector<uint8_t> host_buffer;
+    /// Completes when the frame is ready to be displayed
+    cl::Event ready;
+    /// GLsync, which is not declared by every gl.h. Signaled once the GL
+    /// has finished drawing the texture, or null.
+    void* fence;
+    bool is_rendered;
+  };
+
   void init();
   void release();
 
+  void init_slot(frame_slot& slot);
+  void wait_for_gl(frame_slot& slot);
+  void draw_texture(GLuint texture);
+
   const bool _gl_sharing;
 
   const gl_renderer* _renderer;
-  GLuint _texture;
   cl::Context _context;
-  
-  std::shared_ptr<cl::Image> _cl_buffer;
-  std::vector<cl::Memory> _gl_objects;
 
-  std::vector<uint8_t> _host_cl_buffer;
+  std::vector<frame_slot> _slots;
+  /// The slot into which the next frame is rendered
+  std::size_t _current_slot;
 };
 
 #endif
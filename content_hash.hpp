@@ -0,0 +1,112 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTENT_HASH_HPP
+#define CONTENT_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace gray {
+
+/// Computes 64 bit FNV-1a hashes
+/// \param data The hashed bytes
+/// \param size The number of bytes
+/// \param hash The hash of the preceding data, if the hash is continued
+inline std::uint64_t hash_bytes(const void* data, std::size_t size,
+                                std::uint64_t hash = 14695981039346656037ull)
+{
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for(std::size_t i = 0; i < size; ++i)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/// Hashes the contents of files. The hash of a file is only recomputed
+/// if its size or modification time has changed since it was last read,
+/// such that large textures are not read again for each job.
+class file_hash_cache
+{
+public:
+  /// \return The hash of the contents of a file
+  /// \param path The path of the file
+  std::uint64_t get_hash(const std::string& path)
+  {
+    struct stat status;
+    if(stat(path.c_str(), &status) != 0)
+      throw std::runtime_error("Could not access file "+path);
+
+    file_state& state = _files[path];
+    if(state.is_valid &&
+       state.size == status.st_size &&
+       state.modification_time == status.st_mtim.tv_sec &&
+       state.modification_time_ns == status.st_mtim.tv_nsec)
+      return state.hash;
+
+    std::ifstream file{path.c_str(), std::ios::binary};
+    if(!file.is_open())
+      throw std::runtime_error("Could not open file "+path);
+
+    std::uint64_t hash = hash_bytes(nullptr, 0);
+    std::vector<char> buffer(1 << 20);
+    while(file)
+    {
+      file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+      hash = hash_bytes(buffer.data(), static_cast<std::size_t>(file.gcount()), hash);
+    }
+
+    state.is_valid = true;
+    state.size = status.st_size;
+    state.modification_time = status.st_mtim.tv_sec;
+    state.modification_time_ns = status.st_mtim.tv_nsec;
+    state.hash = hash;
+    return hash;
+  }
+
+private:
+  struct file_state
+  {
+    file_state()
+    : is_valid{false}, size{0}, modification_time{0},
+      modification_time_ns{0}, hash{0}
+    {}
+
+    bool is_valid;
+    off_t size;
+    time_t modification_time;
+    long modification_time_ns;
+    std::uint64_t hash;
+  };
+
+  std::map<std::string, file_state> _files;
+};
+
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DENOISER_HPP
+#define DENOISER_HPP
+
+#include "qcl.hpp"
+
+#include <array>
+
+namespace gray {
+
+/// Edge-aware a-trous wavelet denoiser, guided by the first-hit features
+/// written by the path tracer. See denoising.cl.
+class atrous_denoiser
+{
+public:
+  atrous_denoiser(const qcl::device_context_ptr& ctx)
+  : _ctx{ctx},
+    _filter_kernel{ctx->get_kernel("atrous_filter")},
+    _num_passes{5},
+    _color_sigma{4.0f},
+    _normal_exponent{64.0f},
+    _depth_sigma{0.05f},
+    _albedo_sigma{0.1f},
+    _width{0},
+    _height{0},
+    _view_height{0}
+  {
+  }
+
+  void set_resolution(std::size_t width, std::size_t height)
+  {
+    for(auto& image : _images)
+    {
+      cl_int err;
+      image = std::make_shared<cl::Image2D>(_ctx->get_context(),
+                                            CL_MEM_READ_WRITE,
+                                            cl::ImageFormat{CL_RGBA, CL_FLOAT},
+                                            width, height, 0, nullptr, &err);
+      qcl::check_cl_error(err, "Could not create CL image object for denoising!");
+    }
+
+    _width = width;
+    _height = height;
+  }
+
+  /// Keeps the filter within each view, if several views are stacked
+  /// vertically in the image
+  /// \param view_height The height of each view, 0 if the image
+  /// consists of a single view
+  void set_view_height(std::size_t view_height)
+  {
+    _view_height = view_height;
+  }
+
+  /// Sets the number of filter passes. The filtered region grows
+  /// exponentially with the number of passes.
+  void set_num_passes(std::size_t num_passes)
+  {
+    _num_passes = num_passes;
+  }
+
+  std::size_t get_num_passes() const
+  {
+    return _num_passes;
+  }
+
+  /// Enqueues the filter passes
+  /// \return The denoised image, which remains valid until the next call
+  /// \param input The accumulated image of the path tracer
+  /// \param sample_counts The number of samples of each pixel
+  /// \param albedo The first-hit albedo of each pixel
+  /// \param normal_depth The first-hit normal and depth of each pixel
+  const cl::Image2D& run(const cl::Image2D& input,
+                         const cl::Buffer& sample_counts,
+                         const cl::Buffer& albedo,
+                         const cl::Buffer& normal_depth)
+  {
+    assert(_width != 0 && _height != 0);
+
+    std::size_t work_items_x = get_required_num_work_items(_width);
+    std::size_t work_items_y = get_required_num_work_items(_height);
+
+    const cl::Image2D* pass_input = &input;
+    for(std::size_t pass = 0; pass < _num_passes; ++pass)
+    {
+      const cl::Image2D& pass_output = *_images[pass % 2];
+
+      qcl::kernel_argument_list arguments(_filter_kernel);
+      arguments.push(pass_output);
+      arguments.push(*pass_input);
+      arguments.push(input);
+      arguments.push(sample_counts);
+      arguments.push(albedo);
+      arguments.push(normal_depth);
+      arguments.push(static_cast<cl_int>(1 << pass));
+      arguments.push(_color_sigma);
+      arguments.push(_normal_exponent);
+      arguments.push(_depth_sigma);
+      arguments.push(_albedo_sigma);
+      arguments.push(static_cast<cl_int>(_view_height > 0 ? _view_height : _height));
+
+      cl_int err = _ctx->get_command_queue().enqueueNDRangeKernel(*_filter_kernel,
+                                                                  cl::NullRange,
+                                                                  cl::NDRange(work_items_x, work_items_y),
+                                                                  cl::NDRange(_group_size, _group_size));
+      qcl::check_cl_error(err, "Could not enqueue denoising kernel call!");
+
+      pass_input = &pass_output;
+    }
+    return *pass_input;
+  }
+
+private:
+  inline
+  std::size_t get_required_num_work_items(std::size_t num_items) const
+  {
+    if(num_items % _group_size != 0)
+      return (num_items / _group_size + 1) * _group_size;
+    return num_items;
+  }
+
+  qcl::device_context_ptr _ctx;
+  qcl::kernel_ptr _filter_kernel;
+
+  std::size_t _num_passes;
+  cl_float _color_sigma;
+  cl_float _normal_exponent;
+  cl_float _depth_sigma;
+  cl_float _albedo_sigma;
+
+  std::size_t _width;
+  std::size_t _height;
+  std::size_t _view_height;
+
+  std::array<std::shared_ptr<cl::Image2D>, 2> _images;
+
+  static constexpr std::size_t _group_size = 8;
+};
+}
+
+#endif
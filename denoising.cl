@@ -0,0 +1,151 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DENOISING_CL
+#define DENOISING_CL
+
+#include "common.cl_hpp"
+
+// Edge-aware a-trous wavelet denoiser. Each pass applies a 5x5 B3-spline
+// filter whose taps are spread by the step size of the pass, such that
+// repeated passes with doubling step sizes filter large regions cheaply.
+// The taps are weighted by the similarity of the first-hit features
+// (albedo, normal and depth) written by the path tracer, and of the
+// luminance relative to its standard error. As the image converges, the
+// standard error and hence the amount of filtering vanish.
+
+__constant sampler_t denoising_sampler = CLK_NORMALIZED_COORDS_FALSE |
+                                         CLK_ADDRESS_CLAMP_TO_EDGE |
+                                         CLK_FILTER_NEAREST;
+
+__constant float atrous_kernel[3] = {3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+
+scalar denoising_luminance(float4 color)
+{
+  return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+/// \return The standard error of the luminance of a pixel
+/// \param color The accumulated pixel, w contains the average squared luminance
+/// \param num_samples The number of samples of the pixel
+scalar denoising_get_standard_error(float4 color, int num_samples)
+{
+  scalar luminance = denoising_luminance(color);
+  scalar variance = fmax(color.w - luminance * luminance, 0.f);
+  return sqrt(variance / (scalar)max(num_samples, 1));
+}
+
+/// One pass of the a-trous filter
+/// \param output The filtered image
+/// \param input The result of the previous pass, or the accumulated image
+/// for the first pass
+/// \param noisy_image The accumulated image of the path tracer, from which
+/// the noise level is estimated
+/// \param sample_counts The number of samples of each pixel, row-major
+/// \param albedo The first-hit albedo of each pixel, row-major
+/// \param normal_depth The first-hit normal (xyz) and distance to the
+/// camera (w) of each pixel, row-major
+/// \param step_size The distance between the taps of the filter
+/// \param color_sigma Luminance differences of this many standard errors
+/// are considered as edges
+/// \param normal_exponent Sharpness of the normal edge-stopping function
+/// \param depth_sigma Relative depth differences (per step) that are
+/// considered as edges
+/// \param albedo_sigma Albedo differences that are considered as edges
+/// \param view_height The height of each view if several views are
+/// stacked vertically in the image, the taps do not cross between views.
+/// Otherwise the height of the image.
+__kernel void atrous_filter(__write_only image2d_t output,
+                            __read_only image2d_t input,
+                            __read_only image2d_t noisy_image,
+                            __global const int* sample_counts,
+                            __global const float4* albedo,
+                            __global const float4* normal_depth,
+                            int step_size,
+                            float color_sigma,
+                            float normal_exponent,
+                            float depth_sigma,
+                            float albedo_sigma,
+                            int view_height)
+{
+  int width = get_image_width(output);
+  int height = get_image_height(output);
+
+  int px_x = get_global_id(0);
+  int px_y = get_global_id(1);
+
+  if (px_x >= width || px_y >= height)
+    return;
+
+  int view_begin = (px_y / view_height) * view_height;
+  int view_end = min(view_begin + view_height, height);
+
+  int2 coord = (int2)(px_x, px_y);
+  int pixel_index = px_y * width + px_x;
+
+  float4 center_color = read_imagef(input, denoising_sampler, coord);
+  float4 center_albedo = albedo[pixel_index];
+  float4 center_normal_depth = normal_depth[pixel_index];
+  vector3 center_normal = center_normal_depth.xyz;
+  if (dot(center_normal, center_normal) > 0.f)
+    center_normal = normalize(center_normal);
+  scalar center_luminance = denoising_luminance(center_color);
+
+  scalar standard_error =
+      denoising_get_standard_error(read_imagef(noisy_image, denoising_sampler, coord),
+                                   sample_counts[pixel_index]);
+  scalar luminance_scale = 1.f / (color_sigma * standard_error + 1.e-4f);
+  scalar depth_scale = 1.f / (depth_sigma * (scalar)step_size
+                              * fabs(center_normal_depth.w) + 1.e-4f);
+  scalar albedo_scale = 1.f / (albedo_sigma * albedo_sigma);
+
+  float4 sum = (float4)(0.f, 0.f, 0.f, 0.f);
+  scalar weight_sum = 0.f;
+
+  for (int dy = -2; dy <= 2; ++dy)
+  {
+    for (int dx = -2; dx <= 2; ++dx)
+    {
+      int x = clamp(px_x + dx * step_size, 0, width - 1);
+      int y = clamp(px_y + dy * step_size, view_begin, view_end - 1);
+      int index = y * width + x;
+
+      float4 color = read_imagef(input, denoising_sampler, (int2)(x, y));
+      float4 sample_normal_depth = normal_depth[index];
+      vector3 sample_normal = sample_normal_depth.xyz;
+      if (dot(sample_normal, sample_normal) > 0.f)
+        sample_normal = normalize(sample_normal);
+      float4 albedo_difference = albedo[index] - center_albedo;
+
+      scalar weight = atrous_kernel[abs(dx)] * atrous_kernel[abs(dy)];
+      weight *= exp(-fabs(denoising_luminance(color) - center_luminance) * luminance_scale);
+      weight *= pow(fmax(dot(sample_normal, center_normal), 0.f), normal_exponent);
+      weight *= exp(-fabs(sample_normal_depth.w - center_normal_depth.w) * depth_scale);
+      weight *= exp(-dot(albedo_difference.xyz, albedo_difference.xyz) * albedo_scale);
+
+      sum += weight * color;
+      weight_sum += weight;
+    }
+  }
+
+  // The center tap always has a positive weight, unless its normal vanishes
+  float4 result = weight_sum > 0.f ? sum / weight_sum : center_color;
+  write_imagef(output, coord, result);
+}
+
+#endif
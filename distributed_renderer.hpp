@@ -0,0 +1,371 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISTRIBUTED_RENDERER_HPP
+#define DISTRIBUTED_RENDERER_HPP
+
+#include "socket.hpp"
+#include "scene.hpp"
+#include "random.hpp"
+#include "common.cl_hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+namespace gray {
+
+/// Identifies the messages of the protocol between master and workers
+constexpr std::uint32_t render_protocol_magic = 0x47524159;
+constexpr std::uint32_t render_protocol_version = 2;
+
+/// The part of a render that is sent to a worker. The scene is identified
+/// by its name, since the scenes are built by the application itself.
+struct render_job
+{
+  explicit render_job(const device_object::camera& cam)
+  : width{0}, height{0}, sampling_mode{SAMPLING_MODE_UNIFORM},
+    rays_per_pixel{0}, seed{0}, camera(cam)
+  {}
+
+  std::string scene_name;
+  std::string integrator;
+  std::uint64_t width;
+  std::uint64_t height;
+  portable_int sampling_mode;
+  /// The number of rays per pixel to trace
+  std::uint64_t rays_per_pixel;
+  /// The seed of the random number generator. It must be unique for
+  /// each job, such that the samples of the jobs are independent and
+  /// their sum remains unbiased.
+  std::uint64_t seed;
+  device_object::camera camera;
+
+  void send(socket_connection& connection) const
+  {
+    connection.send_value(render_protocol_magic);
+    connection.send_value(render_protocol_version);
+    connection.send_string(scene_name);
+    connection.send_string(integrator);
+    connection.send_value(width);
+    connection.send_value(height);
+    connection.send_value(sampling_mode);
+    connection.send_value(rays_per_pixel);
+    connection.send_value(seed);
+    connection.send_value(camera);
+  }
+
+  /// Overwrites the job by the next one received from a connection
+  void receive(socket_connection& connection)
+  {
+    check_header(connection);
+    scene_name = connection.receive_string();
+    integrator = connection.receive_string();
+    connection.receive_value(width);
+    connection.receive_value(height);
+    connection.receive_value(sampling_mode);
+    connection.receive_value(rays_per_pixel);
+    connection.receive_value(seed);
+    connection.receive_value(camera);
+  }
+
+  static void check_header(socket_connection& connection)
+  {
+    if(connection.receive_value<std::uint32_t>() != render_protocol_magic ||
+       connection.receive_value<std::uint32_t>() != render_protocol_version)
+      throw std::runtime_error("Received message of unknown protocol");
+  }
+};
+
+/// The samples that a worker has traced for a job, in the layout of
+/// the accumulation buffers of the frame renderer
+struct render_job_result
+{
+  render_job_result()
+  : rays_per_pixel{0}
+  {}
+
+  /// The sums of the samples of each pixel, row-major
+  std::vector<cl_float4> sums;
+  /// The rounding errors of the compensated sums, the exact sums
+  /// are sums - compensations
+  std::vector<cl_float4> compensations;
+  std::vector<cl_int> sample_counts;
+  /// The average first-hit features of each pixel
+  std::vector<cl_float4> albedo;
+  std::vector<cl_float4> normal_depth;
+  /// The number of rays per pixel that have been traced on average
+  std::uint64_t rays_per_pixel;
+
+  void send(socket_connection& connection) const
+  {
+    connection.send_value(render_protocol_magic);
+    connection.send_value(render_protocol_version);
+    connection.send_value(rays_per_pixel);
+    connection.send_vector(sums);
+    connection.send_vector(compensations);
+    connection.send_vector(sample_counts);
+    connection.send_vector(albedo);
+    connection.send_vector(normal_depth);
+  }
+
+  void receive(socket_connection& connection)
+  {
+    render_job::check_header(connection);
+    connection.receive_value(rays_per_pixel);
+    sums = connection.receive_vector<cl_float4>();
+    compensations = connection.receive_vector<cl_float4>();
+    sample_counts = connection.receive_vector<cl_int>();
+    albedo = connection.receive_vector<cl_float4>();
+    normal_depth = connection.receive_vector<cl_float4>();
+  }
+};
+
+/// Distributes a render among workers on other processes or machines.
+/// The requested rays per pixel are split into jobs, which are assigned to
+/// the workers as soon as they have finished their previous job, such that
+/// faster workers receive more jobs. Jobs of workers that fail are assigned
+/// to the remaining workers. The samples of all jobs are summed per pixel.
+class render_master
+{
+public:
+  /// \param workers The addresses of the workers, as host:port
+  explicit render_master(const std::vector<std::string>& workers)
+  {
+    for(const std::string& address : workers)
+    {
+      std::size_t separator = address.rfind(':');
+      if(separator == std::string::npos)
+        throw std::invalid_argument("Worker address "+address+" lacks a port");
+
+      try
+      {
+        _workers.push_back(socket_connection::connect_to(
+            address.substr(0, separator),
+            static_cast<std::uint16_t>(std::stoul(address.substr(separator + 1)))));
+        _worker_names.push_back(address);
+      }
+      catch(std::runtime_error& e)
+      {
+        std::cout << "Skipping worker: " << e.what() << std::endl;
+      }
+    }
+    if(_workers.empty())
+      throw std::runtime_error("No worker could be reached");
+  }
+
+  std::size_t get_num_workers() const
+  {
+    return _workers.size();
+  }
+
+  /// Renders the image described by a job on the workers
+  /// \param job The whole render. Its seed is ignored, each job obtains
+  /// its own.
+  /// \param rays_per_job The number of rays per pixel of each job
+  /// \return The summed samples of all jobs. Their compensations are
+  /// zero, the sums carry at most the rounding error of a single
+  /// conversion from double precision.
+  render_job_result render(const render_job& job, std::size_t rays_per_job)
+  {
+    assert(rays_per_job > 0);
+
+    std::size_t num_pixels = static_cast<std::size_t>(job.width * job.height);
+    _sums.assign(4 * num_pixels, 0.0);
+    _albedo.assign(4 * num_pixels, 0.0);
+    _normal_depth.assign(4 * num_pixels, 0.0);
+    _sample_counts.assign(num_pixels, 0);
+    _rays_per_pixel = 0;
+
+    std::deque<render_job> pending_jobs;
+    std::uint64_t base_seed = device_object::random_engine::generate_seed();
+    for(std::uint64_t rays = 0; rays < job.rays_per_pixel; rays += rays_per_job)
+    {
+      render_job part = job;
+      part.rays_per_pixel = std::min<std::uint64_t>(rays_per_job, job.rays_per_pixel - rays);
+      part.seed = base_seed + pending_jobs.size();
+      pending_jobs.push_back(part);
+    }
+    std::size_t num_jobs = pending_jobs.size();
+    std::size_t num_finished_jobs = 0;
+
+    // The job each worker is busy with
+    std::vector<std::shared_ptr<render_job>> assigned_jobs(_workers.size());
+
+    while(num_finished_jobs < num_jobs)
+    {
+      for(std::size_t i = 0; i < _workers.size(); ++i)
+      {
+        if(assigned_jobs[i] || !_workers[i].is_open() || pending_jobs.empty())
+          continue;
+
+        assigned_jobs[i] = std::make_shared<render_job>(pending_jobs.front());
+        pending_jobs.pop_front();
+        try
+        {
+          assigned_jobs[i]->send(_workers[i]);
+        }
+        catch(std::runtime_error& e)
+        {
+          drop_worker(i, assigned_jobs, pending_jobs, e);
+        }
+      }
+
+      std::vector<pollfd> busy_workers;
+      std::vector<std::size_t> busy_worker_indices;
+      for(std::size_t i = 0; i < _workers.size(); ++i)
+      {
+        if(assigned_jobs[i])
+        {
+          pollfd descriptor;
+          descriptor.fd = _workers[i].get_descriptor();
+          descriptor.events = POLLIN;
+          descriptor.revents = 0;
+          busy_workers.push_back(descriptor);
+          busy_worker_indices.push_back(i);
+        }
+      }
+      if(busy_workers.empty())
+      {
+        if(pending_jobs.empty())
+          continue;
+        throw std::runtime_error("All workers have failed");
+      }
+
+      if(poll(busy_workers.data(), busy_workers.size(), -1) < 0)
+        throw std::runtime_error("Could not wait for workers");
+
+      for(std::size_t j = 0; j < busy_workers.size(); ++j)
+      {
+        if(busy_workers[j].revents == 0)
+          continue;
+
+        std::size_t i = busy_worker_indices[j];
+        try
+        {
+          render_job_result result;
+          result.receive(_workers[i]);
+          add_result(result, num_pixels);
+          assigned_jobs[i] = nullptr;
+          ++num_finished_jobs;
+
+          std::cout << "Finished job " << num_finished_jobs << "/" << num_jobs
+                    << " on " << _worker_names[i] << std::endl;
+        }
+        catch(std::runtime_error& e)
+        {
+          drop_worker(i, assigned_jobs, pending_jobs, e);
+        }
+      }
+    }
+
+    return get_merged_result(num_pixels);
+  }
+
+private:
+  /// Closes the connection to a failed worker and reassigns its job
+  void drop_worker(std::size_t worker,
+                   std::vector<std::shared_ptr<render_job>>& assigned_jobs,
+                   std::deque<render_job>& pending_jobs,
+                   const std::runtime_error& error)
+  {
+    std::cout << "Worker " << _worker_names[worker] << " failed: "
+              << error.what() << std::endl;
+
+    _workers[worker] = socket_connection{};
+    if(assigned_jobs[worker])
+      pending_jobs.push_front(*assigned_jobs[worker]);
+    assigned_jobs[worker] = nullptr;
+  }
+
+  /// Sums the samples in double precision, such that the sums of
+  /// many jobs do not lose the contributions of the later ones
+  void add_result(const render_job_result& result, std::size_t num_pixels)
+  {
+    if(result.sums.size() != num_pixels ||
+       result.compensations.size() != num_pixels ||
+       result.sample_counts.size() != num_pixels ||
+       result.albedo.size() != num_pixels ||
+       result.normal_depth.size() != num_pixels)
+      throw std::runtime_error("Received result of wrong size");
+
+    for(std::size_t i = 0; i < num_pixels; ++i)
+    {
+      double num_samples = static_cast<double>(result.sample_counts[i]);
+      for(std::size_t c = 0; c < 4; ++c)
+      {
+        // The compensations of the workers, which have accumulated the
+        // samples of many frames, are folded in at double precision
+        _sums[4 * i + c] += static_cast<double>(result.sums[i].s[c])
+                          - static_cast<double>(result.compensations[i].s[c]);
+        // The features are averaged over the samples
+        _albedo[4 * i + c] += num_samples * result.albedo[i].s[c];
+        _normal_depth[4 * i + c] += num_samples * result.normal_depth[i].s[c];
+      }
+      _sample_counts[i] += result.sample_counts[i];
+    }
+    _rays_per_pixel += result.rays_per_pixel;
+  }
+
+  render_job_result get_merged_result(std::size_t num_pixels) const
+  {
+    render_job_result merged;
+    merged.rays_per_pixel = _rays_per_pixel;
+    merged.sums.resize(num_pixels);
+    merged.compensations.assign(num_pixels, cl_float4{{0.0f, 0.0f, 0.0f, 0.0f}});
+    merged.sample_counts.resize(num_pixels);
+    merged.albedo.resize(num_pixels);
+    merged.normal_depth.resize(num_pixels);
+
+    for(std::size_t i = 0; i < num_pixels; ++i)
+    {
+      double num_samples = static_cast<double>(_sample_counts[i]);
+      double feature_weight = num_samples > 0.0 ? 1.0 / num_samples : 0.0;
+      for(std::size_t c = 0; c < 4; ++c)
+      {
+        merged.sums[i].s[c] = static_cast<cl_float>(_sums[4 * i + c]);
+        merged.albedo[i].s[c] = static_cast<cl_float>(feature_weight * _albedo[4 * i + c]);
+        merged.normal_depth[i].s[c] = static_cast<cl_float>(feature_weight
+                                                            * _normal_depth[4 * i + c]);
+      }
+      merged.sample_counts[i] = _sample_counts[i];
+    }
+    return merged;
+  }
+
+  std::vector<socket_connection> _workers;
+  std::vector<std::string> _worker_names;
+
+  std::vector<double> _sums;
+  std::vector<double> _albedo;
+  std::vector<double> _normal_depth;
+  std::vector<cl_int> _sample_counts;
+  std::uint64_t _rays_per_pixel;
+};
+
+}
+
+#endif
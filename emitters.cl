@@ -0,0 +1,442 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EMITTERS_CL
+#define EMITTERS_CL
+
+#include "random.cl"
+#include "scene.cl"
+#include "path_guiding.cl"
+
+/// Materials with a lower roughness are treated as perfect mirrors,
+/// for which sampling the emitters explicitly cannot help.
+#define EMITTER_SAMPLING_MIN_ROUGHNESS SPECULAR_ROUGHNESS_THRESHOLD
+
+/// Combines two sampling strategies using the power heuristic
+/// \return The weight of the strategy with pdf \c pdf_a
+/// \param pdf_a The pdf of the strategy that has been used to generate the sample
+/// \param pdf_b The pdf of the other strategy
+scalar emitters_power_heuristic(scalar pdf_a, scalar pdf_b)
+{
+  scalar a2 = pdf_a * pdf_a;
+  scalar b2 = pdf_b * pdf_b;
+  return a2 / (a2 + b2);
+}
+
+/// \return Whether the environment can be sampled as a light source
+/// \param s The scene
+int emitters_is_environment_sampling_enabled(const scene* s)
+{
+  return s->materials.environment_width > 0;
+}
+
+/// \return Whether explicit light sampling is used at a path vertex
+/// with a given material
+/// \param s The scene
+/// \param mat The material at the path vertex
+int emitters_is_sampling_enabled(const scene* s, const material* mat)
+{
+  return (s->num_emitters > 0 || emitters_is_environment_sampling_enabled(s))
+      && mat->roughness >= EMITTER_SAMPLING_MIN_ROUGHNESS;
+}
+
+/// Selects an emitter according to the sampling weights calculated by the host
+/// \return The object entry of the selected emitter
+/// \param s The scene, must contain at least one emitter
+/// \param rand The random number generator context
+object_entry emitters_select(const scene* s, random_ctx* rand)
+{
+  scalar random_sample = random_uniform_scalar(rand);
+
+  for(int i = 0; i < s->num_emitters - 1; ++i)
+    if(random_sample < s->emitters[i].cdf)
+      return s->emitters[i].object;
+
+  return s->emitters[s->num_emitters - 1].object;
+}
+
+/// \return A uniformly distributed point on a disk
+/// \param disk The disk
+/// \param rand The random number generator context
+vector3 emitters_sample_disk_point(const disk_geometry* disk, random_ctx* rand)
+{
+  // Construct a basis in the plane of the disk
+  vector3 basis1 = disk->plane.normal;
+  // Make sure the vector is not parallel to the normal
+  if(fabs(basis1.x) > 0.9f)
+    basis1.y += 1.0f;
+  else
+    basis1.x += 1.0f;
+  basis1 = normalize(cross(disk->plane.normal, basis1));
+  vector3 basis2 = cross(basis1, disk->plane.normal);
+
+  scalar r = disk->radius * sqrt(random_uniform_scalar(rand));
+  scalar phi = random_uniform_scalar_minmax(rand, 0.0f, 2.0f * M_PI_F);
+
+  vector3 point = disk->plane.position;
+  point += r * cos(phi) * basis1;
+  point += r * sin(phi) * basis2;
+
+  return point;
+}
+
+/// \return The light emitted by an emitter at a given point of its surface
+/// \param s The scene
+/// \param emitter The emitter
+/// \param normal The outward surface normal at the point
+intensity emitters_get_emitted_light(const scene* s,
+                                     object_entry emitter,
+                                     vector3 normal)
+{
+  material_id mat;
+  float2 uv = (float2)(0.f, 0.f);
+
+  if(emitter.type == OBJECT_TYPE_SPHERE)
+  {
+    OBJECT_NAME(sphere_geometry) sphere = s->spheres[emitter.local_id];
+    mat = sphere.material_id;
+
+    // Same mapping as in sphere_geometry_intersects
+    scalar x = dot(sphere.geometry.equatorial_basis1, normal);
+    scalar y = dot(sphere.geometry.equatorial_basis2, normal);
+    uv.x = atan2pi(y, x) * 0.5f + 0.5f;
+    uv.y = acospi(dot(sphere.geometry.polar_direction, normal));
+  }
+  else
+    mat = s->disks[emitter.local_id].material_id;
+
+  return material_db_get_material(&(s->materials), mat, uv).emitted_light;
+}
+
+/// \return The probability density (with respect to solid angle) with which
+/// \c emitters_sample_direction generates the direction from a point to
+/// a point on an emitter, not including the probability to select the emitter.
+/// \param s The scene
+/// \param emitter The emitter
+/// \param origin The point from which the emitter is sampled
+/// \param point The point on the surface of the emitter
+/// \param normal The surface normal of the emitter at \c point
+scalar emitters_solid_angle_pdf(const scene* s,
+                                object_entry emitter,
+                                vector3 origin,
+                                vector3 point,
+                                vector3 normal)
+{
+  if(emitter.type == OBJECT_TYPE_SPHERE)
+  {
+    sphere_geometry sphere = s->spheres[emitter.local_id].geometry;
+
+    vector3 to_center = vec_from_to(origin, sphere.position);
+    scalar dist2 = dot(to_center, to_center);
+    scalar radius2 = sphere.radius * sphere.radius;
+    if(dist2 <= radius2)
+      // Spheres are not sampled from inside
+      return 0.f;
+
+    // Uniform sampling of the cone subtended by the sphere
+    scalar sin_theta_max2 = radius2 / dist2;
+    scalar one_minus_cos_theta_max = sin_theta_max2 / (1.f + sqrt(1.f - sin_theta_max2));
+
+    return 1.f / (2.f * M_PI_F * one_minus_cos_theta_max);
+  }
+  else if(emitter.type == OBJECT_TYPE_DISK_PLANE)
+  {
+    disk_geometry disk = s->disks[emitter.local_id].geometry;
+
+    // Uniform sampling of the area of the disk
+    vector3 to_point = vec_from_to(origin, point);
+    scalar dist2 = dot(to_point, to_point);
+    scalar cos_theta_light = fabs(dot(normal, to_point)) * rsqrt(dist2);
+    if(cos_theta_light <= 0.f)
+      return 0.f;
+
+    scalar area = M_PI_F * disk.radius * disk.radius;
+    return dist2 / (cos_theta_light * area);
+  }
+
+  return 0.f;
+}
+
+/// Samples a direction from a point towards an emitter.
+/// \return 1 if a direction could be generated, 0 otherwise
+/// \param s The scene
+/// \param emitter The emitter
+/// \param origin The point from which the emitter is sampled
+/// \param rand The random number generator context
+/// \param direction Will contain the sampled (normalized) direction
+int emitters_sample_direction(const scene* s,
+                              object_entry emitter,
+                              vector3 origin,
+                              random_ctx* rand,
+                              vector3* direction)
+{
+  if(emitter.type == OBJECT_TYPE_SPHERE)
+  {
+    sphere_geometry sphere = s->spheres[emitter.local_id].geometry;
+
+    vector3 to_center = vec_from_to(origin, sphere.position);
+    scalar dist2 = dot(to_center, to_center);
+    scalar radius2 = sphere.radius * sphere.radius;
+    if(dist2 <= radius2)
+      return 0;
+
+    scalar sin_theta_max2 = radius2 / dist2;
+    scalar one_minus_cos_theta_max = sin_theta_max2 / (1.f + sqrt(1.f - sin_theta_max2));
+    scalar cos_theta = 1.f - random_uniform_scalar(rand) * one_minus_cos_theta_max;
+
+    *direction = random_point_on_cone(rand, to_center * rsqrt(dist2), cos_theta);
+    return 1;
+  }
+  else if(emitter.type == OBJECT_TYPE_DISK_PLANE)
+  {
+    disk_geometry disk = s->disks[emitter.local_id].geometry;
+
+    vector3 point = emitters_sample_disk_point(&disk, rand);
+
+    vector3 to_point = vec_from_to(origin, point);
+    scalar dist2 = dot(to_point, to_point);
+    if(dist2 == 0.f)
+      return 0;
+
+    *direction = to_point * rsqrt(dist2);
+    return 1;
+  }
+
+  return 0;
+}
+
+/// Estimates the light that arrives at a path vertex directly from an emitter
+/// and is reflected into the direction of the path. The estimate is weighted
+/// against BSDF sampling (or guided sampling, if enabled) using the power heuristic.
+/// Only directions on the side of the surface from which the path arrives
+/// are sampled, refracted light is left to BSDF sampling.
+/// \return The reflected radiance, not yet multiplied with the energy of the path
+/// \param s The scene
+/// \param mat The material at the path vertex
+/// \param impact The path vertex
+/// \param incident The direction of the path arriving at \c impact
+/// \param guide The path guide, or NULL if path guiding is disabled
+/// \param rand The random number generator context
+intensity emitters_sample_direct_light(const scene* s,
+                                       const material* mat,
+                                       const path_vertex* impact,
+                                       vector3 incident,
+                                       const path_guide* guide,
+                                       random_ctx* rand)
+{
+  intensity result = (intensity)(0, 0, 0);
+
+  if(s->num_emitters == 0 ||
+     mat->roughness < EMITTER_SAMPLING_MIN_ROUGHNESS)
+    return result;
+
+  object_entry emitter = emitters_select(s, rand);
+
+  vector3 direction;
+  if(!emitters_sample_direction(s, emitter, impact->position, rand, &direction))
+    return result;
+
+  vector3 facing_normal = path_vertex_get_facing_normal(impact, incident);
+  if(dot(direction, facing_normal) <= 0.f)
+    return result;
+
+  scalar bsdf_pdf = material_reflection_pdf(mat, impact, incident, direction);
+  if(bsdf_pdf <= 0.f)
+    return result;
+
+  // Cast shadow ray
+  ray shadow_ray;
+  shadow_ray.origin_vertex = *impact;
+  shadow_ray.direction = direction;
+  shadow_ray.origin_vertex.position += self_shadowing_epsilon * direction;
+
+  path_vertex light_vertex;
+  scene_get_nearest_intersection(s, &shadow_ray, &light_vertex);
+  if(light_vertex.hit_object_to.id != emitter.id)
+    // Emitter is occluded
+    return result;
+
+  scalar light_pdf = emitter.emitter_probability
+                   * emitters_solid_angle_pdf(s, emitter,
+                                              impact->position,
+                                              light_vertex.position,
+                                              light_vertex.normal);
+  if(light_pdf <= 0.f)
+    return result;
+
+  scalar sampling_pdf = path_guide_sampling_pdf(guide, mat, impact, incident, direction);
+  scalar weight = emitters_power_heuristic(light_pdf, sampling_pdf);
+
+  // The BSDF times the cosine term equals the scattered fraction times
+  // the pdf of material_propagate_ray.
+  result = mat->scattered_fraction * light_vertex.material_to.emitted_light;
+  result *= weight * bsdf_pdf / light_pdf
+          * fabs(dot(light_vertex.normal, direction));
+
+  return result;
+}
+
+/// \return The index of the first element of a cumulative distribution
+/// that is larger than a given value
+/// \param cdf The cumulative distribution
+/// \param size The number of elements of the distribution
+/// \param value The value in [0,1)
+int emitters_find_cdf_interval(__global const scalar* cdf, int size, scalar value)
+{
+  int first = 0;
+  int last = size - 1;
+  while(first < last)
+  {
+    int middle = (first + last) / 2;
+    if(cdf[middle] > value)
+      last = middle;
+    else
+      first = middle + 1;
+  }
+  return first;
+}
+
+/// \return The probability of a single element of a cumulative distribution
+scalar emitters_get_cdf_probability(__global const scalar* cdf, int index)
+{
+  if(index == 0)
+    return cdf[0];
+  return cdf[index] - cdf[index - 1];
+}
+
+/// \return The probability density (with respect to solid angle) with which
+/// \c emitters_sample_environment generates a given direction
+/// \param s The scene
+/// \param direction The (normalized) direction
+scalar emitters_environment_pdf(const scene* s, vector3 direction)
+{
+  int width = s->materials.environment_width;
+  int height = s->materials.environment_height;
+
+  // Same mapping as the background lookup in scene_get_nearest_intersection
+  scalar v = acospi(direction.z);
+  scalar u = atan2pi(direction.y, direction.x) * 0.5f + 0.5f;
+
+  int x = clamp((int)(u * (scalar)width), 0, width - 1);
+  int y = clamp((int)(v * (scalar)height), 0, height - 1);
+
+  scalar sin_theta = sinpi(v);
+  if(sin_theta <= 0.f)
+    return 0.f;
+
+  scalar uv_pdf = emitters_get_cdf_probability(s->materials.environment_marginal_cdf, y)
+                * emitters_get_cdf_probability(s->materials.environment_conditional_cdf
+                                               + y * width, x)
+                * (scalar)(width * height);
+
+  // Jacobian of the mapping from uv coordinates to directions
+  return uv_pdf / (2.f * M_PI_F * M_PI_F * sin_theta);
+}
+
+/// Samples a direction towards the environment proportionally to the
+/// luminance of the environment texture.
+/// \return The (normalized) direction
+/// \param s The scene, the environment must be available for sampling
+/// \param rand The random number generator context
+vector3 emitters_sample_environment(const scene* s, random_ctx* rand)
+{
+  int width = s->materials.environment_width;
+  int height = s->materials.environment_height;
+
+  __global const scalar* marginal_cdf = s->materials.environment_marginal_cdf;
+
+  // Select the row, i.e. the polar angle
+  scalar random_sample = random_uniform_scalar(rand);
+  int y = emitters_find_cdf_interval(marginal_cdf, height, random_sample);
+  scalar cdf_begin = (y == 0) ? 0.f : marginal_cdf[y - 1];
+  scalar offset = (random_sample - cdf_begin) / (marginal_cdf[y] - cdf_begin);
+  scalar v = ((scalar)y + clamp(offset, 0.f, 1.f)) / (scalar)height;
+
+  // Select the texel within the row, i.e. the azimuthal angle
+  __global const scalar* conditional_cdf = s->materials.environment_conditional_cdf
+                                         + y * width;
+  random_sample = random_uniform_scalar(rand);
+  int x = emitters_find_cdf_interval(conditional_cdf, width, random_sample);
+  cdf_begin = (x == 0) ? 0.f : conditional_cdf[x - 1];
+  offset = (random_sample - cdf_begin) / (conditional_cdf[x] - cdf_begin);
+  scalar u = ((scalar)x + clamp(offset, 0.f, 1.f)) / (scalar)width;
+
+  // Invert the mapping of the background lookup
+  scalar sin_theta = sinpi(v);
+  scalar cos_theta = cospi(v);
+  scalar phi_over_pi = 2.f * u - 1.f;
+
+  return (vector3)(sin_theta * cospi(phi_over_pi),
+                   sin_theta * sinpi(phi_over_pi),
+                   cos_theta);
+}
+
+/// Estimates the light that arrives at a path vertex directly from the
+/// environment, analogous to \c emitters_sample_direct_light.
+/// \return The reflected radiance, not yet multiplied with the energy of the path
+/// \param s The scene
+/// \param mat The material at the path vertex
+/// \param impact The path vertex
+/// \param incident The direction of the path arriving at \c impact
+/// \param guide The path guide, or NULL if path guiding is disabled
+/// \param rand The random number generator context
+intensity emitters_sample_environment_light(const scene* s,
+                                            const material* mat,
+                                            const path_vertex* impact,
+                                            vector3 incident,
+                                            const path_guide* guide,
+                                            random_ctx* rand)
+{
+  intensity result = (intensity)(0, 0, 0);
+
+  if(!emitters_is_environment_sampling_enabled(s) ||
+     mat->roughness < EMITTER_SAMPLING_MIN_ROUGHNESS)
+    return result;
+
+  vector3 direction = emitters_sample_environment(s, rand);
+
+  vector3 facing_normal = path_vertex_get_facing_normal(impact, incident);
+  if(dot(direction, facing_normal) <= 0.f)
+    return result;
+
+  scalar bsdf_pdf = material_reflection_pdf(mat, impact, incident, direction);
+  scalar light_pdf = emitters_environment_pdf(s, direction);
+  if(bsdf_pdf <= 0.f || light_pdf <= 0.f)
+    return result;
+
+  // Cast shadow ray
+  ray shadow_ray;
+  shadow_ray.origin_vertex = *impact;
+  shadow_ray.direction = direction;
+  shadow_ray.origin_vertex.position += self_shadowing_epsilon * direction;
+
+  path_vertex light_vertex;
+  scene_get_nearest_intersection(s, &shadow_ray, &light_vertex);
+  if(light_vertex.hit_object_to.type != OBJECT_TYPE_BACKGROUND)
+    return result;
+
+  scalar sampling_pdf = path_guide_sampling_pdf(guide, mat, impact, incident, direction);
+  scalar weight = emitters_power_heuristic(light_pdf, sampling_pdf);
+
+  result = mat->scattered_fraction * light_vertex.material_to.emitted_light;
+  result *= weight * bsdf_pdf / light_pdf;
+
+  return result;
+}
+
+#endif
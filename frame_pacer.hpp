@@ -0,0 +1,82 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAME_PACER_HPP
+#define FRAME_PACER_HPP
+
+#include "qcl.hpp"
+
+#include <cassert>
+#include <deque>
+
+namespace gray {
+
+/// Bounds the number of frames that the host enqueues ahead of the
+/// device. The host only waits for the oldest frame in flight, such that
+/// the device is never idle while the next frame is enqueued, but the
+/// command queue does not grow without limit.
+class frame_pacer
+{
+public:
+  /// \param ctx The device context whose command queue receives the frames
+  /// \param max_frames_in_flight The number of frames that may be enqueued
+  /// before the host waits
+  frame_pacer(const qcl::device_context_ptr& ctx,
+              std::size_t max_frames_in_flight)
+  : _ctx{ctx}, _max_frames_in_flight{max_frames_in_flight}
+  {
+    assert(max_frames_in_flight > 0);
+  }
+
+  /// Marks the end of a frame that has been enqueued, and waits until
+  /// fewer than the maximum number of frames are in flight
+  void end_frame()
+  {
+    cl::Event frame_done;
+    cl_int err = _ctx->get_command_queue().enqueueMarkerWithWaitList(nullptr,
+                                                                     &frame_done);
+    qcl::check_cl_error(err, "Could not enqueue frame marker!");
+    _frames_in_flight.push_back(frame_done);
+
+    err = _ctx->get_command_queue().flush();
+    qcl::check_cl_error(err, "Could not flush command queue!");
+
+    if(_frames_in_flight.size() >= _max_frames_in_flight)
+    {
+      err = _frames_in_flight.front().wait();
+      qcl::check_cl_error(err, "Could not wait for frame!");
+      _frames_in_flight.pop_front();
+    }
+  }
+
+  /// Forgets the frames in flight, e.g. after the host has waited for
+  /// all enqueued commands
+  void clear()
+  {
+    _frames_in_flight.clear();
+  }
+
+private:
+  qcl::device_context_ptr _ctx;
+  std::size_t _max_frames_in_flight;
+  std::deque<cl::Event> _frames_in_flight;
+};
+
+}
+
+#endif
@@ -23,11 +23,22 @@
 #include "timer.hpp"
 #include "qcl.hpp"
 #include "random.hpp"
-#include "reduction.hpp"
+#include "denoiser.hpp"
+#include "upsampler.hpp"
+#include "launch_controller.hpp"
+#include "integrator_extension.hpp"
 #include "common.cl_hpp"
 
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <array>
+#include <iostream>
+#include <limits>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
 
 namespace gray {
 
@@ -40,36 +51,113 @@ public:
                 std::size_t render_width,
                 std::size_t render_height,
                 std::size_t random_seed = device_object::random_engine::generate_seed())
-  : _target_fps{24.0}, _current_fps{0.0}, _num_rays_ppx{10}, _ctx{ctx},
+  : _target_fps{24.0}, _current_fps{0.0}, _num_rays_ppx{1},
+    _sampling_mode{SAMPLING_MODE_UNIFORM},
+    _convergence_threshold{0.01f},
+    _ctx{ctx},
     _width(render_width), _height(render_height),
     _kernel{ctx->get_kernel(kernel_name)},
+    _camera_prepare_kernel{ctx->get_kernel("camera_prepare")},
+    _camera_prepare_views_kernel{ctx->get_kernel("camera_prepare_views")},
+    _reprojection_kernel{ctx->get_kernel("reproject_render_state")},
+    _merge_kernel{ctx->get_kernel("merge_samples")},
     _post_processing_kernel{ctx->get_kernel(post_processor_name)},
+    _exposure_kernel{ctx->get_kernel("update_exposure")},
     _total_num_rays{0},
-    _kernel_run_event{1},
+    _frame_start_num_rays{0},
+    _fractional_rays_per_pixel{0.0},
+    _is_converged{false},
+    _max_rays_per_frame{0},
+    _is_statistics_enabled{false},
     _frame_number{0},
-    _image_max_reduction{ctx}
+    _launch_number{0},
+    _denoiser{ctx},
+    _upsampler{ctx},
+    _pixel_stride{1},
+    _max_pixel_stride{4},
+    _is_denoising_enabled{true},
+    _is_reprojection_enabled{true},
+    _is_reprojection_pending{false},
+    _max_reprojected_rays{32},
+    _num_interactive_frames{8},
+    _frames_since_discard{_num_interactive_frames},
+    _was_biased{false},
+    _viewport_width{0},
+    _viewport_height{0},
+    _viewport_offset_x{0},
+    _viewport_offset_y{0},
+    _traced_rows_begin{0},
+    _traced_rows_end{0},
+    _is_frame_interactive{false},
+    _num_traced_pixels{0},
+    _num_launches{0},
+    _num_views{1}
   {
     set_resolution(render_width, render_height, random_seed);
-
-    std::vector<cl_float> max_running_average_init{_max_value_running_average_size, 1.0f};
+    _launch_controller.set_target_frame_time(1.0 / _target_fps);
 
     //_ctx->require_several_command_queues(2);
 
-    _ctx->create_buffer<cl_float>(_max_value_running_average, 
-                                  CL_MEM_READ_WRITE,
-                                  _max_value_running_average_size, 
-                                  max_running_average_init.data());
+    _ctx->create_buffer<device_object::camera_frame_state>(_camera_state,
+                                                           CL_MEM_READ_WRITE,
+                                                           1);
+    _ctx->create_buffer<device_object::camera_frame_state>(_previous_camera_state,
+                                                           CL_MEM_READ_WRITE,
+                                                           1);
+
+    // Placeholder for the priority mask, the kernel requires a valid buffer
+    _ctx->create_buffer<cl_float>(_priority_mask, CL_MEM_READ_ONLY, 1);
+
+    _ctx->create_buffer<cl_uint>(_luminance_histogram,
+                                 CL_MEM_READ_WRITE,
+                                 LUMINANCE_HISTOGRAM_SIZE);
+    cl_uint zero = 0;
+    cl_int err = _ctx->get_command_queue().enqueueFillBuffer(_luminance_histogram,
+                                                             zero,
+                                                             0,
+                                                             LUMINANCE_HISTOGRAM_SIZE
+                                                               * sizeof(cl_uint));
+    qcl::check_cl_error(err, "Could not enqueue luminance histogram reset!");
+
+    _ctx->create_buffer<cl_float>(_exposure_state, CL_MEM_READ_WRITE, 2);
+    reset_exposure();
+
+    _tone_mapping.low_percentile = 0.5f;
+    _tone_mapping.high_percentile = 0.95f;
+    _tone_mapping.key_value = 0.18f;
+    _tone_mapping.adaptation_rate = 0.05f;
+    _tone_mapping.tone_mapping_operator = TONE_MAPPING_FILMIC;
+
+    std::vector<cl_uint> error_sums_init(SAMPLING_RAY_COUNT_SLOT + 1, 0);
+    _ctx->create_buffer<cl_uint>(_error_sums,
+                                 CL_MEM_READ_WRITE,
+                                 error_sums_init.size(),
+                                 error_sums_init.data());
   }
 
 
   void set_target_fps(double fps)
   {
     _target_fps = fps;
+    _launch_controller.set_target_frame_time(1.0 / fps);
   }
 
   void set_target_rendering_time(double time)
   {
     _target_fps = 1.0 / time;
+    _launch_controller.set_target_frame_time(time);
+  }
+
+  /// Sets the device time after which a launch of the path tracer should
+  /// have finished. Frames that take longer are split into several launches.
+  void set_max_launch_time(double time)
+  {
+    _launch_controller.set_max_launch_time(time);
+  }
+
+  double get_max_launch_time() const
+  {
+    return _launch_controller.get_max_launch_time();
   }
 
   scalar get_target_fps() const
@@ -82,6 +170,267 @@ public:
     return _current_fps;
   }
 
+  /// Sets how the rays are distributed among the pixels
+  /// \param mode One of the SAMPLING_MODE_* values
+  void set_sampling_mode(portable_int mode)
+  {
+    _sampling_mode = mode;
+  }
+
+  portable_int get_sampling_mode() const
+  {
+    return _sampling_mode;
+  }
+
+  /// Sets the relative standard error below which pixels are
+  /// considered as converged in SAMPLING_MODE_ADAPTIVE_STOP_CONVERGED
+  void set_convergence_threshold(scalar threshold)
+  {
+    _convergence_threshold = threshold;
+  }
+
+  scalar get_convergence_threshold() const
+  {
+    return _convergence_threshold;
+  }
+
+  /// Enables or disables the edge-aware denoiser. If disabled, the image
+  /// is smoothed with a Gaussian filter at low sample counts instead.
+  void set_denoising_enabled(bool enabled)
+  {
+    _is_denoising_enabled = enabled;
+  }
+
+  bool is_denoising_enabled() const
+  {
+    return _is_denoising_enabled;
+  }
+
+  atrous_denoiser& get_denoiser()
+  {
+    return _denoiser;
+  }
+
+  /// Sets how the exposed colors are mapped to the displayable range
+  /// \param op One of the TONE_MAPPING_* values
+  void set_tone_mapping_operator(portable_int op)
+  {
+    _tone_mapping.tone_mapping_operator = op;
+  }
+
+  portable_int get_tone_mapping_operator() const
+  {
+    return _tone_mapping.tone_mapping_operator;
+  }
+
+  /// Sets the value to which the average luminance of the image is
+  /// mapped by the automatic exposure. Larger values brighten the image.
+  void set_exposure_key_value(scalar key_value)
+  {
+    assert(key_value > 0.0f);
+    _tone_mapping.key_value = key_value;
+  }
+
+  scalar get_exposure_key_value() const
+  {
+    return _tone_mapping.key_value;
+  }
+
+  /// Sets the percentiles of the luminance histogram between which the
+  /// luminance is averaged for the exposure
+  void set_exposure_percentiles(scalar low, scalar high)
+  {
+    assert(low >= 0.0f && low < high && high <= 1.0f);
+    _tone_mapping.low_percentile = low;
+    _tone_mapping.high_percentile = high;
+  }
+
+  /// Sets the fraction by which the exposure adapts to the current frame
+  /// in each frame. 1 disables the temporal smoothing.
+  void set_exposure_adaptation_rate(scalar rate)
+  {
+    assert(rate > 0.0f && rate <= 1.0f);
+    _tone_mapping.adaptation_rate = rate;
+  }
+
+  /// Forgets the adapted exposure, such that the exposure of the next
+  /// frame is derived from the luminance of the previous frame alone
+  void reset_exposure()
+  {
+    cl_float zero_exposure = 0.0f;
+    cl_int err = _ctx->get_command_queue().enqueueFillBuffer(_exposure_state,
+                                                             zero_exposure,
+                                                             0,
+                                                             2 * sizeof(cl_float));
+    qcl::check_cl_error(err, "Could not enqueue exposure reset!");
+  }
+
+  /// Sets the largest pixel stride with which frames are rendered while the
+  /// user interacts with the renderer. If the target frame rate cannot be
+  /// reached with one ray per pixel, only every n-th pixel in each direction
+  /// is traced, and the others are interpolated. 1 disables the reduction
+  /// of the resolution.
+  void set_max_pixel_stride(std::size_t stride)
+  {
+    assert(stride > 0);
+    _max_pixel_stride = stride;
+    _pixel_stride = std::min(_pixel_stride, stride);
+  }
+
+  std::size_t get_max_pixel_stride() const
+  {
+    return _max_pixel_stride;
+  }
+
+  /// \return The pixel stride of the last frame
+  std::size_t get_pixel_stride() const
+  {
+    return _pixel_stride;
+  }
+
+  /// Gives the pixels of a rectangle more rays than the other pixels. The
+  /// average number of rays per pixel, and hence the time per frame,
+  /// remains the same.
+  /// \param min_x The first column of the rectangle
+  /// \param min_y The first row of the rectangle
+  /// \param max_x One past the last column of the rectangle
+  /// \param max_y One past the last row of the rectangle
+  /// \param boost The ratio of the number of rays inside and outside
+  /// of the rectangle
+  void set_priority_region(int min_x, int min_y, int max_x, int max_y,
+                           scalar boost = 8.0f)
+  {
+    assert(boost > 0.0f);
+
+    min_x = std::max(min_x, 0);
+    min_y = std::max(min_y, 0);
+    max_x = std::min(max_x, static_cast<int>(_width));
+    max_y = std::min(max_y, static_cast<int>(_height));
+    if(max_x <= min_x || max_y <= min_y)
+    {
+      clear_priority();
+      return;
+    }
+
+    scalar area_fraction = static_cast<scalar>((max_x - min_x) * (max_y - min_y))
+                         / static_cast<scalar>(_width * _height);
+
+    _priority.min_x = min_x;
+    _priority.min_y = min_y;
+    _priority.max_x = max_x;
+    _priority.max_y = max_y;
+    // Choose the factors such that their average over the image is one
+    _priority.outside_factor = 1.0f / (area_fraction * boost + 1.0f - area_fraction);
+    _priority.inside_factor = boost * _priority.outside_factor;
+    _priority.use_mask = 0;
+  }
+
+  /// Distributes the rays according to a per-pixel priority mask. The
+  /// average number of rays per pixel, and hence the time per frame,
+  /// remains the same.
+  /// \param mask The relative priorities of the pixels, row-major with
+  /// the current resolution. Must not be negative.
+  void set_priority_mask(const std::vector<scalar>& mask)
+  {
+    assert(mask.size() == _width * _height);
+
+    double sum = 0.0;
+    for(scalar priority : mask)
+      sum += priority;
+    if(sum <= 0.0)
+    {
+      clear_priority();
+      return;
+    }
+
+    // Normalize the mask to an average of one
+    scalar normalization = static_cast<scalar>(static_cast<double>(mask.size()) / sum);
+    std::vector<cl_float> factors(mask.size());
+    for(std::size_t i = 0; i < mask.size(); ++i)
+      factors[i] = mask[i] * normalization;
+
+    _ctx->create_buffer<cl_float>(_priority_mask, CL_MEM_READ_ONLY, factors.size());
+    cl_int err = _ctx->get_command_queue().enqueueWriteBuffer(_priority_mask,
+                                                              CL_TRUE,
+                                                              0,
+                                                              factors.size() * sizeof(cl_float),
+                                                              factors.data());
+    qcl::check_cl_error(err, "Could not write priority mask!");
+    _priority.use_mask = 1;
+  }
+
+  /// Distributes the rays without priorities
+  void clear_priority()
+  {
+    _priority.min_x = 0;
+    _priority.min_y = 0;
+    _priority.max_x = 0;
+    _priority.max_y = 0;
+    _priority.inside_factor = 1.0f;
+    _priority.outside_factor = 1.0f;
+    _priority.use_mask = 0;
+  }
+
+  /// Sets a fast, biased kernel variant that is used instead of the path
+  /// tracing kernel while the user interacts with the renderer. Once the
+  /// interaction has ended, the preview frames are discarded.
+  /// \param kernel_name The name of the preview kernel, which must expect
+  /// the same arguments as the path tracing kernel without any extension.
+  /// An empty name disables the preview.
+  void set_preview_kernel(const std::string& kernel_name)
+  {
+    if(kernel_name.empty())
+      _preview_kernel = nullptr;
+    else
+      _preview_kernel = _ctx->get_kernel(kernel_name);
+  }
+
+  /// \return Whether the preview kernel is used during interaction. An
+  /// extension with its own interactive mode takes precedence.
+  bool is_preview_kernel_used() const
+  {
+    return _preview_kernel &&
+           !(_extension && _extension->has_interactive_mode());
+  }
+
+  /// Sets an extension of the path tracer. The kernel of the frame renderer
+  /// must be the kernel variant that expects the arguments of the extension.
+  /// \param extension The extension, or nullptr to disable extensions
+  void set_integrator_extension(const std::shared_ptr<integrator_extension>& extension)
+  {
+    _extension = extension;
+    restart_accumulation();
+  }
+
+  /// Restarts the random number generators of the pixels, e.g. such that
+  /// the samples of a render are independent of a previous render
+  /// \param seed The seed of the random number generators
+  void set_random_seed(std::size_t seed)
+  {
+    _ctx->get_command_queue().finish();
+
+    auto work_items = get_required_num_work_items(_width, _height);
+    this->_random = device_object::random_engine{
+        _ctx, work_items[0], work_items[1], seed
+    };
+  }
+
+  /// Limits the number of rays per pixel of the following frames, e.g.
+  /// such that a render does not exceed its number of rays
+  /// \param rays_per_pixel The maximum number of rays per pixel of a
+  /// frame, 0 to let the launch controller decide alone
+  void set_max_rays_per_frame(std::size_t rays_per_pixel)
+  {
+    _max_rays_per_frame = rays_per_pixel;
+  }
+
+  /// Enables printing the performance and the launches of each
+  /// presented frame
+  void set_statistics_enabled(bool enabled)
+  {
+    _is_statistics_enabled = enabled;
+  }
+
   void set_resolution(std::size_t width, 
                       std::size_t height, 
                       std::size_t seed = device_object::random_engine::generate_seed())
@@ -93,14 +442,34 @@ public:
         _ctx, work_items[0], work_items[1], seed
     };
 
-    _buffer_a = create_image_buffer(width, height);
-    _buffer_b = create_image_buffer(width, height);
-    _image_max_reduction.set_resolution(width, height);
-
-    _total_num_rays = 0;
+    _render_result = create_image_buffer(width, height);
+    _ctx->create_buffer<cl_float4>(_accumulated_sums, CL_MEM_READ_WRITE, width * height);
+    _ctx->create_buffer<cl_half>(_accumulated_compensations, CL_MEM_READ_WRITE,
+                                 4 * width * height);
+    _ctx->create_buffer<cl_int>(_sample_counts, CL_MEM_READ_WRITE, width * height);
+    _ctx->create_buffer<cl_float4>(_albedo, CL_MEM_READ_WRITE, width * height);
+    _ctx->create_buffer<cl_float4>(_normal_depth, CL_MEM_READ_WRITE, width * height);
+    _ctx->create_buffer<cl_int>(_reprojected_sample_counts, CL_MEM_READ_WRITE, width * height);
+    _ctx->create_buffer<cl_float4>(_reprojected_albedo, CL_MEM_READ_WRITE, width * height);
+    _ctx->create_buffer<cl_float4>(_reprojected_normal_depth, CL_MEM_READ_WRITE, width * height);
+    _denoiser.set_resolution(width, height);
+    // A priority mask is only valid for the resolution it was given for
+    clear_priority();
+    _upsampler.set_resolution(width, height);
+
+    restart_accumulation();
 
     _width = width;
     _height = height;
+
+    if(_num_views > 1)
+    {
+      _num_views = 1;
+      _denoiser.set_view_height(0);
+      _ctx->create_buffer<device_object::camera_frame_state>(_camera_state,
+                                                             CL_MEM_READ_WRITE,
+                                                             1);
+    }
   }
 
   std::size_t get_resolution_width() const
@@ -113,9 +482,254 @@ public:
     return _height;
   }
 
+  /// Renders several views, e.g. the eyes of a stereo pair or the faces of
+  /// a cube map, in each launch. The views are stacked vertically in the
+  /// image, view i occupying the rows [i*h, (i+1)*h) with h the height
+  /// divided by the number of views. Views require a renderer that uses a
+  /// kernel compiled with WITH_MULTIPLE_VIEWS, and are traced with
+  /// \c trace_views(). Changing the resolution resets the renderer to a
+  /// single view.
+  /// \param num_views The number of views, must divide the height
+  void set_num_views(std::size_t num_views)
+  {
+    assert(num_views > 0);
+    if(_height % num_views != 0)
+      throw std::invalid_argument("The number of views must divide the height of the image");
+
+    _ctx->get_command_queue().finish();
+
+    _num_views = num_views;
+    _ctx->create_buffer<device_object::camera_frame_state>(_camera_state,
+                                                           CL_MEM_READ_WRITE,
+                                                           num_views);
+    _ctx->create_buffer<device_object::camera>(_view_cameras,
+                                               CL_MEM_READ_ONLY,
+                                               num_views);
+    _uploaded_views.clear();
+    _denoiser.set_view_height(num_views > 1 ? _height / num_views : 0);
+
+    // Each view has its own random states, the rows of each view are
+    // padded to the work group size separately
+    auto work_items = get_required_num_work_items(_width, _height / num_views);
+    _random.resize(work_items[0], work_items[1] * num_views);
+
+    restart_accumulation();
+  }
+
+  std::size_t get_num_views() const
+  {
+    return _num_views;
+  }
+
+  /// Renders only a part of a larger image, e.g. a tile. The resolution
+  /// of the renderer is the size of the part.
+  /// \param width The width of the whole image in pixels
+  /// \param height The height of the whole image in pixels
+  /// \param offset_x The x coordinate of the part in the whole image
+  /// \param offset_y The y coordinate of the part in the whole image
+  void set_viewport(std::size_t width, std::size_t height,
+                    std::size_t offset_x, std::size_t offset_y)
+  {
+    _viewport_width = width;
+    _viewport_height = height;
+    _viewport_offset_x = offset_x;
+    _viewport_offset_y = offset_y;
+  }
+
+  /// Renders the whole image again
+  void clear_viewport()
+  {
+    set_viewport(0, 0, 0, 0);
+  }
+
+  /// Discards the accumulated image without considering the renderer as
+  /// interactive, e.g. because a different part of the image is rendered
+  void reset_accumulation()
+  {
+    restart_accumulation();
+  }
+
+  /// Discards the accumulated samples, but keeps the state of the
+  /// integrator extension, e.g. because the samples have been moved
+  /// to another device
+  void restart_samples()
+  {
+    _total_num_rays = 0;
+    _fractional_rays_per_pixel = 0.0;
+    _is_converged = false;
+    _is_reprojection_pending = false;
+  }
+
+  /// Only traces the rays of a range of rows in the following frames,
+  /// the other rows keep their samples. The whole image is still post
+  /// processed.
+  /// \param begin The first traced row
+  /// \param end One past the last traced row
+  void set_traced_rows(std::size_t begin, std::size_t end)
+  {
+    assert(begin < end && end <= _height);
+    _traced_rows_begin = begin;
+    _traced_rows_end = end;
+  }
+
+  /// Traces the rays of all rows again
+  void clear_traced_rows()
+  {
+    _traced_rows_begin = 0;
+    _traced_rows_end = 0;
+  }
+
+  /// \return The average of the samples of each pixel, xyz contains the
+  /// color and w the average squared luminance
+  const cl::Image2D& get_render_result() const
+  {
+    return *_render_result;
+  }
+
+  /// \return The number of samples of each pixel, row-major
+  const cl::Buffer& get_sample_counts() const
+  {
+    return _sample_counts;
+  }
+
+  /// \return The first-hit albedo of each pixel, row-major
+  const cl::Buffer& get_albedo() const
+  {
+    return _albedo;
+  }
+
+  /// \return The first-hit normal and depth of each pixel, row-major
+  const cl::Buffer& get_normal_depth() const
+  {
+    return _normal_depth;
+  }
+
+  /// \return The sums of the samples of each pixel, row-major. See
+  /// accumulation.cl for their compensations.
+  const cl::Buffer& get_accumulated_sums() const
+  {
+    return _accumulated_sums;
+  }
+
+  /// Reads the rounding errors of the accumulated sums, such that sums
+  /// that are added up elsewhere keep the precision of the compensated
+  /// summation. Waits for the device.
+  /// \param sums The accumulated sums, as read from \c get_accumulated_sums()
+  /// \return The compensation of each sum. The exact sum is the
+  /// difference of the sum and its compensation.
+  std::vector<cl_float4> read_compensations(const std::vector<cl_float4>& sums) const
+  {
+    assert(sums.size() == _width * _height);
+
+    std::vector<cl_half> relative_compensations(4 * sums.size());
+    _ctx->memcpy_d2h(relative_compensations.data(), _accumulated_compensations,
+                     relative_compensations.size());
+
+    std::vector<cl_float4> compensations(sums.size());
+    for(std::size_t i = 0; i < sums.size(); ++i)
+      for(std::size_t c = 0; c < 4; ++c)
+        compensations[i].s[c] = half_to_float(relative_compensations[4 * i + c])
+                              * std::abs(sums[i].s[c])
+                              * (1.f / ACCUMULATION_COMPENSATION_SCALE);
+    return compensations;
+  }
+
+  /// \return The state of the random number generator of each work item
+  const device_object::random_engine& get_random_engine() const
+  {
+    return _random;
+  }
+
+  /// Replaces the state of the random number generators, e.g. to resume
+  /// a render with the random numbers it would have continued with
+  /// \param state The state of each work item, see \c get_random_engine()
+  void load_random_state(const std::vector<cl_int>& state)
+  {
+    assert(state.size() == _random.get_num_states());
+    _ctx->memcpy_h2d(_random.get(), state.data(), state.size());
+  }
+
+  /// Continues the frame count of a resumed render
+  void set_frame_number(std::uint_fast64_t frame_number)
+  {
+    _frame_number = frame_number;
+  }
+
+  const device_object::tone_mapping_parameters& get_tone_mapping_parameters() const
+  {
+    return _tone_mapping;
+  }
+
+  /// \return The measured time the device takes to trace a ray,
+  /// or 0 if nothing has been measured yet
+  double get_time_per_ray() const
+  {
+    return _launch_controller.get_time_per_ray();
+  }
+
+  /// Discards the accumulated image because the user has changed the view,
+  /// e.g. by moving the camera. The following frames are considered
+  /// as interactive. If reprojection is enabled, the samples of the
+  /// previous view that are still visible are kept.
   void discard_render_results()
   {
-    this->_total_num_rays = 0;
+    bool reproject = _is_reprojection_enabled && _previous_camera &&
+                     _total_num_rays > 0;
+    std::size_t num_rays = std::min(_total_num_rays, _max_reprojected_rays);
+
+    restart_accumulation();
+    _frames_since_discard = 0;
+
+    if(reproject)
+    {
+      _total_num_rays = num_rays;
+      _is_reprojection_pending = true;
+    }
+  }
+
+  /// Enables or disables the reprojection of the accumulated samples
+  /// when the render results are discarded
+  void set_reprojection_enabled(bool enabled)
+  {
+    _is_reprojection_enabled = enabled;
+    if(!enabled)
+      _is_reprojection_pending = false;
+  }
+
+  bool is_reprojection_enabled() const
+  {
+    return _is_reprojection_enabled;
+  }
+
+  /// Sets the maximum number of rays per pixel that are kept by the
+  /// reprojection. Smaller values let the new view dominate earlier.
+  void set_max_reprojected_rays(std::size_t num_rays)
+  {
+    _max_reprojected_rays = num_rays;
+  }
+
+  std::size_t get_max_reprojected_rays() const
+  {
+    return _max_reprojected_rays;
+  }
+
+  /// \return Whether the user is considered to interact with the renderer,
+  /// i.e. whether the render results have been discarded recently
+  bool is_interactive() const
+  {
+    return _frames_since_discard < _num_interactive_frames;
+  }
+
+  /// Sets for how many frames after the render results have been discarded
+  /// the renderer is considered as interactive
+  void set_num_interactive_frames(std::size_t num_frames)
+  {
+    _num_interactive_frames = num_frames;
+  }
+
+  std::size_t get_num_interactive_frames() const
+  {
+    return _num_interactive_frames;
   }
 
   std::uint_fast64_t get_frame_number() const
@@ -133,6 +747,14 @@ public:
     return _total_num_rays;
   }
 
+  /// \return Whether the last frame has not traced any rays, because
+  /// all pixels have converged. Only happens with
+  /// SAMPLING_MODE_ADAPTIVE_STOP_CONVERGED.
+  bool is_converged() const
+  {
+    return _is_converged;
+  }
+
   void skip_frame()
   {
     ++_frame_number;
@@ -145,68 +767,172 @@ public:
               const device_object::scene& s, 
               const device_object::camera& cam)
   {
-    ++_frame_number;
+    trace(s, cam);
+    present(pixels);
+  }
 
-    if(!_timer.is_running())
-      _timer.start();
+  /// Traces the rays of a frame, without writing the displayed image.
+  /// Must be followed by \c present(), unless the samples are only
+  /// used elsewhere.
+  void trace(const device_object::scene& s,
+             const device_object::camera& cam)
+  {
+    assert(_num_views == 1);
+    trace_frame(s, cam, false);
+  }
 
-    if(_total_num_rays > 100000)
-      return;
+  /// Traces the rays of all views of a frame in the same launches, see
+  /// \c set_num_views(). The reprojection and the preview kernel are
+  /// not used for views.
+  /// \param s The scene
+  /// \param views The camera of each view
+  void trace_views(const device_object::scene& s,
+                   const std::vector<device_object::camera>& views)
+  {
+    assert(!views.empty());
+    if(views.size() != _num_views)
+      throw std::invalid_argument("The number of cameras does not match the number of views");
+
+    // The cameras are only uploaded if they have changed, e.g. in
+    // progressive offline renders they remain the same for all frames
+    if(_uploaded_views.size() != views.size() ||
+       std::memcmp(_uploaded_views.data(), views.data(),
+                   views.size() * sizeof(device_object::camera)) != 0)
+    {
+      _ctx->memcpy_h2d(_view_cameras, views.data(), views.size());
+      _uploaded_views = views;
+    }
+    _is_reprojection_pending = false;
+
+    trace_frame(s, views.front(), true);
+  }
 
-    // Size of work group must divide number of work items
+  /// Render the current progress of all views into \c pixels
+  /// \param pixels An OpenCL image with image_format = {CL_RGBA,CL_UNORM_INT8}.
+  template<class Image_type>
+  void render_views(const Image_type& pixels,
+                    const device_object::scene& s,
+                    const std::vector<device_object::camera>& views)
+  {
+    trace_views(s, views);
+    present(pixels);
+  }
+
+  /// Adds samples that have been traced elsewhere, e.g. by another device,
+  /// to a range of rows of the current frame. Must be called between
+  /// \c trace() and \c present().
+  /// \param sums The sums of the samples of each pixel, row-major
+  /// \param sample_counts The number of samples of each pixel
+  /// \param albedo The first-hit albedo of each pixel
+  /// \param normal_depth The first-hit normal and depth of each pixel
+  /// \param begin The first row to which samples are added
+  /// \param end One past the last row to which samples are added
+  void merge_samples(const cl::Buffer& sums,
+                     const cl::Buffer& sample_counts,
+                     const cl::Buffer& albedo,
+                     const cl::Buffer& normal_depth,
+                     std::size_t begin,
+                     std::size_t end)
+  {
+    assert(begin < end && end <= _height);
+    enqueue_merge(sums, sample_counts, albedo, normal_depth, begin, end,
+                  _frame_start_num_rays);
+  }
+
+  /// Replaces the accumulated image by samples that have been traced
+  /// elsewhere, e.g. by other processes. The image can then be written
+  /// by \c present().
+  /// \param sums The sums of the samples of each pixel, row-major
+  /// \param sample_counts The number of samples of each pixel
+  /// \param albedo The first-hit albedo of each pixel
+  /// \param normal_depth The first-hit normal and depth of each pixel
+  /// \param rays_per_pixel The average number of samples per pixel
+  void load_samples(const std::vector<cl_float4>& sums,
+                    const std::vector<cl_int>& sample_counts,
+                    const std::vector<cl_float4>& albedo,
+                    const std::vector<cl_float4>& normal_depth,
+                    std::size_t rays_per_pixel)
+  {
+    std::size_t num_pixels = _width * _height;
+    assert(sums.size() == num_pixels && sample_counts.size() == num_pixels);
+    assert(albedo.size() == num_pixels && normal_depth.size() == num_pixels);
+
+    cl::Buffer sums_buffer;
+    cl::Buffer sample_counts_buffer;
+    cl::Buffer albedo_buffer;
+    cl::Buffer normal_depth_buffer;
+    _ctx->create_buffer<cl_float4>(sums_buffer, CL_MEM_READ_ONLY, num_pixels);
+    _ctx->create_buffer<cl_int>(sample_counts_buffer, CL_MEM_READ_ONLY, num_pixels);
+    _ctx->create_buffer<cl_float4>(albedo_buffer, CL_MEM_READ_ONLY, num_pixels);
+    _ctx->create_buffer<cl_float4>(normal_depth_buffer, CL_MEM_READ_ONLY, num_pixels);
+
+    cl_int err = _ctx->get_command_queue().enqueueWriteBuffer(sums_buffer, CL_TRUE, 0,
+                                                              num_pixels * sizeof(cl_float4),
+                                                              sums.data());
+    qcl::check_cl_error(err, "Could not write samples!");
+    err = _ctx->get_command_queue().enqueueWriteBuffer(sample_counts_buffer, CL_TRUE, 0,
+                                                       num_pixels * sizeof(cl_int),
+                                                       sample_counts.data());
+    qcl::check_cl_error(err, "Could not write sample counts!");
+    err = _ctx->get_command_queue().enqueueWriteBuffer(albedo_buffer, CL_TRUE, 0,
+                                                       num_pixels * sizeof(cl_float4),
+                                                       albedo.data());
+    qcl::check_cl_error(err, "Could not write albedo!");
+    err = _ctx->get_command_queue().enqueueWriteBuffer(normal_depth_buffer, CL_TRUE, 0,
+                                                       num_pixels * sizeof(cl_float4),
+                                                       normal_depth.data());
+    qcl::check_cl_error(err, "Could not write normals and depths!");
+
+    // Merging into a discarded render state replaces it
+    restart_samples();
+    enqueue_merge(sums_buffer, sample_counts_buffer, albedo_buffer, normal_depth_buffer,
+                  0, _height, 0);
+
+    _total_num_rays = rays_per_pixel;
+    _fractional_rays_per_pixel = 0.0;
+    _num_rays_ppx = 0;
+    _num_traced_pixels = 0;
+    _num_launches = 0;
+  }
+
+  /// Writes the displayed image of the frame that has been traced
+  /// by \c trace() into \c pixels
+  /// \param pixels An OpenCL image with image_format = {CL_RGBA,CL_UNORM_INT8}.
+  template<class Image_type>
+  void present(const Image_type& pixels)
+  {
     auto work_items = get_required_num_work_items(_width, _height);
     cl_int err;
 
-    //Call kernel
-    qcl::kernel_argument_list kernel_arguments(_kernel);
-
-    kernel_arguments.push(*_buffer_a);
-    kernel_arguments.push(*_buffer_b);
-    kernel_arguments.push(static_cast<cl_int>(_total_num_rays));
-    kernel_arguments.push(_random.get());
-    kernel_arguments.push(&cam, sizeof(device_object::camera));
-    kernel_arguments.push(_num_rays_ppx);
-
-    kernel_arguments.push(s.get_objects());
-    kernel_arguments.push(s.get_spheres());
-    kernel_arguments.push(s.get_planes());
-    kernel_arguments.push(s.get_disks());
-    kernel_arguments.push(static_cast<cl_int>(s.get_num_spheres()));
-    kernel_arguments.push(static_cast<cl_int>(s.get_num_planes()));
-    kernel_arguments.push(static_cast<cl_int>(s.get_num_disks()));
-    kernel_arguments.push(s.get_far_clipping_distance());
-    kernel_arguments.push(s.get_background_material());
-
-    kernel_arguments.push(s.get_materials().get_texture_data_buffer());
-    kernel_arguments.push(s.get_materials().get_widths());
-    kernel_arguments.push(s.get_materials().get_heights());
-    kernel_arguments.push(s.get_materials().get_offsets());
-    kernel_arguments.push(s.get_materials().get_materials());
-    kernel_arguments.push(static_cast<cl_int>(s.get_materials().get_num_materials()));
-    kernel_arguments.push(static_cast<cl_int>(s.get_materials().get_num_textures()));
-
-    assert(_kernel_run_event.size() == 1);
-
-    err = _ctx->get_command_queue().enqueueNDRangeKernel(*_kernel,
+    // The accumulated image remains untouched by the denoiser, it is
+    // only used for the displayed image.
+    const cl::Image2D* result = _render_result.get();
+    if(_pixel_stride > 1)
+      result = &_upsampler.run(*result, _normal_depth, _pixel_stride);
+    if(_is_denoising_enabled)
+      result = &_denoiser.run(*result, _sample_counts, _albedo, _normal_depth);
+
+    // Derive the exposure from the luminance histogram that the post
+    // processor has built for the previous frame
+    qcl::kernel_argument_list exposure_arguments(_exposure_kernel);
+    exposure_arguments.push(_luminance_histogram);
+    exposure_arguments.push(_exposure_state);
+    exposure_arguments.push(&_tone_mapping, sizeof(device_object::tone_mapping_parameters));
+
+    err = _ctx->get_command_queue().enqueueNDRangeKernel(*_exposure_kernel,
                                                          cl::NullRange,
-                                                         cl::NDRange(work_items[0], work_items[1]),
-                                                         cl::NDRange(_work_group_size, _work_group_size),
-                                                         nullptr,
-                                                         &(_kernel_run_event[0]));
-
-    qcl::check_cl_error(err, "Could not enqueue kernel call!");
-
-    // Obtain maximum pixel value. This is required for the
-    // color range compression during post processing.
-    _image_max_reduction.run_reduction(*_buffer_a);
+                                                         cl::NDRange(1),
+                                                         cl::NDRange(1));
+    qcl::check_cl_error(err, "Could not enqueue exposure kernel call!");
 
     qcl::kernel_argument_list post_processing_arguments(_post_processing_kernel);
     post_processing_arguments.push(pixels);
-    post_processing_arguments.push(*_buffer_a);
-    post_processing_arguments.push(_image_max_reduction.get_reduction_result());
-    post_processing_arguments.push(_max_value_running_average);
-    post_processing_arguments.push(static_cast<cl_ulong>(_frame_number));
-    post_processing_arguments.push(static_cast<cl_int>(get_smoothing_size()));
+    post_processing_arguments.push(*result);
+    post_processing_arguments.push(_luminance_histogram);
+    post_processing_arguments.push(_exposure_state);
+    post_processing_arguments.push(&_tone_mapping, sizeof(device_object::tone_mapping_parameters));
+    post_processing_arguments.push(static_cast<cl_int>(_is_denoising_enabled ?
+                                                       0 : get_smoothing_size()));
 
     cl::Event post_processor_run;
     err = _ctx->get_command_queue(0).enqueueNDRangeKernel(*_post_processing_kernel,
@@ -220,18 +946,20 @@ public:
     double time = _timer.stop();
     _timer.start();
 
-    _total_num_rays += _num_rays_ppx;
+    double num_traced_rays = static_cast<double>(_num_traced_pixels * _num_rays_ppx);
 
     _current_fps = 1.0 / time;
-    _num_rays_ppx = static_cast<portable_int>(std::round(_num_rays_ppx * _current_fps /
-                                                         _target_fps));
-    if (_num_rays_ppx < 1)
-      _num_rays_ppx = 1;
+    _launch_controller.add_frame_time(time, _num_traced_pixels * _num_rays_ppx);
 
-    std::swap(_buffer_a, _buffer_b);
+    if(_is_frame_interactive)
+      update_pixel_stride();
 
-    std::cout << "Performance @ " << static_cast<double>(_width * _height * _num_rays_ppx) / (1.e6 * time)
-              << " Mrays/s, num_rays_ppx=" << _num_rays_ppx << " fps=" << _current_fps << std::endl;
+    // Samples that have been loaded were not traced by this renderer
+    if(_is_statistics_enabled && _num_launches > 0)
+      std::cout << "Performance @ " << num_traced_rays / (1.e6 * time)
+                << " Mrays/s, num_rays_ppx=" << _num_rays_ppx
+                << " launches=" << _num_launches << " fps=" << _current_fps
+                << " pixel_stride=" << _pixel_stride << std::endl;
   }
 
   const qcl::device_context_ptr& get_current_context() const
@@ -245,6 +973,397 @@ public:
   }
 
 private:
+  /// Converts a half precision value to single precision
+  static float half_to_float(cl_half value)
+  {
+    int exponent = (value >> 10) & 0x1f;
+    int mantissa = value & 0x3ff;
+    float magnitude;
+    if(exponent == 0)
+      magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+    else if(exponent == 0x1f)
+      magnitude = mantissa == 0 ? std::numeric_limits<float>::infinity()
+                                : std::numeric_limits<float>::quiet_NaN();
+    else
+      magnitude = std::ldexp(static_cast<float>(mantissa | 0x400), exponent - 25);
+    return (value & 0x8000) ? -magnitude : magnitude;
+  }
+
+  /// Traces the rays of a frame
+  /// \param s The scene
+  /// \param cam The camera, the first view if \c multiple_views is set
+  /// \param multiple_views Whether the cameras and camera states of all
+  /// views are passed to the kernel
+  void trace_frame(const device_object::scene& s,
+                   const device_object::camera& cam,
+                   bool multiple_views)
+  {
+    ++_frame_number;
+
+    if(!_timer.is_running())
+      _timer.start();
+
+    bool interactive = is_interactive();
+    bool preview = interactive && is_preview_kernel_used() && !multiple_views;
+    if(_extension)
+      _extension->set_interactive(interactive);
+
+    // Frames that have been rendered by the preview kernel or in the
+    // interactive mode of the extension must not be mixed with the
+    // final results
+    bool biased = preview ||
+                  (interactive && _extension && _extension->has_interactive_mode());
+    if(_was_biased && !biased)
+      _total_num_rays = 0;
+    _was_biased = biased;
+    if(interactive)
+      ++_frames_since_discard;
+    else
+      // Refine to the full resolution once the interaction has ended
+      _pixel_stride = 1;
+
+    _is_frame_interactive = interactive;
+    _frame_start_num_rays = _total_num_rays;
+
+    // Size of work group must divide number of work items
+    auto work_items = get_required_num_work_items(_width, _height);
+    // The path tracer only processes the traced pixels of the traced rows.
+    // The first traced row is selected by the global work offset. With
+    // several views, the rows are those of each view.
+    std::size_t view_height = _height / _num_views;
+    std::size_t rows_begin = _traced_rows_end > 0 ? _traced_rows_begin : 0;
+    std::size_t rows_end = _traced_rows_end > 0 ? _traced_rows_end : view_height;
+    std::size_t traced_rows_begin = rows_begin / _pixel_stride;
+    std::size_t traced_width = (_width + _pixel_stride - 1) / _pixel_stride;
+    std::size_t traced_height = (rows_end + _pixel_stride - 1) / _pixel_stride
+                              - traced_rows_begin;
+    auto trace_work_items = get_required_num_work_items(traced_width, traced_height);
+    cl_int err;
+
+    // Keep the camera state of the previous frame for the reprojection
+    if(_is_reprojection_pending)
+    {
+      err = _ctx->get_command_queue().enqueueCopyBuffer(_camera_state,
+                                                        _previous_camera_state,
+                                                        0, 0,
+                                                        sizeof(device_object::camera_frame_state));
+      qcl::check_cl_error(err, "Could not enqueue camera state copy!");
+    }
+
+    // Calculate the per-frame camera state once, instead of
+    // in each work item of the path tracer
+    if(multiple_views)
+    {
+      qcl::kernel_argument_list view_arguments(_camera_prepare_views_kernel);
+      view_arguments.push(_camera_state);
+      view_arguments.push(_view_cameras);
+      view_arguments.push(static_cast<cl_int>(_num_views));
+      view_arguments.push(static_cast<cl_int>(_width));
+      view_arguments.push(static_cast<cl_int>(view_height));
+      s.push_kernel_arguments(view_arguments);
+
+      err = _ctx->get_command_queue().enqueueNDRangeKernel(*_camera_prepare_views_kernel,
+                                                           cl::NullRange,
+                                                           cl::NDRange(_num_views),
+                                                           cl::NullRange);
+      qcl::check_cl_error(err, "Could not enqueue view preparation kernel call!");
+    }
+    else
+    {
+      qcl::kernel_argument_list camera_arguments(_camera_prepare_kernel);
+      camera_arguments.push(_camera_state);
+      camera_arguments.push(&cam, sizeof(device_object::camera));
+      camera_arguments.push(static_cast<cl_int>(_viewport_width > 0 ? _viewport_width : _width));
+      camera_arguments.push(static_cast<cl_int>(_viewport_height > 0 ? _viewport_height : _height));
+      camera_arguments.push(static_cast<cl_int>(_viewport_offset_x));
+      camera_arguments.push(static_cast<cl_int>(_viewport_offset_y));
+      s.push_kernel_arguments(camera_arguments);
+
+      err = _ctx->get_command_queue().enqueueNDRangeKernel(*_camera_prepare_kernel,
+                                                           cl::NullRange,
+                                                           cl::NDRange(1),
+                                                           cl::NDRange(1));
+      qcl::check_cl_error(err, "Could not enqueue camera preparation kernel call!");
+    }
+
+    // The preview kernel does not use the extension
+    const std::shared_ptr<integrator_extension> extension = preview ? nullptr : _extension;
+    if(extension)
+      extension->prepare_frame(s);
+
+    if(_is_reprojection_pending)
+    {
+      reproject_render_state(s, cam, work_items);
+      _is_reprojection_pending = false;
+    }
+
+    // Split the rays of this frame into launches of bounded duration
+    _launch_controller.set_policy(interactive ?
+                                  launch_controller::policy::latency :
+                                  launch_controller::policy::throughput);
+    std::size_t num_traced_pixels = traced_width * traced_height * _num_views;
+    _num_traced_pixels = num_traced_pixels;
+    std::vector<std::size_t> launches = _launch_controller.plan_frame(num_traced_pixels);
+    // The resolution is only increased once one ray per pixel is affordable
+    if(_pixel_stride > 1)
+    {
+      launches = {1};
+      _launch_controller.override_rays_per_pixel(1);
+    }
+    if(_max_rays_per_frame > 0)
+      limit_launches(launches, _max_rays_per_frame);
+
+    _num_rays_ppx = 0;
+    _is_converged = false;
+    // Converged pixels do not receive rays, hence the number of rays
+    // that have been traced is only known on the device
+    const bool count_traced_rays = _sampling_mode == SAMPLING_MODE_ADAPTIVE_STOP_CONVERGED;
+    const std::size_t launch_start_num_rays = _total_num_rays;
+    _launch_ray_counts.assign(launches.size(), 0);
+
+    const qcl::kernel_ptr& kernel = preview ? _preview_kernel : _kernel;
+    for(std::size_t launch = 0; launch < launches.size(); ++launch)
+    {
+      std::size_t rays_per_pixel = launches[launch];
+      ++_launch_number;
+
+      // Reset the error sum of this launch. The error sum of the previous
+      // launch remains in the other slot.
+      cl_int error_sum_slot = static_cast<cl_int>(_launch_number % 2);
+      cl_uint zero = 0;
+      err = _ctx->get_command_queue().enqueueFillBuffer(_error_sums,
+                                                        zero,
+                                                        error_sum_slot * sizeof(cl_uint),
+                                                        sizeof(cl_uint));
+      qcl::check_cl_error(err, "Could not enqueue error sum reset!");
+      err = _ctx->get_command_queue().enqueueFillBuffer(_error_sums,
+                                                        zero,
+                                                        (SAMPLING_ERROR_WEIGHT_OFFSET + error_sum_slot)
+                                                          * sizeof(cl_uint),
+                                                        sizeof(cl_uint));
+      qcl::check_cl_error(err, "Could not enqueue error weight reset!");
+      if(count_traced_rays)
+      {
+        err = _ctx->get_command_queue().enqueueFillBuffer(_error_sums,
+                                                          zero,
+                                                          SAMPLING_RAY_COUNT_SLOT * sizeof(cl_uint),
+                                                          sizeof(cl_uint));
+        qcl::check_cl_error(err, "Could not enqueue ray count reset!");
+      }
+
+      //Call kernel
+      qcl::kernel_argument_list kernel_arguments(kernel);
+
+      kernel_arguments.push(*_render_result);
+      kernel_arguments.push(_accumulated_sums);
+      kernel_arguments.push(_accumulated_compensations);
+      kernel_arguments.push(static_cast<cl_int>(_total_num_rays));
+      kernel_arguments.push(_random.get());
+      if(multiple_views)
+        kernel_arguments.push(_view_cameras);
+      else
+        kernel_arguments.push(&cam, sizeof(device_object::camera));
+      kernel_arguments.push(_camera_state);
+      kernel_arguments.push(static_cast<cl_int>(rays_per_pixel));
+      kernel_arguments.push(_sample_counts);
+      kernel_arguments.push(_error_sums);
+      kernel_arguments.push(error_sum_slot);
+      kernel_arguments.push(static_cast<cl_int>(_sampling_mode));
+      kernel_arguments.push(static_cast<cl_float>(_convergence_threshold));
+      kernel_arguments.push(_albedo);
+      kernel_arguments.push(_normal_depth);
+      kernel_arguments.push(static_cast<cl_int>(_is_denoising_enabled ||
+                                                _is_reprojection_enabled ||
+                                                _pixel_stride > 1 ? 1 : 0));
+      kernel_arguments.push(static_cast<cl_int>(_pixel_stride));
+      kernel_arguments.push(&_priority, sizeof(device_object::sampling_priority));
+      kernel_arguments.push(_priority_mask);
+      s.push_kernel_arguments(kernel_arguments);
+      if(extension)
+        extension->push_kernel_arguments(kernel_arguments);
+
+      cl::Event kernel_run;
+      if(multiple_views)
+        // The third dimension selects the view
+        err = _ctx->get_command_queue().enqueueNDRangeKernel(*kernel,
+                                                             cl::NDRange(0, traced_rows_begin, 0),
+                                                             cl::NDRange(trace_work_items[0],
+                                                                         trace_work_items[1],
+                                                                         _num_views),
+                                                             cl::NDRange(_work_group_size,
+                                                                         _work_group_size, 1),
+                                                             nullptr,
+                                                             &kernel_run);
+      else
+        err = _ctx->get_command_queue().enqueueNDRangeKernel(*kernel,
+                                                             cl::NDRange(0, traced_rows_begin),
+                                                             cl::NDRange(trace_work_items[0],
+                                                                         trace_work_items[1]),
+                                                             cl::NDRange(_work_group_size, _work_group_size),
+                                                             nullptr,
+                                                             &kernel_run);
+
+      qcl::check_cl_error(err, "Could not enqueue kernel call!");
+
+      _launch_controller.add_launch(kernel_run, num_traced_pixels * rays_per_pixel);
+      // The kernel only distinguishes between an empty and a non-empty
+      // render state, the nominal number of rays suffices for the
+      // following launches
+      _total_num_rays += rays_per_pixel;
+      _num_rays_ppx += static_cast<portable_int>(rays_per_pixel);
+
+      if(count_traced_rays)
+      {
+        // Only the last read blocks, the queue is in order
+        const bool is_last_launch = launch + 1 == launches.size();
+        err = _ctx->get_command_queue().enqueueReadBuffer(_error_sums,
+                                                          is_last_launch ? CL_TRUE : CL_FALSE,
+                                                          SAMPLING_RAY_COUNT_SLOT * sizeof(cl_uint),
+                                                          sizeof(cl_uint),
+                                                          _launch_ray_counts.data() + launch);
+        qcl::check_cl_error(err, "Could not read ray count!");
+      }
+    }
+    _num_launches = launches.size();
+
+    if(count_traced_rays)
+      replace_nominal_rays(launch_start_num_rays, num_traced_pixels);
+
+    _previous_camera = std::make_shared<device_object::camera>(cam);
+  }
+
+  /// Removes the rays of the launches of a frame that exceed a maximum
+  /// \param launches The number of rays per pixel of each launch
+  /// \param max_rays_per_pixel The maximum number of rays per pixel of
+  /// all launches together, at least one
+  static void limit_launches(std::vector<std::size_t>& launches,
+                             std::size_t max_rays_per_pixel)
+  {
+    std::size_t remaining_rays = max_rays_per_pixel;
+    std::size_t num_launches = 0;
+    while(num_launches < launches.size() && remaining_rays > 0)
+    {
+      launches[num_launches] = std::min(launches[num_launches], remaining_rays);
+      remaining_rays -= launches[num_launches];
+      ++num_launches;
+    }
+    launches.resize(num_launches);
+  }
+
+  /// Replaces the nominal number of rays per pixel of the current frame
+  /// with the number of rays that have actually been traced
+  /// \param launch_start_num_rays The number of rays per pixel before
+  /// the first launch of the frame
+  /// \param num_traced_pixels The number of pixels traced by each launch
+  void replace_nominal_rays(std::size_t launch_start_num_rays,
+                            std::size_t num_traced_pixels)
+  {
+    std::uint64_t num_rays = 0;
+    for(cl_uint launch_rays : _launch_ray_counts)
+      num_rays += launch_rays;
+
+    // The fractions of the average are carried over to the next frame
+    double rays_per_pixel = static_cast<double>(num_rays)
+                          / static_cast<double>(std::max<std::size_t>(num_traced_pixels, 1))
+                          + _fractional_rays_per_pixel;
+    std::size_t whole_rays_per_pixel = static_cast<std::size_t>(rays_per_pixel);
+    _fractional_rays_per_pixel = rays_per_pixel - static_cast<double>(whole_rays_per_pixel);
+
+    _total_num_rays = launch_start_num_rays + whole_rays_per_pixel;
+    // The kernel treats a render state without rays as empty
+    if(num_rays > 0 && _total_num_rays == 0)
+      _total_num_rays = 1;
+    _num_rays_ppx = static_cast<portable_int>(whole_rays_per_pixel);
+    _is_converged = num_rays == 0 && num_traced_pixels > 0;
+  }
+
+  void restart_accumulation()
+  {
+    _total_num_rays = 0;
+    _fractional_rays_per_pixel = 0.0;
+    _is_converged = false;
+    _is_reprojection_pending = false;
+    if(_extension)
+      _extension->reset();
+  }
+
+  /// Warps the accumulated image of the previous camera into the view
+  /// of the current camera. The result replaces the accumulated samples.
+  void reproject_render_state(const device_object::scene& s,
+                              const device_object::camera& cam,
+                              const std::array<std::size_t,2>& work_items)
+  {
+    qcl::kernel_argument_list arguments(_reprojection_kernel);
+    arguments.push(_accumulated_sums);
+    arguments.push(_accumulated_compensations);
+    arguments.push(*_render_result);
+    arguments.push(_reprojected_sample_counts);
+    arguments.push(_sample_counts);
+    arguments.push(_reprojected_albedo);
+    arguments.push(_albedo);
+    arguments.push(_reprojected_normal_depth);
+    arguments.push(_normal_depth);
+    arguments.push(&cam, sizeof(device_object::camera));
+    arguments.push(_camera_state);
+    arguments.push(_previous_camera.get(), sizeof(device_object::camera));
+    arguments.push(_previous_camera_state);
+    arguments.push(static_cast<cl_int>(_max_reprojected_rays));
+    s.push_kernel_arguments(arguments);
+
+    cl_int err = _ctx->get_command_queue().enqueueNDRangeKernel(*_reprojection_kernel,
+                                                                cl::NullRange,
+                                                                cl::NDRange(work_items[0], work_items[1]),
+                                                                cl::NDRange(_work_group_size, _work_group_size));
+    qcl::check_cl_error(err, "Could not enqueue reprojection kernel call!");
+
+    std::swap(_sample_counts, _reprojected_sample_counts);
+    std::swap(_albedo, _reprojected_albedo);
+    std::swap(_normal_depth, _reprojected_normal_depth);
+  }
+
+  /// Adds samples to the rows [begin, end) of the accumulated image
+  /// \param num_previous_rays If 0, the accumulated samples are discarded
+  void enqueue_merge(const cl::Buffer& sums,
+                     const cl::Buffer& sample_counts,
+                     const cl::Buffer& albedo,
+                     const cl::Buffer& normal_depth,
+                     std::size_t begin,
+                     std::size_t end,
+                     std::size_t num_previous_rays)
+  {
+    qcl::kernel_argument_list arguments(_merge_kernel);
+    arguments.push(*_render_result);
+    arguments.push(_accumulated_sums);
+    arguments.push(_accumulated_compensations);
+    arguments.push(_sample_counts);
+    arguments.push(_albedo);
+    arguments.push(_normal_depth);
+    arguments.push(sums);
+    arguments.push(sample_counts);
+    arguments.push(albedo);
+    arguments.push(normal_depth);
+    arguments.push(static_cast<cl_int>(num_previous_rays));
+
+    auto work_items = get_required_num_work_items(_width, end - begin);
+    cl_int err = _ctx->get_command_queue().enqueueNDRangeKernel(*_merge_kernel,
+                                                                cl::NDRange(0, begin),
+                                                                cl::NDRange(work_items[0], work_items[1]),
+                                                                cl::NDRange(_work_group_size, _work_group_size));
+    qcl::check_cl_error(err, "Could not enqueue sample merge kernel call!");
+  }
+
+  /// Reduces the resolution if the target frame rate is not reached with
+  /// one ray per pixel, and increases it again if there is enough headroom.
+  void update_pixel_stride()
+  {
+    if(_pixel_stride < _max_pixel_stride &&
+       _num_rays_ppx <= 1 && _current_fps < 0.9 * _target_fps)
+      _pixel_stride = std::min(2 * _pixel_stride, _max_pixel_stride);
+    // Halving the stride quadruples the number of traced pixels
+    else if(_pixel_stride > 1 && _current_fps > 4.5 * _target_fps)
+      _pixel_stride /= 2;
+  }
+
   inline int get_smoothing_size() const
   {
     const double max_smoothing = 10.0;
@@ -258,9 +1377,9 @@ private:
     std::size_t effective_width = width;
     std::size_t effective_height = height;
     if(effective_width % _work_group_size != 0)
-      effective_width = (_width / _work_group_size + 1) * _work_group_size;
+      effective_width = (width / _work_group_size + 1) * _work_group_size;
     if(effective_height % _work_group_size != 0)
-      effective_height = (_height / _work_group_size + 1) * _work_group_size;
+      effective_height = (height / _work_group_size + 1) * _work_group_size;
     return {{effective_width, effective_height}};
   }
 
@@ -276,20 +1395,19 @@ private:
 
     qcl::check_cl_error(err, "Could not create CL image object!");
 
-    cl::Event buffer_fill;
-
     cl::array<std::size_t,3> range;
     range[0] = width;
     range[1] = height;
     range[2] = 1;
 
+    // Kernels using the image are enqueued after the fill on the
+    // in-order queue, so the host need not wait for it
     cl_float4 fill_value = {{0.0f, 0.0f, 0.0f, 0.0f}};
-    _ctx->get_command_queue().enqueueFillImage(*ptr,
-                                               fill_value,
-                                               cl::array<std::size_t,3>{},
-                                               range,
-                                               nullptr, &buffer_fill);
-    buffer_fill.wait();
+    err = _ctx->get_command_queue().enqueueFillImage(*ptr,
+                                                     fill_value,
+                                                     cl::array<std::size_t,3>{},
+                                                     range);
+    qcl::check_cl_error(err, "Could not enqueue image fill!");
 
     return ptr;
   }
@@ -297,6 +1415,8 @@ private:
   double _target_fps;
   double _current_fps;
   portable_int _num_rays_ppx;
+  portable_int _sampling_mode;
+  scalar _convergence_threshold;
   qcl::device_context_ptr _ctx;
 
   std::size_t _width;
@@ -305,26 +1425,105 @@ private:
   device_object::random_engine _random;
 
   qcl::kernel_ptr _kernel;
+  qcl::kernel_ptr _camera_prepare_kernel;
+  qcl::kernel_ptr _camera_prepare_views_kernel;
+  qcl::kernel_ptr _reprojection_kernel;
+  qcl::kernel_ptr _merge_kernel;
+  qcl::kernel_ptr _preview_kernel;
   qcl::kernel_ptr _post_processing_kernel;
+  qcl::kernel_ptr _exposure_kernel;
 
   static constexpr std::size_t _work_group_size = 8;
 
-  std::shared_ptr<cl::Image2D> _buffer_a;
-  std::shared_ptr<cl::Image2D> _buffer_b;
+  /// The average of the samples of each pixel, written by the path tracer
+  /// in each frame
+  std::shared_ptr<cl::Image2D> _render_result;
+  /// The sums of the samples of each pixel and their compensations,
+  /// see accumulation.cl
+  cl::Buffer _accumulated_sums;
+  cl::Buffer _accumulated_compensations;
 
   std::size_t _total_num_rays;
-
-  std::vector<cl::Event> _kernel_run_event;
+  /// The number of rays per pixel before the current frame
+  std::size_t _frame_start_num_rays;
+  /// The fraction of a ray per pixel that has been traced in addition
+  /// to \c _total_num_rays, in SAMPLING_MODE_ADAPTIVE_STOP_CONVERGED
+  double _fractional_rays_per_pixel;
+  bool _is_converged;
+  /// The maximum number of rays per pixel of a frame, 0 if unlimited
+  std::size_t _max_rays_per_frame;
+  bool _is_statistics_enabled;
+  /// The number of rays traced by each launch of the current frame
+  std::vector<cl_uint> _launch_ray_counts;
+
+  launch_controller _launch_controller;
 
   timer _timer;
 
   std::uint_fast64_t _frame_number;
-
-  image_maximum_value _image_max_reduction;
-
-  static constexpr std::size_t _max_value_running_average_size = 
-                                    MAX_VALUE_RUNNING_AVERAGE_SIZE;
-  cl::Buffer _max_value_running_average;
+  std::uint_fast64_t _launch_number;
+
+  atrous_denoiser _denoiser;
+  image_upsampler _upsampler;
+  std::size_t _pixel_stride;
+  std::size_t _max_pixel_stride;
+  bool _is_denoising_enabled;
+  bool _is_reprojection_enabled;
+  bool _is_reprojection_pending;
+  std::size_t _max_reprojected_rays;
+
+  device_object::tone_mapping_parameters _tone_mapping;
+  cl::Buffer _luminance_histogram;
+  /// The adapted log2 luminance, and whether it has been initialized
+  cl::Buffer _exposure_state;
+
+  cl::Buffer _camera_state;
+  cl::Buffer _previous_camera_state;
+
+  cl::Buffer _sample_counts;
+  cl::Buffer _error_sums;
+
+  // First-hit features of each pixel, which guide the denoiser
+  cl::Buffer _albedo;
+  cl::Buffer _normal_depth;
+
+  device_object::sampling_priority _priority;
+  cl::Buffer _priority_mask;
+
+  // Targets of the reprojection, swapped with the buffers above
+  cl::Buffer _reprojected_sample_counts;
+  cl::Buffer _reprojected_albedo;
+  cl::Buffer _reprojected_normal_depth;
+
+  /// The camera of the last rendered frame
+  std::shared_ptr<device_object::camera> _previous_camera;
+
+  std::shared_ptr<integrator_extension> _extension;
+
+  std::size_t _num_interactive_frames;
+  std::size_t _frames_since_discard;
+  bool _was_biased;
+
+  // The whole image of which a part is rendered, if the viewport is set
+  std::size_t _viewport_width;
+  std::size_t _viewport_height;
+  std::size_t _viewport_offset_x;
+  std::size_t _viewport_offset_y;
+
+  // The rows traced in each frame, all rows if the end is 0
+  std::size_t _traced_rows_begin;
+  std::size_t _traced_rows_end;
+
+  // State of the current frame, passed from trace() to present()
+  bool _is_frame_interactive;
+  std::size_t _num_traced_pixels;
+  std::size_t _num_launches;
+
+  // The views stacked in the image, the camera of each view and a copy
+  // of the cameras last uploaded to the device
+  std::size_t _num_views;
+  cl::Buffer _view_cameras;
+  std::vector<device_object::camera> _uploaded_views;
 };
 }
 
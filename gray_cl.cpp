@@ -19,14 +19,31 @@
 
 #include "qcl.hpp"
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <array>
+#include <set>
 
+#include <unistd.h>
+
+#include "animation_renderer.hpp"
+#include "checkpoint.hpp"
 #include "cl_gl.hpp"
 #include "common_math.cl_hpp"
 #include "gl_renderer.hpp"
 #include "image.hpp"
+#include "distributed_renderer.hpp"
+#include "frame_pacer.hpp"
 #include "materials.hpp"
+#include "multi_device_renderer.hpp"
+#include "path_guiding.hpp"
+#include "radiance_cache.hpp"
+#include "photon_map.hpp"
 #include "realtime_renderer.hpp"
+#include "render_service.hpp"
 #include "scene.hpp"
+#include "timer.hpp"
+#include "tiled_renderer.hpp"
 
 std::shared_ptr<gray::device_object::scene>
 setup_scene(const qcl::device_context_ptr& ctx)
@@ -110,6 +127,78 @@ setup_camera(const qcl::device_context_ptr& ctx)
   return camera_ptr;
 }
 
+/// Creates an interior scene that is lit only indirectly: the light of
+/// the ceiling lamp leaves through the gap between lamp shade and ceiling,
+/// and a second light source is enclosed in a glass sphere.
+std::shared_ptr<gray::device_object::scene>
+setup_indirect_scene(const qcl::device_context_ptr& ctx)
+{
+  auto materials = std::make_shared<gray::device_object::material_db>(ctx);
+  gray::material_factory material_fac{materials.get()};
+
+  // The room is closed, hence the background remains dark
+  auto scene_ptr = std::make_shared<gray::device_object::scene>(
+      ctx, materials,
+      material_fac.create_uniform_emission_texture({{0.0f, 0.0f, 0.0f}}));
+
+  gray::material_id wall = material_fac.create_uniform_material(
+      {{0.8f, 0.8f, 0.8f}}, 0.0f, 1.0f, 0.8f);
+  gray::material_id red_wall = material_fac.create_uniform_material(
+      {{0.8f, 0.2f, 0.2f}}, 0.0f, 1.0f, 0.8f);
+  gray::material_id glass = material_fac.create_uniform_material(
+      {{0.95f, 0.95f, 0.95f}}, 1.0f, 1.5f, 1.e-5f);
+  gray::material_id lamp = material_fac.create_uniform_material(
+      {{0.0f, 0.0f, 0.0f}}, {{40.0f, 36.0f, 30.0f}}, 0.0f, 1.0f, 1.0f);
+
+  // Floor, ceiling and walls
+  scene_ptr->add_plane({{0.0, 0.0, -1.0}}, {{0.0, 0.0, 1.0}}, wall);
+  scene_ptr->add_plane({{0.0, 0.0, 3.0}}, {{0.0, 0.0, -1.0}}, wall);
+  scene_ptr->add_plane({{-4.0, 0.0, 0.0}}, {{1.0, 0.0, 0.0}}, red_wall);
+  scene_ptr->add_plane({{4.0, 0.0, 0.0}}, {{-1.0, 0.0, 0.0}}, wall);
+  scene_ptr->add_plane({{0.0, 4.0, 0.0}}, {{0.0, -1.0, 0.0}}, wall);
+  scene_ptr->add_plane({{0.0, -6.0, 0.0}}, {{0.0, 1.0, 0.0}}, wall);
+
+  // Ceiling lamp with a shade below it
+  scene_ptr->add_disk({{2.0, 2.0, 2.7f}}, {{0.0, 0.0, 1.0}}, 0.3f, lamp);
+  scene_ptr->add_disk({{2.0, 2.0, 2.6f}}, {{0.0, 0.0, 1.0}}, 0.7f, wall);
+
+  // Light source behind glass
+  scene_ptr->add_sphere({{-2.0, 2.0, -0.4f}}, {{0.0, 0.0, 1.0}},
+                        {{1.0, 0.0, 0.0}}, 0.6f, glass);
+  scene_ptr->add_sphere({{-2.0, 2.0, -0.4f}}, {{0.0, 0.0, 1.0}},
+                        {{1.0, 0.0, 0.0}}, 0.1f, lamp);
+
+  scene_ptr->add_sphere({{0.5, 1.0, -0.2f}}, {{0.0, 0.0, 1.0}},
+                        {{1.0, 0.0, 0.0}}, 0.8f, glass);
+  scene_ptr->add_sphere({{1.5, -0.5, -0.5f}}, {{0.0, 0.0, 1.0}},
+                        {{1.0, 0.0, 0.0}}, 0.5f, wall);
+
+  scene_ptr->transfer_data();
+
+  return scene_ptr;
+}
+
+std::shared_ptr<gray::device_object::camera>
+setup_indirect_camera(const qcl::device_context_ptr& ctx)
+{
+  using namespace gray;
+
+  vector3 camera_pos = {{0.0, -5.5, 1.0}};
+  vector3 look_at = {{0.0, 1.0, -0.2f}};
+  look_at = math::normalize(look_at);
+
+  auto camera_ptr = std::make_shared<gray::device_object::camera>(
+      camera_pos, look_at,
+      0.0,  // roll angle
+      0.05f, // aperture
+      6.0f  // focal length
+      );
+
+  camera_ptr->enable_autofocus();
+
+  return camera_ptr;
+}
+
 namespace gray {
 
 class gray_app
@@ -117,9 +206,18 @@ class gray_app
 public:
   gray_app(int argc, char** argv)
       : _x_resolution{1280}, _y_resolution{1024}, _rays_per_pixel{100},
+        _sampling_mode{SAMPLING_MODE_UNIFORM},
+        _tone_mapping{TONE_MAPPING_FILMIC},
+        _integrator{"pt"}, _scene_name{"default"}, _time_budget{0.0},
+        _output_file{"gray_render.png"}, _disable_denoising{false},
+        _disable_reprojection{false}, _use_roi{false}, _roi{{0, 0, 0, 0}},
+        _disable_preview{false}, _verbose{false}, _frames_in_flight{2},
+        _tile_size{0},
+        _multi_device{false}, _worker_port{0}, _job_size{0},
+        _frames_per_second{24.0}, _checkpoint_interval{600.0},
+        _eye_separation{0.1f},
         _argc{argc}, _argv{argv}
   {
-    image::initialize(argc, argv);
   }
 
   void run()
@@ -143,6 +241,180 @@ public:
         }
         else if (_argv[i] == std::string{"--disable_gl_sharing"})
           disable_gl_sharing = true;
+        else if (_argv[i] == std::string{"--disable_denoising"})
+          _disable_denoising = true;
+        else if (_argv[i] == std::string{"--disable_reprojection"})
+          _disable_reprojection = true;
+        else if (_argv[i] == std::string{"--disable_preview"})
+          _disable_preview = true;
+        else if (_argv[i] == std::string{"--verbose"})
+          _verbose = true;
+        else if (_argv[i] == std::string{"--multi_device"})
+          _multi_device = true;
+        else if (_argv[i] == std::string{"--worker"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Port not given after --worker argument");
+
+          _worker_port = std::stoul(_argv[i + 1]);
+          if (_worker_port == 0 || _worker_port > 65535)
+            throw std::invalid_argument("Invalid port for --worker argument");
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--master"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Workers not given after --master argument "
+                                        "(expected format: host:port,host:port,...)");
+
+          std::string workers = _argv[i + 1];
+          for (char& c : workers)
+            if (c == ',')
+              c = ' ';
+
+          std::istringstream worker_stream{workers};
+          std::string worker;
+          while (worker_stream >> worker)
+            _workers.push_back(worker);
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--daemon"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Socket path not given after "
+                                        "--daemon argument");
+
+          _daemon_socket = _argv[i + 1];
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--submit"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Socket path not given after "
+                                        "--submit argument");
+
+          _submit_socket = _argv[i + 1];
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--animation"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Camera path not given after "
+                                        "--animation argument");
+
+          _animation_file = _argv[i + 1];
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--fps"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Frame rate not given after "
+                                        "--fps argument");
+
+          _frames_per_second = std::stod(_argv[i + 1]);
+          if (!(_frames_per_second > 0.0))
+            throw std::invalid_argument("The frame rate must be positive");
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--checkpoint"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("File name not given after "
+                                        "--checkpoint argument");
+
+          _checkpoint_file = _argv[i + 1];
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--checkpoint_interval"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Interval not given after "
+                                        "--checkpoint_interval argument");
+
+          _checkpoint_interval = std::stod(_argv[i + 1]);
+          if (!(_checkpoint_interval > 0.0))
+            throw std::invalid_argument("The checkpoint interval must be positive");
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--resume"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("File name not given after "
+                                        "--resume argument");
+
+          _resume_file = _argv[i + 1];
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--views"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Views not given after --views argument "
+                                        "(expected stereo or cubemap)");
+
+          _views = _argv[i + 1];
+          if (_views != "stereo" && _views != "cubemap")
+            throw std::invalid_argument("Invalid views: " + _views +
+                                        " (expected stereo or cubemap)");
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--eye_separation"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Distance not given after "
+                                        "--eye_separation argument");
+
+          _eye_separation = std::stof(_argv[i + 1]);
+          if (!(_eye_separation > 0.0f))
+            throw std::invalid_argument("The eye separation must be positive");
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--job_size"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Number of rays per pixel not given after "
+                                        "--job_size argument");
+
+          _job_size = std::stoull(_argv[i + 1]);
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--cpu_partition"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Partition not given after "
+                                        "--cpu_partition argument "
+                                        "(expected numa or a number of "
+                                        "compute units)");
+
+          std::string partition = _argv[i + 1];
+          if (partition == "numa")
+            _cpu_partition = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+                              CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+          else
+          {
+            // A single sub-device, the remaining compute units are left
+            // to the host
+            auto compute_units = static_cast<cl_device_partition_property>(
+                std::stoull(partition));
+            if (compute_units == 0)
+              throw std::invalid_argument("At least one compute unit is required");
+            _cpu_partition = {CL_DEVICE_PARTITION_BY_COUNTS, compute_units,
+                              CL_DEVICE_PARTITION_BY_COUNTS_LIST_END, 0};
+          }
+
+          ++i;
+        }
         else if (_argv[i] == std::string{"--prefer_platform"})
         {
           if (i == static_cast<std::size_t>(_argc) - 1)
@@ -187,6 +459,136 @@ public:
 
           ++i;
         }
+        else if (_argv[i] == std::string{"--tone_mapping"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Tone mapping operator not given after "
+                                        "--tone_mapping argument (expected "
+                                        "clamp, reinhard or filmic)");
+
+          std::string op = _argv[i + 1];
+          if (op == "clamp")
+            _tone_mapping = TONE_MAPPING_CLAMP;
+          else if (op == "reinhard")
+            _tone_mapping = TONE_MAPPING_REINHARD;
+          else if (op == "filmic")
+            _tone_mapping = TONE_MAPPING_FILMIC;
+          else
+            throw std::invalid_argument("Invalid tone mapping operator: " + op);
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--sampling"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Sampling mode not given after "
+                                        "--sampling argument (expected "
+                                        "uniform, adaptive or converge)");
+
+          std::string mode = _argv[i + 1];
+          if (mode == "uniform")
+            _sampling_mode = SAMPLING_MODE_UNIFORM;
+          else if (mode == "adaptive")
+            _sampling_mode = SAMPLING_MODE_ADAPTIVE;
+          else if (mode == "converge")
+            _sampling_mode = SAMPLING_MODE_ADAPTIVE_STOP_CONVERGED;
+          else
+            throw std::invalid_argument("Invalid sampling mode: " + mode);
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--integrator"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Integrator not given after "
+                                        "--integrator argument (expected "
+                                        "pt, ppm, bdpt, guided or cached)");
+
+          _integrator = _argv[i + 1];
+          if (_integrator != "pt" && _integrator != "ppm" &&
+              _integrator != "bdpt" && _integrator != "guided" &&
+              _integrator != "cached")
+            throw std::invalid_argument("Invalid integrator: " + _integrator);
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--scene"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Scene not given after --scene "
+                                        "argument (expected default or "
+                                        "indirect)");
+
+          _scene_name = _argv[i + 1];
+          if (_scene_name != "default" && _scene_name != "indirect")
+            throw std::invalid_argument("Invalid scene: " + _scene_name);
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--time_budget"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Rendering time not given after "
+                                        "--time_budget argument");
+
+          _time_budget = std::stod(_argv[i + 1]);
+          if (!(_time_budget >= 0.0))
+            throw std::invalid_argument("The rendering time must not be negative");
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--frames_in_flight"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Number of frames not given after "
+                                        "--frames_in_flight argument");
+
+          _frames_in_flight = std::stoull(_argv[i + 1]);
+          if (_frames_in_flight == 0)
+            throw std::invalid_argument("At least one frame must be in flight");
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--tile_size"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Tile size not given after "
+                                        "--tile_size argument");
+
+          _tile_size = std::stoull(_argv[i + 1]);
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--output"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("File name not given after "
+                                        "--output argument");
+
+          _output_file = _argv[i + 1];
+
+          ++i;
+        }
+        else if (_argv[i] == std::string{"--roi"})
+        {
+          if (i == static_cast<std::size_t>(_argc) - 1)
+            throw std::invalid_argument("Region not given after --roi argument "
+                                        "(expected format: x,y,width,height)");
+
+          std::string region = _argv[i + 1];
+          for (char& c : region)
+            if (c == ',')
+              c = ' ';
+
+          std::istringstream region_stream{region};
+          if (!(region_stream >> _roi[0] >> _roi[1] >> _roi[2] >> _roi[3]) ||
+              _roi[2] <= 0 || _roi[3] <= 0)
+            throw std::invalid_argument("Given region of interest is invalid "
+                                        "(expected format: x,y,width,height)");
+          _use_roi = true;
+
+          ++i;
+        }
         else
         {
           std::cout << "Invalid argument: " << _argv[i] << std::endl;
@@ -195,9 +597,28 @@ public:
       }
     }
 
+    // Submitting a job needs neither a device nor ImageMagick, such that
+    // the client starts without delay
+    if (!_submit_socket.empty())
+    {
+      submit_job();
+      return;
+    }
+
+    image::initialize(_argc, _argv);
     print_platforms(_environment);
 
-    if (offline)
+    if (!_daemon_socket.empty())
+      launch_daemon(platform_preferences);
+    else if (_worker_port > 0)
+      launch_worker(platform_preferences);
+    else if (!_workers.empty())
+      launch_master(platform_preferences);
+    else if (!_animation_file.empty())
+      launch_animation_renderer(platform_preferences);
+    else if (!_views.empty())
+      launch_multi_view_renderer(platform_preferences);
+    else if (offline)
       launch_offline_renderer(platform_preferences);
     else
     {
@@ -251,14 +672,11 @@ private:
     }
   }
 
-  void prepare_cl(qcl::global_context_ptr global_ctx) const
+  void prepare_cl(qcl::global_context_ptr global_ctx,
+                  const std::string& integrator) const
   {
-    // Compile sources and register kernels
-    global_ctx->global_register_source_file("pathtracer.cl", {"trace_paths"});
-    global_ctx->global_register_source_file("postprocessing.cl",
-                                            {"hdr_color_compression"});
-    global_ctx->global_register_source_file(
-        "reduction.cl", {"max_value_reduction_init", "max_value_reduction"});
+    prepare_common_cl(global_ctx);
+    prepare_integrator_cl(global_ctx, integrator);
 
     qcl::device_context_ptr ctx = global_ctx->device();
 
@@ -268,9 +686,152 @@ private:
     std::cout << "Supported extensions: " << extensions << std::endl;
   }
 
+  /// Compiles the kernels that are used by all integrators
+  void prepare_common_cl(qcl::global_context_ptr global_ctx) const
+  {
+    // Compile sources and register kernels
+    global_ctx->global_register_source_file(
+        "pathtracer.cl",
+        {"trace_paths", "camera_prepare", "camera_prepare_views",
+         "reproject_render_state", "merge_samples"});
+    global_ctx->global_register_source_file("postprocessing.cl",
+                                            {"hdr_color_compression",
+                                             "update_exposure"});
+    global_ctx->global_register_source_file("denoising.cl", {"atrous_filter"});
+    global_ctx->global_register_source_file("pathtracer_preview.cl",
+                                            {"trace_paths_preview"});
+    global_ctx->global_register_source_file("upsampling.cl", {"upsample_image"});
+    if (!_views.empty())
+      global_ctx->global_register_source_file("pathtracer_multiview.cl",
+                                              {"trace_paths_multiview"});
+  }
+
+  /// Compiles the kernels of an integrator
+  void prepare_integrator_cl(qcl::global_context_ptr global_ctx,
+                             const std::string& integrator) const
+  {
+    if (integrator == "ppm")
+    {
+      global_ctx->global_register_source_file("pathtracer_ppm.cl",
+                                              {"trace_paths_ppm"});
+      global_ctx->global_register_source_file("photon_map.cl",
+                                              {"trace_photons"});
+    }
+    else if (integrator == "bdpt")
+      global_ctx->global_register_source_file("pathtracer_bdpt.cl",
+                                              {"trace_bidirectional_paths"});
+    else if (integrator == "guided")
+    {
+      global_ctx->global_register_source_file("pathtracer_guided.cl",
+                                              {"trace_paths_guided"});
+      global_ctx->global_register_source_file("path_guiding.cl",
+                                              {"build_guiding_distribution"});
+    }
+    else if (integrator == "cached")
+    {
+      global_ctx->global_register_source_file("pathtracer_cached.cl",
+                                              {"trace_paths_cached"});
+      global_ctx->global_register_source_file("radiance_cache.cl",
+                                              {"update_radiance_cache"});
+    }
+  }
+
+  static const std::vector<std::string>& get_integrator_names()
+  {
+    static const std::vector<std::string> names = {"pt", "ppm", "bdpt",
+                                                   "guided", "cached"};
+    return names;
+  }
+
+  std::string get_kernel_name(const std::string& integrator) const
+  {
+    if (integrator == "ppm")
+      return "trace_paths_ppm";
+    else if (integrator == "bdpt")
+      return "trace_bidirectional_paths";
+    else if (integrator == "guided")
+      return "trace_paths_guided";
+    else if (integrator == "cached")
+      return "trace_paths_cached";
+    return "trace_paths";
+  }
+
+  std::shared_ptr<gray::device_object::scene>
+  create_scene(const qcl::device_context_ptr& ctx,
+               const std::string& scene_name) const
+  {
+    if (scene_name == "indirect")
+      return setup_indirect_scene(ctx);
+    return setup_scene(ctx);
+  }
+
+  /// \return The files from which a scene is built, e.g. its textures
+  std::vector<std::string> get_scene_files(const std::string& scene_name) const
+  {
+    if (scene_name == "default")
+      return {"skymap.hdr"};
+    else if (scene_name == "indirect")
+      return {};
+    throw std::runtime_error("Invalid scene: " + scene_name);
+  }
+
+  /// \return A hash that identifies a scene by its name and the contents
+  /// of the files it is built from
+  std::uint64_t get_scene_hash(const std::string& scene_name,
+                               gray::file_hash_cache& file_hashes) const
+  {
+    std::uint64_t hash = gray::hash_bytes(scene_name.data(), scene_name.size());
+    for (const std::string& file : get_scene_files(scene_name))
+    {
+      std::uint64_t file_hash = file_hashes.get_hash(file);
+      hash = gray::hash_bytes(&file_hash, sizeof(file_hash), hash);
+    }
+    return hash;
+  }
+
+  std::shared_ptr<gray::device_object::camera>
+  create_camera(const qcl::device_context_ptr& ctx,
+                const std::string& scene_name) const
+  {
+    if (scene_name == "indirect")
+      return setup_indirect_camera(ctx);
+    return setup_camera(ctx);
+  }
+
+  void setup_priority(gray::frame_renderer& renderer) const
+  {
+    if (_use_roi)
+      renderer.set_priority_region(_roi[0], _roi[1],
+                                   _roi[0] + _roi[2], _roi[1] + _roi[3]);
+  }
+
+  void setup_integrator(const qcl::device_context_ptr& ctx,
+                        gray::frame_renderer& renderer,
+                        const std::string& integrator) const
+  {
+    if (integrator == "ppm")
+      renderer.set_integrator_extension(std::make_shared<gray::photon_map>(ctx));
+    else if (integrator == "guided")
+      renderer.set_integrator_extension(std::make_shared<gray::path_guide>(ctx));
+    else if (integrator == "cached")
+      renderer.set_integrator_extension(std::make_shared<gray::radiance_cache>(ctx));
+  }
+
   void launch_offline_renderer(
       const std::vector<std::string>& platform_preferences) const
   {
+    bool tiled = _tile_size > 0;
+    if ((!_checkpoint_file.empty() || !_resume_file.empty()) &&
+        (_multi_device || tiled))
+      throw std::invalid_argument("Checkpoints are only supported for "
+                                  "offline renders on a single device "
+                                  "without tiles");
+
+    if (_multi_device)
+    {
+      launch_multi_device_renderer();
+      return;
+    }
 
     const cl::Platform& selected_platform =
         _environment.get_platform_by_preference(platform_preferences);
@@ -281,38 +842,768 @@ private:
     if (global_ctx->get_num_devices() == 0)
       throw std::runtime_error{"No devices found"};
 
-    prepare_cl(global_ctx);
+    prepare_cl(global_ctx, _integrator);
     qcl::device_context_ptr ctx = global_ctx->device();
 
-    auto scene = setup_scene(ctx);
-    auto camera = setup_camera(ctx);
-
-    gray::frame_renderer renderer{ctx, "trace_paths", "hdr_color_compression",
-                                  _x_resolution, _y_resolution};
+    auto scene = create_scene(ctx, _scene_name);
+    auto camera = create_camera(ctx, _scene_name);
+
+    // In tiled mode, the renderer only holds one tile on the device
+    gray::frame_renderer renderer{ctx, get_kernel_name(_integrator), "hdr_color_compression",
+                                  tiled ? _tile_size : _x_resolution,
+                                  tiled ? _tile_size : _y_resolution};
+    renderer.set_sampling_mode(_sampling_mode);
+    renderer.set_tone_mapping_operator(_tone_mapping);
+    renderer.set_denoising_enabled(!_disable_denoising);
+    renderer.set_statistics_enabled(_verbose);
+    // The region of interest refers to the whole image, not to a tile
+    if (!tiled)
+      setup_priority(renderer);
+    setup_integrator(ctx, renderer, _integrator);
+
+    if (tiled)
+    {
+      renderer.set_target_rendering_time(2.0);
+
+      gray::tiled_renderer tiled_renderer{ctx, renderer, _x_resolution,
+                                          _y_resolution, _frames_in_flight};
+      // Tiled renders are streamed into an uncompressed image
+      std::string output_file =
+          gray::tiled_renderer::get_ppm_file_name(_output_file);
+      if (output_file != _output_file)
+        std::cout << "Tiled renders are written as PPM, writing "
+                  << output_file << " instead of " << _output_file
+                  << std::endl;
+
+      std::cout << "Started render of "
+                << tiled_renderer.get_num_tiles_x() *
+                       tiled_renderer.get_num_tiles_y()
+                << " tiles..." << std::endl;
+      tiled_renderer.render(output_file, *scene, *camera, _rays_per_pixel,
+                            _time_budget);
+      std::cout << "Done." << std::endl;
+      return;
+    }
 
     cl::Image2D pixels{ctx->get_context(), CL_MEM_READ_WRITE,
                        cl::ImageFormat{CL_RGBA, CL_UNORM_INT8}, _x_resolution,
                        _y_resolution};
 
+    // The checkpoint identifies the render by its scene, camera and
+    // integrator, such that it is not resumed with different ones
+    gray::file_hash_cache file_hashes;
+    std::uint64_t scene_hash = gray::hash_camera(
+        *camera, get_scene_hash(_scene_name, file_hashes));
+    // A resumed render keeps writing checkpoints into the file it was
+    // resumed from
+    std::string checkpoint_file =
+        _checkpoint_file.empty() ? _resume_file : _checkpoint_file;
+
+    // With a time budget, the render runs for a fixed wall-clock time and
+    // the number of rays per pixel is ignored
+    double elapsed_time = 0.0;
+
+    if (!_resume_file.empty())
+    {
+      gray::render_checkpoint checkpoint =
+          gray::render_checkpoint::load(_resume_file);
+      if (checkpoint.integrator != _integrator ||
+          checkpoint.sampling_mode != _sampling_mode ||
+          checkpoint.scene_hash != scene_hash)
+        throw std::runtime_error("Checkpoint " + _resume_file +
+                                 " belongs to a different scene, camera, "
+                                 "integrator or sampling mode");
+      checkpoint.restore(renderer);
+      elapsed_time = checkpoint.elapsed_time;
+
+      std::cout << "Resumed render at " << renderer.get_total_rays_per_pixel()
+                << " paths per pixel." << std::endl;
+    }
+
     std::cout << "Started render..." << std::endl;
 
     // Each rendering chunk should take 2s
     renderer.set_target_rendering_time(2.0);
-    while (renderer.get_total_rays_per_pixel() < _rays_per_pixel)
+
+    gray::timer render_timer;
+    render_timer.start();
+    gray::timer checkpoint_timer;
+    checkpoint_timer.start();
+    double time_since_checkpoint = 0.0;
+    std::size_t num_frames = 0;
+    gray::frame_pacer pacer{ctx, _frames_in_flight};
+
+    while ((_time_budget > 0.0 ? elapsed_time < _time_budget
+                               : renderer.get_total_rays_per_pixel() <
+                                     _rays_per_pixel) &&
+           !renderer.is_converged())
     {
       std::cout << "paths traced per pixel: "
                 << renderer.get_total_rays_per_pixel() << std::endl;
       renderer.render(pixels, *scene, *camera);
+      ++num_frames;
+      pacer.end_frame();
+
+      if (_time_budget > 0.0)
+      {
+        elapsed_time += render_timer.stop();
+        render_timer.start();
+      }
+
+      time_since_checkpoint += checkpoint_timer.stop();
+      checkpoint_timer.start();
+      if (!checkpoint_file.empty() &&
+          time_since_checkpoint >= _checkpoint_interval)
+      {
+        // Waits for the frames in flight, which have been traced into
+        // the saved state
+        gray::render_checkpoint checkpoint;
+        checkpoint.capture(renderer);
+        checkpoint.integrator = _integrator;
+        checkpoint.scene_hash = scene_hash;
+        checkpoint.elapsed_time = elapsed_time;
+        checkpoint.save(checkpoint_file);
+        pacer.clear();
+        time_since_checkpoint = 0.0;
+
+        std::cout << "Saved checkpoint at " << checkpoint.rays_per_pixel
+                  << " paths per pixel." << std::endl;
+      }
+    }
+
+    // A render that was resumed after its last frame has not post
+    // processed the loaded samples yet. The first pass only builds the
+    // luminance histogram for the exposure.
+    if (num_frames == 0)
+    {
+      renderer.present(pixels);
+      renderer.present(pixels);
+    }
+
+    ctx->get_command_queue().finish();
+
+    std::cout << "Done." << std::endl;
+    if (_time_budget > 0.0)
+      std::cout << "Rendered " << renderer.get_total_rays_per_pixel()
+                << " paths per pixel in " << elapsed_time << "s." << std::endl;
+
+    gray::image::save_png(_output_file, ctx, pixels, _x_resolution,
+                          _y_resolution);
+  }
+
+  /// Renders the frames of the camera path given by --animation
+  void launch_animation_renderer(
+      const std::vector<std::string>& platform_preferences) const
+  {
+    // An invalid camera path is reported before the kernels are compiled
+    gray::camera_path path = gray::camera_path::load(_animation_file);
+
+    const cl::Platform& selected_platform =
+        _environment.get_platform_by_preference(platform_preferences);
+    qcl::global_context_ptr global_ctx =
+        _environment.create_global_context(selected_platform);
+
+    print_devices(global_ctx);
+    if (global_ctx->get_num_devices() == 0)
+      throw std::runtime_error{"No devices found"};
+
+    prepare_cl(global_ctx, _integrator);
+    qcl::device_context_ptr ctx = global_ctx->device();
+
+    auto scene = create_scene(ctx, _scene_name);
+    auto camera = create_camera(ctx, _scene_name);
+
+    gray::frame_renderer renderer{ctx, get_kernel_name(_integrator),
+                                  "hdr_color_compression", _x_resolution,
+                                  _y_resolution};
+    renderer.set_sampling_mode(_sampling_mode);
+    renderer.set_tone_mapping_operator(_tone_mapping);
+    renderer.set_denoising_enabled(!_disable_denoising);
+    renderer.set_statistics_enabled(_verbose);
+    renderer.set_target_rendering_time(2.0);
+    setup_priority(renderer);
+    setup_integrator(ctx, renderer, _integrator);
+
+    gray::animation_renderer animation{ctx, renderer};
+    std::cout << "Started render of "
+              << gray::animation_renderer::get_num_frames(path,
+                                                          _frames_per_second)
+              << " frames..." << std::endl;
+    animation.render(_output_file, *scene, path, *camera, _frames_per_second,
+                     _rays_per_pixel);
+    std::cout << "Done." << std::endl;
+  }
+
+  /// \return The cameras of the views given by --views
+  /// \param base_camera The camera of the scene. Stereo views shift it
+  /// sideways, the faces of a cube map are seen from its position.
+  std::vector<gray::device_object::camera>
+  get_view_cameras(const gray::device_object::camera& base_camera) const
+  {
+    std::vector<gray::device_object::camera> views;
+    if (_views == "stereo")
+    {
+      // Parallel eyes, the left eye is the upper view
+      gray::vector3 offset =
+          0.5f * _eye_separation * base_camera.get_screen_basis1();
+      for (float side : {-1.0f, 1.0f})
+      {
+        gray::device_object::camera eye = base_camera;
+        eye.set_position(base_camera.get_position() + side * offset);
+        views.push_back(eye);
+      }
     }
+    else if (_views == "cubemap")
+    {
+      // Faces in the order +x, -x, +y, -y, +z, -z. They are seen through a
+      // pinhole with a field of view of 90 degrees, such that the faces
+      // meet without seams.
+      const std::vector<gray::vector3> directions = {
+          VECTOR3(1, 0, 0), VECTOR3(-1, 0, 0), VECTOR3(0, 1, 0),
+          VECTOR3(0, -1, 0), VECTOR3(0, 0, 1), VECTOR3(0, 0, -1)};
+      for (const gray::vector3& direction : directions)
+      {
+        gray::device_object::camera face{base_camera.get_position(), direction,
+                                         0.0f, 1.e-4f, 1.0f};
+        face.set_lens_plane_distance(0.5f);
+        views.push_back(face);
+      }
+    }
+    else
+      throw std::invalid_argument("Invalid views: " + _views);
+
+    return views;
+  }
+
+  /// Renders the views given by --views in the same launches and writes
+  /// them stacked vertically into a single image
+  void launch_multi_view_renderer(
+      const std::vector<std::string>& platform_preferences) const
+  {
+    if (_integrator != "pt")
+      throw std::invalid_argument("Views are only supported by the pt integrator");
+    if (_multi_device || _tile_size > 0 || !_checkpoint_file.empty() ||
+        !_resume_file.empty())
+      throw std::invalid_argument("Views are only supported for offline "
+                                  "renders on a single device without tiles "
+                                  "or checkpoints");
+    if (_views == "cubemap" && _x_resolution != _y_resolution)
+      throw std::invalid_argument("The faces of a cube map require a square "
+                                  "resolution");
+
+    const cl::Platform& selected_platform =
+        _environment.get_platform_by_preference(platform_preferences);
+    qcl::global_context_ptr global_ctx =
+        _environment.create_global_context(selected_platform);
+
+    print_devices(global_ctx);
+    if (global_ctx->get_num_devices() == 0)
+      throw std::runtime_error{"No devices found"};
+
+    prepare_cl(global_ctx, _integrator);
+    qcl::device_context_ptr ctx = global_ctx->device();
+
+    auto scene = create_scene(ctx, _scene_name);
+    auto camera = create_camera(ctx, _scene_name);
+    std::vector<gray::device_object::camera> views = get_view_cameras(*camera);
+
+    std::size_t image_height = views.size() * _y_resolution;
+    gray::frame_renderer renderer{ctx, "trace_paths_multiview",
+                                  "hdr_color_compression", _x_resolution,
+                                  image_height};
+    renderer.set_num_views(views.size());
+    renderer.set_sampling_mode(_sampling_mode);
+    renderer.set_tone_mapping_operator(_tone_mapping);
+    renderer.set_denoising_enabled(!_disable_denoising);
+    renderer.set_statistics_enabled(_verbose);
+    renderer.set_target_rendering_time(2.0);
+
+    cl::Image2D pixels{ctx->get_context(), CL_MEM_READ_WRITE,
+                       cl::ImageFormat{CL_RGBA, CL_UNORM_INT8}, _x_resolution,
+                       image_height};
 
+    std::cout << "Started render of " << views.size() << " views..."
+              << std::endl;
+    gray::frame_pacer pacer{ctx, _frames_in_flight};
+    while (renderer.get_total_rays_per_pixel() < _rays_per_pixel &&
+           !renderer.is_converged())
+    {
+      std::cout << "paths traced per pixel: "
+                << renderer.get_total_rays_per_pixel() << std::endl;
+      renderer.render_views(pixels, *scene, views);
+      pacer.end_frame();
+    }
     ctx->get_command_queue().finish();
+    std::cout << "Done." << std::endl;
+
+    gray::image::save_png(_output_file, ctx, pixels, _x_resolution,
+                          image_height);
+  }
+
+  void launch_multi_device_renderer() const
+  {
+    // All devices of all platforms render strips of the image
+    qcl::global_context_ptr global_ctx =
+        _environment.create_global_context(_cpu_partition);
+
+    print_devices(global_ctx);
+    if (global_ctx->get_num_devices() == 0)
+      throw std::runtime_error{"No devices found"};
+
+    prepare_cl(global_ctx, _integrator);
+
+    // The first device merges the strips and post processes the image,
+    // which should be a GPU if there is one
+    std::vector<qcl::device_context_ptr> contexts;
+    for (std::size_t i = 0; i < global_ctx->get_num_devices(); ++i)
+      contexts.push_back(global_ctx->device(i));
+    std::stable_partition(contexts.begin(), contexts.end(),
+                          [](const qcl::device_context_ptr& ctx) {
+                            return ctx->is_gpu_device();
+                          });
+
+    std::vector<std::shared_ptr<gray::frame_renderer>> renderers;
+    std::vector<std::shared_ptr<gray::device_object::scene>> scenes;
+    for (const qcl::device_context_ptr& ctx : contexts)
+    {
+      auto renderer = std::make_shared<gray::frame_renderer>(
+          ctx, get_kernel_name(_integrator), "hdr_color_compression", _x_resolution,
+          _y_resolution);
+      renderer->set_sampling_mode(_sampling_mode);
+      renderer->set_tone_mapping_operator(_tone_mapping);
+      // The other devices still write the features for the denoiser
+      renderer->set_denoising_enabled(!_disable_denoising);
+      renderer->set_statistics_enabled(_verbose);
+      renderer->set_target_rendering_time(2.0);
+      setup_priority(*renderer);
+      setup_integrator(ctx, *renderer, _integrator);
+
+      renderers.push_back(renderer);
+      scenes.push_back(create_scene(ctx, _scene_name));
+    }
+    auto camera = create_camera(contexts[0], _scene_name);
+
+    gray::multi_device_renderer renderer{renderers};
+
+    cl::Image2D pixels{contexts[0]->get_context(), CL_MEM_READ_WRITE,
+                       cl::ImageFormat{CL_RGBA, CL_UNORM_INT8}, _x_resolution,
+                       _y_resolution};
+
+    std::cout << "Started render on " << renderer.get_num_devices()
+              << " devices..." << std::endl;
+
+    gray::timer render_timer;
+    render_timer.start();
+    double elapsed_time = 0.0;
+
+    // Each frame waits for the strips of all devices, so there are
+    // no frames in flight to consider
+    while ((_time_budget > 0.0 ? elapsed_time < _time_budget
+                               : renderer.get_total_rays_per_pixel() <
+                                     _rays_per_pixel) &&
+           !renderer.is_converged())
+    {
+      std::cout << "paths traced per pixel: "
+                << renderer.get_total_rays_per_pixel() << std::endl;
+      renderer.render(pixels, scenes, *camera);
+
+      elapsed_time += render_timer.stop();
+      render_timer.start();
+    }
+
+    contexts[0]->get_command_queue().finish();
 
     std::cout << "Done." << std::endl;
+    if (_time_budget > 0.0)
+      std::cout << "Rendered " << renderer.get_total_rays_per_pixel()
+                << " paths per pixel in " << elapsed_time << "s." << std::endl;
+
+    std::cout << "Rows per device:";
+    for (std::size_t i = 0; i < renderer.get_num_devices(); ++i)
+      std::cout << " " << renderer.get_num_rows(i);
+    std::cout << std::endl;
 
-    gray::image::save_png("gray_render.png", ctx, pixels, _x_resolution,
+    gray::image::save_png(_output_file, contexts[0], pixels, _x_resolution,
                           _y_resolution);
   }
 
+  /// Renders the jobs received from a master, see \c launch_master()
+  void launch_worker(const std::vector<std::string>& platform_preferences) const
+  {
+    const cl::Platform& selected_platform =
+        _environment.get_platform_by_preference(platform_preferences);
+    qcl::global_context_ptr global_ctx =
+        _environment.create_global_context(selected_platform);
+
+    print_devices(global_ctx);
+    if (global_ctx->get_num_devices() == 0)
+      throw std::runtime_error{"No devices found"};
+
+    qcl::device_context_ptr ctx = global_ctx->device();
+    prepare_common_cl(global_ctx);
+    // The kernels of each integrator are compiled once they are needed
+    std::set<std::string> prepared_integrators;
+
+    gray::tcp_listener listener{static_cast<std::uint16_t>(_worker_port)};
+    std::cout << "Waiting for jobs on port " << _worker_port << "..."
+              << std::endl;
+
+    while (true)
+    {
+      gray::socket_connection connection = listener.accept_connection();
+      try
+      {
+        // The camera is overwritten by the received job
+        gray::render_job job{*create_camera(ctx, _scene_name)};
+        worker_renderer renderer;
+        while (true)
+        {
+          job.receive(connection);
+          if (job.width == 0 || job.height == 0)
+            throw std::runtime_error("Received job without pixels");
+
+          if (prepared_integrators.insert(job.integrator).second)
+            prepare_integrator_cl(global_ctx, job.integrator);
+
+          std::cout << "Rendering " << job.rays_per_pixel
+                    << " paths per pixel..." << std::endl;
+          run_job(ctx, job, renderer).send(connection);
+        }
+      }
+      catch (std::runtime_error& e)
+      {
+        std::cout << "Connection to master ended: " << e.what() << std::endl;
+      }
+    }
+  }
+
+  /// The renderer of a worker together with its scene. It is kept
+  /// across the jobs of a master, such that the progressive state of the
+  /// integrator extension, e.g. the photon radius, converges over all jobs.
+  struct worker_renderer
+  {
+    std::string key;
+    std::shared_ptr<gray::device_object::scene> scene;
+    std::shared_ptr<gray::frame_renderer> renderer;
+  };
+
+  gray::render_job_result run_job(const qcl::device_context_ptr& ctx,
+                                  const gray::render_job& job,
+                                  worker_renderer& cached) const
+  {
+    std::size_t width = static_cast<std::size_t>(job.width);
+    std::size_t height = static_cast<std::size_t>(job.height);
+
+    // The state of the integrator extensions depends on the scene
+    std::string key = job.scene_name + " " + job.integrator + " " +
+                      std::to_string(width) + "x" + std::to_string(height);
+    if (!cached.renderer || cached.key != key)
+    {
+      cached.key = key;
+      cached.scene = create_scene(ctx, job.scene_name);
+      cached.renderer = std::make_shared<gray::frame_renderer>(
+          ctx, get_kernel_name(job.integrator), "hdr_color_compression",
+          width, height, static_cast<std::size_t>(job.seed));
+      // The features are returned for the denoiser of the master
+      cached.renderer->set_denoising_enabled(true);
+      cached.renderer->set_target_rendering_time(2.0);
+      setup_integrator(ctx, *cached.renderer, job.integrator);
+    }
+    else
+    {
+      // Only the samples of the previous job are discarded, they
+      // have been returned to the master
+      cached.renderer->restart_samples();
+      cached.renderer->set_random_seed(static_cast<std::size_t>(job.seed));
+    }
+
+    gray::frame_renderer& renderer = *cached.renderer;
+    renderer.set_sampling_mode(job.sampling_mode);
+
+    // Only the samples are needed, the image is post processed by the master
+    gray::frame_pacer pacer{ctx, _frames_in_flight};
+    while (renderer.get_total_rays_per_pixel() < job.rays_per_pixel &&
+           !renderer.is_converged())
+    {
+      // The last frame only traces the remaining rays of the job
+      renderer.set_max_rays_per_frame(job.rays_per_pixel -
+                                      renderer.get_total_rays_per_pixel());
+      renderer.trace(*cached.scene, job.camera);
+      pacer.end_frame();
+    }
+    renderer.set_max_rays_per_frame(0);
+
+    gray::render_job_result result;
+    result.rays_per_pixel = renderer.get_total_rays_per_pixel();
+    result.sums.resize(width * height);
+    result.sample_counts.resize(width * height);
+    result.albedo.resize(width * height);
+    result.normal_depth.resize(width * height);
+
+    ctx->memcpy_d2h(result.sums.data(), renderer.get_accumulated_sums(),
+                    result.sums.size());
+    result.compensations = renderer.read_compensations(result.sums);
+    ctx->memcpy_d2h(result.sample_counts.data(), renderer.get_sample_counts(),
+                    result.sample_counts.size());
+    ctx->memcpy_d2h(result.albedo.data(), renderer.get_albedo(),
+                    result.albedo.size());
+    ctx->memcpy_d2h(result.normal_depth.data(), renderer.get_normal_depth(),
+                    result.normal_depth.size());
+    return result;
+  }
+
+  /// Distributes an offline render among workers started with --worker,
+  /// and post processes the merged samples on the local device
+  void launch_master(const std::vector<std::string>& platform_preferences) const
+  {
+    const cl::Platform& selected_platform =
+        _environment.get_platform_by_preference(platform_preferences);
+    qcl::global_context_ptr global_ctx =
+        _environment.create_global_context(selected_platform);
+
+    print_devices(global_ctx);
+    if (global_ctx->get_num_devices() == 0)
+      throw std::runtime_error{"No devices found"};
+
+    prepare_cl(global_ctx, _integrator);
+    qcl::device_context_ptr ctx = global_ctx->device();
+
+    auto camera = create_camera(ctx, _scene_name);
+    gray::render_job job{*camera};
+    job.scene_name = _scene_name;
+    job.integrator = _integrator;
+    job.width = _x_resolution;
+    job.height = _y_resolution;
+    job.sampling_mode = _sampling_mode;
+    job.rays_per_pixel = _rays_per_pixel;
+
+    gray::render_master master{_workers};
+    // By default, each worker receives several jobs, such that
+    // faster workers can take over more of the work
+    std::size_t job_size = _job_size;
+    if (job_size == 0)
+      job_size = std::max<std::size_t>(
+          1, (_rays_per_pixel + 4 * master.get_num_workers() - 1) /
+                 (4 * master.get_num_workers()));
+
+    std::cout << "Started render on " << master.get_num_workers()
+              << " workers..." << std::endl;
+    gray::render_job_result result = master.render(job, job_size);
+
+    gray::frame_renderer renderer{ctx, get_kernel_name(_integrator),
+                                  "hdr_color_compression", _x_resolution,
+                                  _y_resolution};
+    renderer.set_tone_mapping_operator(_tone_mapping);
+    renderer.set_denoising_enabled(!_disable_denoising);
+    renderer.set_statistics_enabled(_verbose);
+    renderer.load_samples(result.sums, result.sample_counts, result.albedo,
+                          result.normal_depth,
+                          static_cast<std::size_t>(result.rays_per_pixel));
+
+    cl::Image2D pixels{ctx->get_context(), CL_MEM_READ_WRITE,
+                       cl::ImageFormat{CL_RGBA, CL_UNORM_INT8}, _x_resolution,
+                       _y_resolution};
+    // The first pass only builds the luminance histogram for the exposure
+    renderer.present(pixels);
+    renderer.present(pixels);
+    ctx->get_command_queue().finish();
+
+    std::cout << "Done. Rendered " << result.rays_per_pixel
+              << " paths per pixel." << std::endl;
+
+    gray::image::save_png(_output_file, ctx, pixels, _x_resolution,
+                          _y_resolution);
+  }
+
+  /// A renderer of the render service together with its output image
+  struct service_renderer
+  {
+    std::shared_ptr<gray::frame_renderer> renderer;
+    std::shared_ptr<cl::Image2D> pixels;
+  };
+
+  using scene_cache =
+      gray::resource_cache<std::uint64_t, gray::device_object::scene>;
+  using renderer_cache = gray::resource_cache<std::string, service_renderer>;
+
+  /// Renders the jobs that local clients submit with --submit. The
+  /// context, the compiled kernels, the uploaded scenes and the renderers
+  /// are kept between jobs, such that small jobs start right away.
+  void launch_daemon(const std::vector<std::string>& platform_preferences) const
+  {
+    const cl::Platform& selected_platform =
+        _environment.get_platform_by_preference(platform_preferences);
+    qcl::global_context_ptr global_ctx =
+        _environment.create_global_context(selected_platform);
+
+    print_devices(global_ctx);
+    if (global_ctx->get_num_devices() == 0)
+      throw std::runtime_error{"No devices found"};
+
+    // All kernels are compiled up front, such that no job waits for
+    // a compilation
+    prepare_common_cl(global_ctx);
+    for (const std::string& integrator : get_integrator_names())
+      prepare_integrator_cl(global_ctx, integrator);
+    qcl::device_context_ptr ctx = global_ctx->device();
+
+    gray::file_hash_cache file_hashes;
+    scene_cache scenes{4};
+    renderer_cache renderers{4};
+
+    gray::render_service service{_daemon_socket,
+                                 *create_camera(ctx, _scene_name)};
+    std::cout << "Waiting for jobs on " << _daemon_socket << "..."
+              << std::endl;
+
+    while (true)
+    {
+      gray::queued_job queued = service.next_job();
+
+      gray::service_reply reply;
+      reply.queue_time = queued.queue_timer.stop();
+
+      gray::timer job_timer;
+      job_timer.start();
+      try
+      {
+        run_service_job(ctx, queued.job, file_hashes, scenes, renderers);
+        reply.is_successful = 1;
+      }
+      catch (std::exception& e)
+      {
+        // A failed job must not end the service
+        reply.message = e.what();
+        std::cout << "Job failed: " << e.what() << std::endl;
+      }
+      reply.render_time = job_timer.stop();
+
+      std::cout << "Finished job for " << queued.job.output_file << " in "
+                << reply.render_time << "s, "
+                << service.get_num_queued_jobs() << " job(s) queued"
+                << std::endl;
+      gray::render_service::reply(queued, reply);
+    }
+  }
+
+  void run_service_job(const qcl::device_context_ptr& ctx,
+                       const gray::service_job& job,
+                       gray::file_hash_cache& file_hashes,
+                       scene_cache& scenes,
+                       renderer_cache& renderers) const
+  {
+    const gray::render_job& render = job.render;
+    const std::vector<std::string>& integrators = get_integrator_names();
+    if (std::find(integrators.begin(), integrators.end(), render.integrator) ==
+        integrators.end())
+      throw std::runtime_error("Invalid integrator: " + render.integrator);
+    if (render.width == 0 || render.height == 0 || render.rays_per_pixel == 0)
+      throw std::runtime_error("Received job without pixels or rays");
+
+    // A scene is rebuilt once one of its textures changes
+    std::uint64_t scene_key = get_scene_hash(render.scene_name, file_hashes);
+
+    std::shared_ptr<gray::device_object::scene> scene = scenes.find(scene_key);
+    if (!scene)
+    {
+      std::cout << "Uploading scene " << render.scene_name << "..."
+                << std::endl;
+      scene = create_scene(ctx, render.scene_name);
+      scenes.insert(scene_key, scene);
+    }
+
+    std::size_t width = static_cast<std::size_t>(render.width);
+    std::size_t height = static_cast<std::size_t>(render.height);
+
+    // The state of the integrator extensions depends on the scene
+    std::string renderer_key = render.integrator + " " +
+                               std::to_string(width) + "x" +
+                               std::to_string(height) + " " +
+                               std::to_string(scene_key);
+    std::shared_ptr<service_renderer> cached = renderers.find(renderer_key);
+    if (!cached)
+    {
+      cached = std::make_shared<service_renderer>();
+      cached->renderer = std::make_shared<gray::frame_renderer>(
+          ctx, get_kernel_name(render.integrator), "hdr_color_compression",
+          width, height);
+      cached->renderer->set_target_rendering_time(2.0);
+      cached->renderer->set_statistics_enabled(_verbose);
+      setup_integrator(ctx, *cached->renderer, render.integrator);
+      cached->pixels = std::make_shared<cl::Image2D>(
+          ctx->get_context(), CL_MEM_READ_WRITE,
+          cl::ImageFormat{CL_RGBA, CL_UNORM_INT8}, width, height);
+      renderers.insert(renderer_key, cached);
+    }
+    else
+    {
+      // The image must not depend on the previous jobs
+      cached->renderer->reset_accumulation();
+      cached->renderer->reset_exposure();
+    }
+
+    gray::frame_renderer& renderer = *cached->renderer;
+    renderer.set_sampling_mode(render.sampling_mode);
+    renderer.set_tone_mapping_operator(job.tone_mapping);
+    renderer.set_denoising_enabled(job.is_denoising_enabled != 0);
+
+    gray::frame_pacer pacer{ctx, _frames_in_flight};
+    while (renderer.get_total_rays_per_pixel() < render.rays_per_pixel &&
+           !renderer.is_converged())
+    {
+      renderer.trace(*scene, render.camera);
+      pacer.end_frame();
+    }
+
+    // The first pass only builds the luminance histogram for the exposure
+    renderer.present(*cached->pixels);
+    renderer.present(*cached->pixels);
+    ctx->get_command_queue().finish();
+
+    gray::image::save_png(job.output_file, ctx, *cached->pixels, width,
+                          height);
+  }
+
+  /// Submits the render described by the arguments to a service started
+  /// with --daemon and waits until it has been written
+  void submit_job() const
+  {
+    // The camera does not depend on a device
+    gray::service_job job{*create_camera(nullptr, _scene_name)};
+    job.render.scene_name = _scene_name;
+    job.render.integrator = _integrator;
+    job.render.width = _x_resolution;
+    job.render.height = _y_resolution;
+    job.render.sampling_mode = _sampling_mode;
+    job.render.rays_per_pixel = _rays_per_pixel;
+    job.tone_mapping = _tone_mapping;
+    job.is_denoising_enabled = _disable_denoising ? 0 : 1;
+
+    // The service resolves relative paths in its own working directory
+    job.output_file = _output_file;
+    if (job.output_file.empty() || job.output_file[0] != '/')
+    {
+      std::vector<char> working_directory(4096);
+      if (getcwd(working_directory.data(), working_directory.size()) == nullptr)
+        throw std::runtime_error("Could not determine working directory");
+      job.output_file = std::string{working_directory.data()} + "/" +
+                        job.output_file;
+    }
+
+    gray::socket_connection service =
+        gray::socket_connection::connect_to_unix(_submit_socket);
+    job.send(service);
+
+    gray::service_reply reply;
+    reply.receive(service);
+    if (!reply.is_successful)
+      throw std::runtime_error("Render failed: " + reply.message);
+
+    std::cout << "Rendered " << job.output_file << " in " << reply.render_time
+              << "s after " << reply.queue_time << "s in the queue."
+              << std::endl;
+  }
+
   bool
   launch_realtime_renderer(const std::vector<std::string>& platform_preferences,
                            bool gl_sharing = true) const
@@ -332,29 +1623,42 @@ private:
     print_devices(global_ctx);
     if (global_ctx->get_num_devices() > 0)
     {
-      prepare_cl(global_ctx);
+      prepare_cl(global_ctx, _integrator);
 
       qcl::device_context_ptr ctx = global_ctx->device();
 
       // Create OpenGL <-> OpenCL interoperability
       auto cl_gl_interop =
-          cl_gl{&(gl_renderer::instance()), ctx->get_context(), gl_sharing};
+          cl_gl{&(gl_renderer::instance()), ctx->get_context(), gl_sharing,
+                _frames_in_flight};
 
       // Create scene
-      auto scene = setup_scene(ctx);
-      auto camera = setup_camera(ctx);
+      auto scene = create_scene(ctx, _scene_name);
+      auto camera = create_camera(ctx, _scene_name);
 
       // Create and launch rendering engine
       auto realtime_renderer = gray::realtime_window_renderer{
-          ctx, &cl_gl_interop, scene.get(), camera.get()};
+          ctx, &cl_gl_interop, scene.get(), camera.get(), get_kernel_name(_integrator)};
 
       realtime_renderer.get_render_engine().set_target_fps(20.0);
+      realtime_renderer.get_render_engine().set_sampling_mode(_sampling_mode);
+      realtime_renderer.get_render_engine().set_tone_mapping_operator(_tone_mapping);
+      realtime_renderer.get_render_engine().set_denoising_enabled(!_disable_denoising);
+      realtime_renderer.get_render_engine().set_statistics_enabled(_verbose);
+      realtime_renderer.get_render_engine().set_reprojection_enabled(!_disable_reprojection);
+      setup_priority(realtime_renderer.get_render_engine());
+      if (!_disable_preview)
+        realtime_renderer.get_render_engine().set_preview_kernel("trace_paths_preview");
+      setup_integrator(ctx, realtime_renderer.get_render_engine(),
+                       _integrator);
 
       gray::input_handler input;
       realtime_renderer.launch();
       gray::interactive_camera_control cam_controller(input, camera.get(),
                                                       &realtime_renderer);
       gray::interactive_program_control program_controller(input);
+      gray::interactive_priority_control priority_controller(input,
+                                                             &realtime_renderer);
       gl_renderer::instance().render_loop();
 
       return true;
@@ -366,6 +1670,35 @@ private:
   std::size_t _x_resolution;
   std::size_t _y_resolution;
   std::size_t _rays_per_pixel;
+  portable_int _sampling_mode;
+  portable_int _tone_mapping;
+  std::string _integrator;
+  std::string _scene_name;
+  double _time_budget;
+  std::string _output_file;
+  bool _disable_denoising;
+  bool _disable_reprojection;
+  bool _use_roi;
+  std::array<int, 4> _roi;
+  bool _disable_preview;
+  // Prints the statistics of each frame
+  bool _verbose;
+  std::size_t _frames_in_flight;
+  std::size_t _tile_size;
+  bool _multi_device;
+  std::vector<cl_device_partition_property> _cpu_partition;
+  std::size_t _worker_port;
+  std::vector<std::string> _workers;
+  std::size_t _job_size;
+  std::string _daemon_socket;
+  std::string _submit_socket;
+  std::string _animation_file;
+  double _frames_per_second;
+  std::string _checkpoint_file;
+  double _checkpoint_interval;
+  std::string _resume_file;
+  std::string _views;
+  float _eye_separation;
   int _argc;
   char** _argv;
 };
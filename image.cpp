@@ -75,6 +75,13 @@ void image::save_png(const std::string& filename,
   save_png(filename, pixels, width, height, 4, false);
 }
 
+void image::save_rgba_png(const std::string& filename,
+                          const std::vector<unsigned char>& pixels,
+                          std::size_t width, std::size_t height)
+{
+  save_png(filename, pixels, width, height, 4, false);
+}
+
 void image::initialize(int argc, char** argv)
 {
   Magick::InitializeMagick(*argv);
@@ -61,6 +61,12 @@ public:
                        const cl::Image2D& img, std::size_t width,
                        std::size_t height);
 
+  /// Writes RGBA pixels that have been read from an OpenCL image,
+  /// the first row being the top row of the image
+  static void save_rgba_png(const std::string& filename,
+                            const std::vector<unsigned char>& pixels,
+                            std::size_t width, std::size_t height);
+
 private:
   static void save_png(const std::string& filename,
                        const std::vector<unsigned char>& pixels,
@@ -0,0 +1,66 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INTEGRATOR_EXTENSION_HPP
+#define INTEGRATOR_EXTENSION_HPP
+
+#include "qcl.hpp"
+#include "scene.hpp"
+
+namespace gray {
+
+/// Interface for extensions of the path tracer that require additional
+/// passes before each frame and additional kernel arguments. The kernel
+/// variant used with an extension must declare the arguments after
+/// SCENE_KERNEL_ARGUMENTS.
+class integrator_extension
+{
+public:
+  virtual ~integrator_extension(){}
+
+  /// Enqueues the work that must be done before the path tracing kernel
+  /// of a frame is executed.
+  /// \param s The scene
+  virtual void prepare_frame(const device_object::scene& s) = 0;
+
+  /// Passes the additional arguments to the path tracing kernel
+  /// \param arguments The argument list of the path tracing kernel, after the
+  /// scene arguments have been pushed.
+  virtual void push_kernel_arguments(qcl::kernel_argument_list& arguments) const = 0;
+
+  /// Called when the render results are discarded, e.g. because
+  /// the camera has moved.
+  virtual void reset() = 0;
+
+  /// \return Whether the extension renders differently while the user
+  /// interacts with the renderer. If so, the frames rendered during the
+  /// interaction are discarded once it has ended.
+  virtual bool has_interactive_mode() const
+  { return false; }
+
+  /// Called before each frame to inform the extension whether the user
+  /// currently interacts with the renderer, e.g. by moving the camera.
+  /// Extensions may then trade accuracy for speed.
+  /// \param interactive Whether the user interacts with the renderer
+  virtual void set_interactive(bool interactive)
+  {}
+};
+
+}
+
+#endif
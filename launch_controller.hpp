@@ -0,0 +1,271 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LAUNCH_CONTROLLER_HPP
+#define LAUNCH_CONTROLLER_HPP
+
+#include "qcl.hpp"
+#include "timer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <vector>
+
+namespace gray {
+
+/// Decides how many rays per pixel are traced in a frame, and how they
+/// are split into several launches of the path tracer. The decision is
+/// based on the execution times of previous launches as measured by the
+/// device, which requires a command queue with profiling enabled. Without
+/// device timings, the first estimate is obtained by waiting for the first
+/// launch, and is refined by the host time of the frames afterwards. Host
+/// times are only meaningful once the host is paced by the device, before
+/// that they merely measure how long it takes to enqueue a frame.
+/// No launch exceeds the maximum launch time, such that long frames do
+/// not run into the timeouts of display drivers.
+class launch_controller
+{
+public:
+  enum class policy
+  {
+    /// Leaves headroom below the target frame time and follows changes
+    /// of the cost of the rays quickly, for rendering while the user
+    /// interacts
+    latency,
+    /// Fills the target frame time and smooths the measurements, for
+    /// refining the image while idle or offline
+    throughput
+  };
+
+  launch_controller()
+  : _target_frame_time{1.0 / 24.0},
+    _max_launch_time{0.1},
+    _policy{policy::throughput},
+    _time_per_ray{0.0},
+    _has_device_timings{false},
+    _previous_rays_per_pixel{1},
+    _has_seed_launch{false}
+  {}
+
+  void set_target_frame_time(double time)
+  {
+    assert(time > 0.0);
+    _target_frame_time = time;
+  }
+
+  double get_target_frame_time() const
+  {
+    return _target_frame_time;
+  }
+
+  /// Sets the device time after which a launch should have finished
+  void set_max_launch_time(double time)
+  {
+    assert(time > 0.0);
+    _max_launch_time = time;
+  }
+
+  double get_max_launch_time() const
+  {
+    return _max_launch_time;
+  }
+
+  void set_policy(policy p)
+  {
+    _policy = p;
+  }
+
+  policy get_policy() const
+  {
+    return _policy;
+  }
+
+  /// \return The estimated device time per ray in seconds, or 0 if nothing
+  /// has been measured yet
+  double get_time_per_ray() const
+  {
+    return _time_per_ray;
+  }
+
+  /// Registers a launch of the path tracer. Its execution time is taken
+  /// into account once it has completed, without waiting for it.
+  /// \param event The event of the launch
+  /// \param num_rays The number of rays traced by the launch
+  void add_launch(const cl::Event& event, std::size_t num_rays)
+  {
+    _pending_launches.push_back(pending_launch{event, num_rays});
+
+    // Without any estimate, the host time until the first launch has
+    // completed is measured
+    if(_time_per_ray <= 0.0 && !_has_seed_launch)
+    {
+      _seed_launch = _pending_launches.back();
+      _has_seed_launch = true;
+      _seed_timer.start();
+    }
+  }
+
+  /// Registers the host time of a frame, which refines the estimate as
+  /// long as the device does not provide timings. It is ignored until an
+  /// estimate has been obtained from a completed launch.
+  /// \param time The time between the start of this and the previous frame
+  /// \param num_rays The number of rays traced in the frame
+  void add_frame_time(double time, std::size_t num_rays)
+  {
+    if(!_has_device_timings && _time_per_ray > 0.0 && num_rays > 0)
+      update_estimate(time / static_cast<double>(num_rays));
+  }
+
+  /// Plans the launches of the next frame
+  /// \param num_pixels The number of pixels that are traced
+  /// \return The number of rays per pixel of each launch
+  std::vector<std::size_t> plan_frame(std::size_t num_pixels)
+  {
+    collect_device_timings();
+    if(_time_per_ray <= 0.0 && _has_seed_launch)
+      seed_estimate();
+
+    std::size_t rays_per_pixel = 1;
+    std::size_t rays_per_launch = 1;
+    if(_time_per_ray > 0.0 && num_pixels > 0)
+    {
+      double time_per_pass = _time_per_ray * static_cast<double>(num_pixels);
+
+      double budget = _target_frame_time;
+      if(_policy == policy::latency)
+        budget *= 0.8;
+      rays_per_pixel = to_num_rays(budget / time_per_pass);
+
+      // The estimate may stem from a cheaper view, hence the number of rays
+      // is only increased gradually. Decreasing it happens immediately.
+      std::size_t max_rays_per_pixel = _policy == policy::latency ?
+                                         _previous_rays_per_pixel * 3 / 2 :
+                                         _previous_rays_per_pixel * 2;
+      max_rays_per_pixel = std::max(max_rays_per_pixel, _previous_rays_per_pixel + 1);
+      rays_per_pixel = std::min(rays_per_pixel, max_rays_per_pixel);
+
+      rays_per_launch = std::min(to_num_rays(_max_launch_time / time_per_pass),
+                                 rays_per_pixel);
+    }
+    _previous_rays_per_pixel = rays_per_pixel;
+
+    // Distribute the rays evenly among the launches
+    std::size_t num_launches = (rays_per_pixel + rays_per_launch - 1) / rays_per_launch;
+    std::vector<std::size_t> launches(num_launches, rays_per_pixel / num_launches);
+    for(std::size_t i = 0; i < rays_per_pixel % num_launches; ++i)
+      ++launches[i];
+
+    return launches;
+  }
+
+  /// Limits the number of rays of the next frame, e.g. if the resolution
+  /// is reduced. Plans following frames as if this number had been used.
+  void override_rays_per_pixel(std::size_t rays_per_pixel)
+  {
+    _previous_rays_per_pixel = rays_per_pixel;
+  }
+
+private:
+  struct pending_launch
+  {
+    cl::Event event;
+    std::size_t num_rays;
+  };
+
+  static std::size_t to_num_rays(double num_rays)
+  {
+    if(!(num_rays >= 1.0))
+      return 1;
+    return static_cast<std::size_t>(std::floor(num_rays));
+  }
+
+  /// Takes the timings of all launches into account that have completed.
+  /// Since the launches are executed in order, the first incomplete
+  /// launch ends the search.
+  void collect_device_timings()
+  {
+    while(!_pending_launches.empty())
+    {
+      const pending_launch& launch = _pending_launches.front();
+
+      cl_int status;
+      cl_int err = launch.event.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &status);
+      if(err == CL_SUCCESS && status > CL_COMPLETE)
+        break;
+
+      cl_ulong start = 0;
+      cl_ulong end = 0;
+      // Negative status values indicate a failed launch
+      if(err == CL_SUCCESS && status == CL_COMPLETE &&
+         launch.event.getProfilingInfo(CL_PROFILING_COMMAND_START, &start) == CL_SUCCESS &&
+         launch.event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end) == CL_SUCCESS &&
+         end > start && launch.num_rays > 0)
+      {
+        _has_device_timings = true;
+        update_estimate(1.e-9 * static_cast<double>(end - start)
+                        / static_cast<double>(launch.num_rays));
+      }
+      _pending_launches.pop_front();
+    }
+  }
+
+  /// Waits for the first launch and derives the first estimate from it.
+  /// Without device timings, the host time since the launch was enqueued
+  /// is used, which overestimates the execution time and hence errs on
+  /// the side of short launches.
+  void seed_estimate()
+  {
+    cl_int err = _seed_launch.event.wait();
+    double host_time = _seed_timer.stop();
+    _has_seed_launch = false;
+
+    collect_device_timings();
+    if(err == CL_SUCCESS && _time_per_ray <= 0.0 && _seed_launch.num_rays > 0)
+      update_estimate(host_time / static_cast<double>(_seed_launch.num_rays));
+  }
+
+  void update_estimate(double time_per_ray)
+  {
+    double weight = _policy == policy::latency ? 0.5 : 0.2;
+    if(_time_per_ray <= 0.0)
+      _time_per_ray = time_per_ray;
+    else
+      _time_per_ray += weight * (time_per_ray - _time_per_ray);
+  }
+
+  double _target_frame_time;
+  double _max_launch_time;
+  policy _policy;
+
+  double _time_per_ray;
+  bool _has_device_timings;
+  std::size_t _previous_rays_per_pixel;
+
+  // The launch from which the first estimate is obtained
+  pending_launch _seed_launch;
+  bool _has_seed_launch;
+  timer _seed_timer;
+
+  std::deque<pending_launch> _pending_launches;
+};
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace gray {
+
+/// A file of a given size that is mapped into memory, such that data
+/// larger than the main memory can be written. Pages that have been
+/// written are flushed to the file by the operating system.
+class mapped_file
+{
+public:
+  /// Creates or truncates the file and maps it
+  /// \param filename The path of the file
+  /// \param size The size of the file in bytes
+  mapped_file(const std::string& filename, std::size_t size)
+  : _filename{filename}, _size{size}, _data{nullptr}
+  {
+    _file = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(_file < 0)
+      throw std::runtime_error("Could not open file "+filename);
+
+    if(ftruncate(_file, static_cast<off_t>(size)) != 0)
+    {
+      close(_file);
+      throw std::runtime_error("Could not resize file "+filename);
+    }
+
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _file, 0);
+    if(data == MAP_FAILED)
+    {
+      close(_file);
+      throw std::runtime_error("Could not map file "+filename);
+    }
+    _data = static_cast<unsigned char*>(data);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  ~mapped_file()
+  {
+    munmap(_data, _size);
+    close(_file);
+  }
+
+  /// Writes the modified pages to the file
+  void flush()
+  {
+    if(msync(_data, _size, MS_SYNC) != 0)
+      throw std::runtime_error("Could not write file "+_filename);
+  }
+
+  /// Removes the file once it is no longer mapped, for scratch data
+  void remove_when_closed()
+  {
+    unlink(_filename.c_str());
+  }
+
+  unsigned char* data()
+  {
+    return _data;
+  }
+
+  const unsigned char* data() const
+  {
+    return _data;
+  }
+
+  std::size_t size() const
+  {
+    return _size;
+  }
+
+private:
+  std::string _filename;
+  std::size_t _size;
+  int _file;
+  unsigned char* _data;
+};
+
+}
+
+#endif
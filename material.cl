@@ -183,11 +183,16 @@ vector3 material_reflect(const material* ctx,
   return outgoing;
 }
 
-void material_propagate_ray(const material* ctx,
-                            const path_vertex* impact,
-                            random_ctx* rand,
-                            ray* r)
+/// Scatters a ray at a path vertex by sampling a microfacet normal
+/// and reflecting or refracting the ray.
+/// \return 1 if the ray has been reflected, 0 if it has been refracted
+int material_propagate_ray(const material* ctx,
+                           const path_vertex* impact,
+                           random_ctx* rand,
+                           ray* r)
 {
+  int reflected = 1;
+
   
   scalar refraction_idx_n1 = impact->material_from.refraction_index;
   scalar refraction_idx_n2 = impact->material_to.refraction_index;
@@ -243,11 +248,77 @@ void material_propagate_ray(const material* ctx,
     else
     {
       r->direction = refracted_direction;
+      reflected = 0;
     }
   }
 
   r->origin_vertex = *impact;
   r->origin_vertex.position += self_shadowing_epsilon * r->direction;
+
+  return reflected;
+}
+
+/// \return The probability density (with respect to solid angle) with which
+/// \c material_propagate_ray reflects an incoming ray into a given direction.
+/// Refracted rays are not taken into account.
+/// \param ctx The material
+/// \param impact The path vertex at which the ray is scattered
+/// \param incident The direction of the incoming ray
+/// \param outgoing The direction of the reflected ray
+scalar material_reflection_pdf(const material* ctx,
+                               const path_vertex* impact,
+                               vector3 incident,
+                               vector3 outgoing)
+{
+  vector3 facing_normal = path_vertex_get_facing_normal(impact, incident);
+
+  // The microfacet normal that reflects incident into outgoing
+  vector3 half_vector = outgoing - incident;
+  scalar half_vector_length2 = dot(half_vector, half_vector);
+  if(half_vector_length2 == 0.f)
+    return 0.f;
+  half_vector *= rsqrt(half_vector_length2);
+
+  scalar cos_theta_h = dot(half_vector, facing_normal);
+  if(cos_theta_h <= 0.f)
+    return 0.f;
+
+  // Beckmann distribution, sampled with pdf D(h) * cos(theta_h)
+  scalar cos_theta_h2 = cos_theta_h * cos_theta_h;
+  scalar tan_theta_h2 = (1.f - cos_theta_h2) / cos_theta_h2;
+  scalar roughness2 = ctx->roughness * ctx->roughness;
+  scalar normal_pdf = exp(-tan_theta_h2 / roughness2)
+                    / (M_PI_F * roughness2 * cos_theta_h2 * cos_theta_h);
+
+  // Jacobian of the reflection about the microfacet normal
+  scalar direction_pdf = normal_pdf / (4.f * fabs(dot(outgoing, half_vector)));
+
+  // Probability that the ray is reflected instead of refracted,
+  // evaluated in the same way as in material_propagate_ray
+  scalar refraction_idx_n1 = impact->material_from.refraction_index;
+  scalar refraction_idx_n2 = impact->material_to.refraction_index;
+
+  vector3 refracted_direction = incident;
+  int total_reflection = !material_refract(ctx,
+                                           half_vector,
+                                           incident,
+                                           refraction_idx_n1, refraction_idx_n2,
+                                           &refracted_direction);
+
+  scalar cos_theta_incident = fabs(dot(impact->normal, incident));
+  scalar cos_theta_transmitted = fabs(dot(impact->normal, refracted_direction));
+
+  scalar fresnel_reflectance = material_fresnel_reflectance(ctx,
+                                                            cos_theta_incident,
+                                                            cos_theta_transmitted,
+                                                            refraction_idx_n1,
+                                                            refraction_idx_n2,
+                                                            total_reflection);
+
+  scalar reflection_probability = (1.f - ctx->transmittance)
+                                + ctx->transmittance * fresnel_reflectance;
+
+  return reflection_probability * direction_pdf;
 }
 
 #endif /* MATERIAL_CL */
@@ -21,6 +21,10 @@
 #define MATERIAL_MAP_HPP
 
 #include <cassert>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <limits>
 #include "qcl.hpp"
 #include "types.hpp"
 #include "common.cl_hpp"
@@ -135,9 +139,22 @@ class material_db
 public:
 
   material_db(const qcl::const_device_context_ptr& ctx)
-  : _ctx{ctx}
+  : _environment_texture{-1},
+    _environment_width{0},
+    _environment_height{0},
+    _ctx{ctx}
   {}
 
+  /// Sets the texture of the surrounding environment. During \c transfer_data(),
+  /// a luminance distribution will be calculated from this texture that allows
+  /// the path tracer to sample the environment as a light source.
+  /// \param tex The texture of the background material. The x axis of the
+  /// texture corresponds to the azimuthal, the y axis to the polar angle.
+  void set_environment_texture(texture_id tex)
+  {
+    _environment_texture = tex;
+  }
+
   /// Allocate a new material map - prepares a fresh material_db if \c purge_host_memory()
   /// has been called. 
   texture_id allocate_texture(std::size_t width, std::size_t height)
@@ -222,6 +239,35 @@ public:
     return _offsets;
   }
 
+  /// \return The cumulative distribution of the rows (polar angles)
+  /// of the environment texture
+  const cl::Buffer& get_environment_marginal_cdf() const
+  {
+    return _environment_marginal_cdf;
+  }
+
+  /// \return The cumulative distributions of the texels within each row
+  /// of the environment texture. The distribution of row \c y starts
+  /// at index \c y*width.
+  const cl::Buffer& get_environment_conditional_cdf() const
+  {
+    return _environment_conditional_cdf;
+  }
+
+  /// \return The width of the environment distribution, or 0 if the environment
+  /// cannot be sampled
+  cl_int get_environment_width() const
+  {
+    return _environment_width;
+  }
+
+  /// \return The height of the environment distribution, or 0 if the environment
+  /// cannot be sampled
+  cl_int get_environment_height() const
+  {
+    return _environment_height;
+  }
+
   void transfer_data()
   {
     if (this->_num_textures == 0)
@@ -244,6 +290,8 @@ public:
     _ctx->create_input_buffer<cl_ulong>(_offsets,
                                         _host_offsets.size(),
                                         _host_offsets.data());
+
+    transfer_environment_distribution();
   }
 
   /// Purge host memory. Materials already committed to
@@ -259,6 +307,48 @@ public:
   }
 
 
+  /// \return The luminance of the light emitted by a material,
+  /// averaged over its emission texture
+  scalar get_average_emitted_luminance(material_id index)
+  {
+    assert(static_cast<std::size_t>(index) < _host_materials.size());
+
+    texture_accessor emission = access_texture(
+          _host_materials[index].emitted_ligt_texture_id);
+
+    double luminance = 0.0;
+    for(std::size_t x = 0; x < emission.get_width(); ++x)
+      for(std::size_t y = 0; y < emission.get_height(); ++y)
+      {
+        const float4& texel = emission.read(x, y);
+        luminance += 0.2126 * texel.s[0]
+                   + 0.7152 * texel.s[1]
+                   + 0.0722 * texel.s[2];
+      }
+
+    std::size_t num_texels = emission.get_width() * emission.get_height();
+    if(num_texels == 0)
+      return 0.0f;
+
+    return static_cast<scalar>(luminance / static_cast<double>(num_texels));
+  }
+
+  /// \return The smallest roughness of a material
+  scalar get_min_roughness(material_id index)
+  {
+    assert(static_cast<std::size_t>(index) < _host_materials.size());
+
+    texture_accessor properties = access_texture(
+          _host_materials[index].transmittance_refraction_roughness_texture_id);
+
+    scalar min_roughness = std::numeric_limits<scalar>::max();
+    for(std::size_t x = 0; x < properties.get_width(); ++x)
+      for(std::size_t y = 0; y < properties.get_height(); ++y)
+        min_roughness = std::min(min_roughness, properties.read(x, y).s[2]);
+
+    return min_roughness;
+  }
+
   texture_accessor access_texture(texture_id tex)
   {
     cl_ulong offset = _host_offsets[static_cast<std::size_t>(tex)];
@@ -269,6 +359,78 @@ public:
 
 private:
 
+  /// Calculates the marginal and conditional cumulative distributions of the
+  /// luminance of the environment texture and transfers them to the device.
+  /// Each texel is weighted with the sine of its polar angle to account for
+  /// the distortion of the spherical mapping.
+  void transfer_environment_distribution()
+  {
+    _environment_width = 0;
+    _environment_height = 0;
+
+    if(_environment_texture < 0 || _environment_texture >= _num_textures)
+      return;
+
+    texture_accessor environment = access_texture(_environment_texture);
+    std::size_t width = environment.get_width();
+    std::size_t height = environment.get_height();
+
+    std::vector<scalar> marginal_cdf(height);
+    std::vector<scalar> conditional_cdf(width * height);
+
+    double total_weight = 0.0;
+    for(std::size_t y = 0; y < height; ++y)
+    {
+      double sin_theta = std::sin(M_PI * (static_cast<double>(y) + 0.5)
+                                       / static_cast<double>(height));
+
+      double row_weight = 0.0;
+      for(std::size_t x = 0; x < width; ++x)
+      {
+        const float4& texel = environment.read(x, y);
+        double luminance = 0.2126 * texel.s[0]
+                         + 0.7152 * texel.s[1]
+                         + 0.0722 * texel.s[2];
+
+        row_weight += std::max(luminance, 0.0) * sin_theta;
+        conditional_cdf[y * width + x] = static_cast<scalar>(row_weight);
+      }
+
+      for(std::size_t x = 0; x < width; ++x)
+      {
+        scalar& cdf = conditional_cdf[y * width + x];
+        if(row_weight > 0.0)
+          cdf = static_cast<scalar>(cdf / row_weight);
+        else
+          // Rows without any light will never be selected,
+          // but we still need a valid distribution
+          cdf = static_cast<scalar>(x + 1) / static_cast<scalar>(width);
+      }
+      conditional_cdf[y * width + width - 1] = 1.0f;
+
+      total_weight += row_weight;
+      marginal_cdf[y] = static_cast<scalar>(total_weight);
+    }
+
+    if(total_weight <= 0.0)
+      // The environment does not emit any light
+      return;
+
+    for(scalar& cdf : marginal_cdf)
+      cdf = static_cast<scalar>(cdf / total_weight);
+    marginal_cdf.back() = 1.0f;
+
+    _ctx->create_input_buffer<scalar>(_environment_marginal_cdf,
+                                      marginal_cdf.size(),
+                                      marginal_cdf.data());
+    _ctx->create_input_buffer<scalar>(_environment_conditional_cdf,
+                                      conditional_cdf.size(),
+                                      conditional_cdf.data());
+
+    _environment_width = static_cast<cl_int>(width);
+    _environment_height = static_cast<cl_int>(height);
+  }
+
   std::vector<float4> _host_data_buffer;
   std::vector<material_db_entry> _host_materials;
   std::vector<cl_int> _host_widths;
@@ -282,6 +444,12 @@ private:
   int _num_textures;
   cl::Buffer _offsets;
 
+  texture_id _environment_texture;
+  cl::Buffer _environment_marginal_cdf;
+  cl::Buffer _environment_conditional_cdf;
+  cl_int _environment_width;
+  cl_int _environment_height;
+
   qcl::const_device_context_ptr _ctx;
 };
 
@@ -0,0 +1,319 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MULTI_DEVICE_RENDERER_HPP
+#define MULTI_DEVICE_RENDERER_HPP
+
+#include "frame_renderer.hpp"
+#include "scene.hpp"
+#include "qcl.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+namespace gray {
+
+/// Renders each frame on several devices. The image is split into
+/// horizontal strips, one per device, the heights of which are
+/// rebalanced before each frame according to the measured time per ray
+/// of the devices, such that all strips receive about the same number
+/// of rays per pixel.
+///
+/// The first device holds the accumulated image. The other devices
+/// start from zero samples in each frame, and the samples they have traced
+/// in their strip are added to the accumulated image of the first device,
+/// which then post processes the whole image. Since the samples are merged
+/// per pixel, a row may be traced by different devices in different frames.
+class multi_device_renderer
+{
+public:
+  /// \param renderers One frame renderer per device, all with the same
+  /// resolution. The first one merges the samples and post processes
+  /// the image.
+  explicit multi_device_renderer(const std::vector<std::shared_ptr<frame_renderer>>& renderers)
+  : _width{0}, _height{0}, _total_rays_per_pixel{0.0}
+  {
+    assert(!renderers.empty());
+
+    _main_ctx = renderers[0]->get_cl_context();
+    _width = renderers[0]->get_resolution_width();
+    _height = renderers[0]->get_resolution_height();
+    // Each device traces at least one group of rows
+    assert((_height + row_granularity - 1) / row_granularity >= renderers.size());
+
+    _strips.resize(renderers.size());
+    for(std::size_t i = 0; i < renderers.size(); ++i)
+    {
+      assert(renderers[i]->get_resolution_width() == _width);
+      assert(renderers[i]->get_resolution_height() == _height);
+      _strips[i].renderer = renderers[i];
+      _strips[i].begin = 0;
+      _strips[i].end = 0;
+    }
+
+    std::size_t num_pixels = _width * _height;
+    _main_ctx->create_buffer<cl_float4>(_merged_sums, CL_MEM_READ_ONLY, num_pixels);
+    _main_ctx->create_buffer<cl_int>(_merged_sample_counts, CL_MEM_READ_ONLY, num_pixels);
+    _main_ctx->create_buffer<cl_float4>(_merged_albedo, CL_MEM_READ_ONLY, num_pixels);
+    _main_ctx->create_buffer<cl_float4>(_merged_normal_depth, CL_MEM_READ_ONLY, num_pixels);
+  }
+
+  /// Renders a frame on all devices and writes the result into \c pixels
+  /// \param pixels An OpenCL image of the context of the first device with
+  /// image_format = {CL_RGBA,CL_UNORM_INT8}.
+  /// \param scenes The scene, created for the context of each device
+  /// \param cam The camera
+  template<class Image_type>
+  void render(const Image_type& pixels,
+              const std::vector<std::shared_ptr<device_object::scene>>& scenes,
+              const device_object::camera& cam)
+  {
+    assert(scenes.size() == _strips.size());
+
+    update_partition();
+
+    // All devices trace their strips concurrently before any results
+    // are collected
+    for(std::size_t i = 0; i < _strips.size(); ++i)
+    {
+      device_strip& strip = _strips[i];
+      strip.renderer->set_traced_rows(strip.begin, strip.end);
+      // The samples of the other devices are moved to the first device
+      if(i > 0)
+        strip.renderer->restart_samples();
+      strip.renderer->trace(*scenes[i], cam);
+
+      cl_int err = strip.renderer->get_cl_context()->get_command_queue().flush();
+      qcl::check_cl_error(err, "Could not flush command queue!");
+    }
+
+    double num_rays = static_cast<double>((_strips[0].end - _strips[0].begin)
+                                          * _strips[0].renderer->get_current_rays_per_pixel());
+    for(std::size_t i = 1; i < _strips.size(); ++i)
+    {
+      collect_samples(_strips[i]);
+      _strips[0].renderer->merge_samples(_merged_sums,
+                                         _merged_sample_counts,
+                                         _merged_albedo,
+                                         _merged_normal_depth,
+                                         _strips[i].begin,
+                                         _strips[i].end);
+
+      num_rays += static_cast<double>((_strips[i].end - _strips[i].begin)
+                                      * _strips[i].renderer->get_current_rays_per_pixel());
+    }
+
+    _strips[0].renderer->present(pixels);
+
+    _total_rays_per_pixel += num_rays / static_cast<double>(_height);
+  }
+
+  /// \return The average number of rays per pixel that have been traced
+  std::size_t get_total_rays_per_pixel() const
+  {
+    return static_cast<std::size_t>(_total_rays_per_pixel);
+  }
+
+  /// \return Whether all devices have traced no rays in the last frame,
+  /// because all pixels have converged
+  bool is_converged() const
+  {
+    for(const device_strip& strip : _strips)
+      if(!strip.renderer->is_converged())
+        return false;
+    return true;
+  }
+
+  /// \return The number of devices
+  std::size_t get_num_devices() const
+  {
+    return _strips.size();
+  }
+
+  /// \return The frame renderer of a device
+  /// \param device The index of the device
+  frame_renderer& get_renderer(std::size_t device)
+  {
+    assert(device < _strips.size());
+    return *(_strips[device].renderer);
+  }
+
+  /// \return The number of rows traced by a device in the last frame
+  /// \param device The index of the device
+  std::size_t get_num_rows(std::size_t device) const
+  {
+    assert(device < _strips.size());
+    return _strips[device].end - _strips[device].begin;
+  }
+
+private:
+  /// The strip heights are multiples of the work group size
+  static constexpr std::size_t row_granularity = 8;
+
+  struct device_strip
+  {
+    std::shared_ptr<frame_renderer> renderer;
+    /// The first row and one past the last row of the strip
+    std::size_t begin;
+    std::size_t end;
+    /// Host copies of the samples of the strip, in transit to the first device
+    std::vector<cl_float4> sums;
+    std::vector<cl_int> sample_counts;
+    std::vector<cl_float4> albedo;
+    std::vector<cl_float4> normal_depth;
+    /// The pending transfers from the host copies to the first device
+    std::vector<cl::Event> transfers;
+  };
+
+  /// Assigns each device a number of rows proportional to its measured
+  /// rays per second. Until all devices have been measured, the rows are
+  /// distributed evenly.
+  void update_partition()
+  {
+    std::vector<double> throughputs(_strips.size(), 1.0);
+    bool is_measured = true;
+    for(const device_strip& strip : _strips)
+      if(!(strip.renderer->get_time_per_ray() > 0.0))
+        is_measured = false;
+
+    double total_throughput = 0.0;
+    for(std::size_t i = 0; i < _strips.size(); ++i)
+    {
+      if(is_measured)
+        throughputs[i] = 1.0 / _strips[i].renderer->get_time_per_ray();
+      total_throughput += throughputs[i];
+    }
+
+    std::size_t num_groups = (_height + row_granularity - 1) / row_granularity;
+    std::size_t num_devices = _strips.size();
+
+    std::size_t group_begin = 0;
+    double cumulative_throughput = 0.0;
+    for(std::size_t i = 0; i < num_devices; ++i)
+    {
+      cumulative_throughput += throughputs[i];
+
+      std::size_t group_end = num_groups;
+      if(i + 1 < num_devices)
+      {
+        group_end = static_cast<std::size_t>(std::round(cumulative_throughput / total_throughput
+                                                        * static_cast<double>(num_groups)));
+        // Every device keeps at least one group of rows, such that its
+        // time per ray is still measured
+        group_end = std::max(group_end, group_begin + 1);
+        group_end = std::min(group_end, num_groups - (num_devices - i - 1));
+      }
+
+      std::size_t begin = group_begin * row_granularity;
+      std::size_t end = std::min(group_end * row_granularity, _height);
+      _strips[i].begin = begin;
+      _strips[i].end = end;
+      group_begin = group_end;
+    }
+  }
+
+  /// Copies the samples of the strip of a device into the staging buffers
+  /// of the first device
+  void collect_samples(device_strip& strip)
+  {
+    // The host copies are only reused once their previous
+    // transfers have completed
+    if(!strip.transfers.empty())
+    {
+      cl_int err = cl::Event::waitForEvents(strip.transfers);
+      qcl::check_cl_error(err, "Could not wait for sample transfers!");
+      strip.transfers.clear();
+    }
+
+    std::size_t num_pixels = (strip.end - strip.begin) * _width;
+    std::size_t offset = strip.begin * _width;
+    strip.sums.resize(num_pixels);
+    strip.sample_counts.resize(num_pixels);
+    strip.albedo.resize(num_pixels);
+    strip.normal_depth.resize(num_pixels);
+
+    const frame_renderer& renderer = *(strip.renderer);
+    const cl::CommandQueue& queue = renderer.get_cl_context()->get_command_queue();
+
+    // The reads wait for the device to finish tracing the strip
+    read_rows(queue, renderer.get_accumulated_sums(), offset, strip.sums);
+    read_rows(queue, renderer.get_sample_counts(), offset, strip.sample_counts);
+    read_rows(queue, renderer.get_albedo(), offset, strip.albedo);
+    read_rows(queue, renderer.get_normal_depth(), offset, strip.normal_depth);
+
+    write_rows(_merged_sums, offset, strip.sums, strip.transfers);
+    write_rows(_merged_sample_counts, offset, strip.sample_counts, strip.transfers);
+    write_rows(_merged_albedo, offset, strip.albedo, strip.transfers);
+    write_rows(_merged_normal_depth, offset, strip.normal_depth, strip.transfers);
+  }
+
+  template<class T>
+  static void read_rows(const cl::CommandQueue& queue,
+                        const cl::Buffer& buffer,
+                        std::size_t offset,
+                        std::vector<T>& data)
+  {
+    cl_int err = queue.enqueueReadBuffer(buffer,
+                                         CL_TRUE,
+                                         offset * sizeof(T),
+                                         data.size() * sizeof(T),
+                                         data.data());
+    qcl::check_cl_error(err, "Could not read samples of strip!");
+  }
+
+  /// Enqueues a write without waiting for it, such that the first device
+  /// need not have finished its own strip
+  template<class T>
+  void write_rows(const cl::Buffer& buffer,
+                  std::size_t offset,
+                  const std::vector<T>& data,
+                  std::vector<cl::Event>& transfers) const
+  {
+    cl::Event transfer;
+    cl_int err = _main_ctx->get_command_queue().enqueueWriteBuffer(buffer,
+                                                                   CL_FALSE,
+                                                                   offset * sizeof(T),
+                                                                   data.size() * sizeof(T),
+                                                                   data.data(),
+                                                                   nullptr,
+                                                                   &transfer);
+    qcl::check_cl_error(err, "Could not write samples of strip!");
+    transfers.push_back(transfer);
+  }
+
+  qcl::device_context_ptr _main_ctx;
+
+  std::size_t _width;
+  std::size_t _height;
+
+  std::vector<device_strip> _strips;
+
+  /// Staging buffers on the first device for the samples of the other devices
+  cl::Buffer _merged_sums;
+  cl::Buffer _merged_sample_counts;
+  cl::Buffer _merged_albedo;
+  cl::Buffer _merged_normal_depth;
+
+  double _total_rays_per_pixel;
+};
+
+}
+
+#endif
@@ -64,6 +64,13 @@ typedef struct
   __global material_db_entry* materials;
 
   __global unsigned long* offsets;
+
+  // Luminance distribution of the environment texture,
+  // environment_width is 0 if the environment cannot be sampled.
+  __global scalar* environment_marginal_cdf;
+  __global scalar* environment_conditional_cdf;
+  int environment_width;
+  int environment_height;
 } material_db;
 
 typedef struct
@@ -86,6 +93,17 @@ typedef struct
   path_vertex origin_vertex;
 } ray;
 
+/// \return The normal of a path vertex, oriented such that it points
+/// to the side of the surface where a ray arrives from
+/// \param ctx The path vertex
+/// \param incident The direction of the incoming ray
+vector3 path_vertex_get_facing_normal(const path_vertex* ctx, vector3 incident)
+{
+  if(dot(ctx->normal, incident) > 0.f)
+    return -(ctx->normal);
+  return ctx->normal;
+}
+
 /********************** Geometries *********************************/
 
     /********************** Plane *********************/
@@ -0,0 +1,415 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATH_GUIDING_CL
+#define PATH_GUIDING_CL
+
+#include "random.cl"
+#include "material.cl"
+
+// Path guiding with a learned distribution of the incident light.
+// The scene bounds are divided into a uniform grid. Each cell stores a
+// quadtree of fixed depth over the directions, which are mapped to the
+// unit square with the (area preserving) cylindrical projection. The
+// deepest level of the tree receives the light arriving at the vertices
+// of the camera paths of a frame; the inner nodes contain the sums of
+// their children and are used to sample the tree from the root.
+//
+// Directions are only guided at opaque, rough surfaces, where the BSDF
+// can be evaluated for any direction. There, guided sampling and BSDF
+// sampling are combined as a mixture distribution.
+
+#define PATH_GUIDING_TREE_DEPTH 4
+/// The number of leaves along each dimension of the unit square
+#define PATH_GUIDING_LEAF_RESOLUTION (1 << PATH_GUIDING_TREE_DEPTH)
+#define PATH_GUIDING_NUM_LEAVES (PATH_GUIDING_LEAF_RESOLUTION * PATH_GUIDING_LEAF_RESOLUTION)
+/// The number of nodes of the levels 1 to PATH_GUIDING_TREE_DEPTH,
+/// the root is not stored.
+#define PATH_GUIDING_NUM_NODES ((4 * PATH_GUIDING_NUM_LEAVES - 4) / 3)
+
+/// The training data is accumulated in fixed point
+#define PATH_GUIDING_TRAINING_SCALE 16.f
+/// Bounds single training samples to prevent overflows of the training data
+#define PATH_GUIDING_MAX_SAMPLE_VALUE 1.e4f
+/// The number of vertices per path that contribute to the training
+#define PATH_GUIDING_MAX_RECORDED_VERTICES 8
+
+typedef struct
+{
+  __global const float* distribution;
+  __global uint* training_data;
+  path_guiding_parameters params;
+} path_guide;
+
+/// A path vertex whose incident light is used for training
+typedef struct
+{
+  int cell;
+  int leaf;
+  /// Luminance of the path throughput after scattering at the vertex
+  scalar throughput;
+  /// Luminance of the radiance collected before scattering at the vertex
+  scalar radiance;
+  /// The pdf with which the scattered direction has been sampled
+  scalar pdf;
+} path_guide_record;
+
+/// The kernel parameters describing the path guide, in the order in which they
+/// are pushed by the host.
+#define PATH_GUIDE_KERNEL_ARGUMENTS                          \
+  __global const float* guiding_distribution,                \
+  __global uint* guiding_training_data,                      \
+  path_guiding_parameters path_guiding_params
+
+#define PATH_GUIDE_INIT_FROM_KERNEL_ARGUMENTS(path_guide_ptr)           \
+  do                                                                    \
+  {                                                                     \
+    (path_guide_ptr)->distribution = guiding_distribution;              \
+    (path_guide_ptr)->training_data = guiding_training_data;            \
+    (path_guide_ptr)->params = path_guiding_params;                     \
+  } while(0)
+
+/// \return The index of the first node of a level of the quadtree
+/// \param level The level, starting with 1 for the children of the root
+int path_guide_get_level_offset(int level)
+{
+  return ((1 << (2 * level)) - 4) / 3;
+}
+
+/// \return The index of the cell of the spatial grid that contains a position.
+/// Positions outside of the grid are assigned to the nearest cell.
+/// \param ctx The path guide
+/// \param position The position
+int path_guide_get_cell(const path_guide* ctx, vector3 position)
+{
+  int resolution = ctx->params.grid_resolution;
+  vector3 relative_position = (position - ctx->params.bounds_min) / ctx->params.cell_size;
+
+  int x = clamp((int)floor(relative_position.x), 0, resolution - 1);
+  int y = clamp((int)floor(relative_position.y), 0, resolution - 1);
+  int z = clamp((int)floor(relative_position.z), 0, resolution - 1);
+
+  return (z * resolution + y) * resolution + x;
+}
+
+/// \return The position of a direction on the unit square
+float2 path_guide_direction_to_square(vector3 direction)
+{
+  return (float2)(0.5f * (direction.z + 1.f),
+                  atan2pi(direction.y, direction.x) * 0.5f + 0.5f);
+}
+
+/// \return The direction belonging to a position on the unit square
+vector3 path_guide_square_to_direction(float2 position)
+{
+  scalar cos_theta = 2.f * position.x - 1.f;
+  scalar sin_theta = sqrt(fmax(0.f, 1.f - cos_theta * cos_theta));
+  scalar phi_over_pi = 2.f * position.y - 1.f;
+
+  return (vector3)(sin_theta * cospi(phi_over_pi),
+                   sin_theta * sinpi(phi_over_pi),
+                   cos_theta);
+}
+
+/// \return The index of the leaf that contains a direction
+int path_guide_get_leaf(vector3 direction)
+{
+  float2 position = path_guide_direction_to_square(direction);
+  int x = clamp((int)(position.x * (scalar)PATH_GUIDING_LEAF_RESOLUTION),
+                0, PATH_GUIDING_LEAF_RESOLUTION - 1);
+  int y = clamp((int)(position.y * (scalar)PATH_GUIDING_LEAF_RESOLUTION),
+                0, PATH_GUIDING_LEAF_RESOLUTION - 1);
+  return y * PATH_GUIDING_LEAF_RESOLUTION + x;
+}
+
+/// \return The sum of all leaves of the quadtree of a cell
+scalar path_guide_get_total(const path_guide* ctx, int cell)
+{
+  __global const float* tree = ctx->distribution + cell * PATH_GUIDING_NUM_NODES;
+  return tree[0] + tree[1] + tree[2] + tree[3];
+}
+
+/// \return Whether the light arriving at a path vertex is learned
+/// \param ctx The path guide, may be NULL
+/// \param mat The material at the path vertex
+int path_guide_is_trainable(const path_guide* ctx, const material* mat)
+{
+  return ctx != 0 &&
+         mat->roughness >= SPECULAR_ROUGHNESS_THRESHOLD &&
+         mat->transmittance <= 0.f;
+}
+
+/// \return Whether directions are guided at a path vertex
+/// \param ctx The path guide, may be NULL
+/// \param mat The material at the path vertex
+/// \param cell The cell of the path vertex
+int path_guide_is_applicable(const path_guide* ctx, const material* mat, int cell)
+{
+  return path_guide_is_trainable(ctx, mat) &&
+         ctx->params.guiding_probability > 0.f &&
+         path_guide_get_total(ctx, cell) > 0.f;
+}
+
+/// \return The probability density (with respect to solid angle) with which
+/// \c path_guide_sample generates a direction
+/// \param ctx The path guide
+/// \param cell The cell of the path vertex
+/// \param direction The (normalized) direction
+scalar path_guide_pdf(const path_guide* ctx, int cell, vector3 direction)
+{
+  __global const float* tree = ctx->distribution + cell * PATH_GUIDING_NUM_NODES;
+
+  scalar leaf_value = tree[path_guide_get_level_offset(PATH_GUIDING_TREE_DEPTH)
+                           + path_guide_get_leaf(direction)];
+
+  // The cylindrical projection maps the sphere with area 4pi
+  // to the unit square
+  return leaf_value / path_guide_get_total(ctx, cell)
+       * (scalar)PATH_GUIDING_NUM_LEAVES / (4.f * M_PI_F);
+}
+
+/// Samples a direction proportionally to the learned distribution of a cell
+/// \return The (normalized) direction
+/// \param ctx The path guide
+/// \param cell The cell of the path vertex, its distribution must not be empty
+/// \param rand The random number generator context
+vector3 path_guide_sample(const path_guide* ctx, int cell, random_ctx* rand)
+{
+  __global const float* tree = ctx->distribution + cell * PATH_GUIDING_NUM_NODES;
+
+  // Descend from the root and select one of the four children in each level
+  int x = 0;
+  int y = 0;
+  for (int level = 1; level <= PATH_GUIDING_TREE_DEPTH; ++level)
+  {
+    int level_resolution = 1 << level;
+    __global const float* nodes = tree + path_guide_get_level_offset(level);
+
+    int child_x = 2 * x;
+    int child_y = 2 * y;
+
+    scalar weights[4];
+    scalar total = 0.f;
+    for (int i = 0; i < 4; ++i)
+    {
+      weights[i] = nodes[(child_y + i / 2) * level_resolution + child_x + i % 2];
+      total += weights[i];
+    }
+
+    scalar random_sample = random_uniform_scalar(rand) * total;
+    int selected = 3;
+    for (int i = 0; i < 3; ++i)
+    {
+      if (random_sample < weights[i] && weights[i] > 0.f)
+      {
+        selected = i;
+        break;
+      }
+      random_sample -= weights[i];
+    }
+    // Never select an empty child due to rounding
+    while (weights[selected] <= 0.f && selected > 0)
+      --selected;
+
+    x = child_x + selected % 2;
+    y = child_y + selected / 2;
+  }
+
+  float2 position;
+  position.x = ((scalar)x + random_uniform_scalar(rand)) / (scalar)PATH_GUIDING_LEAF_RESOLUTION;
+  position.y = ((scalar)y + random_uniform_scalar(rand)) / (scalar)PATH_GUIDING_LEAF_RESOLUTION;
+
+  return path_guide_square_to_direction(position);
+}
+
+/// \return The probability density (with respect to solid angle) with which
+/// a reflected direction is sampled at a path vertex, taking path guiding
+/// into account.
+/// \param ctx The path guide, may be NULL if path guiding is disabled
+/// \param mat The material at the path vertex
+/// \param impact The path vertex
+/// \param incident The direction of the incoming ray
+/// \param outgoing The direction of the reflected ray
+scalar path_guide_sampling_pdf(const path_guide* ctx,
+                               const material* mat,
+                               const path_vertex* impact,
+                               vector3 incident,
+                               vector3 outgoing)
+{
+  scalar bsdf_pdf = material_reflection_pdf(mat, impact, incident, outgoing);
+  if (ctx == 0)
+    return bsdf_pdf;
+
+  int cell = path_guide_get_cell(ctx, impact->position);
+  if (!path_guide_is_applicable(ctx, mat, cell))
+    return bsdf_pdf;
+
+  scalar guiding_probability = ctx->params.guiding_probability;
+  return guiding_probability * path_guide_pdf(ctx, cell, outgoing)
+       + (1.f - guiding_probability) * bsdf_pdf;
+}
+
+/// Scatters a ray at an opaque, rough surface by sampling either the
+/// learned distribution or the BSDF. The energy of the ray is multiplied
+/// with the ratio of the BSDF pdf and the pdf of the mixture, the scattered
+/// fraction must be applied by the caller as for \c material_propagate_ray.
+/// \return The pdf with which the new direction has been sampled
+/// \param ctx The path guide
+/// \param mat The material at the path vertex
+/// \param impact The path vertex
+/// \param cell The cell of the path vertex, guiding must be applicable
+/// \param rand The random number generator context
+/// \param r The ray, will be set to the scattered ray
+scalar path_guide_propagate_ray(const path_guide* ctx,
+                                const material* mat,
+                                const path_vertex* impact,
+                                int cell,
+                                random_ctx* rand,
+                                ray* r)
+{
+  vector3 incident = r->direction;
+  scalar guiding_probability = ctx->params.guiding_probability;
+
+  if (random_uniform_scalar(rand) < guiding_probability)
+  {
+    r->direction = path_guide_sample(ctx, cell, rand);
+    r->origin_vertex = *impact;
+    r->origin_vertex.position += self_shadowing_epsilon * r->direction;
+  }
+  else
+    material_propagate_ray(mat, impact, rand, r);
+
+  scalar bsdf_pdf = material_reflection_pdf(mat, impact, incident, r->direction);
+  scalar sampling_pdf = guiding_probability * path_guide_pdf(ctx, cell, r->direction)
+                      + (1.f - guiding_probability) * bsdf_pdf;
+
+  if (sampling_pdf > 0.f)
+    r->energy *= bsdf_pdf / sampling_pdf;
+  else
+    r->energy = (intensity)(0, 0, 0);
+
+  return sampling_pdf;
+}
+
+/// \return The luminance of an intensity
+scalar path_guide_luminance(intensity value)
+{
+  return 0.2126f * value.x + 0.7152f * value.y + 0.0722f * value.z;
+}
+
+/// Adds a value to a training counter. The counter saturates instead of
+/// wrapping around, which would turn bright leaves into dark ones.
+/// \param counter The training counter of a leaf
+/// \param value The added value
+void path_guide_add_training_value(volatile __global uint* counter, uint value)
+{
+  uint previous = *counter;
+  while (1)
+  {
+    uint sum = previous > UINT_MAX - value ? UINT_MAX : previous + value;
+    uint current = atomic_cmpxchg(counter, previous, sum);
+    if (current == previous)
+      return;
+    previous = current;
+  }
+}
+
+/// Adds the light that has arrived at the recorded vertices of a path
+/// to the training data.
+/// \param ctx The path guide
+/// \param records The recorded vertices
+/// \param num_records The number of recorded vertices
+/// \param radiance The total radiance collected by the path
+void path_guide_train(const path_guide* ctx,
+                      const path_guide_record* records,
+                      int num_records,
+                      intensity radiance)
+{
+  scalar total_luminance = path_guide_luminance(radiance);
+
+  for (int i = 0; i < num_records; ++i)
+  {
+    const path_guide_record* record = &(records[i]);
+    if (record->throughput <= 0.f || record->pdf <= 0.f)
+      continue;
+
+    // The light collected after the vertex, divided by the throughput, is
+    // an estimate of the radiance arriving from the sampled direction.
+    // Dividing by the pdf yields an estimate of its integral over the leaf.
+    scalar incident_radiance = (total_luminance - record->radiance) / record->throughput;
+    scalar value = fmin(incident_radiance / record->pdf, PATH_GUIDING_MAX_SAMPLE_VALUE);
+    if (value <= 0.f)
+      continue;
+
+    path_guide_add_training_value(ctx->training_data
+                                    + record->cell * PATH_GUIDING_NUM_LEAVES
+                                    + record->leaf,
+                                  (uint)(value * PATH_GUIDING_TRAINING_SCALE));
+  }
+}
+
+/// Merges the training data of the last frame into the distribution of each
+/// cell, rebuilds the inner nodes of the quadtrees and clears the training data.
+/// \param distribution The quadtrees of all cells
+/// \param training_data The training data of all cells
+/// \param num_cells The number of cells of the spatial grid
+/// \param num_previous_frames The number of frames contained in the distribution
+__kernel void build_guiding_distribution(__global float* distribution,
+                                         __global uint* training_data,
+                                         int num_cells,
+                                         int num_previous_frames)
+{
+  int cell = get_global_id(0);
+  if (cell >= num_cells)
+    return;
+
+  __global float* tree = distribution + cell * PATH_GUIDING_NUM_NODES;
+  __global uint* training = training_data + cell * PATH_GUIDING_NUM_LEAVES;
+
+  // Running average over all frames
+  scalar new_weight = 1.f / (scalar)(num_previous_frames + 1);
+
+  __global float* leaves = tree + path_guide_get_level_offset(PATH_GUIDING_TREE_DEPTH);
+  for (int i = 0; i < PATH_GUIDING_NUM_LEAVES; ++i)
+  {
+    scalar trained_value = (scalar)training[i] / PATH_GUIDING_TRAINING_SCALE;
+    leaves[i] = mix(leaves[i], trained_value, new_weight);
+    training[i] = 0;
+  }
+
+  for (int level = PATH_GUIDING_TREE_DEPTH - 1; level >= 1; --level)
+  {
+    int level_resolution = 1 << level;
+    __global float* nodes = tree + path_guide_get_level_offset(level);
+    __global const float* children = tree + path_guide_get_level_offset(level + 1);
+
+    for (int y = 0; y < level_resolution; ++y)
+      for (int x = 0; x < level_resolution; ++x)
+      {
+        int child_x = 2 * x;
+        int child_y = 2 * y;
+        nodes[y * level_resolution + x] =
+            children[child_y * 2 * level_resolution + child_x]
+          + children[child_y * 2 * level_resolution + child_x + 1]
+          + children[(child_y + 1) * 2 * level_resolution + child_x]
+          + children[(child_y + 1) * 2 * level_resolution + child_x + 1];
+      }
+  }
+}
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATH_GUIDING_HPP
+#define PATH_GUIDING_HPP
+
+#include "integrator_extension.hpp"
+#include "common.cl_hpp"
+
+#include <algorithm>
+
+namespace gray {
+
+/// Online path guiding, to be used with the \c trace_paths_guided kernel.
+/// The camera paths of each frame record the light arriving at their
+/// vertices. Before the next frame, these records are merged into a
+/// distribution over directions for each cell of a spatial grid,
+/// from which the following frames sample their directions.
+class path_guide : public integrator_extension
+{
+public:
+  /// Must match the definitions in path_guiding.cl
+  static constexpr std::size_t num_leaves_per_cell = 256;
+  static constexpr std::size_t num_nodes_per_cell = 340;
+
+  /// \param ctx The device context
+  /// \param grid_resolution The number of cells of the spatial grid
+  /// in each dimension
+  /// \param guiding_probability The probability that a direction is sampled
+  /// from the learned distribution instead of the BSDF, must be in [0,1)
+  path_guide(const qcl::device_context_ptr& ctx,
+             std::size_t grid_resolution = 16,
+             scalar guiding_probability = 0.5f)
+  : _ctx{ctx},
+    _build_kernel{ctx->get_kernel("build_guiding_distribution")},
+    _num_cells{grid_resolution * grid_resolution * grid_resolution},
+    _guiding_probability{guiding_probability},
+    _num_frames{0},
+    _is_grid_initialized{false}
+  {
+    assert(grid_resolution > 0);
+    assert(guiding_probability >= 0.0f && guiding_probability < 1.0f);
+
+    _ctx->create_buffer<cl_float>(_distribution,
+                                  CL_MEM_READ_WRITE,
+                                  _num_cells * num_nodes_per_cell);
+    _ctx->create_buffer<cl_uint>(_training_data,
+                                 CL_MEM_READ_WRITE,
+                                 _num_cells * num_leaves_per_cell);
+
+    _params.grid_resolution = static_cast<cl_int>(grid_resolution);
+    _params.guiding_probability = 0.0f;
+    _params.bounds_min = VECTOR3(0.0f, 0.0f, 0.0f);
+    _params.cell_size = VECTOR3(1.0f, 1.0f, 1.0f);
+
+    clear();
+  }
+
+  /// Discards everything that has been learned
+  void clear()
+  {
+    cl_float zero = 0.0f;
+    cl_int err = _ctx->get_command_queue().enqueueFillBuffer(_distribution,
+                                                             zero,
+                                                             0,
+                                                             _num_cells * num_nodes_per_cell
+                                                               * sizeof(cl_float));
+    qcl::check_cl_error(err, "Could not enqueue guiding distribution reset!");
+
+    cl_uint zero_count = 0;
+    err = _ctx->get_command_queue().enqueueFillBuffer(_training_data,
+                                                      zero_count,
+                                                      0,
+                                                      _num_cells * num_leaves_per_cell
+                                                        * sizeof(cl_uint));
+    qcl::check_cl_error(err, "Could not enqueue guiding training data reset!");
+
+    _num_frames = 0;
+    _params.guiding_probability = 0.0f;
+  }
+
+  virtual void prepare_frame(const device_object::scene& s) override
+  {
+    if(!_is_grid_initialized)
+    {
+      setup_grid(s);
+      _is_grid_initialized = true;
+    }
+
+    if(_num_frames > 0)
+    {
+      // Merge the light recorded by the previous frame
+      qcl::kernel_argument_list arguments(_build_kernel);
+      arguments.push(_distribution);
+      arguments.push(_training_data);
+      arguments.push(static_cast<cl_int>(_num_cells));
+      arguments.push(static_cast<cl_int>(_num_frames - 1));
+
+      cl_int err = _ctx->get_command_queue().enqueueNDRangeKernel(*_build_kernel,
+                                                                  cl::NullRange,
+                                                                  cl::NDRange(_num_cells),
+                                                                  cl::NullRange);
+      qcl::check_cl_error(err, "Could not enqueue guiding distribution build kernel call!");
+
+      _params.guiding_probability = _guiding_probability;
+    }
+
+    ++_num_frames;
+  }
+
+  virtual void push_kernel_arguments(qcl::kernel_argument_list& arguments) const override
+  {
+    arguments.push(_distribution);
+    arguments.push(_training_data);
+    arguments.push(&_params, sizeof(device_object::path_guiding_parameters));
+  }
+
+  /// The learned distribution describes the light in the scene and does not
+  /// depend on the camera. Hence it is kept when the render results are
+  /// discarded, use \c clear() to start learning from scratch.
+  virtual void reset() override
+  {}
+
+private:
+  /// Places the spatial grid around all objects of finite size, and
+  /// the parts of the planes within their extent
+  void setup_grid(const device_object::scene& s)
+  {
+    vector3 min_corner;
+    vector3 max_corner;
+    if(!s.get_bounds(min_corner, max_corner))
+    {
+      min_corner = VECTOR3(-1.0f, -1.0f, -1.0f);
+      max_corner = VECTOR3(1.0f, 1.0f, 1.0f);
+    }
+    s.extend_bounds_by_planes(min_corner, max_corner);
+
+    scalar resolution = static_cast<scalar>(_params.grid_resolution);
+    for(std::size_t dim = 0; dim < 3; ++dim)
+    {
+      // Avoid empty cells in flat scenes
+      scalar extent = std::max(max_corner.s[dim] - min_corner.s[dim], 1.e-3f);
+      // Enlarge the grid slightly, such that the surfaces of the objects
+      // at the boundary are inside
+      scalar margin = 0.01f * extent;
+
+      _params.bounds_min.s[dim] = min_corner.s[dim] - margin;
+      _params.cell_size.s[dim] = (extent + 2.0f * margin) / resolution;
+    }
+  }
+
+  qcl::device_context_ptr _ctx;
+  qcl::kernel_ptr _build_kernel;
+
+  std::size_t _num_cells;
+  scalar _guiding_probability;
+  std::size_t _num_frames;
+  bool _is_grid_initialized;
+
+  device_object::path_guiding_parameters _params;
+
+  cl::Buffer _distribution;
+  cl::Buffer _training_data;
+};
+
+}
+
+#endif
@@ -21,6 +21,79 @@
 
 #include "random.cl"
 #include "scene.cl"
+#include "emitters.cl"
+#include "adaptive_sampling.cl"
+#include "accumulation.cl"
+
+#ifdef WITH_PHOTON_MAPPING
+#include "photon_map.cl"
+#endif
+
+#ifdef WITH_BIDIRECTIONAL_PATH_TRACING
+#include "bdpt.cl"
+#endif
+
+#ifdef WITH_RADIANCE_CACHE
+#include "radiance_cache.cl"
+#endif
+
+// The name of the path tracing kernel, can be changed by
+// variants of the path tracer that include this file.
+#ifndef TRACE_PATHS_KERNEL
+#define TRACE_PATHS_KERNEL trace_paths
+#endif
+
+/// Data of optional extensions of the path tracing algorithm
+typedef struct
+{
+#ifdef WITH_PHOTON_MAPPING
+  photon_map caustics;
+#endif
+#ifdef WITH_PATH_GUIDING
+  path_guide guide;
+#endif
+#ifdef WITH_RADIANCE_CACHE
+  radiance_cache cache;
+#endif
+  /// Avoids an empty struct if no extension is enabled
+  int unused;
+} integrator_extensions;
+
+#if defined(WITH_PHOTON_MAPPING)
+#define INTEGRATOR_EXTENSIONS_KERNEL_ARGUMENTS , PHOTON_MAP_KERNEL_ARGUMENTS
+#elif defined(WITH_PATH_GUIDING)
+#define INTEGRATOR_EXTENSIONS_KERNEL_ARGUMENTS , PATH_GUIDE_KERNEL_ARGUMENTS
+#elif defined(WITH_RADIANCE_CACHE)
+#define INTEGRATOR_EXTENSIONS_KERNEL_ARGUMENTS , RADIANCE_CACHE_KERNEL_ARGUMENTS
+#else
+#define INTEGRATOR_EXTENSIONS_KERNEL_ARGUMENTS
+#endif
+
+/// Initializes the integrator extensions from the kernel parameters
+/// declared by INTEGRATOR_EXTENSIONS_KERNEL_ARGUMENTS
+#if defined(WITH_PHOTON_MAPPING)
+#define INTEGRATOR_EXTENSIONS_INIT_FROM_KERNEL_ARGUMENTS(extensions_ptr) \
+  PHOTON_MAP_INIT_FROM_KERNEL_ARGUMENTS(&((extensions_ptr)->caustics))
+#elif defined(WITH_PATH_GUIDING)
+#define INTEGRATOR_EXTENSIONS_INIT_FROM_KERNEL_ARGUMENTS(extensions_ptr) \
+  PATH_GUIDE_INIT_FROM_KERNEL_ARGUMENTS(&((extensions_ptr)->guide))
+#elif defined(WITH_RADIANCE_CACHE)
+#define INTEGRATOR_EXTENSIONS_INIT_FROM_KERNEL_ARGUMENTS(extensions_ptr) \
+  RADIANCE_CACHE_INIT_FROM_KERNEL_ARGUMENTS(&((extensions_ptr)->cache))
+#else
+#define INTEGRATOR_EXTENSIONS_INIT_FROM_KERNEL_ARGUMENTS(extensions_ptr) \
+  ((extensions_ptr)->unused = 0)
+#endif
+
+/// The camera parameters of the path tracing kernel. With several views,
+/// the kernel receives one camera and camera state per view.
+#ifdef WITH_MULTIPLE_VIEWS
+#define CAMERA_KERNEL_ARGUMENTS __global const camera* cams, \
+                                __global const camera_frame_state* cam_states
+#else
+#define CAMERA_KERNEL_ARGUMENTS camera cam, \
+                                __global const camera_frame_state* cam_state
+#endif
 
 
 typedef uchar3 rgb_color; 
@@ -29,6 +102,17 @@ typedef float4 rgba_color;
 
 #define MAX_BOUNCES 256
 
+#ifdef WITH_PREVIEW_MODE
+// The preview only follows short paths, which mostly contain the direct
+// light found by explicit light sampling, and at most a single pass
+// through a transparent object.
+#define PREVIEW_MAX_BOUNCES 3
+#define PREVIEW_MAX_REFRACTIONS 2
+#define EVALUATE_RAY_MAX_BOUNCES PREVIEW_MAX_BOUNCES
+#else
+#define EVALUATE_RAY_MAX_BOUNCES MAX_BOUNCES
+#endif
+
 typedef struct
 {
   vector3 look_at;
@@ -45,29 +129,23 @@ typedef struct
 
 /// Generates a new ray originating at a given pixel
 /// \param ctx The camera
+/// \param state The per-frame camera state calculated by \c camera_prepare
 /// \param rand The random number generator context
-/// \param width The number of pixels in x direction
-/// \param height The number of pixels in y direction
 /// \param px_x The pixel index in x direction
 /// \param px_y The pixel index in y direction
 /// \param r A pointer to a ray that will be used to store
 /// the generated ray.
-void camera_generate_ray(const camera* ctx, random_ctx* rand,
-                        int width, int height,
+void camera_generate_ray(const camera* ctx, const camera_frame_state* state,
+                        random_ctx* rand,
                         int px_x, int px_y, ray* r)
 {
   // First generate a sample for the position in the pixel
-  scalar px_size = 1.0f / (scalar)width;
-  
   scalar position_in_pixel_x = random_uniform_scalar(rand);
   scalar position_in_pixel_y = random_uniform_scalar(rand);
   
-  scalar px_relative_to_center_x = (scalar)(px_x - width / 2);
-  scalar px_relative_to_center_y = (scalar)(px_y - height/ 2);
-  
-  vector3 origin = ctx->position;
-  origin += (px_relative_to_center_x - 0.5f + position_in_pixel_x) * px_size * ctx->screen_basis1;
-  origin += (px_relative_to_center_y - 0.5f + position_in_pixel_y) * px_size * ctx->screen_basis2;
+  vector3 origin = state->screen_origin;
+  origin += ((scalar)px_x + position_in_pixel_x) * state->pixel_basis1;
+  origin += ((scalar)px_y + position_in_pixel_y) * state->pixel_basis2;
 
   // Generate a sample for the direction
   scalar x,y;
@@ -100,11 +178,11 @@ void camera_generate_ray(const camera* ctx, random_ctx* rand,
   simple_lens_object_propagate_ray(&(ctx->camera_lens), &impact, rand, r);
 }
 
-/// Sets the cameras focal distance such that the nearest object in front of the
-/// pixel of the camera is focused.
+/// \return The focal length for which the nearest object in front of the
+/// center of the camera is focused.
 /// \param ctx The camera
 /// \param s The scene
-void camera_autofocus(camera* ctx, const scene* s)
+scalar camera_autofocus(const camera* ctx, const scene* s)
 {
   ray test_ray;
   test_ray.origin_vertex.position = ctx->camera_lens.geometry.plane.position;
@@ -113,67 +191,666 @@ void camera_autofocus(camera* ctx, const scene* s)
   scene_get_nearest_intersection(s, &test_ray, &intersection);
   scalar dist = distance(intersection.position, test_ray.origin_vertex.position);
 
-  ctx->camera_lens.focal_length = 1.f / (1.f / dist + 1.f / ctx->lens_plane_distance);
+  return 1.f / (1.f / dist + 1.f / ctx->lens_plane_distance);
+}
+
+/// Calculates the camera quantities that do not depend on the pixel.
+/// \param ctx The camera
+/// \param s The scene
+/// \param width The number of pixels in x direction
+/// \param height The number of pixels in y direction
+/// \param state The camera state that will be calculated
+void camera_prepare_frame_state(const camera* ctx, const scene* s,
+                                int width, int height,
+                                camera_frame_state* state)
+{
+  scalar px_size = 1.0f / (scalar)width;
+
+  state->pixel_basis1 = px_size * ctx->screen_basis1;
+  state->pixel_basis2 = px_size * ctx->screen_basis2;
+
+  state->screen_origin = ctx->position;
+  state->screen_origin -= ((scalar)(width / 2) + 0.5f) * state->pixel_basis1;
+  state->screen_origin -= ((scalar)(height / 2) + 0.5f) * state->pixel_basis2;
+
+  // Calculate focal distance if autofocus is enabled
+  if(ctx->camera_lens.focal_length <= 0.0f)
+    state->focal_length = camera_autofocus(ctx, s);
+  else
+    state->focal_length = ctx->camera_lens.focal_length;
 }
 
 
-/// evaluates a given ray using a standard, unbiased path tracing algorithm
+/// Projects a position onto the screen of the camera along the ray through
+/// the center of the lens, which is not deflected by the lens.
+/// \return Whether the position is in front of the camera
+/// \param ctx The camera
+/// \param state The per-frame camera state calculated by \c camera_prepare
+/// \param position The position
+/// \param pixel Will be set to the (continuous) pixel coordinates of the position
+int camera_project(const camera* ctx, const camera_frame_state* state,
+                   vector3 position, float2* pixel)
+{
+  vector3 lens_center = simple_lens_object_get_center(&(ctx->camera_lens));
+  vector3 direction = lens_center - position;
+
+  scalar cos_direction = dot(direction, ctx->look_at);
+  if (cos_direction >= 0.f)
+    return 0;
+
+  // The screen is located behind the lens
+  scalar t = dot(ctx->position - position, ctx->look_at) / cos_direction;
+  vector3 screen_position = position + t * direction - state->screen_origin;
+
+  pixel->x = dot(screen_position, state->pixel_basis1)
+           / dot(state->pixel_basis1, state->pixel_basis1);
+  pixel->y = dot(screen_position, state->pixel_basis2)
+           / dot(state->pixel_basis2, state->pixel_basis2);
+  return 1;
+}
+
+/// evaluates a given ray using a standard, unbiased path tracing algorithm.
+/// Emitters and the environment are additionally sampled explicitly at each vertex, and combined
+/// with the emission found by BSDF sampling using multiple importance sampling.
 /// \return The intensity of the sampled light path
 /// \param r The ray that shall be traced
 /// \param rand The random context that shall be used to generate random numbers
 /// \param s The scene
-intensity evaluate_ray(ray* r, random_ctx* rand, const scene* s)
+/// \param extensions The data of the enabled integrator extensions
+intensity evaluate_ray(ray* r, random_ctx* rand, const scene* s,
+                       const integrator_extensions* extensions)
 {
   path_vertex next_intersection;
   intensity radiance = (intensity)(0, 0, 0);
-  for (int i = 0; i < MAX_BOUNCES; ++i) // we will never really iterate to the end
+
+  // The pdf with which the current ray direction has been sampled
+  // at the previous vertex, if the direction could also have been
+  // generated by explicit light sampling. 0 otherwise.
+  scalar previous_bsdf_pdf = 0.f;
+  vector3 previous_position = r->origin_vertex.position;
+
+#ifdef WITH_PHOTON_MAPPING
+  const photon_map* caustics = &(extensions->caustics);
+  int is_photon_map_enabled = caustics->params.num_photons > 0;
+  int is_photon_map_gathered = 0;
+  // Whether the path is between the vertex where the photon map has been
+  // gathered and the next diffuse vertex. Light arriving along this segment
+  // after specular scattering is already contained in the photon map.
+  int is_caustic_segment = 0;
+  int num_specular_vertices_in_segment = 0;
+#endif
+
+#ifdef WITH_PATH_GUIDING
+  const path_guide* guide = &(extensions->guide);
+  // The vertices at which the incident light is learned
+  path_guide_record guiding_records[PATH_GUIDING_MAX_RECORDED_VERTICES];
+  int num_guiding_records = 0;
+#else
+  const path_guide* guide = 0;
+#endif
+
+#ifdef WITH_RADIANCE_CACHE
+  const radiance_cache* cache = &(extensions->cache);
+  // The vertices whose reflected light is added to the cache
+  radiance_cache_record cache_records[RADIANCE_CACHE_MAX_RECORDED_VERTICES];
+  int num_cache_records = 0;
+  // Whether the path has already been scattered at a rough surface
+  int is_after_diffuse_vertex = 0;
+#endif
+
+#ifdef WITH_PREVIEW_MODE
+  int num_refractions = 0;
+#endif
+
+  for (int i = 0; i < EVALUATE_RAY_MAX_BOUNCES; ++i) // we will never really iterate to the end
   {
     scene_get_nearest_intersection(s, r, &next_intersection);
 
     material *interacting_material;
+    object_entry interacting_object;
     if (dot(next_intersection.normal, r->direction) < 0.f)
+    {
       // Incoming ray
       interacting_material = &(next_intersection.material_to);
+      interacting_object = next_intersection.hit_object_to;
+    }
     else
+    {
       // Outgoing ray
       interacting_material = &(next_intersection.material_from);
+      interacting_object = next_intersection.hit_object_from;
+    }
 
-    // Russian roulette
+    // Russian roulette. Path guiding can raise the energy above one,
+    // such paths always survive and must not be weighted.
     scalar russian_roulette_probability =
-        fmax(r->energy.x,
-            fmax(r->energy.y, 
-                r->energy.z));
+        fmin(1.f, fmax(r->energy.x,
+                       fmax(r->energy.y,
+                            r->energy.z)));
     
     intensity effective_bsdf = 
       interacting_material->scattered_fraction * (1.f / russian_roulette_probability);
 
-    radiance += fabs(dot(next_intersection.normal, r->direction)) 
+    int is_background_hit =
+        next_intersection.hit_object_to.type == OBJECT_TYPE_BACKGROUND;
+
+    scalar emission_weight = 1.f;
+    if (previous_bsdf_pdf > 0.f && is_background_hit &&
+        emitters_is_environment_sampling_enabled(s))
+    {
+      scalar light_pdf = emitters_environment_pdf(s, r->direction);
+      emission_weight = emitters_power_heuristic(previous_bsdf_pdf, light_pdf);
+    }
+    else if (previous_bsdf_pdf > 0.f &&
+             next_intersection.hit_object_to.emitter_probability > 0.f)
+    {
+      scalar light_pdf = next_intersection.hit_object_to.emitter_probability
+                       * emitters_solid_angle_pdf(s,
+                                                  next_intersection.hit_object_to,
+                                                  previous_position,
+                                                  next_intersection.position,
+                                                  next_intersection.normal);
+      emission_weight = emitters_power_heuristic(previous_bsdf_pdf, light_pdf);
+    }
+
+#ifdef WITH_PHOTON_MAPPING
+    if (is_caustic_segment && num_specular_vertices_in_segment > 0)
+    {
+      // Light sources that emit photons
+      int is_photon_emitter = is_background_hit ?
+            (caustics->params.environment_probability > 0.f) :
+            (next_intersection.hit_object_to.emitter_probability > 0.f &&
+             caustics->params.environment_probability < 1.f);
+      if (is_photon_emitter)
+        emission_weight = 0.f;
+    }
+#endif
+
+    radiance += emission_weight * fabs(dot(next_intersection.normal, r->direction))
               * r->energy * interacting_material->emitted_light;
+
+#ifdef WITH_RADIANCE_CACHE
+    if (!is_background_hit && radiance_cache_is_cacheable(interacting_material))
+    {
+      vector3 facing_normal = path_vertex_get_facing_normal(&next_intersection,
+                                                            r->direction);
+      if (cache->params.is_preview && is_after_diffuse_vertex)
+      {
+        // Replace the remaining path by the cached reflected light
+        intensity reflected_radiance;
+        if (radiance_cache_lookup(cache,
+                                  next_intersection.position,
+                                  facing_normal,
+                                  &reflected_radiance))
+        {
+          radiance += r->energy * reflected_radiance;
+          break;
+        }
+      }
+
+      if (num_cache_records < RADIANCE_CACHE_MAX_RECORDED_VERTICES)
+      {
+        radiance_cache_record* record = &(cache_records[num_cache_records++]);
+        record->position = next_intersection.position;
+        record->normal = facing_normal;
+        record->throughput = r->energy;
+        record->radiance = radiance;
+      }
+      is_after_diffuse_vertex = 1;
+    }
+#endif
+
+    if (!is_background_hit)
+    {
+      radiance += r->energy * emitters_sample_direct_light(s,
+                                                           interacting_material,
+                                                           &next_intersection,
+                                                           r->direction,
+                                                           guide,
+                                                           rand);
+      radiance += r->energy * emitters_sample_environment_light(s,
+                                                                interacting_material,
+                                                                &next_intersection,
+                                                                r->direction,
+                                                                guide,
+                                                                rand);
+    }
+
+#ifdef WITH_PHOTON_MAPPING
+    int is_gathering_vertex = 0;
+    if (is_photon_map_enabled && !is_background_hit)
+    {
+      if (interacting_material->roughness >= SPECULAR_ROUGHNESS_THRESHOLD)
+      {
+        // A diffuse vertex ends the caustic segment
+        is_caustic_segment = 0;
+        if (!is_photon_map_gathered)
+        {
+          radiance += r->energy * photon_map_gather(caustics,
+                                                    interacting_material,
+                                                    &next_intersection,
+                                                    r->direction);
+          is_photon_map_gathered = 1;
+          is_gathering_vertex = 1;
+        }
+      }
+      else if (is_caustic_segment)
+      {
+        // Photons are not traced via planes, see photon_map_trace
+        if (interacting_object.type == OBJECT_TYPE_PLANE)
+          is_caustic_segment = 0;
+        ++num_specular_vertices_in_segment;
+      }
+    }
+#endif
+
     r->energy *= effective_bsdf;
 
     if(random_uniform_scalar(rand) < russian_roulette_probability)
-      material_propagate_ray(interacting_material,
-                             &next_intersection,
-                             rand,
-                             r);
+    {
+      vector3 incident = r->direction;
+      int reflected;
+#ifdef WITH_PATH_GUIDING
+      int guiding_cell = path_guide_get_cell(guide, next_intersection.position);
+      if (path_guide_is_applicable(guide, interacting_material, guiding_cell))
+      {
+        path_guide_propagate_ray(guide,
+                                 interacting_material,
+                                 &next_intersection,
+                                 guiding_cell,
+                                 rand,
+                                 r);
+        reflected = 1;
+      }
+      else
+#endif
+        reflected = material_propagate_ray(interacting_material,
+                                           &next_intersection,
+                                           rand,
+                                           r);
+
+#ifdef WITH_PREVIEW_MODE
+      if (!reflected && ++num_refractions > PREVIEW_MAX_REFRACTIONS)
+        break;
+#endif
+
+      // Only reflections to the side of the incoming ray can
+      // also be generated by explicit light sampling
+      previous_bsdf_pdf = 0.f;
+      if (reflected && emitters_is_sampling_enabled(s, interacting_material))
+      {
+        vector3 facing_normal = path_vertex_get_facing_normal(&next_intersection,
+                                                              incident);
+        if (dot(r->direction, facing_normal) > 0.f)
+          previous_bsdf_pdf = path_guide_sampling_pdf(guide,
+                                                      interacting_material,
+                                                      &next_intersection,
+                                                      incident,
+                                                      r->direction);
+      }
+      previous_position = next_intersection.position;
+
+#ifdef WITH_PATH_GUIDING
+      if (num_guiding_records < PATH_GUIDING_MAX_RECORDED_VERTICES &&
+          path_guide_is_trainable(guide, interacting_material))
+      {
+        path_guide_record* record = &(guiding_records[num_guiding_records++]);
+        record->cell = guiding_cell;
+        record->leaf = path_guide_get_leaf(r->direction);
+        record->throughput = path_guide_luminance(r->energy);
+        record->radiance = path_guide_luminance(radiance);
+        record->pdf = path_guide_sampling_pdf(guide,
+                                              interacting_material,
+                                              &next_intersection,
+                                              incident,
+                                              r->direction);
+      }
+#endif
+
+#ifdef WITH_PHOTON_MAPPING
+      if (is_gathering_vertex)
+      {
+        // The photon map only contains the light reflected to the side of
+        // the incoming ray
+        vector3 facing_normal = path_vertex_get_facing_normal(&next_intersection,
+                                                              incident);
+        is_caustic_segment = reflected && dot(r->direction, facing_normal) > 0.f;
+        num_specular_vertices_in_segment = 0;
+      }
+#endif
+    }
     else
-      return radiance;
+      break;
   }
+
+#ifdef WITH_PATH_GUIDING
+  path_guide_train(guide, guiding_records, num_guiding_records, radiance);
+#endif
+
+#ifdef WITH_RADIANCE_CACHE
+  radiance_cache_update(cache, cache_records, num_cache_records, radiance);
+#endif
+
   return radiance;
 }
 
+/// Determines the features of the first surface hit by a camera ray,
+/// which guide the denoiser.
+/// \param s The scene
+/// \param r The camera ray
+/// \param albedo Will be set to the reflectance of the hit surface, or
+/// the emitted light of the background
+/// \param normal_depth Will be set to the normal of the hit surface
+/// facing the camera (xyz) and its distance to the camera (w)
+void get_first_hit_features(const scene* s, const ray* r,
+                            float4* albedo, float4* normal_depth)
+{
+  path_vertex first_hit;
+  scene_get_nearest_intersection(s, r, &first_hit);
+
+  const material* hit_material = dot(first_hit.normal, r->direction) < 0.f ?
+                                 &(first_hit.material_to) :
+                                 &(first_hit.material_from);
+
+  intensity reflectance = hit_material->scattered_fraction + hit_material->emitted_light;
+  albedo->xyz = clamp(reflectance, (intensity)(0.f), (intensity)(1.f));
+  albedo->w = 1.f;
+
+  normal_depth->xyz = path_vertex_get_facing_normal(&first_hit, r->direction);
+  normal_depth->w = distance(first_hit.position, r->origin_vertex.position);
+}
+
 __constant sampler_t pixel_sampler = CLK_NORMALIZED_COORDS_FALSE | 
                                      CLK_ADDRESS_CLAMP_TO_EDGE |
                                      CLK_FILTER_NEAREST;
 
 
+/// Calculates the per-frame camera state. Must be executed by a single
+/// work item before \c trace_paths.
+/// \param frame_state The camera state that will be written
+/// \param cam The camera object
+/// \param width The number of pixels of the whole image in x direction
+/// \param height The number of pixels of the whole image in y direction
+/// \param offset_x The x coordinate in the whole image of the pixel (0,0)
+/// of the rendered image, if only a part of the image is rendered
+/// \param offset_y The y coordinate in the whole image of the pixel (0,0)
+/// of the rendered image
+__kernel void camera_prepare(__global camera_frame_state* frame_state,
+                             camera cam,
+                             int width,
+                             int height,
+                             int offset_x,
+                             int offset_y,
+                             SCENE_KERNEL_ARGUMENTS)
+{
+  if(get_global_id(0) == 0)
+  {
+    scene s;
+    SCENE_INIT_FROM_KERNEL_ARGUMENTS(&s);
+
+    camera_frame_state state;
+    camera_prepare_frame_state(&cam, &s, width, height, &state);
+    state.screen_origin += (scalar)offset_x * state.pixel_basis1
+                         + (scalar)offset_y * state.pixel_basis2;
+
+    *frame_state = state;
+  }
+}
+
+/// Calculates the per-frame camera states of several views, one work
+/// item per view. See \c camera_prepare.
+/// \param frame_states The camera state of each view that will be written
+/// \param cams The camera of each view
+/// \param num_views The number of views
+/// \param width The number of pixels of each view in x direction
+/// \param height The number of pixels of each view in y direction
+__kernel void camera_prepare_views(__global camera_frame_state* frame_states,
+                                   __global const camera* cams,
+                                   int num_views,
+                                   int width,
+                                   int height,
+                                   SCENE_KERNEL_ARGUMENTS)
+{
+  int view = get_global_id(0);
+  if(view < num_views)
+  {
+    scene s;
+    SCENE_INIT_FROM_KERNEL_ARGUMENTS(&s);
+
+    camera cam = cams[view];
+    camera_frame_state state;
+    camera_prepare_frame_state(&cam, &s, width, height, &state);
+
+    frame_states[view] = state;
+  }
+}
+
+/// Warps the render state of the previous camera into the view of the
+/// current camera. Each pixel follows the ray through its center and
+/// the center of the lens to the first hit, and takes over the samples of
+/// the pixel of the previous camera in which the hit has been seen, if
+/// the depth and normal found there agree. Pixels that were not visible
+/// before start without samples.
+/// \param accumulated_sums The reprojected sums of the samples of each pixel
+/// \param accumulated_compensations The compensations of the sums, see
+/// accumulation.cl
+/// \param previous_render_state The average of the samples of each pixel
+/// of the previous camera, as written by the path tracer
+/// \param sample_counts The reprojected number of rays of each pixel
+/// \param previous_sample_counts The number of rays of each pixel of the
+/// previous camera
+/// \param albedo_buffer The reprojected first-hit albedo
+/// \param previous_albedo_buffer The first-hit albedo of the previous camera
+/// \param normal_depth_buffer The reprojected first-hit normal and depth
+/// \param previous_normal_depth_buffer The first-hit normal and depth of
+/// the previous camera
+/// \param cam The current camera
+/// \param cam_state The current camera state, as calculated by \c camera_prepare
+/// \param previous_cam The previous camera
+/// \param previous_cam_state The camera state of the previous camera
+/// \param max_sample_count The number of rays of reprojected pixels is
+/// limited to this value, such that the new view soon dominates.
+__kernel void reproject_render_state(__global float4* accumulated_sums,
+                                     __global half* accumulated_compensations,
+                                     __read_only image2d_t previous_render_state,
+                                     __global int* sample_counts,
+                                     __global const int* previous_sample_counts,
+                                     __global float4* albedo_buffer,
+                                     __global const float4* previous_albedo_buffer,
+                                     __global float4* normal_depth_buffer,
+                                     __global const float4* previous_normal_depth_buffer,
+                                     camera cam,
+                                     __global const camera_frame_state* cam_state,
+                                     camera previous_cam,
+                                     __global const camera_frame_state* previous_cam_state,
+                                     int max_sample_count,
+                                     SCENE_KERNEL_ARGUMENTS)
+{
+  int width = get_image_width(previous_render_state);
+  int height = get_image_height(previous_render_state);
+
+  int px_x = get_global_id(0);
+  int px_y = get_global_id(1);
+
+  if (px_x >= width || px_y >= height)
+    return;
+
+  scene s;
+  SCENE_INIT_FROM_KERNEL_ARGUMENTS(&s);
+
+  camera_frame_state state = *cam_state;
+  camera_frame_state previous_state = *previous_cam_state;
+
+  int2 coord = (int2)(px_x, px_y);
+  int pixel_index = px_y * width + px_x;
+
+  vector3 screen_position = state.screen_origin
+                          + ((scalar)px_x + 0.5f) * state.pixel_basis1
+                          + ((scalar)px_y + 0.5f) * state.pixel_basis2;
+  ray r;
+  r.origin_vertex.position = simple_lens_object_get_center(&(cam.camera_lens));
+  r.direction = normalize(r.origin_vertex.position - screen_position);
+
+  path_vertex first_hit;
+  scene_get_nearest_intersection(&s, &r, &first_hit);
+  vector3 normal = path_vertex_get_facing_normal(&first_hit, r.direction);
+
+  rgba_color color = (rgba_color)(0.f, 0.f, 0.f, 0.f);
+  float4 albedo = (float4)(0.f, 0.f, 0.f, 0.f);
+  float4 normal_depth = (float4)(0.f, 0.f, 0.f, 0.f);
+  int num_samples = 0;
+
+  float2 previous_pixel;
+  if (camera_project(&previous_cam, &previous_state, first_hit.position, &previous_pixel))
+  {
+    int previous_x = (int)floor(previous_pixel.x);
+    int previous_y = (int)floor(previous_pixel.y);
+
+    if (previous_x >= 0 && previous_x < width &&
+        previous_y >= 0 && previous_y < height)
+    {
+      int previous_index = previous_y * width + previous_x;
+      float4 previous_normal_depth = previous_normal_depth_buffer[previous_index];
+
+      // Reject pixels that have been covered by a different surface
+      scalar depth = distance(first_hit.position,
+                              simple_lens_object_get_center(&(previous_cam.camera_lens)));
+      int is_same_depth = fabs(previous_normal_depth.w - depth) < 0.05f * depth;
+      int is_same_normal = dot(previous_normal_depth.xyz, normal)
+                         > 0.9f * length(previous_normal_depth.xyz);
+
+      if (is_same_depth && is_same_normal)
+      {
+        num_samples = min(previous_sample_counts[previous_index], max_sample_count);
+        color = read_imagef(previous_render_state, pixel_sampler,
+                            (int2)(previous_x, previous_y));
+        albedo = previous_albedo_buffer[previous_index];
+        // The depth is now measured from the current camera
+        normal_depth.xyz = previous_normal_depth.xyz;
+        normal_depth.w = distance(first_hit.position, r.origin_vertex.position);
+      }
+    }
+  }
+
+  // The samples are only read from the previous render state, so the
+  // sums can be replaced in place
+  accumulation_store(accumulated_sums, accumulated_compensations, pixel_index,
+                     color * (float)num_samples, (float4)(0.f, 0.f, 0.f, 0.f));
+  sample_counts[pixel_index] = num_samples;
+  albedo_buffer[pixel_index] = albedo;
+  normal_depth_buffer[pixel_index] = normal_depth;
+}
+
+/// Adds samples that have been traced separately, e.g. by another device,
+/// to the accumulated render state. The processed rows are selected by
+/// the global work offset.
+/// \param pixels The image of the average of the samples of each pixel
+/// \param accumulated_sums The sums of the samples of each pixel, row-major
+/// \param accumulated_compensations The compensations of the sums
+/// \param sample_counts The number of samples of each pixel
+/// \param albedo_buffer The average first-hit albedo of each pixel
+/// \param normal_depth_buffer The average first-hit normal and depth of each pixel
+/// \param merged_sums The sums of the added samples of each pixel. They
+/// have no compensations: they either contain the samples of a single
+/// frame of another device, or have been summed in double precision on
+/// the host, e.g. the results of distributed workers, which include the
+/// compensations of the workers.
+/// \param merged_sample_counts The number of added samples of each pixel
+/// \param merged_albedo_buffer The first-hit albedo of the added samples
+/// \param merged_normal_depth_buffer The first-hit normal and depth of the
+/// added samples
+/// \param num_previous_rays If 0, the previous render state is discarded
+__kernel void merge_samples(__write_only image2d_t pixels,
+                            __global float4* accumulated_sums,
+                            __global half* accumulated_compensations,
+                            __global int* sample_counts,
+                            __global float4* albedo_buffer,
+                            __global float4* normal_depth_buffer,
+                            __global const float4* merged_sums,
+                            __global const int* merged_sample_counts,
+                            __global const float4* merged_albedo_buffer,
+                            __global const float4* merged_normal_depth_buffer,
+                            int num_previous_rays)
+{
+  int width = get_image_width(pixels);
+  int height = get_image_height(pixels);
+
+  int px_x = get_global_id(0);
+  int px_y = get_global_id(1);
+
+  if (px_x >= width || px_y >= height)
+    return;
+
+  int pixel_index = px_y * width + px_x;
+
+  float4 sum = (float4)(0.f, 0.f, 0.f, 0.f);
+  float4 compensation = (float4)(0.f, 0.f, 0.f, 0.f);
+  int previous_pixel_rays = 0;
+  if (num_previous_rays > 0)
+  {
+    accumulation_load(accumulated_sums, accumulated_compensations, pixel_index,
+                      &sum, &compensation);
+    previous_pixel_rays = sample_counts[pixel_index];
+  }
+
+  int num_rays = merged_sample_counts[pixel_index];
+  int total_ray_number = previous_pixel_rays + num_rays;
+
+  if (num_rays > 0)
+  {
+    accumulation_add(&sum, &compensation, merged_sums[pixel_index]);
+
+    float4 albedo = merged_albedo_buffer[pixel_index];
+    float4 normal_depth = merged_normal_depth_buffer[pixel_index];
+    if (previous_pixel_rays > 0)
+    {
+      scalar merged_weight = (scalar)num_rays / (scalar)total_ray_number;
+      albedo = mix(albedo_buffer[pixel_index], albedo, merged_weight);
+      normal_depth = mix(normal_depth_buffer[pixel_index], normal_depth,
+                         merged_weight);
+    }
+    albedo_buffer[pixel_index] = albedo;
+    normal_depth_buffer[pixel_index] = normal_depth;
+  }
+
+  accumulation_store(accumulated_sums, accumulated_compensations, pixel_index,
+                     sum, compensation);
+  sample_counts[pixel_index] = total_ray_number;
+  write_imagef(pixels, (int2)(px_x, px_y),
+               accumulation_get_mean(sum, compensation, total_ray_number));
+}
+
 /// Main kernel for the path tracing algorithm
-/// \param pixels An image into which the current rendering state will be written
-/// \param current_render_state The rendering state of the previous frame
-/// \param num_previous_rays The number of rays (per pixel) that have been evaluated until now
+/// \param pixels An image into which the current rendering state will be written.
+/// xyz contains the average color, w the average squared luminance of the samples.
+/// \param accumulated_sums The sums of the samples of each pixel, row-major,
+/// which are updated in place. See accumulation.cl.
+/// \param accumulated_compensations The compensations of the sums
+/// \param num_previous_rays The number of rays (per pixel) that have been evaluated
+/// until now on average. If 0, the previous rendering state is discarded.
 /// \param permanent_random_state_buffer The state buffer of the random number generator
-/// \param cam The camera object
-/// \param rays_per_pixel How many rays per pixel to be evaluated
+/// \param cam The camera object. With WITH_MULTIPLE_VIEWS, \c cams holds
+/// the camera of each view instead.
+/// \param cam_state The per-frame camera state, as calculated by \c camera_prepare.
+/// With WITH_MULTIPLE_VIEWS, \c cam_states holds the state of each view, as
+/// calculated by \c camera_prepare_views.
+/// \param rays_per_pixel How many rays per pixel to be evaluated on average
+/// \param sample_counts The number of rays evaluated for each pixel, row-major
+/// \param error_sums Accumulated relative errors of the current and the previous frame,
+/// followed by the number of rays traced by the current launch
+/// \param error_sum_slot The element of \c error_sums used by the current frame.
+/// It must have been set to zero.
+/// \param sampling_mode One of the SAMPLING_MODE_* values
+/// \param convergence_threshold The relative error below which pixels are
+/// considered as converged
+/// \param albedo_buffer The average first-hit albedo of each pixel, row-major
+/// \param normal_depth_buffer The average first-hit normal (xyz) and
+/// depth (w) of each pixel, row-major
+/// \param write_features Whether the first-hit features are written
+/// \param pixel_stride Only every pixel_stride-th pixel in each direction
+/// is traced, for rendering at a reduced resolution. See upsampling.cl.
+/// \param priority The region of the image that receives more rays
+/// \param priority_mask Per-pixel ray factors, if enabled in \c priority
 /// \param objects The object list of the scene
 /// \param spheres The list of spheres in the scene
 /// \param planes The list of planes in the scene
@@ -182,94 +859,207 @@ __constant sampler_t pixel_sampler = CLK_NORMALIZED_COORDS_FALSE |
 /// \param num_planes The number of planes in the scene
 /// \param num_disks The number of disks in the scene
 /// \param far_clipping_distance The distance at which the skydome is located
-__kernel void trace_paths(__write_only image2d_t pixels,
-                          __read_only image2d_t current_render_state, //output of previous kernel
-                          int num_previous_rays,
-                          __global int *permanent_random_state_buffer,
-                          camera cam,
-                          int rays_per_pixel,
-
-                          // Scene definition
-                          __global object_entry *objects,
-                          __global object_sphere_geometry *spheres,
-                          __global object_plane_geometry *planes,
-                          __global object_disk_geometry *disks,
-                          int num_spheres,
-                          int num_planes,
-                          int num_disks,
-                          float far_clipping_distance,
-                          material_id background_material,
-                          
-                          // Material Database
-                          __global float4 * texture_data_buffer,
-                          __global int *widths,
-                          __global int *heights,
-                          __global unsigned long *offsets,
-                          __global material_db_entry* materials,
-                          int num_materials,
-                          int num_textures)
+__kernel void TRACE_PATHS_KERNEL(__write_only image2d_t pixels,
+                                 __global float4* accumulated_sums,
+                                 __global half* accumulated_compensations,
+                                 int num_previous_rays,
+                                 __global int *permanent_random_state_buffer,
+                                 CAMERA_KERNEL_ARGUMENTS,
+                                 int rays_per_pixel,
+                                 __global int* sample_counts,
+                                 __global unsigned* error_sums,
+                                 int error_sum_slot,
+                                 int sampling_mode,
+                                 float convergence_threshold,
+                                 __global float4* albedo_buffer,
+                                 __global float4* normal_depth_buffer,
+                                 int write_features,
+                                 int pixel_stride,
+                                 sampling_priority priority,
+                                 __global const float* priority_mask,
+                                 SCENE_KERNEL_ARGUMENTS
+                                 INTEGRATOR_EXTENSIONS_KERNEL_ARGUMENTS)
 {
+  __local scalar group_errors[ADAPTIVE_SAMPLING_MAX_GROUP_SIZE];
+  __local int group_rays[ADAPTIVE_SAMPLING_MAX_GROUP_SIZE];
+
   // Get resolution of render window
   int width = get_image_width(pixels);
   int height = get_image_height(pixels);
 
+#ifdef WITH_MULTIPLE_VIEWS
+  // The views are stacked vertically in the image, the third dimension
+  // of the NDRange selects the view
+  int view = get_global_id(2);
+  int view_height = height / (int)get_global_size(2);
+#else
+  int view = 0;
+  int view_height = height;
+#endif
+  int view_offset = view * view_height;
+
   // Determine which pixel this thread will process
-  int px_x = get_global_id(0);
-  int px_y = get_global_id(1);
+  int px_x = get_global_id(0) * pixel_stride;
+  int px_y = get_global_id(1) * pixel_stride;
 
   random_ctx random;
 
-  if(px_x < width && px_y < height)
+  scalar pixel_error = 0.f;
+  int pixel_rays = 0;
+  int is_valid_pixel = px_x < width && px_y < view_height;
+
+  if(is_valid_pixel)
   {
     random_init(&random, permanent_random_state_buffer);
     // Initialize scene object
-    int num_objects = num_spheres + num_planes + num_disks;
     scene s;
-    scene_init(&s, objects, num_objects,
-               spheres, num_spheres,
-               planes, num_planes,
-               disks, num_disks,
-               far_clipping_distance,
-               background_material);
-
-    s.materials.data_buffer = texture_data_buffer;
-    s.materials.width   = widths;
-    s.materials.height  = heights;
-    s.materials.offsets = offsets;
-    s.materials.num_materials = num_materials;
-    s.materials.num_textures = num_textures;
-    s.materials.materials = materials;
-
-    // Calculate focal distance if autofocus is enabled
-    if(cam.camera_lens.focal_length <= 0.0f)
-      camera_autofocus(&cam, &s);
+    SCENE_INIT_FROM_KERNEL_ARGUMENTS(&s);
+
+    integrator_extensions extensions;
+    INTEGRATOR_EXTENSIONS_INIT_FROM_KERNEL_ARGUMENTS(&extensions);
+
+#ifdef WITH_MULTIPLE_VIEWS
+    camera cam = cams[view];
+    camera_frame_state frame_state = cam_states[view];
+#else
+    camera_frame_state frame_state = *cam_state;
+#endif
+    cam.camera_lens.focal_length = frame_state.focal_length;
+
+    // The row of the pixel in the image of all views
+    int image_y = view_offset + px_y;
+    int2 coord = (int2)(px_x, image_y);
+    int pixel_index = image_y * width + px_x;
+
+    float4 sum = (float4)(0.f, 0.f, 0.f, 0.f);
+    float4 compensation = (float4)(0.f, 0.f, 0.f, 0.f);
+    int previous_pixel_rays = 0;
+    if(num_previous_rays > 0)
+    {
+      accumulation_load(accumulated_sums, accumulated_compensations, pixel_index,
+                        &sum, &compensation);
+      previous_pixel_rays = sample_counts[pixel_index];
+    }
+    rgba_color previous_result = accumulation_get_mean(sum, compensation,
+                                                       previous_pixel_rays);
+
+    int num_rays = adaptive_sampling_get_num_rays(
+                        sampling_mode,
+                        rays_per_pixel,
+                        previous_pixel_rays,
+                        adaptive_sampling_get_error(previous_result, previous_pixel_rays),
+                        adaptive_sampling_get_mean_error(error_sums, error_sum_slot),
+                        convergence_threshold);
+
+    num_rays = adaptive_sampling_apply_priority(
+                        num_rays,
+                        adaptive_sampling_get_priority(&priority, priority_mask,
+                                                       px_x, image_y, width),
+                        previous_pixel_rays,
+                        random_uniform_scalar(&random));
+    pixel_rays = num_rays;
 
     // Actual work starts here
     intensity pixel_value = (intensity)(0, 0, 0);
+    scalar squared_luminance = 0.f;
+    float4 albedo = (float4)(0.f, 0.f, 0.f, 0.f);
+    float4 normal_depth = (float4)(0.f, 0.f, 0.f, 0.f);
     ray r;
-    for (int i = 0; i < rays_per_pixel; ++i)
+    for (int i = 0; i < num_rays; ++i)
     {
-      camera_generate_ray(&cam, &random, width, height, px_x, px_y, &r);
+      camera_generate_ray(&cam, &frame_state, &random, px_x, px_y, &r);
+
+      // One camera ray per frame suffices to estimate the features
+      if (write_features && i == 0)
+        get_first_hit_features(&s, &r, &albedo, &normal_depth);
+
+#ifdef WITH_BIDIRECTIONAL_PATH_TRACING
+      intensity ray_value = bdpt_evaluate_ray(&r, &random, &s);
+#else
+      intensity ray_value = evaluate_ray(&r, &random, &s, &extensions);
+#endif
+      scalar luminance = adaptive_sampling_luminance(ray_value);
 
-      pixel_value += evaluate_ray(&r, &random, &s);
+      pixel_value += ray_value;
+      squared_luminance += luminance * luminance;
     }
 
     // Save result
-    int2 coord = (int2)(px_x, px_y);
+    int total_ray_number = num_rays + previous_pixel_rays;
+
+    if(num_rays > 0)
+    {
+      scalar previous_weight = (scalar)previous_pixel_rays / (scalar)total_ray_number;
 
-    rgba_color previous_result = read_imagef(current_render_state, pixel_sampler, coord);
-    scalar total_ray_number = (scalar)rays_per_pixel + (scalar)num_previous_rays;
+      accumulation_add(&sum, &compensation,
+                       (float4)(pixel_value, squared_luminance));
 
-    rgba_color color;
-    color.xyz = pixel_value / total_ray_number;
-    color += previous_result * (scalar)num_previous_rays / total_ray_number;
-    color.w = 1.f;
+      if (write_features)
+      {
+        if (previous_pixel_rays > 0)
+        {
+          albedo = mix(albedo_buffer[pixel_index], albedo, 1.f - previous_weight);
+          normal_depth = mix(normal_depth_buffer[pixel_index], normal_depth,
+                             1.f - previous_weight);
+        }
+        albedo_buffer[pixel_index] = albedo;
+        normal_depth_buffer[pixel_index] = normal_depth;
+      }
+    }
+
+    // The sums are also stored if no rays have been traced, since they
+    // are reset if the previous render state is discarded
+    accumulation_store(accumulated_sums, accumulated_compensations, pixel_index,
+                       sum, compensation);
+    sample_counts[pixel_index] = total_ray_number;
 
+    rgba_color color = accumulation_get_mean(sum, compensation, total_ray_number);
     write_imagef(pixels, coord, color);
+
+    // With a pixel stride, this work item is responsible for a block of
+    // pixels of which only the first one is traced. The others keep their
+    // samples, and their average is written such that the image remains
+    // a complete render state for the reprojection.
+    for (int y = image_y; y < min(image_y + pixel_stride, view_offset + view_height); ++y)
+    {
+      for (int x = px_x; x < min(px_x + pixel_stride, width); ++x)
+      {
+        if (x == px_x && y == image_y)
+          continue;
+
+        int block_index = y * width + x;
+        float4 block_sum = (float4)(0.f, 0.f, 0.f, 0.f);
+        float4 block_compensation = (float4)(0.f, 0.f, 0.f, 0.f);
+        int block_rays = 0;
+        if (num_previous_rays > 0)
+        {
+          accumulation_load(accumulated_sums, accumulated_compensations, block_index,
+                            &block_sum, &block_compensation);
+          block_rays = sample_counts[block_index];
+        }
+        else
+        {
+          accumulation_store(accumulated_sums, accumulated_compensations, block_index,
+                             block_sum, block_compensation);
+          sample_counts[block_index] = 0;
+        }
+        write_imagef(pixels, (int2)(x, y),
+                     accumulation_get_mean(block_sum, block_compensation, block_rays));
+      }
+    }
+
+    pixel_error = adaptive_sampling_get_error(color, total_ray_number);
+
     random_fini(&random);
   }
-  //else
-  //  printf("res %d %d, %d %d: not processing\n", width, height, px_x, px_y);
+
+  adaptive_sampling_accumulate_error(group_errors,
+                                     group_rays,
+                                     pixel_error,
+                                     pixel_rays,
+                                     is_valid_pixel,
+                                     error_sums,
+                                     error_sum_slot);
 }
 
 #endif
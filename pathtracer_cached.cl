@@ -0,0 +1,31 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATHTRACER_CACHED_CL
+#define PATHTRACER_CACHED_CL
+
+// Path tracer variant that maintains a world-space cache of the reflected
+// light, into which paths are terminated while the user interacts,
+// see radiance_cache.cl
+
+#define WITH_RADIANCE_CACHE
+#define TRACE_PATHS_KERNEL trace_paths_cached
+
+#include "pathtracer.cl"
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATHTRACER_MULTIVIEW_CL
+#define PATHTRACER_MULTIVIEW_CL
+
+// Path tracer variant that renders several views of the scene in one
+// launch, e.g. a stereo pair or the faces of a cube map. The views are
+// stacked vertically in the image, and the third dimension of the
+// NDRange selects the view.
+
+#define WITH_MULTIPLE_VIEWS
+#define TRACE_PATHS_KERNEL trace_paths_multiview
+
+#include "pathtracer.cl"
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PHOTON_MAP_CL
+#define PHOTON_MAP_CL
+
+#include "random.cl"
+#include "scene.cl"
+#include "emitters.cl"
+
+// Caustic photon map for (probabilistic) progressive photon mapping.
+// Only photons that have been scattered by at least one specular surface
+// before hitting a diffuse surface are stored. The path tracer gathers
+// them at its first diffuse vertex and in return ignores the light that
+// reaches this vertex along purely specular paths.
+
+#define PHOTON_MAP_MAX_BOUNCES 16
+
+typedef struct
+{
+  __global const photon* photons;
+  __global const int* grid_heads;
+  photon_map_parameters params;
+} photon_map;
+
+/// The kernel parameters describing a photon map, in the order in which they
+/// are pushed by the host.
+#define PHOTON_MAP_KERNEL_ARGUMENTS                          \
+  __global const photon* photons,                            \
+  __global const int* photon_grid_heads,                     \
+  photon_map_parameters photon_map_params
+
+#define PHOTON_MAP_INIT_FROM_KERNEL_ARGUMENTS(photon_map_ptr)           \
+  do                                                                    \
+  {                                                                     \
+    (photon_map_ptr)->photons = photons;                                \
+    (photon_map_ptr)->grid_heads = photon_grid_heads;                   \
+    (photon_map_ptr)->params = photon_map_params;                       \
+  } while(0)
+
+/// \return The cell of the hash grid that contains a given position
+int3 photon_map_get_cell(const photon_map_parameters* params, vector3 position)
+{
+  vector3 cell = floor(position / params->cell_size);
+  return (int3)((int)cell.x, (int)cell.y, (int)cell.z);
+}
+
+/// \return The hash of a grid cell
+int photon_map_hash(const photon_map_parameters* params, int3 cell)
+{
+  unsigned hash = ((unsigned)cell.x * 73856093u)
+                ^ ((unsigned)cell.y * 19349663u)
+                ^ ((unsigned)cell.z * 83492791u);
+  return (int)(hash % (unsigned)params->hash_grid_size);
+}
+
+/// Generates a photon leaving an emissive object or the environment.
+/// \return 0 if no photon could be generated
+/// \param s The scene
+/// \param params The photon map parameters
+/// \param rand The random number generator context
+/// \param r Will contain the photon ray, the flux is stored in its energy
+int photon_map_emit(const scene* s,
+                    const photon_map_parameters* params,
+                    random_ctx* rand,
+                    ray* r)
+{
+  vector3 position;
+  vector3 direction;
+  intensity flux;
+
+  if(random_uniform_scalar(rand) < params->environment_probability)
+  {
+    // Emit from the environment towards the specular objects
+    vector3 environment_direction = emitters_sample_environment(s, rand);
+    scalar direction_pdf = emitters_environment_pdf(s, environment_direction);
+    if(direction_pdf <= 0.f)
+      return 0;
+
+    // Start on a disk perpendicular to the direction, covering
+    // the bounding sphere of the specular objects
+    disk_geometry start_disk;
+    start_disk.plane.normal = environment_direction;
+    start_disk.plane.position = params->specular_bounds_center
+                              + params->specular_bounds_radius * environment_direction;
+    start_disk.radius = params->specular_bounds_radius;
+
+    position = emitters_sample_disk_point(&start_disk, rand);
+    direction = -environment_direction;
+
+    float2 uv = (float2)(atan2pi(environment_direction.y, environment_direction.x) * 0.5f + 0.5f,
+                         acospi(environment_direction.z));
+    intensity emitted_light = material_db_get_material(&(s->materials),
+                                                       s->background_material,
+                                                       uv).emitted_light;
+
+    scalar area = M_PI_F * start_disk.radius * start_disk.radius;
+    flux = emitted_light * area / (direction_pdf * params->environment_probability);
+  }
+  else
+  {
+    object_entry emitter = emitters_select(s, rand);
+    scalar probability = emitter.emitter_probability
+                       * (1.f - params->environment_probability);
+
+    vector3 normal;
+    scalar area;
+    if(emitter.type == OBJECT_TYPE_SPHERE)
+    {
+      sphere_geometry sphere = s->spheres[emitter.local_id].geometry;
+      normal = random_uniform_sphere(rand);
+      position = sphere.position + sphere.radius * normal;
+      area = 4.f * M_PI_F * sphere.radius * sphere.radius;
+    }
+    else if(emitter.type == OBJECT_TYPE_DISK_PLANE)
+    {
+      disk_geometry disk = s->disks[emitter.local_id].geometry;
+      position = emitters_sample_disk_point(&disk, rand);
+      normal = disk.plane.normal;
+      // Disks emit to both sides
+      if(random_uniform_scalar(rand) < 0.5f)
+        normal *= -1.f;
+      area = 2.f * M_PI_F * disk.radius * disk.radius;
+    }
+    else
+      return 0;
+
+    // Cosine weighted direction
+    scalar cos_theta = sqrt(random_uniform_scalar(rand));
+    direction = random_point_on_cone(rand, normal, cos_theta);
+
+    // The emitted radiance is proportional to the cosine, see evaluate_ray.
+    // Together with the pdf cos/pi of the direction this yields:
+    flux = emitters_get_emitted_light(s, emitter, normal)
+         * M_PI_F * cos_theta * area / probability;
+  }
+
+  r->origin_vertex.position = position + self_shadowing_epsilon * direction;
+  r->direction = direction;
+  r->energy = flux / (scalar)params->num_photons;
+
+  return 1;
+}
+
+/// Traces a photon until it hits a diffuse surface.
+/// \return 1 if the photon should be stored, i.e. if it has been scattered
+/// by a specular surface before, 0 otherwise
+/// \param s The scene
+/// \param rand The random number generator context
+/// \param r The photon ray
+/// \param result Will contain the stored photon
+int photon_map_trace(const scene* s, random_ctx* rand, ray* r, photon* result)
+{
+  int num_specular_bounces = 0;
+
+  for(int i = 0; i < PHOTON_MAP_MAX_BOUNCES; ++i)
+  {
+    path_vertex vertex;
+    scene_get_nearest_intersection(s, r, &vertex);
+
+    if(vertex.hit_object_to.type == OBJECT_TYPE_BACKGROUND)
+      return 0;
+
+    material* interacting_material;
+    object_entry interacting_object;
+    if(dot(vertex.normal, r->direction) < 0.f)
+    {
+      interacting_material = &(vertex.material_to);
+      interacting_object = vertex.hit_object_to;
+    }
+    else
+    {
+      interacting_material = &(vertex.material_from);
+      interacting_object = vertex.hit_object_from;
+    }
+
+    if(interacting_material->roughness >= SPECULAR_ROUGHNESS_THRESHOLD)
+    {
+      if(num_specular_bounces == 0)
+        // Direct illumination is handled by the path tracer
+        return 0;
+
+      result->position = vertex.position;
+      result->direction = r->direction;
+      result->flux = r->energy;
+      return 1;
+    }
+
+    // Caustics involving planes cannot be reached by photons from the
+    // environment and are therefore left to the path tracer.
+    if(interacting_object.type == OBJECT_TYPE_PLANE)
+      return 0;
+
+    ++num_specular_bounces;
+
+    // Russian roulette
+    intensity scattered_fraction = interacting_material->scattered_fraction;
+    scalar survival_probability = fmin(1.f,
+                                       fmax(scattered_fraction.x,
+                                            fmax(scattered_fraction.y,
+                                                 scattered_fraction.z)));
+    if(random_uniform_scalar(rand) >= survival_probability)
+      return 0;
+
+    r->energy *= scattered_fraction * (1.f / survival_probability);
+    material_propagate_ray(interacting_material, &vertex, rand, r);
+  }
+  return 0;
+}
+
+/// Estimates the caustic radiance reflected at a diffuse path vertex
+/// towards the camera.
+/// \return The reflected radiance, not yet multiplied with the energy of the path
+/// \param ctx The photon map
+/// \param mat The material at the path vertex
+/// \param impact The path vertex
+/// \param incident The direction of the path arriving at \c impact
+intensity photon_map_gather(const photon_map* ctx,
+                            const material* mat,
+                            const path_vertex* impact,
+                            vector3 incident)
+{
+  const photon_map_parameters* params = &(ctx->params);
+
+  vector3 facing_normal = path_vertex_get_facing_normal(impact, incident);
+  scalar radius2 = params->radius * params->radius;
+
+  // Since the cells have twice the size of the gathering radius,
+  // 2x2x2 cells cover the gathering sphere.
+  vector3 relative_position = impact->position / params->cell_size;
+  int3 cell = photon_map_get_cell(params, impact->position);
+  vector3 position_in_cell = relative_position - floor(relative_position);
+  int3 neighbor_offset = (int3)(position_in_cell.x < 0.5f ? -1 : 1,
+                                position_in_cell.y < 0.5f ? -1 : 1,
+                                position_in_cell.z < 0.5f ? -1 : 1);
+
+  intensity result = (intensity)(0, 0, 0);
+
+  int visited_hashes[8];
+  for(int i = 0; i < 8; ++i)
+  {
+    int3 current_cell = cell;
+    if(i & 1) current_cell.x += neighbor_offset.x;
+    if(i & 2) current_cell.y += neighbor_offset.y;
+    if(i & 4) current_cell.z += neighbor_offset.z;
+
+    int hash = photon_map_hash(params, current_cell);
+    visited_hashes[i] = hash;
+
+    // Different cells can map to the same hash - do not
+    // gather their photons twice
+    int already_visited = 0;
+    for(int j = 0; j < i; ++j)
+      if(visited_hashes[j] == hash)
+        already_visited = 1;
+    if(already_visited)
+      continue;
+
+    for(int photon_id = ctx->grid_heads[hash];
+        photon_id >= 0;
+        photon_id = ctx->photons[photon_id].next)
+    {
+      photon p = ctx->photons[photon_id];
+
+      vector3 delta = vec_from_to(impact->position, p.position);
+      if(dot(delta, delta) > radius2)
+        continue;
+
+      // The photon must arrive at the same side of the surface
+      if(dot(p.direction, facing_normal) >= 0.f)
+        continue;
+
+      // The BSDF times the cosine term equals the scattered fraction
+      // times the reflection pdf
+      vector3 to_light = -p.direction;
+      scalar cos_theta = fabs(dot(impact->normal, to_light));
+      if(cos_theta <= 0.f)
+        continue;
+
+      scalar pdf = material_reflection_pdf(mat, impact, incident, to_light);
+      result += p.flux * (pdf / cos_theta);
+    }
+  }
+
+  return mat->scattered_fraction * result / (M_PI_F * radius2);
+}
+
+/// Traces one photon per work item and inserts the stored photons into
+/// the hash grid. The heads of the hash grid must have been set to -1.
+/// \param photons The photon buffer, one photon per work item
+/// \param grid_heads The first photon of each hash grid cell
+/// \param permanent_random_state_buffer The state buffer of the random number generator
+/// \param params The photon map parameters of this pass
+__kernel void trace_photons(__global photon* photons,
+                            __global int* grid_heads,
+                            __global int* permanent_random_state_buffer,
+                            photon_map_parameters params,
+                            SCENE_KERNEL_ARGUMENTS)
+{
+  int photon_id = get_global_id(0);
+  if(photon_id >= params.num_photons)
+    return;
+
+  random_ctx random;
+  random_init(&random, permanent_random_state_buffer);
+
+  scene s;
+  SCENE_INIT_FROM_KERNEL_ARGUMENTS(&s);
+
+  photon result;
+  result.flux = (vector3)(0.f, 0.f, 0.f);
+  result.next = -1;
+
+  ray r;
+  if(photon_map_emit(&s, &params, &random, &r) &&
+     photon_map_trace(&s, &random, &r, &result))
+  {
+    int cell_hash = photon_map_hash(&params, photon_map_get_cell(&params, result.position));
+    result.next = atomic_xchg(grid_heads + cell_hash, photon_id);
+  }
+
+  photons[photon_id] = result;
+
+  random_fini(&random);
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PHOTON_MAP_HPP
+#define PHOTON_MAP_HPP
+
+#include "integrator_extension.hpp"
+#include "random.hpp"
+#include "common.cl_hpp"
+
+#include <cmath>
+
+namespace gray {
+
+/// Probabilistic progressive photon mapping for caustics, to be used with
+/// the \c trace_paths_ppm kernel. In each pass (i.e., each frame) a new
+/// caustic photon map is traced and stored in a hash grid on the device.
+/// The gathering radius shrinks from pass to pass, such that the average
+/// over all passes converges to the correct result.
+class photon_map : public integrator_extension
+{
+public:
+  /// \param ctx The device context
+  /// \param num_photons The number of photons emitted per pass
+  /// \param alpha Controls how fast the radius shrinks, must be in (0,1).
+  /// \param seed The seed of the random number generator
+  photon_map(const qcl::device_context_ptr& ctx,
+             std::size_t num_photons = 1 << 18,
+             scalar alpha = 0.7f,
+             std::size_t seed = device_object::random_engine::generate_seed())
+  : _ctx{ctx},
+    _trace_kernel{ctx->get_kernel("trace_photons")},
+    _num_photons{num_photons},
+    _hash_grid_size{2 * num_photons},
+    _alpha{alpha},
+    _initial_radius{-1.0f},
+    _radius{-1.0f},
+    _pass{0},
+    _random{ctx, num_photons, 1, seed}
+  {
+    assert(alpha > 0.0f && alpha < 1.0f);
+
+    _ctx->create_buffer<device_object::photon>(_photons,
+                                               CL_MEM_READ_WRITE,
+                                               _num_photons);
+    _ctx->create_buffer<cl_int>(_grid_heads,
+                                CL_MEM_READ_WRITE,
+                                _hash_grid_size);
+
+    _params.num_photons = 0;
+    _params.hash_grid_size = static_cast<cl_int>(_hash_grid_size);
+    _params.environment_probability = 0.0f;
+    _params.radius = 0.0f;
+    _params.cell_size = 0.0f;
+    _params.specular_bounds_center = VECTOR3(0.0f, 0.0f, 0.0f);
+    _params.specular_bounds_radius = 0.0f;
+  }
+
+  /// Sets the gathering radius of the first pass. By default, it
+  /// is derived from the size of the specular objects.
+  void set_initial_radius(scalar radius)
+  {
+    assert(radius > 0.0f);
+    _initial_radius = radius;
+  }
+
+  scalar get_current_radius() const
+  {
+    return _radius;
+  }
+
+  virtual void prepare_frame(const device_object::scene& s) override
+  {
+    ++_pass;
+
+    if(_pass == 1)
+      setup_light_sources(s);
+
+    update_radius();
+    _params.radius = _radius;
+    _params.cell_size = 2.0f * _radius;
+
+    cl_int empty_cell = -1;
+    cl_int err = _ctx->get_command_queue().enqueueFillBuffer(_grid_heads,
+                                                             empty_cell,
+                                                             0,
+                                                             _hash_grid_size * sizeof(cl_int));
+    qcl::check_cl_error(err, "Could not enqueue photon grid reset!");
+
+    if(_params.num_photons == 0)
+      return;
+
+    qcl::kernel_argument_list arguments(_trace_kernel);
+    arguments.push(_photons);
+    arguments.push(_grid_heads);
+    arguments.push(_random.get());
+    arguments.push(&_params, sizeof(device_object::photon_map_parameters));
+    s.push_kernel_arguments(arguments);
+
+    err = _ctx->get_command_queue().enqueueNDRangeKernel(*_trace_kernel,
+                                                         cl::NullRange,
+                                                         cl::NDRange(_num_photons),
+                                                         cl::NullRange);
+    qcl::check_cl_error(err, "Could not enqueue photon tracing kernel call!");
+  }
+
+  virtual void push_kernel_arguments(qcl::kernel_argument_list& arguments) const override
+  {
+    arguments.push(_photons);
+    arguments.push(_grid_heads);
+    arguments.push(&_params, sizeof(device_object::photon_map_parameters));
+  }
+
+  virtual void reset() override
+  {
+    _pass = 0;
+  }
+
+private:
+  /// Determines from where photons are emitted
+  void setup_light_sources(const device_object::scene& s)
+  {
+    bool has_specular_objects = s.get_specular_bounds(_params.specular_bounds_center,
+                                                      _params.specular_bounds_radius);
+
+    bool has_environment = s.get_materials().get_environment_width() > 0;
+    bool has_emitters = s.get_num_emitters() > 0;
+
+    // Without specular objects there are no caustics, and
+    // without light sources there is nothing to trace.
+    if(!has_specular_objects || (!has_environment && !has_emitters))
+    {
+      _params.num_photons = 0;
+      _params.environment_probability = 0.0f;
+    }
+    else
+    {
+      _params.num_photons = static_cast<cl_int>(_num_photons);
+      if(has_environment && has_emitters)
+        _params.environment_probability = 0.5f;
+      else if(has_environment)
+        _params.environment_probability = 1.0f;
+      else
+        _params.environment_probability = 0.0f;
+    }
+  }
+
+  /// Shrinks the radius according to Knaus & Zwicker:
+  /// r_{i+1}^2 = r_i^2 * (i + alpha) / (i + 1)
+  void update_radius()
+  {
+    if(_pass == 1)
+    {
+      _radius = _initial_radius;
+      if(_radius <= 0.0f)
+        _radius = std::max(0.02f * _params.specular_bounds_radius, 1.e-3f);
+    }
+    else
+    {
+      scalar i = static_cast<scalar>(_pass - 1);
+      _radius *= std::sqrt((i + _alpha) / (i + 1.0f));
+    }
+  }
+
+  qcl::device_context_ptr _ctx;
+  qcl::kernel_ptr _trace_kernel;
+
+  std::size_t _num_photons;
+  std::size_t _hash_grid_size;
+
+  scalar _alpha;
+  scalar _initial_radius;
+  scalar _radius;
+  std::size_t _pass;
+
+  device_object::random_engine _random;
+  device_object::photon_map_parameters _params;
+
+  cl::Buffer _photons;
+  cl::Buffer _grid_heads;
+};
+
+}
+
+#endif
@@ -25,51 +25,113 @@ __constant sampler_t pixel_sampler = CLK_NORMALIZED_COORDS_FALSE |
                                      CLK_ADDRESS_CLAMP_TO_EDGE |
                                      CLK_FILTER_NEAREST;
 
-scalar color_post_process(scalar color, scalar max)
+scalar color_luminance(float4 color)
 {
+  return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+/// \return The bin of the luminance histogram, or -1 if the luminance
+/// is below the range of the histogram
+int luminance_histogram_get_bin(scalar luminance)
+{
+  if (!(luminance > exp2(LUMINANCE_HISTOGRAM_MIN_LOG2)))
+    return -1;
+
+  scalar relative_log = (log2(luminance) - LUMINANCE_HISTOGRAM_MIN_LOG2)
+                      / (LUMINANCE_HISTOGRAM_MAX_LOG2 - LUMINANCE_HISTOGRAM_MIN_LOG2);
+  int bin = (int)(relative_log * LUMINANCE_HISTOGRAM_SIZE);
+  return clamp(bin, 0, LUMINANCE_HISTOGRAM_SIZE - 1);
+}
+
+/// \return The log2 luminance at the center of a bin
+scalar luminance_histogram_get_log_luminance(int bin)
+{
+  return LUMINANCE_HISTOGRAM_MIN_LOG2 +
+         ((scalar)bin + 0.5f) / (scalar)LUMINANCE_HISTOGRAM_SIZE
+         * (LUMINANCE_HISTOGRAM_MAX_LOG2 - LUMINANCE_HISTOGRAM_MIN_LOG2);
+}
+
+scalar tone_map(scalar color, int tone_mapping_operator)
+{
+  if (tone_mapping_operator == TONE_MAPPING_REINHARD)
+    color = color / (1.0f + color);
+  else if (tone_mapping_operator == TONE_MAPPING_FILMIC)
+    // Fit of the ACES filmic curve by K. Narkowicz
+    color = (color * (2.51f * color + 0.03f)) /
+            (color * (2.43f * color + 0.59f) + 0.14f);
+
   scalar gamma = 1.f / 2.2f;
-  return pow(clamp(color / max, 0.0f, 1.0f), gamma);
+  return pow(clamp(color, 0.0f, 1.0f), gamma);
 }
 
-__kernel void hdr_color_compression(__write_only image2d_t output_pixels,
-                                    __read_only image2d_t render_result,
-                                    __global float* max_pixel_values,
-                                    __global float* max_values_running_average,
-                                    unsigned long frame_number,
-                                    int smoothing_range)
+/// Derives the exposure from the luminance histogram of the previous
+/// frame and resets the histogram for the current frame. Must be run
+/// with a single work item before \c hdr_color_compression.
+/// \param exposure_state The adapted log2 luminance of the scene, and
+/// whether it has been initialized
+__kernel void update_exposure(__global uint* histogram,
+                              __global float* exposure_state,
+                              tone_mapping_parameters params)
 {
+  float num_pixels = 0.0f;
+  for (int i = 0; i < LUMINANCE_HISTOGRAM_SIZE; ++i)
+    num_pixels += (float)histogram[i];
+
+  // Average the log luminance between the percentiles, such that
+  // neither dark regions nor a few very bright pixels dominate
+  float min_count = params.low_percentile * num_pixels;
+  float max_count = params.high_percentile * num_pixels;
+  float cumulative_count = 0.0f;
+  float log_luminance_sum = 0.0f;
+  float weight_sum = 0.0f;
+  for (int i = 0; i < LUMINANCE_HISTOGRAM_SIZE; ++i)
+  {
+    float count = (float)histogram[i];
+    // The number of pixels of this bin between the percentiles
+    float weight = clamp(cumulative_count + count, min_count, max_count)
+                 - clamp(cumulative_count, min_count, max_count);
+    cumulative_count += count;
 
-  __local float running_average[MAX_VALUE_RUNNING_AVERAGE_SIZE];
-  int local_id = get_local_id(0) * get_local_size(1) + get_local_id(1);
-  int new_max_value_pos = frame_number % MAX_VALUE_RUNNING_AVERAGE_SIZE;
+    log_luminance_sum += weight * luminance_histogram_get_log_luminance(i);
+    weight_sum += weight;
 
-  // Load buffer for running average of max pixel value into local memory,
-  // and update buffer in global memory.
-  float max_value = max_pixel_values[0];
-  if(max_value < 0.2f)
-    max_value = 0.2f;
+    histogram[i] = 0;
+  }
 
-  if (local_id < MAX_VALUE_RUNNING_AVERAGE_SIZE)
+  if (weight_sum > 0.0f)
   {
-    if (local_id == new_max_value_pos)
+    float target = log_luminance_sum / weight_sum;
+    if (exposure_state[1] == 0.0f)
     {
-      running_average[local_id] = max_value;
+      exposure_state[0] = target;
+      exposure_state[1] = 1.0f;
     }
     else
-      running_average[local_id] = max_values_running_average[local_id];
+      // Adapt in the log domain, such that the exposure changes smoothly
+      exposure_state[0] = mix(exposure_state[0], target, params.adaptation_rate);
   }
-  barrier(CLK_LOCAL_MEM_FENCE);
+}
 
-  if(get_global_id(0) * get_global_size(1) + get_global_id(1) == new_max_value_pos)
-    max_values_running_average[new_max_value_pos] = max_value;
+/// Applies the exposure and the tone mapping operator. The luminance
+/// histogram of the result is accumulated into \c histogram for the
+/// exposure of the next frame.
+__kernel void hdr_color_compression(__write_only image2d_t output_pixels,
+                                    __read_only image2d_t render_result,
+                                    __global uint* histogram,
+                                    __global float* exposure_state,
+                                    tone_mapping_parameters params,
+                                    int smoothing_range)
+{
 
-  // Calculate running average
-  float avg_max_value = 0.0f;
-  // MAX_VALUE_RUNNING_AVERAGE_SIZE is usually so small that there are no
-  // more sophisticated reduction mechanisms necessary.
-  for (int i = 0; i < MAX_VALUE_RUNNING_AVERAGE_SIZE; ++i)
-    avg_max_value += running_average[i];
-  avg_max_value /= (float)MAX_VALUE_RUNNING_AVERAGE_SIZE;
+  __local uint local_histogram[LUMINANCE_HISTOGRAM_SIZE];
+  int local_id = get_local_id(0) * get_local_size(1) + get_local_id(1);
+  int local_size = get_local_size(0) * get_local_size(1);
+
+  for (int i = local_id; i < LUMINANCE_HISTOGRAM_SIZE; i += local_size)
+    local_histogram[i] = 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  float exposure = params.key_value / exp2(exposure_state[0]);
 
   int width = get_image_width(output_pixels);
   int height = get_image_height(output_pixels);
@@ -107,14 +169,25 @@ __kernel void hdr_color_compression(__write_only image2d_t output_pixels,
 
     result_pixel *= 1.f / weight_sum;
 
-    result_pixel.x = color_post_process(result_pixel.x, avg_max_value);
-    result_pixel.y = color_post_process(result_pixel.y, avg_max_value);
-    result_pixel.z = color_post_process(result_pixel.z, avg_max_value);
+    int bin = luminance_histogram_get_bin(color_luminance(result_pixel));
+    if (bin >= 0)
+      atomic_inc(local_histogram + bin);
+
+    result_pixel.x = tone_map(exposure * result_pixel.x, params.tone_mapping_operator);
+    result_pixel.y = tone_map(exposure * result_pixel.y, params.tone_mapping_operator);
+    result_pixel.z = tone_map(exposure * result_pixel.z, params.tone_mapping_operator);
     result_pixel.w = 1.0f;
     coord = (int2)(px_x, px_y);
 
     write_imagef(output_pixels, coord, result_pixel);
   }
+
+  // Merge the histogram of the work group, such that only one global
+  // atomic operation per group and bin is required
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int i = local_id; i < LUMINANCE_HISTOGRAM_SIZE; i += local_size)
+    if (local_histogram[i] > 0)
+      atomic_add(histogram + i, local_histogram[i]);
 }
 
-#endif
\ No newline at end of file
+#endif
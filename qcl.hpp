@@ -645,7 +645,9 @@ private:
   /// Initializes the device and creates a command queue.
   void init_device()
   {
-    add_command_queue();
+    // Profiling is enabled on the default queue, such that the
+    // execution times of kernels can be measured
+    add_command_queue(CL_QUEUE_PROFILING_ENABLE);
 
     check_cl_error(_device.getInfo(CL_DEVICE_TYPE, &_device_type),
                    "get_device_type(): Could not obtain device type");
@@ -960,10 +962,74 @@ public:
     }
     
     global_context_ptr global_ctx(new global_context(contexts));
-    
+
     return global_ctx;
   }
-  
+
+  /// Creates a global context containing all devices from all platforms
+  /// which are of a given device type. The CPUs are split into sub-devices
+  /// by device fission, each of which obtains its own device context.
+  /// \return The global context
+  /// \param cpu_partition The partition properties of the CPUs, as expected
+  /// by clCreateSubDevices(), terminated by 0. CPUs that cannot be
+  /// partitioned this way are used as a whole.
+  /// \param type The type of the device that shall be included in the context.
+  global_context_ptr
+  create_global_context(const std::vector<cl_device_partition_property>& cpu_partition,
+                        cl_device_type type = CL_DEVICE_TYPE_ALL) const
+  {
+    std::vector<device_context_ptr> contexts;
+
+    for(std::size_t i = 0; i < _platforms.size(); ++i)
+    {
+      std::vector<cl::Device> devices;
+      get_devices(_platforms[i], devices, type);
+      partition_cpu_devices(cpu_partition, devices);
+
+      for(std::size_t j = 0; j  < devices.size(); ++j)
+      {
+        device_context_ptr new_context(new device_context(_platforms[i], devices[j]));
+
+        contexts.push_back(new_context);
+      }
+    }
+
+    global_context_ptr global_ctx(new global_context(contexts));
+
+    return global_ctx;
+  }
+
+  /// Replaces the CPUs of a device list by their sub-devices
+  /// \param partition The partition properties, as expected by
+  /// clCreateSubDevices(), terminated by 0
+  /// \param devices The device list
+  static
+  void partition_cpu_devices(const std::vector<cl_device_partition_property>& partition,
+                             std::vector<cl::Device>& devices)
+  {
+    if(partition.empty())
+      return;
+
+    std::vector<cl::Device> result;
+    for(cl::Device& device : devices)
+    {
+      cl_device_type type;
+      check_cl_error(device.getInfo(CL_DEVICE_TYPE, &type),
+                     "Could not obtain device type!");
+
+      std::vector<cl::Device> sub_devices;
+      // Devices that do not support the partition, e.g. without several
+      // NUMA nodes, are not treated as error
+      if(type == CL_DEVICE_TYPE_CPU &&
+         device.createSubDevices(partition.data(), &sub_devices) == CL_SUCCESS &&
+         !sub_devices.empty())
+        result.insert(result.end(), sub_devices.begin(), sub_devices.end());
+      else
+        result.push_back(device);
+    }
+    devices = result;
+  }
+
   /// Creates a global context containing all available GPUs of the system.
   /// \return The global context.
   global_context_ptr create_global_gpu_context() const
@@ -0,0 +1,279 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RADIANCE_CACHE_CL
+#define RADIANCE_CACHE_CL
+
+#include "material.cl"
+
+// World-space cache of the light reflected by rough surfaces.
+// Space is divided into cubic cells, which are further split by the
+// dominant axis of the surface normal, such that both sides of thin
+// objects are kept apart. The cells are stored in a hash table with
+// linear probing; an entry is claimed by the first path that reaches it.
+// Each entry accumulates the reflected radiance of all paths through its
+// cell in fixed point. The cache does not depend on the camera, it is
+// refined by every frame and kept when the camera moves.
+//
+// In the preview mode, paths are terminated into the cache at the first
+// rough vertex after a diffuse bounce, which makes the indirect light
+// available after a single bounce.
+
+/// Layout of an entry: checksum of the key (0 if unused), sums of the
+/// red, green and blue radiance, number of samples
+#define RADIANCE_CACHE_ENTRY_SIZE 5
+#define RADIANCE_CACHE_CHECKSUM 0
+#define RADIANCE_CACHE_SUM 1
+#define RADIANCE_CACHE_COUNT 4
+
+/// The number of slots that are tested before a lookup gives up
+#define RADIANCE_CACHE_MAX_PROBES 8
+/// The radiance is accumulated in fixed point
+#define RADIANCE_CACHE_SCALE 256.f
+/// Bounds single samples to prevent overflows of the sums
+#define RADIANCE_CACHE_MAX_SAMPLE_VALUE 100.f
+/// Entries are not updated anymore once they contain this many samples,
+/// until they have been refreshed by \c update_radiance_cache
+#define RADIANCE_CACHE_MAX_COUNT 65536
+/// Entries with more samples are refreshed by \c update_radiance_cache,
+/// such that the cache follows changes of the scene
+#define RADIANCE_CACHE_REFRESH_COUNT 4096
+/// The number of samples an entry needs before it is used
+#define RADIANCE_CACHE_MIN_COUNT 8
+/// The number of vertices per path that contribute to the cache
+#define RADIANCE_CACHE_MAX_RECORDED_VERTICES 8
+
+typedef struct
+{
+  __global uint* entries;
+  radiance_cache_parameters params;
+} radiance_cache;
+
+/// A path vertex whose reflected light is added to the cache
+typedef struct
+{
+  vector3 position;
+  /// The normal on the side from which the path arrived
+  vector3 normal;
+  /// The path throughput at the arrival at the vertex
+  intensity throughput;
+  /// The radiance collected before the light reflected at the vertex
+  intensity radiance;
+} radiance_cache_record;
+
+/// The kernel parameters describing the radiance cache, in the order in which
+/// they are pushed by the host.
+#define RADIANCE_CACHE_KERNEL_ARGUMENTS                      \
+  __global uint* radiance_cache_entries,                     \
+  radiance_cache_parameters radiance_cache_params
+
+#define RADIANCE_CACHE_INIT_FROM_KERNEL_ARGUMENTS(radiance_cache_ptr)   \
+  do                                                                    \
+  {                                                                     \
+    (radiance_cache_ptr)->entries = radiance_cache_entries;             \
+    (radiance_cache_ptr)->params = radiance_cache_params;               \
+  } while(0)
+
+/// \return Whether the light reflected by a material is cached. Only rough,
+/// opaque surfaces reflect light similarly into all directions.
+int radiance_cache_is_cacheable(const material* mat)
+{
+  return mat->roughness >= SPECULAR_ROUGHNESS_THRESHOLD &&
+         mat->transmittance <= 0.f;
+}
+
+/// Mixes a value into a hash
+uint radiance_cache_hash_combine(uint hash, int value)
+{
+  hash ^= (uint)value;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/// \return The hash of the cell of a position and normal
+/// \param ctx The radiance cache
+/// \param position The position
+/// \param normal The normal
+/// \param seed Distinguishes different hash functions
+uint radiance_cache_hash(const radiance_cache* ctx,
+                         vector3 position,
+                         vector3 normal,
+                         uint seed)
+{
+  vector3 cell = floor(position / ctx->params.cell_size);
+
+  vector3 abs_normal = fabs(normal);
+  int normal_axis = 0;
+  scalar normal_component = normal.x;
+  if (abs_normal.y > abs_normal.x && abs_normal.y >= abs_normal.z)
+  {
+    normal_axis = 1;
+    normal_component = normal.y;
+  }
+  else if (abs_normal.z > abs_normal.x)
+  {
+    normal_axis = 2;
+    normal_component = normal.z;
+  }
+  int normal_index = 2 * normal_axis + (normal_component < 0.f ? 1 : 0);
+
+  uint hash = seed;
+  hash = radiance_cache_hash_combine(hash, (int)cell.x);
+  hash = radiance_cache_hash_combine(hash, (int)cell.y);
+  hash = radiance_cache_hash_combine(hash, (int)cell.z);
+  hash = radiance_cache_hash_combine(hash, normal_index);
+  return hash;
+}
+
+/// \return The index of the entry of the cell of a position and normal,
+/// or -1 if there is no such entry.
+/// \param ctx The radiance cache
+/// \param position The position
+/// \param normal The normal on the side of the surface that is of interest
+/// \param insert Whether an unused entry shall be claimed if the cell has
+/// no entry yet
+int radiance_cache_find_entry(const radiance_cache* ctx,
+                              vector3 position,
+                              vector3 normal,
+                              int insert)
+{
+  uint num_entries = (uint)ctx->params.num_entries;
+  uint first_slot = radiance_cache_hash(ctx, position, normal, 0x2545f491u) % num_entries;
+  // 0 marks unused entries
+  uint checksum = radiance_cache_hash(ctx, position, normal, 0x9e3779b9u) | 1u;
+
+  for (uint i = 0; i < RADIANCE_CACHE_MAX_PROBES; ++i)
+  {
+    uint slot = (first_slot + i) % num_entries;
+    __global uint* entry = ctx->entries + slot * RADIANCE_CACHE_ENTRY_SIZE;
+
+    uint stored_checksum = entry[RADIANCE_CACHE_CHECKSUM];
+    if (stored_checksum == checksum)
+      return (int)slot;
+
+    if (stored_checksum == 0u)
+    {
+      if (!insert)
+        return -1;
+
+      stored_checksum = atomic_cmpxchg(entry + RADIANCE_CACHE_CHECKSUM, 0u, checksum);
+      // Either we have claimed the entry, or another path has
+      // claimed it for the same cell in the meantime
+      if (stored_checksum == 0u || stored_checksum == checksum)
+        return (int)slot;
+    }
+  }
+  return -1;
+}
+
+/// Looks up the cached light reflected at a position
+/// \return Whether the cache contains enough samples for the position
+/// \param ctx The radiance cache
+/// \param position The position of the path vertex
+/// \param normal The normal on the side from which the path arrives
+/// \param reflected_radiance Will be set to the cached reflected radiance
+int radiance_cache_lookup(const radiance_cache* ctx,
+                          vector3 position,
+                          vector3 normal,
+                          intensity* reflected_radiance)
+{
+  int slot = radiance_cache_find_entry(ctx, position, normal, 0);
+  if (slot < 0)
+    return 0;
+
+  __global const uint* entry = ctx->entries + slot * RADIANCE_CACHE_ENTRY_SIZE;
+  uint count = entry[RADIANCE_CACHE_COUNT];
+  if (count < RADIANCE_CACHE_MIN_COUNT)
+    return 0;
+
+  intensity sum = (intensity)((scalar)entry[RADIANCE_CACHE_SUM],
+                              (scalar)entry[RADIANCE_CACHE_SUM + 1],
+                              (scalar)entry[RADIANCE_CACHE_SUM + 2]);
+  *reflected_radiance = sum / (RADIANCE_CACHE_SCALE * (scalar)count);
+  return 1;
+}
+
+/// Adds the light that has been reflected at the recorded vertices of
+/// a path to the cache.
+/// \param ctx The radiance cache
+/// \param records The recorded vertices
+/// \param num_records The number of recorded vertices
+/// \param radiance The total radiance of the path
+void radiance_cache_update(const radiance_cache* ctx,
+                           const radiance_cache_record* records,
+                           int num_records,
+                           intensity radiance)
+{
+  for (int i = 0; i < num_records; ++i)
+  {
+    const radiance_cache_record* record = &(records[i]);
+
+    // The light collected from the vertex on, divided by the throughput,
+    // is an estimate of the light reflected at the vertex. Channels with
+    // vanishing throughput have not collected any light afterwards.
+    intensity reflected_radiance = (radiance - record->radiance)
+                                 / fmax(record->throughput, (intensity)(1.e-6f));
+    reflected_radiance = clamp(reflected_radiance,
+                               (intensity)(0.f),
+                               (intensity)(RADIANCE_CACHE_MAX_SAMPLE_VALUE));
+
+    int slot = radiance_cache_find_entry(ctx, record->position, record->normal, 1);
+    if (slot < 0)
+      continue;
+
+    __global uint* entry = ctx->entries + slot * RADIANCE_CACHE_ENTRY_SIZE;
+    if (atomic_inc(entry + RADIANCE_CACHE_COUNT) >= RADIANCE_CACHE_MAX_COUNT)
+    {
+      // The entry is full, it must be refreshed first
+      atomic_dec(entry + RADIANCE_CACHE_COUNT);
+      continue;
+    }
+
+    // Round to nearest to avoid a systematic underestimation of dim light
+    intensity fixed_point = reflected_radiance * RADIANCE_CACHE_SCALE + (intensity)(0.5f);
+    atomic_add(entry + RADIANCE_CACHE_SUM,     (uint)fixed_point.x);
+    atomic_add(entry + RADIANCE_CACHE_SUM + 1, (uint)fixed_point.y);
+    atomic_add(entry + RADIANCE_CACHE_SUM + 2, (uint)fixed_point.z);
+  }
+}
+
+/// Halves the samples of entries that contain many samples. Old samples
+/// hence lose their influence over time, and the sums cannot overflow.
+/// \param entries The entries of the hash table
+/// \param num_entries The number of entries
+__kernel void update_radiance_cache(__global uint* entries,
+                                    int num_entries)
+{
+  int slot = get_global_id(0);
+  if (slot >= num_entries)
+    return;
+
+  __global uint* entry = entries + slot * RADIANCE_CACHE_ENTRY_SIZE;
+  if (entry[RADIANCE_CACHE_COUNT] > RADIANCE_CACHE_REFRESH_COUNT)
+  {
+    entry[RADIANCE_CACHE_SUM]     /= 2;
+    entry[RADIANCE_CACHE_SUM + 1] /= 2;
+    entry[RADIANCE_CACHE_SUM + 2] /= 2;
+    entry[RADIANCE_CACHE_COUNT]   /= 2;
+  }
+}
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RADIANCE_CACHE_HPP
+#define RADIANCE_CACHE_HPP
+
+#include "integrator_extension.hpp"
+#include "common.cl_hpp"
+
+#include <algorithm>
+
+namespace gray {
+
+/// World-space cache of the light reflected by rough surfaces, to be used
+/// with the \c trace_paths_cached kernel. All frames add the light found
+/// by their paths to the cache. While the user interacts with the renderer,
+/// paths are terminated into the cache after the first diffuse bounce,
+/// which yields converged looking previews after few frames. Since the
+/// cache does not depend on the camera, it is kept when the camera moves.
+class radiance_cache : public integrator_extension
+{
+public:
+  /// Must match the definition in radiance_cache.cl
+  static constexpr std::size_t entry_size = 5;
+
+  /// \param ctx The device context
+  /// \param num_entries The number of entries of the hash table
+  /// \param resolution The number of cells along the largest extent
+  /// of the scene
+  radiance_cache(const qcl::device_context_ptr& ctx,
+                 std::size_t num_entries = 1 << 20,
+                 std::size_t resolution = 128)
+  : _ctx{ctx},
+    _update_kernel{ctx->get_kernel("update_radiance_cache")},
+    _resolution{resolution},
+    _is_cell_size_initialized{false}
+  {
+    assert(num_entries > 0);
+    assert(resolution > 0);
+
+    _ctx->create_buffer<cl_uint>(_entries,
+                                 CL_MEM_READ_WRITE,
+                                 num_entries * entry_size);
+
+    _params.cell_size = 1.0f;
+    _params.num_entries = static_cast<cl_int>(num_entries);
+    _params.is_preview = 0;
+
+    clear();
+  }
+
+  /// Discards all cached light
+  void clear()
+  {
+    cl_uint zero = 0;
+    cl_int err = _ctx->get_command_queue().enqueueFillBuffer(_entries,
+                                                             zero,
+                                                             0,
+                                                             _params.num_entries * entry_size
+                                                               * sizeof(cl_uint));
+    qcl::check_cl_error(err, "Could not enqueue radiance cache reset!");
+  }
+
+  virtual void prepare_frame(const device_object::scene& s) override
+  {
+    if(!_is_cell_size_initialized)
+    {
+      setup_cell_size(s);
+      _is_cell_size_initialized = true;
+    }
+
+    qcl::kernel_argument_list arguments(_update_kernel);
+    arguments.push(_entries);
+    arguments.push(_params.num_entries);
+
+    cl_int err = _ctx->get_command_queue().enqueueNDRangeKernel(*_update_kernel,
+                                                                cl::NullRange,
+                                                                cl::NDRange(_params.num_entries),
+                                                                cl::NullRange);
+    qcl::check_cl_error(err, "Could not enqueue radiance cache update kernel call!");
+  }
+
+  virtual void push_kernel_arguments(qcl::kernel_argument_list& arguments) const override
+  {
+    arguments.push(_entries);
+    arguments.push(&_params, sizeof(device_object::radiance_cache_parameters));
+  }
+
+  /// The cached light does not depend on the camera. Hence it is kept
+  /// when the render results are discarded, use \c clear() to start from
+  /// an empty cache.
+  virtual void reset() override
+  {}
+
+  /// The previews are biased, since the cache blurs the light
+  /// over its cells
+  virtual bool has_interactive_mode() const override
+  {
+    return true;
+  }
+
+  virtual void set_interactive(bool interactive) override
+  {
+    _params.is_preview = interactive ? 1 : 0;
+  }
+
+private:
+  /// Chooses the cell size according to the extent of the objects
+  /// of finite size
+  void setup_cell_size(const device_object::scene& s)
+  {
+    vector3 min_corner;
+    vector3 max_corner;
+    scalar extent = 2.0f;
+    if(s.get_bounds(min_corner, max_corner))
+    {
+      extent = 0.0f;
+      for(std::size_t dim = 0; dim < 3; ++dim)
+        extent = std::max(extent, max_corner.s[dim] - min_corner.s[dim]);
+    }
+
+    _params.cell_size = std::max(extent, 1.e-3f) / static_cast<scalar>(_resolution);
+  }
+
+  qcl::device_context_ptr _ctx;
+  qcl::kernel_ptr _update_kernel;
+
+  std::size_t _resolution;
+  bool _is_cell_size_initialized;
+
+  device_object::radiance_cache_parameters _params;
+
+  cl::Buffer _entries;
+};
+
+}
+
+#endif
@@ -33,9 +33,18 @@ __constant const unsigned long random_a = 16807;
 
 
 
+/// \return The index of the state of the work item. The third dimension
+/// of the NDRange, e.g. the views of a multi-view render, selects a
+/// separate set of states.
+int random_get_state_index()
+{
+  return (get_global_id(2) * get_global_size(0) + get_global_id(0))
+         * get_global_size(1) + get_global_id(1);
+}
+
 void random_init(random_ctx* ctx, __global int* state_buffer)
 {
-  int global_id = get_global_id(0) * get_global_size(1) + get_global_id(1);
+  int global_id = random_get_state_index();
 
   ctx->state_buffer = state_buffer;
   ctx->local_state = state_buffer[global_id];
@@ -43,7 +52,7 @@ void random_init(random_ctx* ctx, __global int* state_buffer)
 
 void random_fini(random_ctx* ctx)
 {
-  int global_id = get_global_id(0) * get_global_size(1) + get_global_id(1);
+  int global_id = random_get_state_index();
 
   ctx->state_buffer[global_id] = ctx->local_state;
 }
@@ -108,7 +117,7 @@ vector3 random_uniform_sphere(random_ctx* ctx)
 
   scalar u = random_uniform_scalar_minmax(ctx, -1.f, 1.f);
   scalar phi = random_uniform_scalar_minmax(ctx, 0, 2.f * M_PI_F);
-  scalar sqrt_term = sqrt(1.f - u);
+  scalar sqrt_term = sqrt(1.f - u * u);
   scalar cos_phi = cos(phi);
   vector3 result;
   result.x = sqrt_term * cos_phi;
@@ -60,6 +60,12 @@ public:
   {
     return _state;
   }
+
+  /// \return The number of cl_int states in the buffer, one per work item
+  std::size_t get_num_states() const
+  {
+    return _num_states;
+  }
   
 private:
   void init(std::size_t width, std::size_t height)
@@ -72,10 +78,12 @@ private:
     }
     _ctx->create_buffer<cl_int>(_state, CL_MEM_READ_WRITE, width*height, random_init.data());
     _ctx->memcpy_h2d<cl_int>(_state, random_init.data(), random_init.size());
+    _num_states = random_init.size();
   }
 
   qcl::const_device_context_ptr _ctx;
   std::mt19937 _gen;
+  std::size_t _num_states = 0;
 
   cl::Buffer _state;
 };
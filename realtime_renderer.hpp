@@ -35,13 +35,14 @@ public:
   realtime_window_renderer(const qcl::device_context_ptr& ctx,
                          cl_gl* cl_gl_interoperability,
                          const device_object::scene* s,
-                         const device_object::camera* cam)
+                         const device_object::camera* cam,
+                         const std::string& kernel_name = "trace_paths")
   : _cl_gl_interoperability{cl_gl_interoperability},
     _scene{s}, _camera{cam},
     _renderer
     {
       ctx, 
-      "trace_paths",
+      kernel_name,
       "hdr_color_compression", 
       gl_renderer::instance().get_width(),
       gl_renderer::instance().get_height()
@@ -368,6 +369,66 @@ private:
 
   scalar _last_camera_focus;
 };
+
+/// Gives the region around the mouse cursor more rays than the rest of
+/// the image. Toggled with the 'c' key.
+class interactive_priority_control
+{
+public:
+  interactive_priority_control(input_handler& input,
+                               realtime_window_renderer* realtime_renderer)
+  : _renderer{realtime_renderer}, _is_enabled{false},
+    _cursor_x{0}, _cursor_y{0}
+  {
+    assert(realtime_renderer);
+
+    input.add_key_event('c', [this](input_handler *input, int x, int y) {
+      _is_enabled = !_is_enabled;
+      _cursor_x = x;
+      _cursor_y = y;
+      update_priority();
+    });
+
+    input.add_mouse_motion_event([this](input_handler *input, int x, int y,
+                                        int delta_x, int delta_y) {
+      _cursor_x = x;
+      _cursor_y = y;
+      if (_is_enabled)
+        update_priority();
+    });
+  }
+
+private:
+  /// The size of the prioritized square relative to the smaller
+  /// dimension of the image
+  static constexpr scalar relative_region_size = 0.25f;
+
+  void update_priority()
+  {
+    frame_renderer& engine = _renderer->get_render_engine();
+    if (!_is_enabled)
+    {
+      engine.clear_priority();
+      return;
+    }
+
+    std::size_t image_size = std::min(engine.get_resolution_width(),
+                                      engine.get_resolution_height());
+    int half_size = static_cast<int>(0.5f * relative_region_size * image_size);
+
+    // The rows of the image are displayed from top to bottom,
+    // like the window coordinates.
+    engine.set_priority_region(_cursor_x - half_size,
+                               _cursor_y - half_size,
+                               _cursor_x + half_size,
+                               _cursor_y + half_size);
+  }
+
+  realtime_window_renderer *_renderer;
+  bool _is_enabled;
+  int _cursor_x;
+  int _cursor_y;
+};
 }
 
 #endif
@@ -0,0 +1,290 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RENDER_SERVICE_HPP
+#define RENDER_SERVICE_HPP
+
+#include "distributed_renderer.hpp"
+#include "socket.hpp"
+#include "scene.hpp"
+#include "timer.hpp"
+#include "content_hash.hpp"
+#include "common.cl_hpp"
+
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+
+namespace gray {
+
+/// Identifies the messages between the render service and its clients
+constexpr std::uint32_t service_protocol_magic = 0x47525356;
+constexpr std::uint32_t service_protocol_version = 1;
+
+/// A render that a client submits to the render service. In contrast to
+/// the jobs of the workers, the service post processes the image and
+/// writes it to a file.
+struct service_job
+{
+  explicit service_job(const device_object::camera& cam)
+  : render(cam), tone_mapping{TONE_MAPPING_FILMIC}, is_denoising_enabled{1}
+  {}
+
+  /// The scene, integrator, resolution, sample budget and camera
+  render_job render;
+  portable_int tone_mapping;
+  portable_int is_denoising_enabled;
+  /// The path of the written png file. Since the service runs in its own
+  /// working directory, it should be an absolute path.
+  std::string output_file;
+
+  void send(socket_connection& connection) const
+  {
+    connection.send_value(service_protocol_magic);
+    connection.send_value(service_protocol_version);
+    render.send(connection);
+    connection.send_value(tone_mapping);
+    connection.send_value(is_denoising_enabled);
+    connection.send_string(output_file);
+  }
+
+  void receive(socket_connection& connection)
+  {
+    check_header(connection);
+    render.receive(connection);
+    connection.receive_value(tone_mapping);
+    connection.receive_value(is_denoising_enabled);
+    output_file = connection.receive_string();
+  }
+
+  static void check_header(socket_connection& connection)
+  {
+    if(connection.receive_value<std::uint32_t>() != service_protocol_magic ||
+       connection.receive_value<std::uint32_t>() != service_protocol_version)
+      throw std::runtime_error("Received message of unknown protocol");
+  }
+};
+
+/// The answer of the service once a job has been rendered or has failed
+struct service_reply
+{
+  service_reply()
+  : is_successful{0}, queue_time{0.0}, render_time{0.0}
+  {}
+
+  portable_int is_successful;
+  /// The seconds the job has waited in the queue
+  double queue_time;
+  /// The seconds from the start of the job until the image was written
+  double render_time;
+  /// The reason of a failure
+  std::string message;
+
+  void send(socket_connection& connection) const
+  {
+    connection.send_value(service_protocol_magic);
+    connection.send_value(service_protocol_version);
+    connection.send_value(is_successful);
+    connection.send_value(queue_time);
+    connection.send_value(render_time);
+    connection.send_string(message);
+  }
+
+  void receive(socket_connection& connection)
+  {
+    service_job::check_header(connection);
+    connection.receive_value(is_successful);
+    connection.receive_value(queue_time);
+    connection.receive_value(render_time);
+    message = connection.receive_string();
+  }
+};
+
+/// Keeps a limited number of objects, e.g. scenes that have been
+/// uploaded to the device. If the cache is full, the object that
+/// has been used least recently is released.
+template<class Key, class T>
+class resource_cache
+{
+public:
+  /// \param max_size The maximum number of cached objects
+  explicit resource_cache(std::size_t max_size)
+  : _max_size{max_size}, _num_uses{0}
+  {}
+
+  /// \return The cached object, or nullptr if there is none
+  /// \param key The key of the object
+  std::shared_ptr<T> find(const Key& key)
+  {
+    auto entry = _entries.find(key);
+    if(entry == _entries.end())
+      return nullptr;
+
+    entry->second.last_use = ++_num_uses;
+    return entry->second.object;
+  }
+
+  /// Adds an object to the cache
+  /// \param key The key of the object
+  /// \param object The object
+  void insert(const Key& key, const std::shared_ptr<T>& object)
+  {
+    while(_entries.size() >= _max_size && !_entries.empty())
+    {
+      auto least_recent = _entries.begin();
+      for(auto entry = _entries.begin(); entry != _entries.end(); ++entry)
+        if(entry->second.last_use < least_recent->second.last_use)
+          least_recent = entry;
+      _entries.erase(least_recent);
+    }
+
+    cache_entry& entry = _entries[key];
+    entry.object = object;
+    entry.last_use = ++_num_uses;
+  }
+
+  std::size_t get_num_objects() const
+  {
+    return _entries.size();
+  }
+
+private:
+  struct cache_entry
+  {
+    std::shared_ptr<T> object;
+    std::size_t last_use;
+  };
+
+  std::size_t _max_size;
+  std::size_t _num_uses;
+  std::map<Key, cache_entry> _entries;
+};
+
+/// A job that waits in the queue of the render service, together with
+/// the connection of the client to which the result is reported
+struct queued_job
+{
+  queued_job(const service_job& j, socket_connection&& c)
+  : job(j), client(std::move(c))
+  {
+    queue_timer.start();
+  }
+
+  service_job job;
+  socket_connection client;
+  /// Measures the time that the job has waited in the queue
+  timer queue_timer;
+};
+
+/// Receives jobs from local clients over a UNIX domain socket and
+/// queues them in the order of their arrival. Jobs are accepted whenever
+/// the service asks for the next job, such that clients which submit jobs
+/// while a job is rendered are queued as well.
+class render_service
+{
+public:
+  /// \param socket_path The path of the socket
+  /// \param initial_camera The camera of the received jobs before they
+  /// are overwritten by the data of the client
+  render_service(const std::string& socket_path,
+                 const device_object::camera& initial_camera)
+  : _listener{socket_path}, _initial_camera(initial_camera)
+  {}
+
+  /// Waits until a job is available and removes it from the queue
+  queued_job next_job()
+  {
+    while(_jobs.empty())
+      accept_jobs(-1);
+    // Jobs that have arrived during the previous render are queued
+    // before the next one is started
+    accept_jobs(0);
+
+    queued_job job = std::move(_jobs.front());
+    _jobs.pop_front();
+    return job;
+  }
+
+  /// \return The number of jobs that are waiting
+  std::size_t get_num_queued_jobs() const
+  {
+    return _jobs.size();
+  }
+
+  /// Reports the result of a job to its client. Clients that have
+  /// disconnected are ignored.
+  static void reply(queued_job& job, const service_reply& reply)
+  {
+    try
+    {
+      reply.send(job.client);
+    }
+    catch(std::runtime_error& e)
+    {
+      std::cout << "Could not report result to client: " << e.what() << std::endl;
+    }
+  }
+
+private:
+  /// Receives the jobs of all pending connections
+  /// \param timeout The milliseconds to wait for the first connection,
+  /// -1 to wait indefinitely
+  void accept_jobs(int timeout)
+  {
+    pollfd descriptor;
+    descriptor.fd = _listener.get_descriptor();
+    descriptor.events = POLLIN;
+    descriptor.revents = 0;
+
+    while(poll(&descriptor, 1, timeout) > 0)
+    {
+      timeout = 0;
+      descriptor.revents = 0;
+
+      socket_connection client = _listener.accept_connection();
+      // A client that does not send its job must not block the service
+      client.set_receive_timeout(5);
+      try
+      {
+        service_job job{_initial_camera};
+        job.receive(client);
+        _jobs.emplace_back(job, std::move(client));
+      }
+      catch(std::runtime_error& e)
+      {
+        std::cout << "Could not receive job: " << e.what() << std::endl;
+      }
+    }
+  }
+
+  unix_listener _listener;
+  device_object::camera _initial_camera;
+  std::deque<queued_job> _jobs;
+};
+
+}
+
+#endif
@@ -43,6 +43,9 @@ typedef struct
   object_entry background_object;
 
   material_id background_material;
+
+  __global emitter_entry* emitters;
+  int num_emitters;
 } scene;
 
 void scene_init(scene* ctx,
@@ -51,7 +54,8 @@ void scene_init(scene* ctx,
                 __global OBJECT_NAME(plane_geometry)* planes, int num_planes,
                 __global OBJECT_NAME(disk_geometry)* disks, int num_disks,
                 scalar far_clipping_distance,
-                material_id background_material)
+                material_id background_material,
+                __global emitter_entry* emitters, int num_emitters)
 {
   ctx->objects = objects;
   ctx->num_objects = num_objects;
@@ -68,11 +72,68 @@ void scene_init(scene* ctx,
   ctx->background_object.type = OBJECT_TYPE_BACKGROUND;
   ctx->background_object.id = BACKGROUND_ID;
   ctx->background_object.local_id = 0;
+  ctx->background_object.emitter_probability = 0.f;
   ctx->background_material = background_material;
 
   ctx->far_clipping_distance = far_clipping_distance;
+
+  ctx->emitters = emitters;
+  ctx->num_emitters = num_emitters;
 }
 
+/// The kernel parameters describing a scene, in the order in which they
+/// are pushed by the host. Use together with SCENE_INIT_FROM_KERNEL_ARGUMENTS.
+#define SCENE_KERNEL_ARGUMENTS                               \
+  __global object_entry *objects,                            \
+  __global object_sphere_geometry *spheres,                  \
+  __global object_plane_geometry *planes,                    \
+  __global object_disk_geometry *disks,                      \
+  int num_spheres,                                           \
+  int num_planes,                                            \
+  int num_disks,                                             \
+  float far_clipping_distance,                               \
+  material_id background_material,                           \
+  __global emitter_entry *emitters,                          \
+  int num_emitters,                                          \
+  __global float4 * texture_data_buffer,                     \
+  __global int *widths,                                      \
+  __global int *heights,                                     \
+  __global unsigned long *offsets,                           \
+  __global material_db_entry* materials,                     \
+  int num_materials,                                         \
+  int num_textures,                                          \
+  __global float *environment_marginal_cdf,                  \
+  __global float *environment_conditional_cdf,               \
+  int environment_width,                                     \
+  int environment_height
+
+/// Initializes a scene object from the kernel parameters declared
+/// by SCENE_KERNEL_ARGUMENTS
+#define SCENE_INIT_FROM_KERNEL_ARGUMENTS(scene_ptr)                     \
+  do                                                                    \
+  {                                                                     \
+    scene_init((scene_ptr), objects, num_spheres + num_planes + num_disks, \
+               spheres, num_spheres,                                    \
+               planes, num_planes,                                      \
+               disks, num_disks,                                        \
+               far_clipping_distance,                                   \
+               background_material,                                     \
+               emitters, num_emitters);                                 \
+    (scene_ptr)->materials.data_buffer = texture_data_buffer;           \
+    (scene_ptr)->materials.width   = widths;                            \
+    (scene_ptr)->materials.height  = heights;                           \
+    (scene_ptr)->materials.offsets = offsets;                           \
+    (scene_ptr)->materials.num_materials = num_materials;               \
+    (scene_ptr)->materials.num_textures = num_textures;                 \
+    (scene_ptr)->materials.materials = materials;                       \
+    (scene_ptr)->materials.environment_marginal_cdf =                   \
+                                         environment_marginal_cdf;      \
+    (scene_ptr)->materials.environment_conditional_cdf =                \
+                                         environment_conditional_cdf;   \
+    (scene_ptr)->materials.environment_width = environment_width;       \
+    (scene_ptr)->materials.environment_height = environment_height;     \
+  } while(0)
+
 #define OBJECTS_INTERSECTS(geometry_type, object_ptr, ray_ptr, path_vertex_ptr) \
   (geometry_type ## _intersects(object_ptr, ray_ptr, path_vertex_ptr))
 
@@ -94,6 +155,7 @@ void scene_get_medium(const scene* ctx, vector3 position,
   // For now, constant medium everywhere
   medium_entry->id = MEDIUM_ID;
   medium_entry->local_id = 0;
+  medium_entry->emitter_probability = 0.f;
   medium_entry->type = OBJECT_TYPE_SURROUNDING_MEDIUM;
 
   medium_material->scattered_fraction = (intensity)(1, 1, 1);
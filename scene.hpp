@@ -20,6 +20,9 @@
 #define SCENE_HPP
 
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 #include "types.hpp"
 #include "common.cl_hpp"
@@ -56,9 +59,10 @@ public:
     // Recalculate screen basis vectors
     vector3 v1 = VECTOR3(0, 0, 1);
     
-    if (_look_at.s[0] == v1.s[0] &&
-        _look_at.s[1] == v1.s[1] &&
-        _look_at.s[2] == v1.s[2])
+    // The basis is undefined if the camera looks along the z axis,
+    // in either direction
+    if (_look_at.s[0] == 0.0f &&
+        _look_at.s[1] == 0.0f)
     {
       v1 = VECTOR3(1, 0, 0);
     }
@@ -126,6 +130,22 @@ public:
     return _lens_plane_distance;
   }
 
+  /// Sets the distance between the screen and the lens. Since the screen
+  /// is one unit wide, this determines the horizontal field of view,
+  /// e.g. 0.5 results in 90 degrees. The focal plane distance is kept.
+  /// \param distance The distance between screen and lens
+  void set_lens_plane_distance(scalar distance)
+  {
+    assert(distance > 0.0);
+    bool autofocus = is_autofocus_enabled();
+    scalar focal_plane_distance = autofocus ? 0.0f : get_focal_plane_distance();
+
+    _lens_plane_distance = distance;
+    set_position(get_position());
+    if(!autofocus)
+      set_focal_plane_distance(focal_plane_distance);
+  }
+
   scalar get_focal_length() const
   {
     if(_camera_lens.focal_length > 0.0)
@@ -191,6 +211,7 @@ public:
     material_factory fac{_materials.get()};
     this->set_background_material(fac.create_background_material(
                                     background_texture));
+    _materials->set_environment_texture(background_texture);
   }
 
   scene(const scene& other) = delete;
@@ -215,6 +236,7 @@ public:
     entry.id = static_cast<portable_int>(_host_objects.size());
     entry.local_id = static_cast<portable_int>(_host_spheres.size());
     entry.type = OBJECT_TYPE_SPHERE;
+    entry.emitter_probability = 0.0f;
 
     _host_objects.push_back(entry);
     _host_spheres.push_back(geometry);
@@ -234,6 +256,7 @@ public:
     entry.id = static_cast<portable_int>(_host_objects.size());
     entry.local_id = static_cast<portable_int>(_host_planes.size());
     entry.type = OBJECT_TYPE_PLANE;
+    entry.emitter_probability = 0.0f;
 
     _host_objects.push_back(entry);
     _host_planes.push_back(geometry);
@@ -255,6 +278,7 @@ public:
     entry.id = static_cast<portable_int>(_host_objects.size());
     entry.local_id = static_cast<portable_int>(_host_disks.size());
     entry.type = OBJECT_TYPE_DISK_PLANE;
+    entry.emitter_probability = 0.0f;
 
     _host_objects.push_back(entry);
     _host_disks.push_back(geometry);
@@ -310,10 +334,162 @@ public:
     return _disks;
   }
 
+  const cl::Buffer& get_emitters() const
+  {
+    return _emitters;
+  }
+
+  int get_num_emitters() const
+  {
+    return static_cast<int>(_host_emitters.size());
+  }
+
+  /// Calculates the bounding box of all objects of finite size,
+  /// i.e. of all spheres and disks.
+  /// \return false if there are no such objects
+  /// \param min_corner Will contain the corner with the smallest coordinates
+  /// \param max_corner Will contain the corner with the largest coordinates
+  bool get_bounds(vector3& min_corner, vector3& max_corner) const
+  {
+    if(_host_spheres.empty() && _host_disks.empty())
+      return false;
+
+    min_corner = VECTOR3(std::numeric_limits<scalar>::max(),
+                         std::numeric_limits<scalar>::max(),
+                         std::numeric_limits<scalar>::max());
+    max_corner = -1.0f * min_corner;
+
+    auto extend = [&](const vector3& center, scalar radius)
+    {
+      for(std::size_t dim = 0; dim < 3; ++dim)
+      {
+        min_corner.s[dim] = std::min(min_corner.s[dim], center.s[dim] - radius);
+        max_corner.s[dim] = std::max(max_corner.s[dim], center.s[dim] + radius);
+      }
+    };
+
+    for(const object_sphere_geometry& sphere : _host_spheres)
+      extend(sphere.geometry.position, sphere.geometry.radius);
+
+    for(const object_disk_geometry& disk : _host_disks)
+      extend(disk.geometry.plane.position, disk.geometry.radius);
+
+    return true;
+  }
+
+  /// Extends a bounding box by the parts of the planes that lie in front
+  /// of or behind it, e.g. the part of a floor below the objects. Since
+  /// the planes are infinite, they are clipped to the extent of the box:
+  /// the corners of the box are projected onto each plane.
+  /// \param min_corner The corner with the smallest coordinates
+  /// \param max_corner The corner with the largest coordinates
+  void extend_bounds_by_planes(vector3& min_corner, vector3& max_corner) const
+  {
+    std::vector<vector3> corners;
+    for(std::size_t i = 0; i < 8; ++i)
+      corners.push_back(VECTOR3((i & 1) ? max_corner.s[0] : min_corner.s[0],
+                                (i & 2) ? max_corner.s[1] : min_corner.s[1],
+                                (i & 4) ? max_corner.s[2] : min_corner.s[2]));
+
+    for(const object_plane_geometry& plane : _host_planes)
+    {
+      vector3 normal = math::normalize(plane.geometry.normal);
+      for(const vector3& corner : corners)
+      {
+        scalar distance = math::dot(corner - plane.geometry.position, normal);
+        vector3 projection = corner - distance * normal;
+        for(std::size_t dim = 0; dim < 3; ++dim)
+        {
+          min_corner.s[dim] = std::min(min_corner.s[dim], projection.s[dim]);
+          max_corner.s[dim] = std::max(max_corner.s[dim], projection.s[dim]);
+        }
+      }
+    }
+  }
+
+  /// Calculates a bounding sphere of all spheres and disks that
+  /// have specular parts.
+  /// \return false if there are no such objects
+  /// \param center Will contain the center of the bounding sphere
+  /// \param radius Will contain the radius of the bounding sphere
+  bool get_specular_bounds(vector3& center, scalar& radius) const
+  {
+    std::vector<vector3> centers;
+    std::vector<scalar> radii;
+
+    for(const object_sphere_geometry& sphere : _host_spheres)
+      if(_materials->get_min_roughness(sphere.material_id) < SPECULAR_ROUGHNESS_THRESHOLD)
+      {
+        centers.push_back(sphere.geometry.position);
+        radii.push_back(sphere.geometry.radius);
+      }
+
+    for(const object_disk_geometry& disk : _host_disks)
+      if(_materials->get_min_roughness(disk.material_id) < SPECULAR_ROUGHNESS_THRESHOLD)
+      {
+        centers.push_back(disk.geometry.plane.position);
+        radii.push_back(disk.geometry.radius);
+      }
+
+    if(centers.empty())
+      return false;
+
+    // Center of the bounding box
+    vector3 min_corner = centers[0];
+    vector3 max_corner = centers[0];
+    for(std::size_t i = 0; i < centers.size(); ++i)
+      for(std::size_t dim = 0; dim < 3; ++dim)
+      {
+        min_corner.s[dim] = std::min(min_corner.s[dim], centers[i].s[dim] - radii[i]);
+        max_corner.s[dim] = std::max(max_corner.s[dim], centers[i].s[dim] + radii[i]);
+      }
+    center = 0.5f * (min_corner + max_corner);
+
+    radius = 0.0f;
+    for(std::size_t i = 0; i < centers.size(); ++i)
+    {
+      vector3 delta = centers[i] - center;
+      radius = std::max(radius, std::sqrt(math::dot(delta, delta)) + radii[i]);
+    }
+
+    return true;
+  }
+
+  /// Passes the scene to a kernel in the order expected by
+  /// SCENE_KERNEL_ARGUMENTS
+  /// \param arguments The argument list of the kernel
+  void push_kernel_arguments(qcl::kernel_argument_list& arguments) const
+  {
+    arguments.push(get_objects());
+    arguments.push(get_spheres());
+    arguments.push(get_planes());
+    arguments.push(get_disks());
+    arguments.push(static_cast<cl_int>(get_num_spheres()));
+    arguments.push(static_cast<cl_int>(get_num_planes()));
+    arguments.push(static_cast<cl_int>(get_num_disks()));
+    arguments.push(get_far_clipping_distance());
+    arguments.push(get_background_material());
+    arguments.push(get_emitters());
+    arguments.push(static_cast<cl_int>(get_num_emitters()));
+
+    arguments.push(get_materials().get_texture_data_buffer());
+    arguments.push(get_materials().get_widths());
+    arguments.push(get_materials().get_heights());
+    arguments.push(get_materials().get_offsets());
+    arguments.push(get_materials().get_materials());
+    arguments.push(static_cast<cl_int>(get_materials().get_num_materials()));
+    arguments.push(static_cast<cl_int>(get_materials().get_num_textures()));
+    arguments.push(get_materials().get_environment_marginal_cdf());
+    arguments.push(get_materials().get_environment_conditional_cdf());
+    arguments.push(get_materials().get_environment_width());
+    arguments.push(get_materials().get_environment_height());
+  }
+
   /// Performs a full data transfer to the device
   void transfer_data()
   {
     _materials->transfer_data();
+    update_emitters();
     if (!_host_objects.empty())
     {
       _ctx->create_input_buffer<object_entry>(_objects,
@@ -332,6 +508,10 @@ public:
         _ctx->create_input_buffer<object_disk_geometry>(_disks,
                                                         _host_disks.size(),
                                                         _host_disks.data());
+      if(!_host_emitters.empty())
+        _ctx->create_input_buffer<emitter_entry>(_emitters,
+                                                 _host_emitters.size(),
+                                                 _host_emitters.data());
     }
   }
 
@@ -348,12 +528,66 @@ private:
     _background_material = material;
   }
 
+  /// Rebuilds the list of emitters for explicit light sampling. Spheres
+  /// and disks are selected with a probability proportional to their
+  /// emitted power, estimated from the average emitted luminance and the area.
+  void update_emitters()
+  {
+    _host_emitters.clear();
+
+    std::vector<scalar> weights;
+
+    auto add_emitter = [&](object_id id, material_id mat, scalar area)
+    {
+      scalar luminance = _materials->get_average_emitted_luminance(mat);
+      if(luminance > 0.0f)
+      {
+        emitter_entry emitter;
+        emitter.object = _host_objects[id];
+        emitter.cdf = 0.0f;
+        _host_emitters.push_back(emitter);
+        weights.push_back(luminance * area);
+      }
+    };
+
+    for(const object_sphere_geometry& sphere : _host_spheres)
+      add_emitter(sphere.id, sphere.material_id,
+                  4.0f * static_cast<scalar>(M_PI)
+                  * sphere.geometry.radius * sphere.geometry.radius);
+
+    for(const object_disk_geometry& disk : _host_disks)
+      add_emitter(disk.id, disk.material_id,
+                  static_cast<scalar>(M_PI)
+                  * disk.geometry.radius * disk.geometry.radius);
+
+    scalar total_weight = 0.0f;
+    for(scalar w : weights)
+      total_weight += w;
+
+    for(object_entry& entry : _host_objects)
+      entry.emitter_probability = 0.0f;
+
+    scalar cdf = 0.0f;
+    for(std::size_t i = 0; i < _host_emitters.size(); ++i)
+    {
+      scalar probability = weights[i] / total_weight;
+      cdf += probability;
+
+      _host_emitters[i].cdf = cdf;
+      _host_emitters[i].object.emitter_probability = probability;
+      _host_objects[_host_emitters[i].object.id].emitter_probability = probability;
+    }
+    if(!_host_emitters.empty())
+      _host_emitters.back().cdf = 1.0f;
+  }
+
   qcl::const_device_context_ptr _ctx;
 
   std::vector<object_entry> _host_objects;
   std::vector<object_sphere_geometry> _host_spheres;
   std::vector<object_plane_geometry> _host_planes;
   std::vector<object_disk_geometry> _host_disks;
+  std::vector<emitter_entry> _host_emitters;
 
   scalar _far_clipping_distance;
 
@@ -361,6 +595,7 @@ private:
   cl::Buffer _spheres;
   cl::Buffer _planes;
   cl::Buffer _disks;
+  cl::Buffer _emitters;
 
   material_id _background_material;
 
@@ -0,0 +1,365 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SOCKET_HPP
+#define SOCKET_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace gray {
+
+/// A connected TCP or UNIX domain socket. Values are transferred in the
+/// byte order of the host, so all connected machines must share the same
+/// architecture.
+class socket_connection
+{
+public:
+  /// Takes ownership of a connected socket
+  explicit socket_connection(int socket = -1)
+  : _socket{socket}
+  {}
+
+  socket_connection(const socket_connection&) = delete;
+  socket_connection& operator=(const socket_connection&) = delete;
+
+  socket_connection(socket_connection&& other)
+  : _socket{other._socket}
+  {
+    other._socket = -1;
+  }
+
+  socket_connection& operator=(socket_connection&& other)
+  {
+    std::swap(_socket, other._socket);
+    return *this;
+  }
+
+  ~socket_connection()
+  {
+    if(_socket >= 0)
+      close(_socket);
+  }
+
+  /// Connects to a listening socket
+  /// \param host The name or address of the host
+  /// \param port The port
+  static socket_connection connect_to(const std::string& host, std::uint16_t port)
+  {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* addresses = nullptr;
+    std::string service = std::to_string(port);
+    if(getaddrinfo(host.c_str(), service.c_str(), &hints, &addresses) != 0)
+      throw std::runtime_error("Could not resolve host "+host);
+
+    int s = -1;
+    for(addrinfo* address = addresses; address != nullptr; address = address->ai_next)
+    {
+      s = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+      if(s < 0)
+        continue;
+      if(connect(s, address->ai_addr, address->ai_addrlen) == 0)
+        break;
+      close(s);
+      s = -1;
+    }
+    freeaddrinfo(addresses);
+
+    if(s < 0)
+      throw std::runtime_error("Could not connect to "+host+":"+service);
+
+    // Messages are complete when they are sent, there is nothing to batch
+    int no_delay = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+    return socket_connection{s};
+  }
+
+  /// Connects to a listening UNIX domain socket
+  /// \param path The path of the socket
+  static socket_connection connect_to_unix(const std::string& path)
+  {
+    sockaddr_un address = unix_address(path);
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(s < 0)
+      throw std::runtime_error("Could not create socket");
+    if(connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+      close(s);
+      throw std::runtime_error("Could not connect to "+path);
+    }
+    return socket_connection{s};
+  }
+
+  /// \return The address of a UNIX domain socket
+  /// \param path The path of the socket
+  static sockaddr_un unix_address(const std::string& path)
+  {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.empty() || path.size() >= sizeof(address.sun_path))
+      throw std::invalid_argument("Invalid socket path "+path);
+    std::memcpy(address.sun_path, path.data(), path.size());
+    return address;
+  }
+
+  /// Aborts the receiving of data if nothing arrives in time, such that
+  /// a stalled peer cannot block the receiver forever
+  /// \param seconds The timeout in seconds
+  void set_receive_timeout(long seconds)
+  {
+    timeval timeout;
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+
+  bool is_open() const
+  {
+    return _socket >= 0;
+  }
+
+  /// \return The file descriptor of the socket, e.g. for poll()
+  int get_descriptor() const
+  {
+    return _socket;
+  }
+
+  /// Sends a block of bytes
+  void send_bytes(const void* data, std::size_t size)
+  {
+    const char* bytes = static_cast<const char*>(data);
+    while(size > 0)
+    {
+      ssize_t sent = send(_socket, bytes, size, MSG_NOSIGNAL);
+      if(sent <= 0)
+        throw std::runtime_error("Could not send data over connection");
+      bytes += sent;
+      size -= static_cast<std::size_t>(sent);
+    }
+  }
+
+  /// Receives a block of bytes, waiting until all have arrived
+  void receive_bytes(void* data, std::size_t size)
+  {
+    char* bytes = static_cast<char*>(data);
+    while(size > 0)
+    {
+      ssize_t received = recv(_socket, bytes, size, 0);
+      if(received <= 0)
+        throw std::runtime_error("Connection closed while receiving data");
+      bytes += received;
+      size -= static_cast<std::size_t>(received);
+    }
+  }
+
+  template<class T>
+  void send_value(const T& value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be sent");
+    send_bytes(&value, sizeof(T));
+  }
+
+  template<class T>
+  T receive_value()
+  {
+    T value;
+    receive_value(value);
+    return value;
+  }
+
+  /// Overwrites an existing object, for types that are not default
+  /// constructible
+  template<class T>
+  void receive_value(T& value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be received");
+    receive_bytes(&value, sizeof(T));
+  }
+
+  /// Sends the number of elements followed by the elements
+  template<class T>
+  void send_vector(const std::vector<T>& data)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be sent");
+    send_value(static_cast<std::uint64_t>(data.size()));
+    send_bytes(data.data(), data.size() * sizeof(T));
+  }
+
+  template<class T>
+  std::vector<T> receive_vector()
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be received");
+    std::vector<T> data(static_cast<std::size_t>(receive_value<std::uint64_t>()));
+    receive_bytes(data.data(), data.size() * sizeof(T));
+    return data;
+  }
+
+  void send_string(const std::string& s)
+  {
+    send_value(static_cast<std::uint64_t>(s.size()));
+    send_bytes(s.data(), s.size());
+  }
+
+  std::string receive_string()
+  {
+    std::string s(static_cast<std::size_t>(receive_value<std::uint64_t>()), '\0');
+    receive_bytes(&s[0], s.size());
+    return s;
+  }
+
+private:
+  int _socket;
+};
+
+/// A TCP socket that accepts connections on a port of all interfaces
+class tcp_listener
+{
+public:
+  /// \param port The port
+  explicit tcp_listener(std::uint16_t port)
+  {
+    _socket = socket(AF_INET, SOCK_STREAM, 0);
+    if(_socket < 0)
+      throw std::runtime_error("Could not create socket");
+
+    // Allow restarting a worker on the same port right away
+    int reuse = 1;
+    setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if(bind(_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+       listen(_socket, 8) != 0)
+    {
+      close(_socket);
+      throw std::runtime_error("Could not listen on port "+std::to_string(port));
+    }
+  }
+
+  tcp_listener(const tcp_listener&) = delete;
+  tcp_listener& operator=(const tcp_listener&) = delete;
+
+  ~tcp_listener()
+  {
+    close(_socket);
+  }
+
+  /// Waits for the next connection
+  socket_connection accept_connection()
+  {
+    int s = accept(_socket, nullptr, nullptr);
+    if(s < 0)
+      throw std::runtime_error("Could not accept connection");
+
+    int no_delay = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+    return socket_connection{s};
+  }
+
+private:
+  int _socket;
+};
+
+/// A UNIX domain socket that accepts connections of local processes.
+/// The socket file is removed when the listener is destroyed.
+class unix_listener
+{
+public:
+  /// \param path The path of the socket. A stale socket file of a
+  /// previous listener at this path is replaced.
+  explicit unix_listener(const std::string& path)
+  : _path{path}
+  {
+    sockaddr_un address = socket_connection::unix_address(path);
+
+    _socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(_socket < 0)
+      throw std::runtime_error("Could not create socket");
+
+    unlink(path.c_str());
+    if(bind(_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+       listen(_socket, 16) != 0)
+    {
+      close(_socket);
+      throw std::runtime_error("Could not listen on "+path);
+    }
+  }
+
+  unix_listener(const unix_listener&) = delete;
+  unix_listener& operator=(const unix_listener&) = delete;
+
+  ~unix_listener()
+  {
+    close(_socket);
+    unlink(_path.c_str());
+  }
+
+  /// \return The file descriptor of the socket, e.g. for poll()
+  int get_descriptor() const
+  {
+    return _socket;
+  }
+
+  /// Waits for the next connection
+  socket_connection accept_connection()
+  {
+    int s = accept(_socket, nullptr, nullptr);
+    if(s < 0)
+      throw std::runtime_error("Could not accept connection");
+    return socket_connection{s};
+  }
+
+private:
+  std::string _path;
+  int _socket;
+};
+
+}
+
+#endif
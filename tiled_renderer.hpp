@@ -0,0 +1,547 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TILED_RENDERER_HPP
+#define TILED_RENDERER_HPP
+
+#include "frame_renderer.hpp"
+#include "frame_pacer.hpp"
+#include "denoiser.hpp"
+#include "mapped_file.hpp"
+#include "timer.hpp"
+#include "common.cl_hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace gray {
+
+/// Renders images that are too large for the device memory in tiles.
+/// The tiles are rendered one after another by a \c frame_renderer with
+/// the resolution of a tile, and the results are streamed into a memory
+/// mapped scratch file on the host. Afterwards, the passes that depend on
+/// the whole image are applied across the tiles:
+/// 1. The denoiser filters each tile together with a border that covers
+///    its footprint, which yields the same result as filtering the whole
+///    image at once.
+/// 2. The luminance histogram of all tiles determines a common exposure.
+/// 3. Each tile is tone mapped with this exposure and written into the
+///    output file, a memory mapped binary PPM image.
+class tiled_renderer
+{
+public:
+  /// \param ctx The device context
+  /// \param tile_renderer The renderer of the tiles. Its resolution is
+  /// the size of the tiles.
+  /// \param width The width of the whole image in pixels
+  /// \param height The height of the whole image in pixels
+  /// \param max_frames_in_flight The number of frames of a tile that may
+  /// be enqueued before the host waits, see \c frame_pacer
+  tiled_renderer(const qcl::device_context_ptr& ctx,
+                 frame_renderer& tile_renderer,
+                 std::size_t width,
+                 std::size_t height,
+                 std::size_t max_frames_in_flight = 2)
+  : _ctx{ctx},
+    _renderer(tile_renderer),
+    _post_processing_kernel{ctx->get_kernel("hdr_color_compression")},
+    _exposure_kernel{ctx->get_kernel("update_exposure")},
+    _denoiser{ctx},
+    _width{width},
+    _height{height},
+    _tile_width{tile_renderer.get_resolution_width()},
+    _tile_height{tile_renderer.get_resolution_height()},
+    _max_frames_in_flight{max_frames_in_flight},
+    _denoised_region_width{0},
+    _denoised_region_height{0}
+  {
+    assert(width > 0 && height > 0);
+
+    _tile_pixels = create_image(_tile_width, _tile_height,
+                                cl::ImageFormat{CL_RGBA, CL_UNORM_INT8});
+    _tile_input = create_image(_tile_width, _tile_height,
+                               cl::ImageFormat{CL_RGBA, CL_FLOAT});
+
+    _ctx->create_buffer<cl_uint>(_luminance_histogram,
+                                 CL_MEM_READ_WRITE,
+                                 LUMINANCE_HISTOGRAM_SIZE);
+    _ctx->create_buffer<cl_float>(_exposure_state, CL_MEM_READ_WRITE, 2);
+  }
+
+  std::size_t get_num_tiles_x() const
+  {
+    return (_width + _tile_width - 1) / _tile_width;
+  }
+
+  std::size_t get_num_tiles_y() const
+  {
+    return (_height + _tile_height - 1) / _tile_height;
+  }
+
+  /// \return The name of the image with the extension .ppm, which
+  /// replaces the extension of the given name, if any. Since the image is
+  /// streamed into a memory mapped file, it cannot be compressed.
+  /// \param output_file The name of the image, e.g. render.png
+  static std::string get_ppm_file_name(const std::string& output_file)
+  {
+    std::size_t extension = output_file.rfind('.');
+    std::size_t directory = output_file.rfind('/');
+    if(extension == std::string::npos ||
+       (directory != std::string::npos && extension < directory))
+      return output_file + ".ppm";
+    return output_file.substr(0, extension) + ".ppm";
+  }
+
+  /// Renders the image and writes it as binary PPM file
+  /// \param output_file The path of the PPM file, which must have the
+  /// extension .ppm, see \c get_ppm_file_name(). A scratch file with
+  /// the suffix .scratch is created next to it while rendering.
+  /// \param s The scene
+  /// \param cam The camera
+  /// \param rays_per_pixel The number of rays per pixel of each tile,
+  /// if \c time_budget is 0
+  /// \param time_budget The total rendering time in seconds, which is
+  /// distributed evenly among the tiles. 0 to render a fixed number
+  /// of rays per pixel instead.
+  void render(const std::string& output_file,
+              const device_object::scene& s,
+              const device_object::camera& cam,
+              std::size_t rays_per_pixel,
+              double time_budget = 0.0)
+  {
+    if(get_ppm_file_name(output_file) != output_file)
+      throw std::invalid_argument("Tiled renders are written as PPM, "
+                                  "the output file must end with .ppm: "+output_file);
+
+    std::size_t num_pixels = _width * _height;
+
+    // Planes of the scratch file
+    std::size_t color_offset = 0;
+    std::size_t albedo_offset = color_offset + num_pixels * sizeof(cl_float4);
+    std::size_t normal_depth_offset = albedo_offset + num_pixels * sizeof(cl_float4);
+    std::size_t denoised_offset = normal_depth_offset + num_pixels * sizeof(cl_float4);
+    std::size_t sample_counts_offset = denoised_offset + num_pixels * sizeof(cl_float4);
+    std::size_t scratch_size = sample_counts_offset + num_pixels * sizeof(cl_int);
+
+    mapped_file scratch{output_file + ".scratch", scratch_size};
+    scratch.remove_when_closed();
+
+    planes p;
+    p.color = scratch.data() + color_offset;
+    p.albedo = scratch.data() + albedo_offset;
+    p.normal_depth = scratch.data() + normal_depth_offset;
+    p.sample_counts = scratch.data() + sample_counts_offset;
+    p.denoised = p.color;
+    if(_renderer.is_denoising_enabled())
+      p.denoised = scratch.data() + denoised_offset;
+
+    std::size_t num_tiles = get_num_tiles_x() * get_num_tiles_y();
+    double tile_time_budget = time_budget / static_cast<double>(num_tiles);
+
+    for_each_tile([&](const tile& t)
+    {
+      std::cout << "Rendering tile " << t.index + 1 << "/" << num_tiles << std::endl;
+      render_tile(t, p, s, cam, rays_per_pixel, tile_time_budget);
+    });
+
+    if(_renderer.is_denoising_enabled())
+    {
+      std::cout << "Denoising..." << std::endl;
+      for_each_tile([&](const tile& t)
+      {
+        denoise_tile(t, p);
+      });
+    }
+
+    std::cout << "Tone mapping..." << std::endl;
+    // The first post processing pass only collects the luminance histogram
+    // of all tiles, from which the exposure of the whole image is derived
+    reset_exposure();
+    for_each_tile([&](const tile& t)
+    {
+      post_process_tile(t, p);
+    });
+    update_exposure();
+
+    std::ostringstream header;
+    header << "P6\n" << _width << " " << _height << "\n255\n";
+    std::string header_string = header.str();
+
+    mapped_file output{output_file, header_string.size() + 3 * num_pixels};
+    std::memcpy(output.data(), header_string.data(), header_string.size());
+    unsigned char* output_pixels = output.data() + header_string.size();
+
+    std::vector<cl_uchar> tile_pixels(4 * _tile_width * _tile_height);
+    for_each_tile([&](const tile& t)
+    {
+      post_process_tile(t, p);
+      read_region(*_tile_pixels, t.width, t.height, 4 * _tile_width, tile_pixels.data());
+
+      for(std::size_t y = 0; y < t.height; ++y)
+        for(std::size_t x = 0; x < t.width; ++x)
+        {
+          const cl_uchar* in = tile_pixels.data() + 4 * (y * _tile_width + x);
+          unsigned char* out = output_pixels + 3 * ((t.y + y) * _width + t.x + x);
+          out[0] = in[0];
+          out[1] = in[1];
+          out[2] = in[2];
+        }
+    });
+    output.flush();
+  }
+
+private:
+  struct tile
+  {
+    std::size_t index;
+    std::size_t x;
+    std::size_t y;
+    // The size of the tile without the part outside of the image
+    std::size_t width;
+    std::size_t height;
+  };
+
+  /// Pointers to the planes of the scratch file
+  struct planes
+  {
+    unsigned char* color;
+    unsigned char* albedo;
+    unsigned char* normal_depth;
+    unsigned char* sample_counts;
+    unsigned char* denoised;
+  };
+
+  template<class Function>
+  void for_each_tile(Function f) const
+  {
+    tile t;
+    t.index = 0;
+    for(t.y = 0; t.y < _height; t.y += _tile_height)
+      for(t.x = 0; t.x < _width; t.x += _tile_width)
+      {
+        t.width = std::min(_tile_width, _width - t.x);
+        t.height = std::min(_tile_height, _height - t.y);
+        f(t);
+        ++t.index;
+      }
+  }
+
+  /// \return The address of a pixel in a plane of the scratch file
+  unsigned char* get_pixel(unsigned char* plane, std::size_t pixel_size,
+                           std::size_t x, std::size_t y) const
+  {
+    return plane + (y * _width + x) * pixel_size;
+  }
+
+  void render_tile(const tile& t, const planes& p,
+                   const device_object::scene& s,
+                   const device_object::camera& cam,
+                   std::size_t rays_per_pixel,
+                   double time_budget)
+  {
+    _renderer.set_viewport(_width, _height, t.x, t.y);
+    _renderer.reset_accumulation();
+
+    // Only the samples are needed in each frame, the displayed image is
+    // written once the tile is complete
+    frame_pacer pacer{_ctx, _max_frames_in_flight};
+    timer tile_timer;
+    tile_timer.start();
+    double elapsed_time = 0.0;
+    while((time_budget > 0.0 ? elapsed_time < time_budget
+                             : _renderer.get_total_rays_per_pixel() < rays_per_pixel) &&
+          !_renderer.is_converged())
+    {
+      _renderer.trace(s, cam);
+      pacer.end_frame();
+      if(time_budget > 0.0)
+      {
+        elapsed_time += tile_timer.stop();
+        tile_timer.start();
+      }
+    }
+    _renderer.present(*_tile_pixels);
+
+    // Stream the tile into the scratch file
+    std::size_t row_pitch = _width * sizeof(cl_float4);
+    read_region(_renderer.get_render_result(), t.width, t.height, row_pitch,
+                get_pixel(p.color, sizeof(cl_float4), t.x, t.y));
+
+    read_buffer_region(_renderer.get_sample_counts(), sizeof(cl_int),
+                       _tile_width, t.width, t.height,
+                       get_pixel(p.sample_counts, sizeof(cl_int), t.x, t.y));
+    read_buffer_region(_renderer.get_albedo(), sizeof(cl_float4),
+                       _tile_width, t.width, t.height,
+                       get_pixel(p.albedo, sizeof(cl_float4), t.x, t.y));
+    read_buffer_region(_renderer.get_normal_depth(), sizeof(cl_float4),
+                       _tile_width, t.width, t.height,
+                       get_pixel(p.normal_depth, sizeof(cl_float4), t.x, t.y));
+  }
+
+  /// Filters a tile together with a border of the size of the footprint
+  /// of the denoiser
+  void denoise_tile(const tile& t, const planes& p)
+  {
+    // Each pass reads two taps in each direction, spread by its step size
+    std::size_t border = 2 * ((std::size_t{1} << _denoiser.get_num_passes()) - 1);
+
+    std::size_t min_x = t.x > border ? t.x - border : 0;
+    std::size_t min_y = t.y > border ? t.y - border : 0;
+    std::size_t max_x = std::min(t.x + t.width + border, _width);
+    std::size_t max_y = std::min(t.y + t.height + border, _height);
+    std::size_t region_width = max_x - min_x;
+    std::size_t region_height = max_y - min_y;
+
+    if(region_width != _denoised_region_width || region_height != _denoised_region_height)
+      set_denoised_region_size(region_width, region_height);
+
+    std::size_t row_pitch = _width * sizeof(cl_float4);
+    write_region(*_region_input, region_width, region_height, row_pitch,
+                 get_pixel(p.color, sizeof(cl_float4), min_x, min_y));
+    write_buffer_region(_region_sample_counts, sizeof(cl_int),
+                        region_width, region_width, region_height,
+                        get_pixel(p.sample_counts, sizeof(cl_int), min_x, min_y));
+    write_buffer_region(_region_albedo, sizeof(cl_float4),
+                        region_width, region_width, region_height,
+                        get_pixel(p.albedo, sizeof(cl_float4), min_x, min_y));
+    write_buffer_region(_region_normal_depth, sizeof(cl_float4),
+                        region_width, region_width, region_height,
+                        get_pixel(p.normal_depth, sizeof(cl_float4), min_x, min_y));
+
+    const cl::Image2D& result = _denoiser.run(*_region_input, _region_sample_counts,
+                                              _region_albedo, _region_normal_depth);
+
+    // Only the tile itself is kept
+    cl::array<std::size_t,3> origin;
+    origin[0] = t.x - min_x;
+    origin[1] = t.y - min_y;
+    origin[2] = 0;
+    cl::array<std::size_t,3> region;
+    region[0] = t.width;
+    region[1] = t.height;
+    region[2] = 1;
+    cl_int err = _ctx->get_command_queue().enqueueReadImage(
+        result, CL_TRUE, origin, region, row_pitch, 0,
+        get_pixel(p.denoised, sizeof(cl_float4), t.x, t.y));
+    qcl::check_cl_error(err, "Could not read denoised tile!");
+  }
+
+  void set_denoised_region_size(std::size_t width, std::size_t height)
+  {
+    _region_input = create_image(width, height, cl::ImageFormat{CL_RGBA, CL_FLOAT});
+    _ctx->create_buffer<cl_int>(_region_sample_counts, CL_MEM_READ_ONLY, width * height);
+    _ctx->create_buffer<cl_float4>(_region_albedo, CL_MEM_READ_ONLY, width * height);
+    _ctx->create_buffer<cl_float4>(_region_normal_depth, CL_MEM_READ_ONLY, width * height);
+    _denoiser.set_resolution(width, height);
+
+    _denoised_region_width = width;
+    _denoised_region_height = height;
+  }
+
+  /// Tone maps a tile into \c _tile_pixels and adds it to the
+  /// luminance histogram
+  void post_process_tile(const tile& t, const planes& p)
+  {
+    // Tiles at the border of the image do not cover the whole input image.
+    // Black pixels do not contribute to the histogram.
+    if(t.width < _tile_width || t.height < _tile_height)
+    {
+      cl::array<std::size_t,3> region;
+      region[0] = _tile_width;
+      region[1] = _tile_height;
+      region[2] = 1;
+      cl_float4 fill_value = {{0.0f, 0.0f, 0.0f, 0.0f}};
+      cl_int err = _ctx->get_command_queue().enqueueFillImage(*_tile_input,
+                                                              fill_value,
+                                                              cl::array<std::size_t,3>{},
+                                                              region);
+      qcl::check_cl_error(err, "Could not enqueue image fill!");
+    }
+
+    write_region(*_tile_input, t.width, t.height, _width * sizeof(cl_float4),
+                 get_pixel(p.denoised, sizeof(cl_float4), t.x, t.y));
+
+    device_object::tone_mapping_parameters params = _renderer.get_tone_mapping_parameters();
+
+    qcl::kernel_argument_list arguments(_post_processing_kernel);
+    arguments.push(*_tile_pixels);
+    arguments.push(*_tile_input);
+    arguments.push(_luminance_histogram);
+    arguments.push(_exposure_state);
+    arguments.push(&params, sizeof(device_object::tone_mapping_parameters));
+    arguments.push(static_cast<cl_int>(0));
+
+    cl_int err = _ctx->get_command_queue().enqueueNDRangeKernel(
+        *_post_processing_kernel,
+        cl::NullRange,
+        cl::NDRange(get_required_num_work_items(t.width),
+                    get_required_num_work_items(t.height)),
+        cl::NDRange(_group_size, _group_size));
+    qcl::check_cl_error(err, "Could not enqueue postprocessing kernel call!");
+  }
+
+  void reset_exposure()
+  {
+    cl_uint zero = 0;
+    cl_int err = _ctx->get_command_queue().enqueueFillBuffer(_luminance_histogram,
+                                                             zero,
+                                                             0,
+                                                             LUMINANCE_HISTOGRAM_SIZE
+                                                               * sizeof(cl_uint));
+    qcl::check_cl_error(err, "Could not enqueue luminance histogram reset!");
+
+    cl_float zero_exposure = 0.0f;
+    err = _ctx->get_command_queue().enqueueFillBuffer(_exposure_state,
+                                                      zero_exposure,
+                                                      0,
+                                                      2 * sizeof(cl_float));
+    qcl::check_cl_error(err, "Could not enqueue exposure reset!");
+  }
+
+  /// Sets the exposure from the histogram of all tiles. Since the exposure
+  /// state has been reset, there is no temporal adaptation.
+  void update_exposure()
+  {
+    device_object::tone_mapping_parameters params = _renderer.get_tone_mapping_parameters();
+
+    qcl::kernel_argument_list arguments(_exposure_kernel);
+    arguments.push(_luminance_histogram);
+    arguments.push(_exposure_state);
+    arguments.push(&params, sizeof(device_object::tone_mapping_parameters));
+
+    cl_int err = _ctx->get_command_queue().enqueueNDRangeKernel(*_exposure_kernel,
+                                                                cl::NullRange,
+                                                                cl::NDRange(1),
+                                                                cl::NDRange(1));
+    qcl::check_cl_error(err, "Could not enqueue exposure kernel call!");
+  }
+
+  /// Reads the upper left part of an image into host memory
+  void read_region(const cl::Image2D& image, std::size_t width, std::size_t height,
+                   std::size_t host_row_pitch, void* host_data)
+  {
+    cl::array<std::size_t,3> region;
+    region[0] = width;
+    region[1] = height;
+    region[2] = 1;
+    cl_int err = _ctx->get_command_queue().enqueueReadImage(
+        image, CL_TRUE, cl::array<std::size_t,3>{}, region, host_row_pitch, 0, host_data);
+    qcl::check_cl_error(err, "Could not read tile!");
+  }
+
+  /// Writes host memory into the upper left part of an image
+  void write_region(const cl::Image2D& image, std::size_t width, std::size_t height,
+                    std::size_t host_row_pitch, const void* host_data)
+  {
+    cl::array<std::size_t,3> region;
+    region[0] = width;
+    region[1] = height;
+    region[2] = 1;
+    cl_int err = _ctx->get_command_queue().enqueueWriteImage(
+        image, CL_TRUE, cl::array<std::size_t,3>{}, region, host_row_pitch, 0,
+        const_cast<void*>(host_data));
+    qcl::check_cl_error(err, "Could not write tile!");
+  }
+
+  /// Reads the upper left part of a row-major buffer of pixels into the
+  /// corresponding region of a plane of the scratch file
+  void read_buffer_region(const cl::Buffer& buffer, std::size_t pixel_size,
+                          std::size_t buffer_width, std::size_t width, std::size_t height,
+                          void* host_data)
+  {
+    cl::array<std::size_t,3> region;
+    region[0] = width * pixel_size;
+    region[1] = height;
+    region[2] = 1;
+    cl_int err = _ctx->get_command_queue().enqueueReadBufferRect(
+        buffer, CL_TRUE, cl::array<std::size_t,3>{}, cl::array<std::size_t,3>{}, region,
+        buffer_width * pixel_size, 0, _width * pixel_size, 0, host_data);
+    qcl::check_cl_error(err, "Could not read tile buffer!");
+  }
+
+  /// Writes a region of a plane of the scratch file into the upper
+  /// left part of a row-major buffer of pixels
+  void write_buffer_region(const cl::Buffer& buffer, std::size_t pixel_size,
+                           std::size_t buffer_width, std::size_t width, std::size_t height,
+                           const void* host_data)
+  {
+    cl::array<std::size_t,3> region;
+    region[0] = width * pixel_size;
+    region[1] = height;
+    region[2] = 1;
+    cl_int err = _ctx->get_command_queue().enqueueWriteBufferRect(
+        buffer, CL_TRUE, cl::array<std::size_t,3>{}, cl::array<std::size_t,3>{}, region,
+        buffer_width * pixel_size, 0, _width * pixel_size, 0, host_data);
+    qcl::check_cl_error(err, "Could not write tile buffer!");
+  }
+
+  std::shared_ptr<cl::Image2D> create_image(std::size_t width, std::size_t height,
+                                            const cl::ImageFormat& format) const
+  {
+    cl_int err;
+    auto image = std::make_shared<cl::Image2D>(_ctx->get_context(), CL_MEM_READ_WRITE,
+                                               format, width, height, 0, nullptr, &err);
+    qcl::check_cl_error(err, "Could not create CL image object for tile!");
+    return image;
+  }
+
+  std::size_t get_required_num_work_items(std::size_t num_items) const
+  {
+    if(num_items % _group_size != 0)
+      return (num_items / _group_size + 1) * _group_size;
+    return num_items;
+  }
+
+  qcl::device_context_ptr _ctx;
+  frame_renderer& _renderer;
+  qcl::kernel_ptr _post_processing_kernel;
+  qcl::kernel_ptr _exposure_kernel;
+  atrous_denoiser _denoiser;
+
+  std::size_t _width;
+  std::size_t _height;
+  std::size_t _tile_width;
+  std::size_t _tile_height;
+  std::size_t _max_frames_in_flight;
+
+  std::shared_ptr<cl::Image2D> _tile_pixels;
+  std::shared_ptr<cl::Image2D> _tile_input;
+
+  // Device memory for the denoising of a tile with its border
+  std::size_t _denoised_region_width;
+  std::size_t _denoised_region_height;
+  std::shared_ptr<cl::Image2D> _region_input;
+  cl::Buffer _region_sample_counts;
+  cl::Buffer _region_albedo;
+  cl::Buffer _region_normal_depth;
+
+  cl::Buffer _luminance_histogram;
+  cl::Buffer _exposure_state;
+
+  static constexpr std::size_t _group_size = 8;
+};
+
+}
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPSAMPLER_HPP
+#define UPSAMPLER_HPP
+
+#include "qcl.hpp"
+
+namespace gray {
+
+/// Fills the pixels skipped when rendering with a pixel stride by
+/// depth-guided interpolation. See upsampling.cl.
+class image_upsampler
+{
+public:
+  image_upsampler(const qcl::device_context_ptr& ctx)
+  : _ctx{ctx},
+    _upsampling_kernel{ctx->get_kernel("upsample_image")},
+    _depth_sigma{0.05f},
+    _width{0},
+    _height{0}
+  {
+  }
+
+  void set_resolution(std::size_t width, std::size_t height)
+  {
+    cl_int err;
+    _image = std::make_shared<cl::Image2D>(_ctx->get_context(),
+                                           CL_MEM_READ_WRITE,
+                                           cl::ImageFormat{CL_RGBA, CL_FLOAT},
+                                           width, height, 0, nullptr, &err);
+    qcl::check_cl_error(err, "Could not create CL image object for upsampling!");
+
+    _width = width;
+    _height = height;
+  }
+
+  /// Enqueues the upsampling
+  /// \return The upsampled image, which remains valid until the next call
+  /// \param input The render state
+  /// \param normal_depth The first-hit normal and depth of each pixel
+  /// \param stride The pixel stride with which the render state has been rendered
+  const cl::Image2D& run(const cl::Image2D& input,
+                         const cl::Buffer& normal_depth,
+                         std::size_t stride)
+  {
+    assert(_width != 0 && _height != 0);
+
+    qcl::kernel_argument_list arguments(_upsampling_kernel);
+    arguments.push(*_image);
+    arguments.push(input);
+    arguments.push(normal_depth);
+    arguments.push(static_cast<cl_int>(stride));
+    arguments.push(_depth_sigma);
+
+    cl_int err = _ctx->get_command_queue().enqueueNDRangeKernel(*_upsampling_kernel,
+                                                                cl::NullRange,
+                                                                cl::NDRange(get_required_num_work_items(_width),
+                                                                            get_required_num_work_items(_height)),
+                                                                cl::NDRange(_group_size, _group_size));
+    qcl::check_cl_error(err, "Could not enqueue upsampling kernel call!");
+
+    return *_image;
+  }
+
+private:
+  inline
+  std::size_t get_required_num_work_items(std::size_t num_items) const
+  {
+    if(num_items % _group_size != 0)
+      return (num_items / _group_size + 1) * _group_size;
+    return num_items;
+  }
+
+  qcl::device_context_ptr _ctx;
+  qcl::kernel_ptr _upsampling_kernel;
+
+  cl_float _depth_sigma;
+
+  std::size_t _width;
+  std::size_t _height;
+
+  std::shared_ptr<cl::Image2D> _image;
+
+  static constexpr std::size_t _group_size = 8;
+};
+}
+
+#endif
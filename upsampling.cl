@@ -0,0 +1,105 @@
+/*
+ * This file is part of gray, a free, GPU accelerated, realtime pathtracing engine,
+ * Copyright (C) 2016  Aksel Alpay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPSAMPLING_CL
+#define UPSAMPLING_CL
+
+#include "common.cl_hpp"
+
+// Fills the pixels that have been skipped when rendering with a pixel
+// stride, see the pixel_stride argument of the path tracing kernels.
+// Each skipped pixel is interpolated bilinearly from the four surrounding
+// traced pixels. To keep object boundaries sharp, traced pixels are
+// ignored if their depth differs from the depth of the nearest traced
+// pixel.
+
+__constant sampler_t upsampling_sampler = CLK_NORMALIZED_COORDS_FALSE |
+                                          CLK_ADDRESS_CLAMP_TO_EDGE |
+                                          CLK_FILTER_NEAREST;
+
+/// \param output The upsampled image
+/// \param input The render state, in which only the pixels with coordinates
+/// divisible by \c stride are up to date
+/// \param normal_depth The first-hit normal (xyz) and depth (w) of each
+/// pixel, row-major
+/// \param stride The pixel stride with which \c input has been rendered
+/// \param depth_sigma Relative depth differences that are considered as edges
+__kernel void upsample_image(__write_only image2d_t output,
+                             __read_only image2d_t input,
+                             __global const float4* normal_depth,
+                             int stride,
+                             float depth_sigma)
+{
+  int width = get_image_width(output);
+  int height = get_image_height(output);
+
+  int px_x = get_global_id(0);
+  int px_y = get_global_id(1);
+
+  if (px_x >= width || px_y >= height)
+    return;
+
+  int2 coord = (int2)(px_x, px_y);
+
+  if (px_x % stride == 0 && px_y % stride == 0)
+  {
+    write_imagef(output, coord, read_imagef(input, upsampling_sampler, coord));
+    return;
+  }
+
+  // The traced pixels surrounding this pixel
+  int last_x = ((width - 1) / stride) * stride;
+  int last_y = ((height - 1) / stride) * stride;
+  int x0 = (px_x / stride) * stride;
+  int y0 = (px_y / stride) * stride;
+  int x1 = min(x0 + stride, last_x);
+  int y1 = min(y0 + stride, last_y);
+
+  scalar fx = (scalar)(px_x - x0) / (scalar)stride;
+  scalar fy = (scalar)(px_y - y0) / (scalar)stride;
+
+  int2 anchors[4] = {(int2)(x0, y0), (int2)(x1, y0), (int2)(x0, y1), (int2)(x1, y1)};
+  scalar bilinear_weights[4] = {(1.f - fx) * (1.f - fy), fx * (1.f - fy),
+                                (1.f - fx) * fy,         fx * fy};
+
+  int nearest = 0;
+  for (int i = 1; i < 4; ++i)
+    if (bilinear_weights[i] > bilinear_weights[nearest])
+      nearest = i;
+
+  scalar reference_depth = normal_depth[anchors[nearest].y * width + anchors[nearest].x].w;
+  scalar depth_scale = 1.f / (depth_sigma * fabs(reference_depth) + 1.e-4f);
+
+  float4 sum = (float4)(0.f, 0.f, 0.f, 0.f);
+  scalar weight_sum = 0.f;
+  for (int i = 0; i < 4; ++i)
+  {
+    scalar depth = normal_depth[anchors[i].y * width + anchors[i].x].w;
+    scalar weight = bilinear_weights[i] * exp(-fabs(depth - reference_depth) * depth_scale);
+
+    sum += weight * read_imagef(input, upsampling_sampler, anchors[i]);
+    weight_sum += weight;
+  }
+
+  float4 result = weight_sum > 0.f ?
+                  sum / weight_sum :
+                  read_imagef(input, upsampling_sampler, anchors[nearest]);
+  write_imagef(output, coord, result);
+}
+
+#endif